@@ -105,6 +105,21 @@ public:
      */
     void put(ImageBlock &b);
 
+    /**
+     * \brief Merge another image block into this one without locking
+     *
+     * Only the outer part of \c b, which lies within one border width of
+     * the edge of its rectangle and may therefore also be covered by the
+     * blocks of neighboring tiles, is added with atomic operations. The
+     * interior is added directly, which requires that no two blocks with
+     * the same offset are merged at the same time (e.g. because every
+     * tile is rendered by one thread at a time).
+     *
+     * The destination is not locked, so readers that hold the lock may
+     * observe partially merged blocks.
+     */
+    void putExclusive(const ImageBlock &b);
+
     /// Lock the image block (using an internal mutex)
     inline void lock() const { m_mutex.lock(); }
     
@@ -126,6 +141,109 @@ protected:
     mutable tbb::mutex m_mutex;
 };
 
+/**
+ * \brief Per-pixel sample statistics for adaptive sampling
+ *
+ * This buffer accompanies the \ref ImageBlock of the entire image. For
+ * every pixel, it keeps the number of samples that were taken inside of
+ * it, along with the running mean and variance of their luminance. A
+ * pixel is considered converged once the estimated standard error of its
+ * mean, relative to the mean, falls below a threshold (pixels darker than
+ * \c ERROR_FLOOR are measured relative to that value instead), or once it
+ * has received the maximum number of samples.
+ *
+ * Every pixel must only be updated by one thread at a time, which holds
+ * for the tiles of a \ref TileScheduler.
+ */
+class PixelStatistics {
+public:
+    /// Luminance below which errors are measured in absolute terms
+    static constexpr float ERROR_FLOOR = 1e-2f;
+
+    /**
+     * \brief Create empty statistics for an image
+     *
+     * \param size
+     *     Size of the image in pixels
+     * \param threshold
+     *     Relative standard error at which a pixel is converged (0: pixels
+     *     only converge when they reach \c maxSamples)
+     * \param minSamples
+     *     Number of samples below which a pixel is never converged
+     * \param maxSamples
+     *     Number of samples at which a pixel is always converged
+     */
+    PixelStatistics(const Vector2i &size, float threshold,
+                    uint32_t minSamples, uint32_t maxSamples);
+
+    /// Record the value of a sample taken inside the given pixel
+    void put(const Point2i &pixel, const Color3f &value) {
+        Pixel &p = m_pixels[pixel.y() * m_size.x() + pixel.x()];
+        float luminance = value.getLuminance(), delta = luminance - p.mean;
+        p.count++;
+        p.mean += delta / p.count;
+        p.m2 += delta * (luminance - p.mean);
+    }
+
+    /// Return the number of samples taken inside the given pixel
+    uint32_t getSampleCount(const Point2i &pixel) const {
+        return m_pixels[pixel.y() * m_size.x() + pixel.x()].count;
+    }
+
+    /// Return the variance of the mean luminance of a pixel
+    float getVariance(const Point2i &pixel) const;
+
+    /// Return the standard error of the mean luminance of a pixel relative to the mean
+    float getRelativeError(const Point2i &pixel) const;
+
+    /// Does the given pixel need no further samples?
+    bool isConverged(const Point2i &pixel) const {
+        uint32_t count = getSampleCount(pixel);
+        return count >= m_maxSamples || (m_threshold > 0 &&
+            count >= m_minSamples && getRelativeError(pixel) <= m_threshold);
+    }
+
+    /**
+     * \brief Return the sum of the variances of the mean luminance over a
+     * rectangle of pixels
+     *
+     * Pixels with fewer than two samples have no variance estimate. They
+     * are left out of the sum, and their number is stored in \c missing.
+     */
+    double getVarianceSum(const Point2i &offset, const Vector2i &size, uint32_t &missing) const;
+
+    /// Return the number of pixels in a rectangle that are not converged
+    uint32_t getActivePixelCount(const Point2i &offset, const Vector2i &size) const;
+
+    /// Return a bitmap with the number of samples of every pixel
+    Bitmap *toSampleCountBitmap() const;
+
+    /// Return the size of the image
+    const Vector2i &getSize() const { return m_size; }
+
+    /// Write the statistics of all pixels to a stream
+    void serialize(std::ostream &os) const;
+
+    /// Restore the statistics written by \ref serialize() for an image of the same size
+    void unserialize(std::istream &is);
+
+    /// Return a human-readable string summary
+    std::string toString() const;
+
+private:
+    struct Pixel {
+        uint32_t count = 0; ///< Number of samples
+        float mean = 0.f;   ///< Mean luminance
+        float m2 = 0.f;     ///< Sum of the squared deviations from the mean
+    };
+
+    Vector2i m_size;
+    std::vector<Pixel> m_pixels;
+    float m_threshold;
+    uint32_t m_minSamples;
+    uint32_t m_maxSamples;
+};
+
 /**
  * \brief Spiraling block generator
  *
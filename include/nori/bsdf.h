@@ -123,6 +123,9 @@ public:
 
     virtual float getAlpha(const BSDFQueryRecord &bRec) const { return 1.0f; };
 
+    /// Can \ref getAlpha() return zero, i.e. does the surface have cut-out regions?
+    virtual bool hasAlpha() const { return false; }
+
     virtual bool isNull() const { return false; };
 };
 
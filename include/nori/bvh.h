@@ -20,6 +20,14 @@
 #define __NORI_BVH_H
 
 #include <nori/shape.h>
+#include <nori/simd.h>
+#include <nori/mmap.h>
+#include <nori/pager.h>
+#include <functional>
+#include <memory>
+#if defined(NORI_BVH_STATS)
+#include <tbb/enumerable_thread_specific.h>
+#endif
 
 NORI_NAMESPACE_BEGIN
 
@@ -38,11 +46,85 @@ NORI_NAMESPACE_BEGIN
  * "Fast and Parallel Construction of SAH-based Bounding Volume Hierarchies"
  * by Ingo Wald (Proc. IEEE/EG Symposium on Interactive Ray Tracing, 2007)
  *
+ * After construction, the binary tree can optionally be collapsed into a
+ * 4- or 8-wide hierarchy whose child bounding boxes are stored in SoA
+ * form, so that a single SSE/AVX instruction sequence tests a ray
+ * against all children of a node (see \ref setWidth()). The wide nodes
+ * can additionally be stored with 8-bit quantized child bounds, which
+ * roughly halves their size (see \ref setCompressed()). Finally, the
+ * nodes of the traversed hierarchy can be rearranged into treelets or
+ * a van Emde Boas layout to improve cache locality (see
+ * \ref setNodeOrder()).
+ *
+ * Triangles of \ref Mesh instances are additionally copied into SoA
+ * blocks of pre-transformed vertex data in leaf order, which lets the
+ * traversal test several triangles of a leaf with one SIMD kernel
+ * instead of one virtual \ref Shape::rayIntersect() call each.
+ *
+ * When a cache directory is set, the finished arrays are written to a
+ * file named after a hash of the geometry and the build parameters, and
+ * later builds of the same scene map this file back into memory instead
+ * of constructing the hierarchy again (see \ref setCacheDirectory()).
+ *
+ * The triangle blocks and the meshes can also be kept on disk in clusters
+ * that each cover a subtree of the hierarchy, and paged in on demand
+ * within a fixed memory budget (see \ref setPagingBudget()).
+ *
  * \author Wenzel Jakob
  */
 class BVH {
-    friend class BVHBuildTask;
+    friend class BVHBuilder;
+    friend class SBVHBuilder;
+    friend class LBVHBuilder;
 public:
+    /// Construction algorithms supported by \ref build()
+    enum EBuildMethod {
+        /// Binned SAH object partitioning (default)
+        EBinnedSAH = 0,
+
+        /// Object partitioning plus spatial splits with duplicated references (SBVH)
+        ESpatialSplits,
+
+        /// Morton code based linear BVH (LBVH), fast but of lower quality
+        ELinear,
+
+        /// Linear BVH with SAH-optimized upper levels (HLBVH)
+        EHierarchicalLinear
+    };
+
+    /**
+     * \brief Any-hit filter invoked for every candidate intersection
+     *
+     * Receives the shape, the index of the primitive within the shape,
+     * the ray, the surface coordinates reported by
+     * \ref Shape::rayIntersect() (barycentric for meshes) and the distance
+     * of a hit that lies within the current ray segment. Returning \c false
+     * rejects the hit, and the traversal continues as if the primitive had
+     * been missed.
+     */
+    typedef std::function<bool(const Shape *shape, uint32_t index, const Ray3f &ray,
+                               const Point2f &uv, float t)> HitFilter;
+
+    /// Candidate intersection kept by \ref rayIntersectMulti()
+    struct MultiHit {
+        float t;             ///< Distance along the ray
+        Point2f uv;          ///< Surface coordinates reported by the shape
+        const Shape *shape;  ///< Shape that was hit
+        uint32_t index;      ///< Index of the primitive within the shape
+    };
+
+    /// Arrangements of the nodes in memory supported by \ref build()
+    enum ENodeOrder {
+        /// Depth-first order as produced by the builders (default)
+        EDepthFirstOrder = 0,
+
+        /// Treelets of nodes that are likely to be visited together
+        ETreeletOrder,
+
+        /// Recursive van Emde Boas layout (cache-oblivious)
+        EVanEmdeBoasOrder
+    };
+
     /// Create a new and empty BVH
     BVH() { m_shapeOffset.push_back(0u); }
 
@@ -62,6 +144,126 @@ public:
     /// Build the BVH
     void build();
 
+    /**
+     * \brief Set the branching factor used for traversal
+     *
+     * Valid values are 2 (the binary SAH tree, default), 4 and 8.
+     * The wide variants are collapsed from the binary tree after
+     * construction. This function can only be used before
+     * \ref build() is called.
+     */
+    void setWidth(int width);
+
+    /// Return the branching factor used for traversal
+    int getWidth() const { return m_width; }
+
+    /**
+     * \brief Store the wide nodes with quantized child bounds
+     *
+     * Every child bounding box is then stored with 8 bits per plane
+     * relative to the bounds of its parent, rounded outwards. This
+     * requires a branching factor of 4 or 8 and can only be used before
+     * \ref build() is called.
+     */
+    void setCompressed(bool compressed) { m_compressed = compressed; }
+
+    /// Are the wide nodes stored with quantized child bounds?
+    bool isCompressed() const { return m_compressed; }
+
+    /**
+     * \brief Select the construction algorithm
+     *
+     * This function can only be used before \ref build() is called.
+     */
+    void setBuildMethod(EBuildMethod method) { m_buildMethod = method; }
+
+    /// Return the construction algorithm
+    EBuildMethod getBuildMethod() const { return m_buildMethod; }
+
+    /// Look up a construction algorithm by name ("sah", "sbvh", "lbvh" or "hlbvh")
+    static EBuildMethod parseBuildMethod(const std::string &name);
+
+    /**
+     * \brief Select the arrangement of the nodes in memory
+     *
+     * After construction (and collapsing), the nodes used by the traversal
+     * are permuted accordingly and all child indices are rewritten. This
+     * only affects the memory access pattern, not the hierarchy itself.
+     * This function can only be used before \ref build() is called.
+     */
+    void setNodeOrder(ENodeOrder order) { m_nodeOrder = order; }
+
+    /// Return the arrangement of the nodes in memory
+    ENodeOrder getNodeOrder() const { return m_nodeOrder; }
+
+    /// Look up a node arrangement by name ("depthfirst", "treelet" or "veb")
+    static ENodeOrder parseNodeOrder(const std::string &name);
+
+    /**
+     * \brief Set the duplication budget of the spatial split builder
+     *
+     * The builder stops splitting references once their total count
+     * exceeds <tt>(1 + budget)</tt> times the number of primitives.
+     */
+    void setSplitBudget(float budget);
+
+    /**
+     * \brief Copy the triangles into SoA blocks for the leaf tests
+     *
+     * The blocks duplicate the vertex positions of all meshes in leaf
+     * order. Without them (e.g. for scenes that barely fit into memory),
+     * every primitive of a leaf is intersected through the \ref Shape
+     * interface instead, which is slower. Enabled by default. This
+     * function can only be used before \ref build() is called.
+     */
+    void setTriangleBlocks(bool blocks) { m_triangleBlocks = blocks; }
+
+    /// Are the triangles copied into SoA blocks?
+    bool hasTriangleBlocks() const { return m_triangleBlocks; }
+
+    /**
+     * \brief Set a directory in which built hierarchies are cached
+     *
+     * Before constructing the BVH, \ref build() looks for a file in this
+     * directory whose name is a hash of the geometry and the build
+     * parameters. If it exists, its contents are used in place (via
+     * a memory mapping) without copying. Otherwise, the BVH is built and
+     * written to this file. An empty string (default) disables caching.
+     */
+    void setCacheDirectory(const std::string &directory) { m_cacheDirectory = directory; }
+
+    /// Return the cache directory (empty if caching is disabled)
+    const std::string &getCacheDirectory() const { return m_cacheDirectory; }
+
+    /**
+     * \brief Page the geometry from disk within a memory budget
+     *
+     * After construction, the triangle blocks and the vertex data of the
+     * meshes (see \ref Mesh::page()) are written to a cluster file in the
+     * cache directory (see \ref setCacheDirectory()) or in the temporary
+     * directory, partitioned into clusters of about \ref PAGING_CLUSTER_SIZE
+     * bytes that follow subtrees of the hierarchy, and the in-memory copies
+     * are released. Leaf tests, hit information, alpha tests and surface
+     * samples load the clusters they need and, once more than \c budget
+     * bytes are resident, the least recently used clusters are evicted.
+     * Zero (default) keeps everything in memory. This function can only
+     * be used before \ref build() is called.
+     *
+     * The nodes, the references and, per triangle, the area CDF of the
+     * meshes and the position of its record stay in memory. Shapes that
+     * are not meshes are not paged.
+     */
+    void setPagingBudget(size_t budget) { m_pagingBudget = budget; }
+
+    /// Return the memory budget of the paged geometry (0 if paging is disabled)
+    size_t getPagingBudget() const { return m_pagingBudget; }
+
+    /// Return the paging counters of every thread (empty if paging is disabled)
+    std::vector<ClusterCache::Stats> getPagingStats() const;
+
+    /// Reset the paging counters
+    void resetPagingStats();
+
     /**
      * \brief Intersect a ray against all shapes registered
      * with the BVH
@@ -73,12 +275,123 @@ public:
      * information is really needed. When set to \c true, the 
      * function just checks whether or not there is occlusion, but without
      * providing any more detail (i.e. \c its will not be filled with
-     * contents). This is usually much faster.
+     * contents). This is equivalent to calling \ref occluded().
+     *
+     * Candidate hits that are rejected by \c filter (if given) are
+     * skipped during the traversal, see \ref HitFilter.
      *
      * \return \c true If an intersection was found
      */
     bool rayIntersect(const Ray3f &ray, Intersection &its, 
-        bool shadowRay = false) const;
+        bool shadowRay = false, const HitFilter *filter = nullptr) const;
+
+    /**
+     * \brief Find the closest intersection without computing the
+     * full hit information
+     *
+     * Only \c its.t, \c its.uv and \c its.mesh are set, and \c f receives
+     * the index of the primitive within \c its.mesh. Passing these to
+     * \ref Shape::setHitInformation() completes the record. On return,
+     * \c ray.mint holds the adaptive ray epsilon and \c ray.maxt the
+     * distance to the intersection (if any).
+     */
+    bool rayIntersectClosest(Ray3f &ray, Intersection &its, uint32_t &f,
+        const HitFilter *filter = nullptr) const;
+
+    /**
+     * \brief Find the \c k closest intersections along a ray segment
+     *
+     * All hits are gathered in a single traversal; once \c k of them are
+     * known, the segment is shortened to the farthest one so that the rest
+     * of the hierarchy is culled as in a closest-hit query. Hits rejected
+     * by \c filter (if given) are skipped. With spatial splits, a primitive
+     * that is referenced by several leaves is only reported once.
+     *
+     * The hits are kept sorted by distance (and by shape and primitive,
+     * which makes the repeated hits of a primitive adjacent) in \c scratch,
+     * so a candidate costs a binary search and at most \c k moves.
+     *
+     * \param its
+     *    Array of \c k records that receives the complete hit information
+     *    of the intersections in order of increasing distance
+     * \param scratch
+     *    Array of \c k entries that holds the hits during the traversal
+     *
+     * \return The number of intersections that were found (at most \c k)
+     */
+    uint32_t rayIntersectMulti(const Ray3f &ray, Intersection *its, MultiHit *scratch,
+        uint32_t k, const HitFilter *filter = nullptr) const;
+
+    /**
+     * \brief Check whether any shape registered with the BVH
+     * intersects the given ray segment
+     *
+     * This is a dedicated any-hit traversal for shadow rays: it stops at
+     * the first intersection and does not record any hit information.
+     * The primitive that occluded the previous query of the calling
+     * thread is tested before the traversal starts, since consecutive
+     * shadow rays tend to be blocked by the same geometry.
+     *
+     * Candidate hits that are rejected by \c filter (if given) do not
+     * occlude the ray, see \ref HitFilter.
+     *
+     * \return \c true if the ray segment is occluded
+     */
+    bool occluded(const Ray3f &ray, const HitFilter *filter = nullptr) const;
+
+    /**
+     * \brief Intersect a packet of 4 rays against all shapes registered
+     * with the BVH
+     *
+     * Packets are traversed through the binary tree together: a node is
+     * visited once for all rays of the packet, rejected early using an
+     * interval-arithmetic frustum test when the ray directions share
+     * their signs, and then tested precisely for the active lanes.
+     * This works best for coherent rays such as neighboring camera rays.
+     * Only the binary layout (\ref setWidth() with 2) is traversed in
+     * packets; with the wide layouts, the rays are traced one by one.
+     * Packets do not support hit filters.
+     *
+     * \param rays
+     *    Array of 4 rays
+     * \param its
+     *    Array of 4 intersection records. Only entries whose bit is
+     *    set in the returned mask contain valid information.
+     * \param mask
+     *    Bit mask of active lanes; inactive rays are ignored
+     *
+     * \return Bit mask of the lanes that found an intersection
+     */
+    uint32_t rayIntersect4(const Ray3f *rays, Intersection *its,
+        uint32_t mask = 0xFu) const;
+
+    /// Intersect a packet of 8 rays (see \ref rayIntersect4())
+    uint32_t rayIntersect8(const Ray3f *rays, Intersection *its,
+        uint32_t mask = 0xFFu) const;
+
+    /// Intersect a packet of 16 rays (see \ref rayIntersect4())
+    uint32_t rayIntersect16(const Ray3f *rays, Intersection *its,
+        uint32_t mask = 0xFFFFu) const;
+
+    /// Counters describing the work done by the traversal routines
+    struct TraversalStats {
+        uint64_t rays = 0;             ///< Number of closest-hit queries
+        uint64_t nodes = 0;            ///< Nodes visited by closest-hit queries
+        uint64_t primitives = 0;       ///< Primitives tested by closest-hit queries
+        uint64_t shadowRays = 0;       ///< Number of occlusion queries
+        uint64_t shadowNodes = 0;      ///< Nodes visited by occlusion queries
+    };
+
+    /**
+     * \brief Return the traversal counters accumulated over all threads
+     *
+     * The counters are only maintained when Nori is compiled with the
+     * \c NORI_BVH_STATS CMake option; otherwise they are always zero.
+     */
+    TraversalStats getTraversalStats() const;
+
+    /// Reset the traversal counters
+    void resetTraversalStats();
 
     /// Return the total number of shapes registered with the BVH
     uint32_t getShapeCount() const { return (uint32_t) m_shapes.size(); }
@@ -97,6 +410,9 @@ public:
         return m_bbox;
     }
 
+    /// Return the number of bytes used by the nodes, indices and triangle blocks
+    size_t getMemoryUsage() const;
+
 protected:
     /**
      * \brief Compute the shape and primitive indices corresponding to
@@ -120,8 +436,107 @@ protected:
         return m_shapes[shapeIdx]->getCentroid(index);
     }
 
-    /// Compute internal tree statistics
-    std::pair<float, uint32_t> statistics(uint32_t index = 0) const;
+    /// Return the calling thread's traversal counters (\c nullptr if disabled)
+#if defined(NORI_BVH_STATS)
+    TraversalStats *localStats() const { return &m_stats.local(); }
+#else
+    TraversalStats *localStats() const { return nullptr; }
+#endif
+
+    /// Build \ref m_nodes and \ref m_indices using the parallel binned SAH builder
+    void buildBinnedSAH();
+
+    /// Build \ref m_nodes and \ref m_indices using spatial splits, returns the number of references
+    uint32_t buildSpatialSplits();
+
+    /// Build \ref m_nodes and \ref m_indices from Morton codes, optionally with SAH-optimized upper levels
+    void buildLinear(bool refineTop);
+
+    /// Remove the unused entries of a conservatively allocated \ref m_nodes array with \c nodeCount used nodes
+    void compactNodes(uint32_t nodeCount);
+
+    /// Return a hash of the geometry and all parameters that affect \ref build()
+    uint64_t getCacheKey() const;
+
+    /// Map the cached hierarchy with the given key, returns \c false if unavailable
+    bool loadCache(uint64_t key);
+
+    /// Write the hierarchy to the cache file with the given key
+    void saveCache(uint64_t key) const;
+
+    /**
+     * \brief Compute internal tree statistics
+     *
+     * Returns the SAH cost and node count of the subtree at \c index.
+     * Subtrees up to a certain \c depth are processed in parallel.
+     */
+    std::pair<float, uint32_t> statistics(uint32_t index = 0, uint32_t depth = 0) const;
+
+    /// Collapse the binary tree into an \c N-wide hierarchy
+    template <int N> void collapse();
+
+    /// Recursive helper function of \ref collapse()
+    template <int N> uint32_t collapse(uint32_t node_idx);
+
+    /// Replace the \c N-wide nodes by their compressed version
+    template <int N> void compress();
+
+    /// Rearrange the nodes used by the traversal according to \ref m_nodeOrder
+    void reorderNodes();
+
+    /// Copy all triangles into SoA blocks following the order of \ref m_indices
+    void packTriangles();
+
+    /**
+     * \brief Move the triangle blocks and the meshes into clusters that
+     * are paged from disk
+     *
+     * \c key identifies the geometry and build parameters, and names the
+     * cluster file.
+     */
+    void pageGeometry(uint64_t key);
+
+    /**
+     * \brief Find the closest intersection with the primitives referenced
+     * by entries <tt>[start, end)</tt> of \ref m_indices
+     *
+     * On success, \c ray.maxt, \c its.t, \c its.uv and \c its.mesh are
+     * updated and \c f receives the primitive index within \c its.mesh.
+     * Hits are only accepted if \c filter is \c nullptr or returns \c true.
+     */
+    bool rayIntersectLeaf(uint32_t start, uint32_t end, Ray3f &ray,
+        Intersection &its, uint32_t &f, const HitFilter *filter) const;
+
+    /// Any-hit version of \ref rayIntersectLeaf(), returns the occluding primitive in \c prim
+    bool occludedLeaf(uint32_t start, uint32_t end, const Ray3f &ray,
+        uint32_t &prim, const HitFilter *filter) const;
+
+    /// Version of \ref rayIntersectLeaf() that calls the \ref Shape interface for every primitive
+    bool rayIntersectLeafScalar(uint32_t start, uint32_t end, Ray3f &ray,
+        Intersection &its, uint32_t &f, const HitFilter *filter) const;
+
+    /// Version of \ref occludedLeaf() that calls the \ref Shape interface for every primitive
+    bool occludedLeafScalar(uint32_t start, uint32_t end, const Ray3f &ray,
+        uint32_t &prim, const HitFilter *filter) const;
+
+    /// Packet traversal of the binary hierarchy with \c N rays
+    template <int N> uint32_t rayIntersectPacket(const Ray3f *rays,
+        Intersection *its, uint32_t mask) const;
+
+    /// Closest-hit traversal of the binary hierarchy, see \ref rayIntersectClosest()
+    bool rayIntersectBinary(Ray3f &ray, Intersection &its, uint32_t &f,
+        const HitFilter *filter) const;
+
+    /// Closest-hit traversal of a wide hierarchy, see \ref rayIntersectClosest()
+    template <typename Node> bool rayIntersectWide(const MappedArray<Node> &nodes,
+        Ray3f &ray, Intersection &its, uint32_t &f, const HitFilter *filter) const;
+
+    /// Any-hit traversal of the binary hierarchy, returns the occluding primitive in \c prim
+    bool occludedBinary(const Ray3f &ray, uint32_t &prim, const HitFilter *filter) const;
+
+    /// Any-hit traversal of a wide hierarchy, returns the occluding primitive in \c prim
+    template <typename Node> bool occludedWide(const MappedArray<Node> &nodes,
+        const Ray3f &ray, uint32_t &prim, const HitFilter *filter) const;
 
     /* BVH node in 32 bytes */
     struct BVHNode {
@@ -134,7 +549,8 @@ protected:
 
             struct {
                 unsigned flag : 1;
-                uint32_t axis : 31;
+                unsigned axis : 2;
+                unsigned leftChild : 29;
                 uint32_t rightChild;
             } inner;
 
@@ -162,12 +578,117 @@ protected:
             return leaf.start + leaf.size;
         }
     };
+
+    /**
+     * \brief N-wide BVH node with SoA child bounding boxes
+     *
+     * Every child slot either references another wide node
+     * (<tt>count == 0</tt>) or a range of <tt>count</tt> entries of
+     * \ref m_indices starting at \c child. Unused slots have an empty
+     * bounding box and are never reported as hit by the traversal.
+     */
+    template <int N> struct alignas(32) WideNode {
+        static constexpr int Width = N;
+
+        float lower[3][N];   ///< Per-axis minimum of the child bounding boxes
+        float upper[3][N];   ///< Per-axis maximum of the child bounding boxes
+        uint32_t child[N];   ///< Child node index or start of the primitive range
+        uint32_t count[N];   ///< Number of primitives (0 for inner children)
+
+        /// Return the lower (\c side = 0) or upper planes of all children along \c axis
+        SimdFloat<N> planes(int side, int axis) const {
+            return SimdFloat<N>::load(side == 0 ? lower[axis] : upper[axis]);
+        }
+    };
+
+    /**
+     * \brief N-wide BVH node with quantized child bounding boxes
+     *
+     * The planes of the child boxes are stored as multiples
+     * <tt>origin + q * scale</tt> with an 8-bit \c q, where \c origin is
+     * the minimum of the node's bounding box and \c scale is a power of
+     * two. The product is therefore exact and the decoded planes are the
+     * same with and without fused multiply-adds. Lower planes are rounded
+     * down and upper planes up, so the decoded boxes contain the original
+     * ones. Unused slots have <tt>lower = 255</tt> and <tt>upper = 0</tt>,
+     * which the slab test never reports as hit.
+     */
+    template <int N> struct alignas(16) CompressedNode {
+        static constexpr int Width = N;
+
+        float origin[3];       ///< Minimum of the node's bounding box
+        float scale[3];        ///< Per-axis size of a quantization step
+        uint8_t lower[3][N];   ///< Quantized minimum of the child bounding boxes
+        uint8_t upper[3][N];   ///< Quantized maximum of the child bounding boxes
+        uint32_t child[N];     ///< Child node index or start of the primitive range
+        uint32_t count[N];     ///< Number of primitives (0 for inner children)
+
+        /// Return the lower (\c side = 0) or upper planes of all children along \c axis
+        SimdFloat<N> planes(int side, int axis) const {
+            return SimdFloat<N>(origin[axis]) + SimdFloat<N>::loadBytes(
+                side == 0 ? lower[axis] : upper[axis]) * SimdFloat<N>(scale[axis]);
+        }
+    };
+
+    /// Number of primitives per \ref TriangleBlock
+    static constexpr uint32_t TRIANGLE_BLOCK_SIZE = NORI_SIMD_WIDTH;
+
+    /// Approximate size of the clusters used for paging (in bytes)
+    static constexpr uint32_t PAGING_CLUSTER_SIZE = 64 * 1024;
+
+    /**
+     * \brief SoA block holding \ref TRIANGLE_BLOCK_SIZE consecutive
+     * entries of \ref m_indices
+     *
+     * Triangles are stored as a vertex and two edges, which is exactly
+     * what the Moeller-Trumbore test needs. Lanes whose primitive is not
+     * a triangle (e.g. a \c Sphere) have their bit set in \c virtualMask
+     * and are intersected through the \ref Shape interface.
+     */
+    struct alignas(32) TriangleBlock {
+        float p0[3][TRIANGLE_BLOCK_SIZE];     ///< First vertex
+        float e1[3][TRIANGLE_BLOCK_SIZE];     ///< Edge from the first to the second vertex
+        float e2[3][TRIANGLE_BLOCK_SIZE];     ///< Edge from the first to the third vertex
+        uint32_t shape[TRIANGLE_BLOCK_SIZE];  ///< Index into \ref m_shapes
+        uint32_t index[TRIANGLE_BLOCK_SIZE];  ///< Primitive index within the shape
+        uint32_t virtualMask;                 ///< Lanes that must use the virtual path
+    };
+
+    /// Return the node array of the \c N-wide hierarchy
+    template <int N> MappedArray<WideNode<N>> &getWideNodes();
+
+    /// Return the node array of the \c N-wide hierarchy (const version)
+    template <int N> const MappedArray<WideNode<N>> &getWideNodes() const;
+
+    /// Return the compressed node array of the \c N-wide hierarchy
+    template <int N> MappedArray<CompressedNode<N>> &getCompressedNodes();
 private:
     std::vector<Shape *> m_shapes;       ///< List of meshes registered with the BVH
     std::vector<uint32_t> m_shapeOffset; ///< Index of the first triangle for each shape
-    std::vector<BVHNode> m_nodes;       ///< BVH nodes
-    std::vector<uint32_t> m_indices;    ///< Index references by BVH nodes
+    MappedArray<BVHNode> m_nodes;       ///< BVH nodes
+    MappedArray<uint32_t> m_indices;    ///< Index references by BVH nodes
+    MappedArray<WideNode<4>> m_nodes4;  ///< Collapsed 4-wide BVH nodes
+    MappedArray<WideNode<8>> m_nodes8;  ///< Collapsed 8-wide BVH nodes
+    MappedArray<CompressedNode<4>> m_compressedNodes4; ///< Compressed 4-wide BVH nodes
+    MappedArray<CompressedNode<8>> m_compressedNodes8; ///< Compressed 8-wide BVH nodes
+    MappedArray<TriangleBlock> m_triangles; ///< Primitive data in the order of m_indices
+    bool m_triangleBlocks = true;       ///< Fill \ref m_triangles after construction?
+    int m_width = 2;                    ///< Branching factor used for traversal
+    bool m_compressed = false;          ///< Store the wide nodes with quantized bounds?
+    EBuildMethod m_buildMethod = EBinnedSAH; ///< Construction algorithm
+    ENodeOrder m_nodeOrder = EDepthFirstOrder; ///< Arrangement of the nodes in memory
+    float m_splitBudget = 0.3f;         ///< Duplication budget of the spatial split builder
     BoundingBox3f m_bbox;               ///< Bounding box of the entire BVH
+    std::string m_cacheDirectory;       ///< Directory of cached hierarchies (empty: disabled)
+    std::unique_ptr<MemoryMappedFile> m_cacheFile; ///< Mapped cache file backing the arrays
+    size_t m_pagingBudget = 0;          ///< Memory budget of the paged geometry (0: disabled)
+    std::unique_ptr<ClusterCache> m_pager; ///< Resident clusters of blocks and meshes (if paging)
+    std::string m_clusterFile;          ///< Cluster file that clear() deletes (only on Windows)
+    std::vector<uint32_t> m_clusterStart; ///< First triangle block of every cluster, plus the block count
+    uint64_t m_generation = 0;          ///< Unique number of the last build() (0: not built)
+#if defined(NORI_BVH_STATS)
+    mutable tbb::enumerable_thread_specific<TraversalStats> m_stats; ///< Per-thread traversal counters
+#endif
 };
 
 NORI_NAMESPACE_END
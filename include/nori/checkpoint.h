@@ -0,0 +1,135 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_CHECKPOINT_H)
+#define __NORI_CHECKPOINT_H
+
+#include <nori/block.h>
+#include <nori/scheduler.h>
+#include <nori/timer.h>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Periodic snapshots of a rendering, from which it can be resumed
+ *
+ * A checkpoint file holds the accumulated image (color and weight,
+ * including the border), the number of finished samples, the number of
+ * active pixels and the sample generator of every tile, the queues of the
+ * scheduler, and the per-pixel statistics of adaptive sampling. A
+ * rendering that is restored from it continues every tile with exactly the
+ * samples that it would have rendered next. With a single worker, it
+ * produces the same image as an uninterrupted rendering, bit for bit;
+ * with more, the rounding of the pixels that neighboring tiles share
+ * depends on the timing of the workers either way, and with adaptive
+ * sampling, so can the decision which pixels have converged. Checkpoints
+ * are only written when requested with \c --checkpoint.
+ *
+ * The workers bracket their visits with \ref beginVisit() and
+ * \ref endVisit(). \ref capture() waits until no visit is in progress,
+ * copies the state into memory, and leaves writing the file to a
+ * background thread, so that the workers only pause for the copy. Files
+ * are replaced as a whole (by renaming a temporary file), so a rendering
+ * that is killed while writing leaves the previous checkpoint intact.
+ */
+class RenderCheckpoint {
+public:
+    /**
+     * \brief Prepare checkpoints of a rendering
+     *
+     * \param filename
+     *    Name of the checkpoint file
+     * \param key
+     *    Hash of the scene and the render settings. A checkpoint is only
+     *    restored by a rendering with the same key.
+     * \param interval
+     *    Number of seconds between two checkpoints
+     */
+    RenderCheckpoint(const std::string &filename, uint64_t key, float interval);
+
+    /// Wait for the file to be written
+    ~RenderCheckpoint();
+
+    /**
+     * \brief Restore the state of a rendering from the checkpoint file
+     *
+     * The tiles of \c scheduler must not have been visited yet. Their
+     * samplers are cloned from \c sampler. Afterwards, the scheduler only
+     * visits the tiles that need further samples.
+     *
+     * \return \c false if there is no checkpoint file, in which case
+     * nothing is changed
+     */
+    bool restore(ImageBlock &film, TileScheduler &scheduler, const Sampler &sampler,
+                 PixelStatistics *statistics) const;
+
+    /**
+     * \brief Mark the start of a visit, during which no checkpoint is captured
+     *
+     * Must be called before the tile is requested from the scheduler, so
+     * that every tile is either in a queue or visited when a checkpoint is
+     * captured.
+     */
+    void beginVisit() {
+        std::lock_guard<std::mutex> gate(m_gate);
+        m_visits.lock_shared();
+    }
+
+    /// Mark the end of a visit (after the tile was returned to the scheduler)
+    void endVisit() { m_visits.unlock_shared(); }
+
+    /// Is the next checkpoint due, and is the previous one written?
+    bool isDue() const {
+        return !m_writing && m_timer.elapsed() >= m_nextCapture;
+    }
+
+    /**
+     * \brief Capture the state of the rendering and write it in the background
+     *
+     * Must not be called between \ref beginVisit() and \ref endVisit() by the
+     * same thread. If another thread is capturing a checkpoint or the
+     * previous one is still being written, this function returns right away.
+     */
+    void capture(const ImageBlock &film, TileScheduler &scheduler,
+                 const PixelStatistics *statistics);
+
+    /// Wait for the file to be written and delete it (e.g. once the rendering is finished)
+    void remove();
+
+private:
+    /// Write a captured state to the checkpoint file
+    void write(const std::string &data);
+
+    std::string m_filename;
+    uint64_t m_key;
+    float m_interval;
+    Timer m_timer;
+    std::atomic<double> m_nextCapture; ///< Time of the next checkpoint in milliseconds
+    std::mutex m_gate;
+    std::shared_mutex m_visits;
+    std::thread m_writer;
+    std::atomic<bool> m_writing { false };
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_CHECKPOINT_H */
@@ -195,6 +195,15 @@ extern std::string timeString(double time, bool precise = false);
 /// Convert a memory amount in bytes into a human-readable string
 extern std::string memString(size_t size, bool precise = false);
 
+/**
+ * \brief Continue a 64-bit hash with a block of memory
+ *
+ * Uses wyhash-style multiply mixing with a MurmurHash3 finalizer, so
+ * all bits of the result are well distributed. The result can be passed
+ * as \c hash to continue with another block.
+ */
+extern uint64_t hashBytes(const void *data, size_t size, uint64_t hash = 0xcbf29ce484222325ull);
+
 /// Measures associated with probability distributions
 enum EMeasure {
     EUnknownMeasure = 0,
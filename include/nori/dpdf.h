@@ -108,6 +108,26 @@ public:
         return m_sum;
     }
 
+    /// Return the cumulative distribution (\ref size() + 1 entries, starting with zero)
+    const std::vector<float> &getCDF() const {
+        return m_cdf;
+    }
+
+    /**
+     * \brief Restore a normalized distribution
+     *
+     * \param cdf
+     *     Normalized cumulative distribution as returned by \ref getCDF()
+     * \param sum
+     *     Original sum of the entries as returned by \ref getSum()
+     */
+    void setNormalizedCDF(std::vector<float> &&cdf, float sum) {
+        m_cdf = std::move(cdf);
+        m_sum = sum;
+        m_normalization = 1.0f / sum;
+        m_normalized = true;
+    }
+
     /**
      * \brief %Transform a uniformly distributed sample to the stored distribution
      * 
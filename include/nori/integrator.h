@@ -23,6 +23,8 @@
 
 NORI_NAMESPACE_BEGIN
 
+struct Intersection;
+
 /**
  * \brief Abstract integrator (i.e. a rendering technique)
  *
@@ -54,6 +56,27 @@ public:
      */
     virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const = 0;
 
+    /**
+     * \brief Sample the incident radiance along a ray whose first
+     * intersection has already been computed
+     *
+     * This is used when primary rays are traced in packets (see
+     * \ref Scene::rayIntersectStream()). The default implementation
+     * ignores the precomputed intersection and calls \ref Li().
+     *
+     * \param its
+     *    The first intersection along \c ray (only valid if \c hit is set)
+     * \param hit
+     *    Whether \c ray intersected the scene
+     */
+    virtual Color3f LiHit(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                          const Intersection &its, bool hit) const {
+        return Li(scene, sampler, ray);
+    }
+
+    /// Does \ref LiHit() make use of the precomputed primary intersection?
+    virtual bool supportsPrimaryHits() const { return false; }
+
     /**
      * \brief Return the type of object (i.e. Mesh/BSDF/etc.) 
      * provided by this instance
@@ -0,0 +1,109 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_LOD_H)
+#define __NORI_LOD_H
+
+#include <nori/mesh.h>
+#include <nori/bvh.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Mesh with simplified levels of detail
+ *
+ * This shape takes the place of a \ref Mesh with levels of detail (see
+ * \ref Mesh::buildLevelsOfDetail()) in the scene's BVH. The mesh and each
+ * of its simplified versions have their own BVH, and every ray is
+ * intersected with a single level, which is chosen from the size of a
+ * camera pixel at the point where the ray enters the mesh's bounding box
+ * (or, for rays that start inside of it, where the line of sight from the
+ * camera to their origin enters it).
+ * Transitions between the levels are dithered per ray (see src/lod.cpp).
+ *
+ * Hits are reported on the level meshes, which share the BSDF of the
+ * original mesh.
+ */
+class LODShape : public Shape {
+public:
+    /**
+     * \brief Take over \c mesh and its levels of detail
+     *
+     * The BVHs of the levels are built with the width, node layout and
+     * construction algorithm of \c settings.
+     */
+    LODShape(Mesh *mesh, const BVH &settings);
+
+    /// Release the levels (including the original mesh)
+    virtual ~LODShape();
+
+    /**
+     * \brief Set the parameters of the level selection
+     *
+     * Until this is called, all rays intersect the original mesh.
+     *
+     * \param position
+     *    Position of the camera
+     * \param pixelAngle
+     *    Angle between the rays through neighboring pixels
+     * \param pixelError
+     *    Tolerated distance between a level and the original mesh,
+     *    relative to the size of a pixel
+     */
+    void setCamera(const Point3f &position, float pixelAngle, float pixelError);
+
+    /// Return the number of levels, including the original mesh
+    uint32_t getLevelCount() const { return (uint32_t) m_levels.size(); }
+
+    /// Return the level of detail that is intersected with \c ray (0 is the original mesh)
+    uint32_t selectLevel(const Ray3f &ray) const;
+
+    virtual BoundingBox3f getBoundingBox(uint32_t index) const override { return m_bbox; }
+
+    virtual Point3f getCentroid(uint32_t index) const override { return m_bbox.getCenter(); }
+
+    virtual bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const override;
+
+    virtual bool occluded(uint32_t index, const Ray3f &ray) const override;
+
+    virtual void setHitInformation(uint32_t index, const Ray3f &ray, Intersection &its) const override;
+
+    virtual void sampleSurface(ShapeQueryRecord &sRec, const Point2f &sample) const override;
+
+    virtual float pdfSurface(const ShapeQueryRecord &sRec) const override;
+
+    virtual std::string toString() const override;
+
+private:
+    /// Return the level of detail for rays that reach the mesh at \c p
+    uint32_t selectLevel(const Point3f &p) const;
+
+    /// Return the any-hit filter for queries of the levels (\c nullptr if there is none)
+    const BVH::HitFilter *getHitFilter() const { return m_hitFilter ? &m_hitFilter : nullptr; }
+
+    std::vector<std::unique_ptr<BVH>> m_levels; ///< BVH of every level, from fine to coarse
+    std::vector<float> m_errors;         ///< Simplification error of every level
+    BVH::HitFilter m_hitFilter;
+    Point3f m_cameraPosition;
+    float m_pixelAngle = 0.f;
+    float m_pixelError = 1.f;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_LOD_H */
@@ -21,9 +21,12 @@
 
 #include <nori/shape.h>
 #include <nori/dpdf.h>
+#include <memory>
 
 NORI_NAMESPACE_BEGIN
 
+class ClusterCache;
+
 /**
  * \brief Triangle mesh
  *
@@ -34,11 +37,18 @@ NORI_NAMESPACE_BEGIN
  */
 class Mesh : public Shape {
 public:
+    /// Release all memory
+    virtual ~Mesh();
+
     /// Initialize internal data structures (called once by the XML parser)
     virtual void activate() override;
 
     /// Return the total number of triangles in this shape
-    virtual uint32_t getPrimitiveCount() const override { return (uint32_t) m_F.cols(); }
+    virtual uint32_t getPrimitiveCount() const override {
+        if (m_pager)
+            return (uint32_t) m_slots.size();
+        return m_packedF.empty() ? (uint32_t) m_F.cols() : (uint32_t) (m_packedF.size() / 3);
+    }
 
     //// Return an axis-aligned bounding box containing the given triangle
     virtual BoundingBox3f getBoundingBox(uint32_t index) const override;
@@ -46,6 +56,12 @@ public:
     //// Return the centroid of the given triangle
     virtual Point3f getCentroid(uint32_t index) const override;
 
+    //// Return a bounding box of the part of the given triangle inside \c clip
+    virtual BoundingBox3f getClippedBoundingBox(uint32_t index, const BoundingBox3f &clip) const override;
+
+    /// Return a hash of the vertex positions and triangle indices
+    virtual uint64_t getGeometryHash() const override;
+
     /** \brief Ray-triangle intersection test
      *
      * Uses the algorithm by Moeller and Trumbore discussed at
@@ -76,8 +92,11 @@ public:
     /// Set intersection information: hit point, shading frame, UVs
     virtual void setHitInformation(uint32_t index, const Ray3f &ray, Intersection & its) const override;
 
+    /// Return the alpha of the BSDF at a hit, only interpolating the texture coordinates
+    virtual float getAlpha(uint32_t index, const Ray3f &ray, const Point2f &uv, float t) const override;
+
     /// Return the total number of vertices in this shape
-    uint32_t getVertexCount() const { return (uint32_t) m_V.cols(); }
+    uint32_t getVertexCount() const { return m_pager ? m_pagedVertexCount : (uint32_t) m_V.cols(); }
 
     /**
      * \brief Uniformly sample a position on the mesh with
@@ -92,22 +111,110 @@ public:
     Point3f getInterpolatedVertex(uint32_t index, const Vector3f & bc) const;
     Normal3f getInterpolatedNormal(uint32_t index, const Vector3f & bc) const;
 
+    /**
+     * \brief Vertex data of one triangle
+     *
+     * This is also the record of a triangle in the paged representation
+     * (see \ref page()), so it only consists of floats.
+     */
+    struct Triangle {
+        Point3f p[3];     ///< Vertex positions
+        Normal3f n[3];    ///< Vertex normals (if the mesh has normals)
+        Point2f uv[3];    ///< Texture coordinates (if the mesh has them)
+        Vector3f t[3];    ///< Tangents (if the mesh has them)
+        Vector3f b[3];    ///< Bitangents (if the mesh has tangents)
+    };
+
+    /// Attributes that \ref getTriangle() fetches in addition to the positions
+    enum ETriangleAttributes {
+        ETriangleNormals = 1,
+        ETriangleTexCoords = 2,
+        ETriangleTangents = 4,
+        ETriangleAll = ETriangleNormals | ETriangleTexCoords | ETriangleTangents
+    };
+
+    /**
+     * \brief Fetch the vertex data of a triangle
+     *
+     * \c attributes is a combination of \ref ETriangleAttributes. Attributes
+     * that the mesh does not have are left untouched. A paged mesh pins the
+     * cluster that holds the triangle while copying it.
+     */
+    void getTriangle(uint32_t index, Triangle &tri, uint32_t attributes = 0) const;
+
+    /**
+     * \brief Read the triangles from the clusters of \c pager from now on
+     *
+     * The record of triangle \c i is entry <tt>slots[i]</tt> of an array of
+     * \ref Triangle records, which is split into clusters of \c perCluster
+     * records starting with cluster \c firstCluster. The vertex arrays are
+     * released, only the slots and the area distribution used for sampling
+     * stay in memory. The cache must outlive all further queries.
+     */
+    void page(const ClusterCache *pager, uint32_t firstCluster, uint32_t perCluster,
+              std::vector<uint32_t> &&slots);
+
+    /// Are the triangles read from clusters (see \ref page())?
+    bool isPaged() const { return m_pager != nullptr; }
+
+    /// Return the index of vertex \c k (0, 1 or 2) of the given triangle
+    uint32_t getVertexIndex(uint32_t index, int k) const {
+        if (m_packedF.empty())
+            return m_F(k, index);
+        uint32_t base = m_clusterBase[index / FACE_CLUSTER_SIZE];
+        if (base & WIDE_CLUSTER_FLAG)
+            return m_wideF[(size_t) (base & ~WIDE_CLUSTER_FLAG) * 3 * FACE_CLUSTER_SIZE +
+                           3 * (index % FACE_CLUSTER_SIZE) + k];
+        return base + m_packedF[3 * index + k];
+    }
+
     /// Return a pointer to the vertex positions
     const MatrixXf &getVertexPositions() const { return m_V; }
 
-    /// Return a pointer to the vertex normals (or \c nullptr if there are none)
+    /// Return a pointer to the vertex normals (empty if there are none or if they are compressed)
     const MatrixXf &getVertexNormals() const { return m_N; }
 
-    /// Return a pointer to the texture coordinates (or \c nullptr if there are none)
+    /// Return a pointer to the texture coordinates (empty if there are none or if they are compressed)
     const MatrixXf &getVertexTexCoords() const { return m_UV; }
 
-    /// Return a pointer to the triangle vertex index list
+    /// Return a pointer to the triangle vertex index list (empty if it is compressed, see \ref getVertexIndex())
     const MatrixXu &getIndices() const { return m_F; }
 
+    /// Are the vertex attributes stored in the compact representation?
+    bool isCompressed() const { return m_compressed; }
+
+    /**
+     * \brief Write this mesh to a binary \c .nmesh file
+     *
+     * \param halfPrecision
+     *    Store normals, texture coordinates and tangents as 16-bit floats
+     */
+    void writeNMesh(const std::string &filename, bool halfPrecision = false) const;
 
     /// Return the name of this mesh
     const std::string &getName() const { return m_name; }
 
+    /// Were simplified levels of detail created by \ref activate()?
+    bool hasLevelsOfDetail() const { return !m_levels.empty(); }
+
+    /**
+     * \brief Hand the simplified levels of detail over to the caller
+     *
+     * The levels are ordered from fine to coarse and share the BSDF and
+     * the medium of this mesh, so they must not outlive it.
+     */
+    std::vector<std::unique_ptr<Mesh>> releaseLevelsOfDetail() {
+        std::vector<std::unique_ptr<Mesh>> levels;
+        levels.swap(m_levels);
+        return levels;
+    }
+
+    /**
+     * \brief Return a bound on the distance between this mesh and the
+     * mesh it was simplified from (0 unless it is a level of detail)
+     */
+    float getSimplificationError() const { return m_simplificationError; }
+
     /// Return a human-readable summary of this instance
     virtual std::string toString() const override;
 
@@ -115,6 +222,74 @@ protected:
     /// Create an empty mesh
     Mesh();
 
+    /**
+     * \brief Read the properties shared by the mesh loaders
+     *
+     * These are the boolean \c compressAttributes (see \ref
+     * compressAttributes()), the integer \c lodLevels (1 to 4, default 1)
+     * and the float \c lodReduction (in (0, 1), default 0.25, see \ref
+     * buildLevelsOfDetail()). They take effect in \ref activate().
+     */
+    void readMeshProperties(const PropertyList &propList);
+
+    /**
+     * \brief Load the contents of a binary \c .nmesh file (see src/nmesh.cpp)
+     *
+     * The sections of the file are copied into the vertex and index
+     * matrices, so the file is not accessed after loading. The precomputed
+     * tangents and area CDF are only used when \c trafo is the identity,
+     * otherwise they are recomputed.
+     */
+    void readNMesh(const std::string &filename, const Transform &trafo);
+
+    /// Compute the per-vertex tangents and bitangents from the normals and texture coordinates
+    void compute_pervertex_TBN();
+
+    /// Build the distribution of the triangles proportional to their surface area
+    void computeAreaPDF(DiscretePDF &pdf) const;
+
+    /**
+     * \brief Replace the vertex attributes by their compact representation
+     *
+     * Normals, tangents and bitangents are octahedral-encoded in 2x16 bits,
+     * texture coordinates are stored as two half floats, and the indices
+     * of every cluster of \ref FACE_CLUSTER_SIZE triangles are stored as
+     * 16-bit offsets from the smallest index of the cluster. Texture
+     * coordinates outside of the half range keep their 32-bit
+     * representation. So do the indices of clusters that span more than
+     * 2^16 vertices: they are marked with \ref WIDE_CLUSTER_FLAG in the
+     * cluster base and stored in a side table, while all other clusters
+     * of the mesh stay compact. Positions are not affected, so
+     * intersections remain exact.
+     */
+    void compressAttributes();
+
+    /// Does the mesh provide normals, texture coordinates or tangents (in any representation)?
+    bool hasNormals() const {
+        return m_N.size() > 0 || !m_packedN.empty() || (m_pagedAttributes & ETriangleNormals);
+    }
+    bool hasTexCoords() const {
+        return m_UV.size() > 0 || !m_packedUV.empty() || (m_pagedAttributes & ETriangleTexCoords);
+    }
+    bool hasTangents() const {
+        return (m_T.size() > 0 && m_B.size() > 0) || !m_packedT.empty() || (m_pagedAttributes & ETriangleTangents);
+    }
+
+    /// Number of triangles that share a base index in the compact representation
+    static const uint32_t FACE_CLUSTER_SIZE = 64;
+
+    /// Marks a cluster base that refers to 32-bit indices in the side table
+    static const uint32_t WIDE_CLUSTER_FLAG = 0x80000000u;
+
+    /**
+     * \brief Create the simplified levels of detail (see src/simplify.cpp)
+     *
+     * Every level has \ref m_lodReduction times the triangles of the
+     * previous one. Levels that the simplification cannot reach are
+     * omitted.
+     */
+    void buildLevelsOfDetail();
+
 protected:
     std::string m_name;                  ///< Identifying name
     MatrixXf      m_V;                   ///< Vertex positions
@@ -125,6 +300,29 @@ protected:
     MatrixXf      m_T;                   ///< Vertex Tangents
     MatrixXf      m_B;                   ///< Vertex Bitangents
 
+    /* Compact representation (see \ref compressAttributes()) */
+    bool m_compressAttributes = false;   ///< Compress the attributes in \ref activate()?
+    bool m_compressed = false;
+    std::vector<uint32_t> m_packedN, m_packedT, m_packedB, m_packedUV;
+    std::vector<uint32_t> m_clusterBase;
+    std::vector<uint16_t> m_packedF;
+    std::vector<uint32_t> m_wideF;       ///< Indices of the clusters marked with \ref WIDE_CLUSTER_FLAG
+
+    /* Levels of detail (see \ref buildLevelsOfDetail()) */
+    uint32_t m_lodLevels = 1;            ///< Number of levels including this mesh
+    float m_lodReduction = 0.25f;        ///< Ratio of the triangle counts of consecutive levels
+    std::vector<std::unique_ptr<Mesh>> m_levels;
+    const Mesh *m_source = nullptr;      ///< Mesh this level was simplified from (shares its BSDF)
+    float m_simplificationError = 0.f;
+
+    /* Paged representation (see \ref page()) */
+    const ClusterCache *m_pager = nullptr; ///< Cache holding the triangle records (\c nullptr: in memory)
+    uint32_t m_firstCluster = 0;         ///< Cluster holding the first records
+    uint32_t m_trianglesPerCluster = 0;  ///< Number of records per cluster
+    uint32_t m_pagedAttributes = 0;      ///< Attributes stored in the records (\ref ETriangleAttributes)
+    uint32_t m_pagedVertexCount = 0;     ///< Vertex count before paging
+    std::vector<uint32_t> m_slots;       ///< Position of the record of every triangle
+
     DiscretePDF m_pdf;
 };
 
@@ -0,0 +1,139 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_MMAP_H)
+#define __NORI_MMAP_H
+
+#include <nori/common.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Read-only memory mapping of a file
+ *
+ * The pages of the file are loaded lazily by the operating system and
+ * shared between all processes that map the same file.
+ */
+class MemoryMappedFile {
+public:
+    /// Map the given file into memory (throws a \ref NoriException on failure)
+    MemoryMappedFile(const std::string &filename);
+
+    /// Unmap the file
+    ~MemoryMappedFile();
+
+    /// Return a pointer to the start of the mapping
+    const uint8_t *data() const { return m_data; }
+
+    /// Return the size of the mapping in bytes
+    size_t size() const { return m_size; }
+
+    /// Return the name of the mapped file
+    const std::string &getFilename() const { return m_filename; }
+
+    /**
+     * \brief Drop a range of the mapping from the memory of the process
+     *
+     * The pages stay valid and are read from the file again when they are
+     * accessed the next time. This is a hint, which may be ignored.
+     */
+    void discard(size_t offset, size_t size) const;
+
+private:
+    MemoryMappedFile(const MemoryMappedFile &) = delete;
+    MemoryMappedFile &operator=(const MemoryMappedFile &) = delete;
+
+    std::string m_filename;
+    const uint8_t *m_data = nullptr;
+    size_t m_size = 0;
+#if defined(PLATFORM_WINDOWS)
+    void *m_file = nullptr, *m_mapping = nullptr;
+#endif
+};
+
+/**
+ * \brief Array that either owns its elements or refers to read-only
+ * data stored elsewhere (e.g. in a \ref MemoryMappedFile)
+ *
+ * In the owning state, this class forwards to a \c std::vector and
+ * supports the subset of its interface that is needed to build data
+ * structures in place. \ref map() switches to the referring state, in
+ * which the array must no longer be modified.
+ */
+template <typename T> class MappedArray {
+public:
+    MappedArray() { }
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    T *data() { return m_data; }
+    const T *data() const { return m_data; }
+
+    T &operator[](size_t i) { return m_data[i]; }
+    const T &operator[](size_t i) const { return m_data[i]; }
+
+    T *begin() { return m_data; }
+    T *end() { return m_data + m_size; }
+    const T *begin() const { return m_data; }
+    const T *end() const { return m_data + m_size; }
+
+    T &back() { return m_data[m_size - 1]; }
+
+    void resize(size_t size) { m_vector.resize(size); sync(); }
+    void reserve(size_t size) { m_vector.reserve(size); sync(); }
+    void push_back(const T &value) { m_vector.push_back(value); sync(); }
+    void emplace_back() { m_vector.emplace_back(); sync(); }
+    void clear() { m_vector.clear(); sync(); }
+    void shrink_to_fit() { m_vector.shrink_to_fit(); sync(); }
+
+    /// Take ownership of the contents of a vector
+    MappedArray &operator=(std::vector<T> &&vector) {
+        m_vector = std::move(vector);
+        sync();
+        return *this;
+    }
+
+    /// Refer to \c size elements at \c data, which must outlive this array
+    void map(const T *data, size_t size) {
+        m_vector.clear();
+        m_vector.shrink_to_fit();
+        m_data = const_cast<T *>(data);
+        m_size = size;
+    }
+
+    /// Does this array refer to external data?
+    bool isMapped() const { return m_size > 0 && m_data != m_vector.data(); }
+
+private:
+    MappedArray(const MappedArray &) = delete;
+    MappedArray &operator=(const MappedArray &) = delete;
+
+    void sync() {
+        m_data = m_vector.data();
+        m_size = m_vector.size();
+    }
+
+    std::vector<T> m_vector;
+    T *m_data = nullptr;
+    size_t m_size = 0;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_MMAP_H */
@@ -0,0 +1,185 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_PAGER_H)
+#define __NORI_PAGER_H
+
+#include <nori/mmap.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Memory-budgeted cache of the clusters of a read-only file
+ *
+ * The file is divided into clusters (consecutive byte ranges), which are
+ * copied into memory when they are first requested. Once the resident
+ * clusters would exceed the budget, the least recently used clusters that
+ * are not pinned by any thread are released again.
+ *
+ * Requests for resident clusters are lock-free. Loading and eviction are
+ * serialized by a mutex, but the data itself is read without holding it,
+ * and threads that request a cluster that is currently being loaded wait
+ * for it instead of reading it a second time. As long as every thread
+ * pins at most one cluster at a time, a budget of one cluster per thread
+ * is always sufficient; otherwise the budget is exceeded temporarily.
+ */
+class ClusterCache {
+public:
+    /// Counters describing the paging activity of one thread
+    struct Stats {
+        uint64_t accesses = 0;    ///< Number of \ref acquire() calls
+        uint64_t misses = 0;      ///< Requests that had to load the cluster
+        uint64_t evictions = 0;   ///< Clusters released to make room
+        uint64_t bytesRead = 0;   ///< Bytes copied from the file
+    };
+
+    /**
+     * \brief Create a cache for the given file
+     *
+     * \param filename
+     *    File that stores the clusters
+     * \param offsets
+     *    Byte offsets of the clusters within the file in increasing
+     *    order, followed by the end of the last cluster
+     * \param budget
+     *    Maximum number of bytes held by resident clusters
+     */
+    ClusterCache(const std::string &filename, const std::vector<uint64_t> &offsets,
+                 size_t budget);
+
+    /// Release all clusters
+    ~ClusterCache();
+
+    /**
+     * \brief Return the data of a cluster and pin it in memory
+     *
+     * The data is loaded first if necessary. It stays valid and at the
+     * same address until the calling thread passes the cluster to
+     * \ref release(). The data is aligned to 64 bytes.
+     */
+    const uint8_t *acquire(uint32_t cluster) const {
+        Cluster &c = m_clusters[cluster];
+        Stats &stats = localStats();
+        stats.accesses++;
+
+        /* Pin first, then check residency (see evict()) */
+        c.pins.fetch_add(1);
+        const uint8_t *data = c.data.load();
+        if (data) {
+            touch(c);
+            return data;
+        }
+        c.pins.fetch_sub(1);
+        return load(cluster, stats);
+    }
+
+    /// Unpin a cluster that was returned by \ref acquire()
+    void release(uint32_t cluster) const {
+        m_clusters[cluster].pins.fetch_sub(1, std::memory_order_release);
+    }
+
+    /// Return the number of clusters
+    uint32_t getClusterCount() const { return m_clusterCount; }
+
+    /// Return the memory budget in bytes
+    size_t getBudget() const { return m_budget; }
+
+    /// Return the number of bytes held by resident clusters
+    size_t getResidentBytes() const;
+
+    /// Return the counters of every thread that has used the cache
+    std::vector<Stats> getStats() const;
+
+    /// Reset the counters of all threads
+    void resetStats();
+
+private:
+    ClusterCache(const ClusterCache &) = delete;
+    ClusterCache &operator=(const ClusterCache &) = delete;
+
+    /// Frees storage allocated with 64-byte alignment
+    struct AlignedDeleter {
+        void operator()(uint8_t *ptr) const;
+    };
+
+    struct Cluster {
+        uint64_t offset = 0;                       ///< Position within the file
+        uint32_t size = 0;                         ///< Size in bytes
+        std::atomic<const uint8_t *> data { nullptr }; ///< Resident data (\c nullptr if not resident)
+        std::atomic<uint32_t> pins { 0 };          ///< Number of threads using the data
+        std::atomic<uint64_t> lastUse { 0 };       ///< Value of \ref m_clock at the last request
+        std::unique_ptr<uint8_t, AlignedDeleter> storage; ///< Owner of \c data (guarded by \ref m_mutex)
+        uint32_t residentIndex = 0;                ///< Position in \ref m_resident (guarded)
+        bool loading = false;                      ///< Is a thread reading the data? (guarded)
+    };
+
+    /**
+     * \brief Return the counters of the calling thread
+     *
+     * Looking up the thread's entry is comparatively slow, so the result
+     * is remembered per thread together with the identifier of the cache.
+     */
+    Stats &localStats() const {
+        static thread_local uint64_t cacheId = 0;
+        static thread_local Stats *stats = nullptr;
+        if (cacheId != m_id) {
+            stats = &m_stats.local();
+            cacheId = m_id;
+        }
+        return *stats;
+    }
+
+    /// Mark a cluster as recently used
+    void touch(Cluster &c) const {
+        uint64_t now = m_clock.load(std::memory_order_relaxed);
+        if (c.lastUse.load(std::memory_order_relaxed) != now)
+            c.lastUse.store(now, std::memory_order_relaxed);
+    }
+
+    /// Slow path of \ref acquire(): load a cluster that is not resident
+    const uint8_t *load(uint32_t cluster, Stats &stats) const;
+
+    /// Release the least recently used unpinned cluster (requires \ref m_mutex)
+    bool evict(Stats &stats) const;
+
+    uint64_t m_id;                       ///< Unique identifier (see \ref localStats())
+    std::unique_ptr<MemoryMappedFile> m_file;
+    std::unique_ptr<Cluster[]> m_clusters;
+    uint32_t m_clusterCount = 0;
+    size_t m_budget;
+
+    /* Bookkeeping of the resident clusters, guarded by m_mutex */
+    mutable std::mutex m_mutex;
+    mutable std::condition_variable m_loaded;
+    mutable std::vector<uint32_t> m_resident;
+    mutable size_t m_residentBytes = 0;
+
+    /// Advanced by every miss; orders the clusters by their last use
+    mutable std::atomic<uint64_t> m_clock { 1 };
+
+    mutable tbb::enumerable_thread_specific<Stats> m_stats; ///< Per-thread counters
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_PAGER_H */
@@ -34,6 +34,37 @@ public:
 
     void renderScene(const std::string & filename);
 
+    /**
+     * \brief Render progressively until a deadline or a noise level is reached
+     *
+     * Applies to subsequent calls of \ref renderScene(). When either value
+     * is positive, the sample count of the scene's sampler is ignored, and
+     * the rendering stops once \c timeBudget seconds have passed since the
+     * call of renderScene() (including the time to load the scene) or once
+     * the estimated RMSE of the pixel luminances has fallen to
+     * \c targetRMSE, whichever comes first. Pass zero to disable a
+     * criterion. Every pixel receives at least one sample, and at least two
+     * before the noise level can be estimated.
+     */
+    void setStopCriteria(float timeBudget, float targetRMSE) {
+        m_timeBudget = timeBudget;
+        m_targetRMSE = targetRMSE;
+    }
+
+    /**
+     * \brief Save the state of the rendering periodically and resume from it
+     *
+     * Applies to subsequent calls of \ref renderScene(). Every \c interval
+     * seconds (0: never), the state is saved next to the output image, in a
+     * file with the extension <tt>.checkpoint</tt> that is deleted once the
+     * rendering finishes. With \c resume, a rendering that finds such a
+     * file continues from it (see \ref RenderCheckpoint).
+     */
+    void setCheckpoints(float interval, bool resume) {
+        m_checkpointInterval = interval;
+        m_resume = resume;
+    }
+
     bool isBusy();
     void stopRendering();
 
@@ -45,6 +76,10 @@ protected:
     std::thread m_render_thread;
     std::atomic<int> m_render_status; // 0: free, 1: busy, 2: interruption, 3: done
     std::atomic<float> m_progress;
+    float m_timeBudget = 0.f;  // seconds, 0: render all samples of the sampler
+    float m_targetRMSE = 0.f;
+    float m_checkpointInterval = 0.f;  // seconds, 0: no checkpoints
+    bool m_resume = false;  // continue from an existing checkpoint
 
 };
 
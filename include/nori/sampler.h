@@ -98,6 +98,22 @@ public:
     /// Return the number of configured pixel samples
     virtual size_t getSampleCount() const { return m_sampleCount; }
 
+    /**
+     * \brief Write the current state of the sample generator to a stream
+     *
+     * Together with \ref unserialize(), this lets an interrupted rendering
+     * continue with exactly the samples that it would have used next
+     * (see \ref RenderCheckpoint).
+     */
+    virtual void serialize(std::ostream &os) const {
+        throw NoriException("%s does not support checkpoints!", toString());
+    }
+
+    /// Restore a state that was written by \ref serialize()
+    virtual void unserialize(std::istream &is) {
+        throw NoriException("%s does not support checkpoints!", toString());
+    }
+
     /**
      * \brief Return the type of object (i.e. Mesh/Sampler/etc.) 
      * provided by this instance
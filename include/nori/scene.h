@@ -24,6 +24,8 @@
 
 NORI_NAMESPACE_BEGIN
 
+class LODShape;
+
 /**
  * \brief Main scene data structure
  *
@@ -84,10 +86,24 @@ public:
      *    A detailed intersection record, which will be filled by the
      *    intersection query
      *
+     * Cut-out regions of alpha-tested shapes are skipped (see
+     * \ref Shape::isAlphaTested()).
+     *
      * \return \c true if an intersection was found
      */
     bool rayIntersect(const Ray3f &ray, Intersection &its) const {
-        return m_bvh->rayIntersect(ray, its, false);
+        return m_bvh->rayIntersect(ray, its, false, getHitFilter());
+    }
+
+    /**
+     * \brief Find the \c k closest intersections along a ray segment
+     * in order of increasing distance (see \ref BVH::rayIntersectMulti())
+     *
+     * \return The number of intersections written to \c its
+     */
+    uint32_t rayIntersectMulti(const Ray3f &ray, Intersection *its,
+                               BVH::MultiHit *scratch, uint32_t k) const {
+        return m_bvh->rayIntersectMulti(ray, its, scratch, k, getHitFilter());
     }
 
     /**
@@ -106,10 +122,52 @@ public:
      * \return \c true if an intersection was found
      */
     bool rayIntersect(const Ray3f &ray) const {
-        Intersection its; /* Unused */
-        return m_bvh->rayIntersect(ray, its, true);
+        return m_bvh->occluded(ray, getHitFilter());
     }
 
+    /**
+     * \brief Intersect a stream of rays against the scene
+     *
+     * The rays are traced in packets of 16 consecutive entries (see
+     * \ref BVH::rayIntersect16()), so callers should order the stream
+     * such that neighboring rays are coherent. Packets do not run the
+     * alpha test, so the rays whose closest hit lies on an alpha-tested
+     * shape are traced again one by one.
+     *
+     * \param rays
+     *    Array of \c count rays
+     * \param its
+     *    Array of \c count intersection records
+     * \param hits
+     *    Array of \c count flags that are set to \c true when the
+     *    corresponding ray found an intersection
+     */
+    void rayIntersectStream(const Ray3f *rays, Intersection *its,
+        bool *hits, size_t count) const;
+
+    /// Should primary rays be traced as packets?
+    bool usePacketTracing() const { return m_packetTracing; }
+
+    /// Return the number of samples per pixel that are rendered at each visit of an image tile
+    uint32_t getSamplesPerVisit() const { return m_samplesPerVisit; }
+
+    /// Should each pixel only receive samples until its estimate has converged?
+    bool useAdaptiveSampling() const { return m_adaptiveThreshold > 0; }
+
+    /// Return the relative standard error at which adaptive sampling considers a pixel converged
+    float getAdaptiveThreshold() const { return m_adaptiveThreshold; }
+
+    /// Return the number of samples that every pixel receives with adaptive sampling
+    uint32_t getAdaptiveMinSamples() const { return m_adaptiveMinSamples; }
+
+    /**
+     * \brief Return the maximum number of samples per pixel with adaptive sampling
+     *
+     * The total number of samples stays that of the sampler, but pixels that
+     * have not converged may use the samples that converged pixels left over.
+     */
+    uint32_t getAdaptiveMaxSamples() const;
+
     /**
      * \brief Return an axis-aligned box that bounds the scene
      */
@@ -133,13 +191,25 @@ public:
 
     virtual EClassType getClassType() const override { return EScene; }
 private:
+    /// Return the any-hit filter passed to the BVH (\c nullptr if there is none)
+    const BVH::HitFilter *getHitFilter() const { return m_hitFilter ? &m_hitFilter : nullptr; }
+
     std::vector<Shape *> m_shapes;
     Integrator *m_integrator = nullptr;
     Sampler *m_sampler = nullptr;
     Camera *m_camera = nullptr;
     BVH *m_bvh = nullptr;
+    bool m_packetTracing = false;
+    uint32_t m_samplesPerVisit = 1;
+    float m_adaptiveThreshold = 0.f;
+    uint32_t m_adaptiveMinSamples = 16;
+    uint32_t m_adaptiveMaxSamples = 0;
+    BVH::HitFilter m_hitFilter;         ///< Alpha test, empty if no shape is alpha-tested
 
     std::vector<Emitter *> m_emitters;
+    std::vector<NoriObject *> m_shapeGroups;
+    std::vector<LODShape *> m_lodShapes;  ///< Meshes with levels of detail (owned by the BVH)
+    float m_lodPixelError;
 };
 
 NORI_NAMESPACE_END
@@ -0,0 +1,195 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_SCHEDULER_H)
+#define __NORI_SCHEDULER_H
+
+#include <nori/sampler.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Progressive work-stealing scheduler for the tiles of an image
+ *
+ * The image is divided into the blocks of a \ref BlockGenerator (in its
+ * spiral order), which are rendered in visits of a few samples per pixel
+ * until they have received all of their samples. Every worker owns a queue
+ * of tiles: it takes the tile at the front of its queue and, unless the
+ * tile is finished, returns it to the back after the visit, so that its
+ * tiles are refined in turns. A worker whose queue is empty steals a tile
+ * from the back of another queue.
+ *
+ * There is no synchronization between passes over the image. A tile is
+ * visited by one worker at a time, so its state (including its sample
+ * generator) needs no locking, and the image does not depend on which
+ * worker renders which visit.
+ *
+ * For adaptive sampling, the renderer lowers the number of active pixels
+ * of a tile as they converge, and the tile is retired once none are left.
+ * The samples that retired pixels did not take remain in a global budget
+ * that the other tiles use up. Since the budget is shared, the samples of
+ * the last visits depend on the timing of the workers.
+ */
+class TileScheduler {
+public:
+    /// Rectangular part of the image together with its rendering state
+    struct Tile {
+        Point2i offset;                   ///< Position of the tile in the image
+        Vector2i size;                    ///< Size of the tile in pixels
+        uint32_t id = 0;                  ///< Index of the tile (see \ref getTile())
+        uint32_t samples = 0;             ///< Number of finished samples per pixel
+        uint32_t activePixels = 0;        ///< Number of pixels that still need samples
+        std::unique_ptr<Sampler> sampler; ///< Sample generator (created on the first visit)
+    };
+
+    /// Samples <tt>[sampleBegin, sampleEnd)</tt> of every pixel of a tile
+    struct Visit {
+        Tile *tile = nullptr;
+        uint32_t sampleBegin = 0;
+        uint32_t sampleEnd = 0;
+    };
+
+    /**
+     * \brief Divide an image into tiles and distribute them over the workers
+     *
+     * \param size
+     *    Size of the image in pixels
+     * \param tileSize
+     *    Maximum width and height of the tiles
+     * \param sampleCount
+     *    Maximum number of samples per pixel
+     * \param samplesPerVisit
+     *    Number of samples per pixel that are rendered in one visit of a tile
+     * \param workerCount
+     *    Number of workers that call \ref next()
+     * \param sampleBudget
+     *    Total number of pixel samples after which no further visits are
+     *    started (0: the number of pixels times \c sampleCount)
+     */
+    TileScheduler(const Vector2i &size, int tileSize, uint32_t sampleCount,
+                  uint32_t samplesPerVisit, uint32_t workerCount,
+                  uint64_t sampleBudget = 0);
+
+    /**
+     * \brief Return the next visit of the given worker
+     *
+     * This function is thread-safe, as long as every worker index is used
+     * by one thread at a time.
+     *
+     * \return \c false if all remaining tiles are being rendered by other
+     * workers (which finish them on their own), if the sample budget is
+     * exhausted or if the scheduler was aborted or stopped.
+     */
+    bool next(uint32_t worker, Visit &visit);
+
+    /**
+     * \brief Record that a visit returned by \ref next() was rendered
+     *
+     * \param samples
+     *    Number of samples per pixel that were actually rendered (less than
+     *    requested if the rendering was interrupted)
+     * \param pixelSamples
+     *    Total number of samples that were rendered, which is less than
+     *    \c samples times the size of the tile if some pixels converged
+     *
+     * The tile is visited again unless it has received all samples or
+     * its number of active pixels was set to zero.
+     */
+    void finish(uint32_t worker, const Visit &visit, uint32_t samples, uint64_t pixelSamples);
+
+    /**
+     * \brief Continue a rendering whose tiles were restored from a checkpoint
+     *
+     * Must be called before the first call to \ref next(), after the
+     * samples, active pixels and samplers of the tiles were set. The queues
+     * are replaced by the ones returned by \ref getQueue() (if the number
+     * of workers differs, their tiles are dealt out again), and the sample
+     * budget is charged with the samples that were already rendered.
+     */
+    void restore(const std::vector<std::vector<uint32_t>> &queues, uint64_t finishedSamples);
+
+    /// Return the tiles in the queue of a worker, in the order of their next visits
+    std::vector<uint32_t> getQueue(uint32_t worker) const;
+
+    /// Make all subsequent calls to \ref next() fail
+    void abort() { m_aborted = true; }
+
+    /**
+     * \brief Finish the rendering early
+     *
+     * Afterwards, only tiles that have not received any samples yet are
+     * visited (once), so that every pixel ends up with at least one sample.
+     */
+    void stop() { m_stopped = true; }
+
+    /// Was \ref stop() called?
+    bool isStopped() const { return m_stopped; }
+
+    /// Was \ref abort() called?
+    bool isAborted() const { return m_aborted; }
+
+    /// Return the fraction of the sample budget that has been used
+    float getProgress() const {
+        return (float) std::min((double) m_finishedSamples.load(std::memory_order_relaxed) / m_sampleBudget, 1.0);
+    }
+
+    /// Return the number of pixel samples that have been rendered
+    uint64_t getFinishedSamples() const { return m_finishedSamples.load(std::memory_order_relaxed); }
+
+    /// Return the maximum number of samples per pixel
+    uint32_t getSampleCount() const { return m_sampleCount; }
+
+    /// Return the number of samples per pixel and visit
+    uint32_t getSamplesPerVisit() const { return m_samplesPerVisit; }
+
+    /// Return the number of tiles
+    uint32_t getTileCount() const { return (uint32_t) m_tiles.size(); }
+
+    /// Return the number of workers
+    uint32_t getWorkerCount() const { return m_workerCount; }
+
+    /// Return a tile by its index
+    Tile &getTile(uint32_t id) { return m_tiles[id]; }
+
+private:
+    /// Tiles that wait for a visit by one worker
+    struct alignas(64) Queue {
+        std::mutex mutex;
+        std::deque<uint32_t> tiles;
+    };
+
+    /// Remove a tile from the front (or, when stealing, the back) of a queue
+    bool pop(uint32_t worker, bool steal, uint32_t &id);
+
+    std::vector<Tile> m_tiles;
+    std::unique_ptr<Queue[]> m_queues;
+    uint32_t m_workerCount;
+    uint32_t m_sampleCount;
+    uint32_t m_samplesPerVisit;
+    double m_sampleBudget;
+    std::atomic<uint64_t> m_finishedSamples { 0 };
+    std::atomic<bool> m_aborted { false };
+    std::atomic<bool> m_stopped { false };
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_SCHEDULER_H */
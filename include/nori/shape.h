@@ -91,12 +91,63 @@ public:
     //// Return the centroid of the given triangle
     virtual Point3f getCentroid(uint32_t index) const = 0;
 
+    /**
+     * \brief Return a bounding box of the part of the given primitive
+     * that lies inside \c clip
+     *
+     * This is used by the spatial split BVH builder. The default
+     * implementation conservatively clips the primitive's bounding box;
+     * the result is invalid if the primitive lies outside of \c clip.
+     */
+    virtual BoundingBox3f getClippedBoundingBox(uint32_t index, const BoundingBox3f &clip) const {
+        BoundingBox3f result = getBoundingBox(index);
+        result.clip(clip);
+        return result;
+    }
+
+    /**
+     * \brief Return a hash of the geometry of this shape
+     *
+     * This identifies cached acceleration structures. The default
+     * implementation hashes the bounding boxes of all primitives, which
+     * suffices for shapes that are fully determined by them.
+     */
+    virtual uint64_t getGeometryHash() const;
+
     //// Ray-Shape intersection test
     virtual bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const = 0;
 
+    /// Ray-Shape occlusion test, shapes may override this with an any-hit query
+    virtual bool occluded(uint32_t index, const Ray3f &ray) const {
+        float u, v, t;
+        return rayIntersect(index, ray, u, v, t);
+    }
+
     /// Set the intersection information: hit point, shading frame, UVs, etc.
     virtual void setHitInformation(uint32_t index, const Ray3f &ray, Intersection & its) const = 0;
 
+    /**
+     * \brief Is the surface cut out where the alpha of its BSDF is zero?
+     *
+     * Hits on the cut-out regions are rejected inside the traversal (see
+     * \ref alphaTest()) rather than continued by the integrators. Emitters
+     * and medium boundaries are never cut out.
+     */
+    bool isAlphaTested() const { return m_alphaTested; }
+
+    /**
+     * \brief Return the alpha of the BSDF at a hit reported by \ref rayIntersect()
+     *
+     * The default implementation completes the hit information to look up
+     * the texture coordinates.
+     */
+    virtual float getAlpha(uint32_t index, const Ray3f &ray, const Point2f &uv, float t) const;
+
+    /// Any-hit filter that rejects hits on the cut-out regions of alpha-tested shapes (see \ref BVH::HitFilter)
+    static bool alphaTest(const Shape *shape, uint32_t index, const Ray3f &ray, const Point2f &uv, float t) {
+        return !shape->isAlphaTested() || shape->getAlpha(index, ray, uv, t) > 0.f;
+    }
+
     /**
      * \brief Sample a point on the surface (potentially using the point sRec.ref to importance sample)
      * This method should set sRec.p, sRec.n and sRec.pdf
@@ -119,6 +170,7 @@ protected:
     BSDF *m_bsdf = nullptr;           ///< BSDF of the surface
     Emitter *m_emitter = nullptr;     ///< Associated emitter, if any
     Medium *m_medium = nullptr;       ///< Associated medium, if any
+    bool m_alphaTested = false;       ///< Are hits with zero alpha rejected?
     BoundingBox3f m_bbox;                ///< Bounding box of the mesh
 
 };
@@ -0,0 +1,160 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* =======================================================================
+     This file contains thin wrappers around the SSE/AVX instruction sets
+     that are used by the wide BVH traversal kernels.
+ * ======================================================================= */
+
+#if !defined(__NORI_SIMD_H)
+#define __NORI_SIMD_H
+
+#include <nori/common.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define NORI_HAS_SSE 1
+#  include <immintrin.h>
+#endif
+
+#if defined(__AVX__)
+#  define NORI_HAS_AVX 1
+#endif
+
+/* Number of lanes used for SoA primitive data. It determines the layout
+   of BVH::TriangleBlock, so CMake defines it identically for all targets;
+   the fallback below only applies to builds outside of CMake. */
+#if !defined(NORI_SIMD_WIDTH)
+#  if defined(NORI_HAS_AVX)
+#    define NORI_SIMD_WIDTH 8
+#  else
+#    define NORI_SIMD_WIDTH 4
+#  endif
+#endif
+
+#if NORI_SIMD_WIDTH != 4 && NORI_SIMD_WIDTH != 8
+#  error "NORI_SIMD_WIDTH must be 4 or 8"
+#endif
+
+#if defined(_MSC_VER)
+#  include <intrin.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Fixed-width float vector used by the BVH traversal kernels
+ *
+ * The generic version is a plain array that the compiler is free to
+ * auto-vectorize. The 4- and 8-wide versions map onto SSE and AVX
+ * registers when the corresponding instruction sets are enabled at
+ * compile time (see the \c NORI_ENABLE_AVX2 CMake option).
+ */
+template <int N> struct SimdFloat {
+    float v[N];
+
+    SimdFloat() { }
+    explicit SimdFloat(float f) { for (int i = 0; i < N; ++i) v[i] = f; }
+    static SimdFloat load(const float *p) { SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = p[i]; return r; }
+    static SimdFloat loadBytes(const uint8_t *p) { SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = (float) p[i]; return r; }
+    void store(float *p) const { for (int i = 0; i < N; ++i) p[i] = v[i]; }
+
+    friend SimdFloat operator+(const SimdFloat &a, const SimdFloat &b) { SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = a.v[i] + b.v[i]; return r; }
+    friend SimdFloat operator-(const SimdFloat &a, const SimdFloat &b) { SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = a.v[i] - b.v[i]; return r; }
+    friend SimdFloat operator*(const SimdFloat &a, const SimdFloat &b) { SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = a.v[i] * b.v[i]; return r; }
+    friend SimdFloat operator/(const SimdFloat &a, const SimdFloat &b) { SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = a.v[i] / b.v[i]; return r; }
+    friend SimdFloat min(const SimdFloat &a, const SimdFloat &b) { SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = std::min(a.v[i], b.v[i]); return r; }
+    friend SimdFloat max(const SimdFloat &a, const SimdFloat &b) { SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = std::max(a.v[i], b.v[i]); return r; }
+
+    /// Return a bit mask with bit \c i set when <tt>a[i] <= b[i]</tt>
+    friend uint32_t maskLessEqual(const SimdFloat &a, const SimdFloat &b) {
+        uint32_t mask = 0;
+        for (int i = 0; i < N; ++i)
+            mask |= (a.v[i] <= b.v[i] ? 1u : 0u) << i;
+        return mask;
+    }
+};
+
+#if defined(NORI_HAS_SSE)
+template <> struct SimdFloat<4> {
+    __m128 v;
+
+    SimdFloat() { }
+    SimdFloat(__m128 v) : v(v) { }
+    explicit SimdFloat(float f) : v(_mm_set1_ps(f)) { }
+    static SimdFloat load(const float *p) { return _mm_load_ps(p); }
+    static SimdFloat loadBytes(const uint8_t *p) {
+        int32_t bytes;
+        memcpy(&bytes, p, sizeof(int32_t));
+        __m128i zero = _mm_setzero_si128();
+        __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+        return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+    }
+    void store(float *p) const { _mm_store_ps(p, v); }
+
+    friend SimdFloat operator+(const SimdFloat &a, const SimdFloat &b) { return _mm_add_ps(a.v, b.v); }
+    friend SimdFloat operator-(const SimdFloat &a, const SimdFloat &b) { return _mm_sub_ps(a.v, b.v); }
+    friend SimdFloat operator*(const SimdFloat &a, const SimdFloat &b) { return _mm_mul_ps(a.v, b.v); }
+    friend SimdFloat operator/(const SimdFloat &a, const SimdFloat &b) { return _mm_div_ps(a.v, b.v); }
+    friend SimdFloat min(const SimdFloat &a, const SimdFloat &b) { return _mm_min_ps(a.v, b.v); }
+    friend SimdFloat max(const SimdFloat &a, const SimdFloat &b) { return _mm_max_ps(a.v, b.v); }
+    friend uint32_t maskLessEqual(const SimdFloat &a, const SimdFloat &b) {
+        return (uint32_t) _mm_movemask_ps(_mm_cmple_ps(a.v, b.v));
+    }
+};
+#endif
+
+#if defined(NORI_HAS_AVX)
+template <> struct SimdFloat<8> {
+    __m256 v;
+
+    SimdFloat() { }
+    SimdFloat(__m256 v) : v(v) { }
+    explicit SimdFloat(float f) : v(_mm256_set1_ps(f)) { }
+    static SimdFloat load(const float *p) { return _mm256_load_ps(p); }
+    static SimdFloat loadBytes(const uint8_t *p) {
+        return _mm256_insertf128_ps(_mm256_castps128_ps256(
+            SimdFloat<4>::loadBytes(p).v), SimdFloat<4>::loadBytes(p + 4).v, 1);
+    }
+    void store(float *p) const { _mm256_store_ps(p, v); }
+
+    friend SimdFloat operator+(const SimdFloat &a, const SimdFloat &b) { return _mm256_add_ps(a.v, b.v); }
+    friend SimdFloat operator-(const SimdFloat &a, const SimdFloat &b) { return _mm256_sub_ps(a.v, b.v); }
+    friend SimdFloat operator*(const SimdFloat &a, const SimdFloat &b) { return _mm256_mul_ps(a.v, b.v); }
+    friend SimdFloat operator/(const SimdFloat &a, const SimdFloat &b) { return _mm256_div_ps(a.v, b.v); }
+    friend SimdFloat min(const SimdFloat &a, const SimdFloat &b) { return _mm256_min_ps(a.v, b.v); }
+    friend SimdFloat max(const SimdFloat &a, const SimdFloat &b) { return _mm256_max_ps(a.v, b.v); }
+    friend uint32_t maskLessEqual(const SimdFloat &a, const SimdFloat &b) {
+        return (uint32_t) _mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ));
+    }
+};
+#endif
+
+/// Index of the lowest set bit (\c mask must be nonzero)
+inline int lowestBit(uint32_t mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int) index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_SIMD_H */
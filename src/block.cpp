@@ -21,6 +21,7 @@
 #include <nori/rfilter.h>
 #include <nori/bbox.h>
 #include <tbb/tbb.h>
+#include <atomic>
 
 NORI_NAMESPACE_BEGIN
 
@@ -132,11 +133,112 @@ void ImageBlock::put(ImageBlock &b) {
         += b.topLeftCorner(size.y(), size.x());
 }
 
+/// Atomically add \c value to \c target
+static inline void atomicAdd(float &target, float value) {
+    static_assert(sizeof(std::atomic<float>) == sizeof(float),
+                  "std::atomic<float> must have the layout of a float");
+    std::atomic<float> &ref = reinterpret_cast<std::atomic<float> &>(target);
+    float current = ref.load(std::memory_order_relaxed);
+    while (!ref.compare_exchange_weak(current, current + value, std::memory_order_relaxed))
+        ;
+}
+
+void ImageBlock::putExclusive(const ImageBlock &b) {
+    Vector2i offset = b.getOffset() - m_offset +
+        Vector2i::Constant(m_borderSize - b.getBorderSize());
+    Vector2i size   = b.getSize()   + Vector2i(2*b.getBorderSize());
+
+    /* Pixels of b that no block of a neighboring tile can reach */
+    int core = 2 * b.getBorderSize();
+    Vector2i coreSize = (b.getSize() - Vector2i::Constant(core)).cwiseMax(0);
+    if ((coreSize.array() == 0).any())
+        coreSize.setZero();
+
+    block(offset.y() + core, offset.x() + core, coreSize.y(), coreSize.x())
+        += b.block(core, core, coreSize.y(), coreSize.x());
+
+    for (int y=0; y<size.y(); ++y) {
+        bool coreRow = y >= core && y < core + coreSize.y();
+        for (int x=0; x<size.x(); ++x) {
+            if (coreRow && x == core) {
+                x += coreSize.x() - 1;
+                continue;
+            }
+            const Color4f &value = b.coeff(y, x);
+            Color4f &target = coeffRef(offset.y() + y, offset.x() + x);
+            for (int i=0; i<4; ++i)
+                atomicAdd(target[i], value[i]);
+        }
+    }
+}
+
 std::string ImageBlock::toString() const {
     return tfm::format("ImageBlock[offset=%s, size=%s]]",
         m_offset.toString(), m_size.toString());
 }
 
+PixelStatistics::PixelStatistics(const Vector2i &size, float threshold,
+                                 uint32_t minSamples, uint32_t maxSamples)
+    : m_size(size), m_pixels((size_t) size.x() * size.y()), m_threshold(threshold),
+      m_minSamples(minSamples), m_maxSamples(maxSamples) { }
+
+float PixelStatistics::getVariance(const Point2i &pixel) const {
+    const Pixel &p = m_pixels[pixel.y() * m_size.x() + pixel.x()];
+    if (p.count < 2)
+        return std::numeric_limits<float>::infinity();
+    return p.m2 / ((p.count - 1) * (float) p.count);
+}
+
+float PixelStatistics::getRelativeError(const Point2i &pixel) const {
+    const Pixel &p = m_pixels[pixel.y() * m_size.x() + pixel.x()];
+    return std::sqrt(getVariance(pixel)) / std::max(std::abs(p.mean), ERROR_FLOOR);
+}
+
+double PixelStatistics::getVarianceSum(const Point2i &offset, const Vector2i &size,
+                                       uint32_t &missing) const {
+    double sum = 0;
+    missing = 0;
+    for (int y=offset.y(); y<offset.y() + size.y(); ++y) {
+        for (int x=offset.x(); x<offset.x() + size.x(); ++x) {
+            Point2i pixel(x, y);
+            if (getSampleCount(pixel) < 2)
+                missing++;
+            else
+                sum += getVariance(pixel);
+        }
+    }
+    return sum;
+}
+
+uint32_t PixelStatistics::getActivePixelCount(const Point2i &offset, const Vector2i &size) const {
+    uint32_t count = 0;
+    for (int y=offset.y(); y<offset.y() + size.y(); ++y)
+        for (int x=offset.x(); x<offset.x() + size.x(); ++x)
+            count += isConverged(Point2i(x, y)) ? 0 : 1;
+    return count;
+}
+
+Bitmap *PixelStatistics::toSampleCountBitmap() const {
+    Bitmap *result = new Bitmap(m_size);
+    for (int y=0; y<m_size.y(); ++y)
+        for (int x=0; x<m_size.x(); ++x)
+            result->coeffRef(y, x) = Color3f((float) m_pixels[y * m_size.x() + x].count);
+    return result;
+}
+
+void PixelStatistics::serialize(std::ostream &os) const {
+    os.write((const char *) m_pixels.data(), (std::streamsize) (m_pixels.size() * sizeof(Pixel)));
+}
+
+void PixelStatistics::unserialize(std::istream &is) {
+    is.read((char *) m_pixels.data(), (std::streamsize) (m_pixels.size() * sizeof(Pixel)));
+}
+
+std::string PixelStatistics::toString() const {
+    return tfm::format("PixelStatistics[size=%s, threshold=%f, minSamples=%i, maxSamples=%i]",
+        m_size.toString(), m_threshold, m_minSamples, m_maxSamples);
+}
+
 BlockGenerator::BlockGenerator(const Vector2i &size, int blockSize)
         : m_size(size), m_blockSize(blockSize) {
     m_numBlocks = Vector2i(
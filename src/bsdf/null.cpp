@@ -127,6 +127,11 @@ public:
         return true;
     }
 
+    /* Without a base color, the surface is a pass-through medium boundary */
+    bool hasAlpha() const {
+        return m_alpha_map != nullptr && m_albedo != nullptr;
+    }
+
     float getEmission(const BSDFQueryRecord &bRec) const {
         if (m_emission_map == nullptr) {
             return 1.0f;
@@ -21,6 +21,7 @@
 #include <tbb/tbb.h>
 #include <Eigen/Geometry>
 #include <atomic>
+#include <cstdio>
 
 /*
  * =======================================================================
@@ -42,21 +43,20 @@ struct Bins {
 };
 
 /**
- * \brief Build task for parallel BVH construction
+ * \brief Parallel BVH builder
  *
- * This class uses the task scheduling system of Intel' Thread Building Blocks
- * to parallelize the divide and conquer BVH build at all levels.
+ * The upper levels of the tree are built by binning the primitive
+ * centroids along the largest axis. Binning and partitioning run in
+ * parallel, and the two subtrees of every node are constructed
+ * concurrently using <tt>tbb::parallel_invoke</tt>. Small subtrees are
+ * finished by a serial builder that sweeps over all possible split
+ * positions along each axis.
  *
  * The used methodology is roughly that described in
  * "Fast and Parallel Construction of SAH-based Bounding Volume Hierarchies"
  * by Ingo Wald (Proc. IEEE/EG Symposium on Interactive Ray Tracing, 2007)
  */
-class BVHBuildTask : public tbb::task {
-private:
-    BVH &bvh;
-    uint32_t node_idx;
-    uint32_t *start, *end, *temp;
-
+class BVHBuilder {
 public:
     /// Build-related parameters
     enum {
@@ -73,12 +73,26 @@ public:
         INTERSECTION_COST = 1
     };
 
-public:
+    /// Prepare the construction of the given BVH
+    BVHBuilder(BVH &bvh) : bvh(bvh) {
+        /* Query the bounding boxes and centroids once, since the
+           build accesses them many times */
+        uint32_t size = bvh.getPrimitiveCount();
+        m_bboxes.resize(size);
+        m_centroids.resize(size);
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, size, GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t f = range.begin(); f != range.end(); ++f) {
+                    m_bboxes[f] = bvh.getBoundingBox(f);
+                    m_centroids[f] = bvh.getCentroid(f);
+                }
+            }
+        );
+    }
+
     /**
-     * Create a new build task
-     *
-     * \param bvh
-     *    Reference to the underlying BVH
+     * \brief Build the subtree rooted at the given node
      *
      * \param node_idx
      *    Index of the BVH node that should be built
@@ -94,17 +108,14 @@ public:
      *    construction purposes. The usable length is <tt>end-start</tt>
      *    unsigned integers.
      */
-    BVHBuildTask(BVH &bvh, uint32_t node_idx, uint32_t *start, uint32_t *end, uint32_t *temp)
-        : bvh(bvh), node_idx(node_idx), start(start), end(end), temp(temp) { }
-
-    task *execute() {
+    void build(uint32_t node_idx, uint32_t *start, uint32_t *end, uint32_t *temp) {
         uint32_t size = (uint32_t) (end-start);
         BVH::BVHNode &node = bvh.m_nodes[node_idx];
 
         /* Switch to a serial build when less than SERIAL_THRESHOLD triangles are left */
         if (size < SERIAL_THRESHOLD) {
-            execute_serially(bvh, node_idx, start, end, temp);
-            return nullptr;
+            buildSerially(node_idx, start, end);
+            return;
         }
 
         /* Always split along the largest axis */
@@ -120,14 +131,14 @@ public:
             [&](const tbb::blocked_range<uint32_t> &range, Bins result) {
                 for (uint32_t i = range.begin(); i != range.end(); ++i) {
                     uint32_t f = start[i];
-                    float centroid = bvh.getCentroid(f)[axis];
+                    float centroid = m_centroids[f][axis];
 
                     int index = std::min(std::max(
                         (int) ((centroid - min) * inv_bin_size), 0),
                         (Bins::BIN_COUNT - 1));
 
                     result.counts[index]++;
-                    result.bbox[index].expandBy(bvh.getBoundingBox(f));
+                    result.bbox[index].expandBy(m_bboxes[f]);
                 }
                 return result;
             },
@@ -171,8 +182,8 @@ public:
         if (best_index == -1) {
             /* Could not find a good split plane -- retry with
                more careful serial code just to be sure.. */
-            execute_serially(bvh, node_idx, start, end, temp);
-            return nullptr;
+            buildSerially(node_idx, start, end);
+            return;
         }
 
         uint32_t left_count = bins.counts[best_index];
@@ -181,6 +192,7 @@ public:
 
         bvh.m_nodes[node_idx_left ].bbox = bbox_left[best_index];
         bvh.m_nodes[node_idx_right].bbox = best_bbox_right;
+        node.inner.leftChild = node_idx_left;
         node.inner.rightChild = node_idx_right;
         node.inner.axis = axis;
         node.inner.flag = 0;
@@ -194,7 +206,7 @@ public:
                 uint32_t count_left = 0, count_right = 0;
                 for (uint32_t i = range.begin(); i != range.end(); ++i) {
                     uint32_t f = start[i];
-                    float centroid = bvh.getCentroid(f)[axis];
+                    float centroid = m_centroids[f][axis];
                     int index = (int) ((centroid - min) * inv_bin_size);
                     (index <= best_index ? count_left : count_right)++;
                 }
@@ -202,7 +214,7 @@ public:
                 uint32_t idx_r = offset_right.fetch_add(count_right);
                 for (uint32_t i = range.begin(); i != range.end(); ++i) {
                     uint32_t f = start[i];
-                    float centroid = bvh.getCentroid(f)[axis];
+                    float centroid = m_centroids[f][axis];
                     int index = (int) ((centroid - min) * inv_bin_size);
                     if (index <= best_index)
                         temp[idx_l++] = f;
@@ -211,46 +223,77 @@ public:
                 }
             }
         );
-        memcpy(start, temp, size * sizeof(uint32_t));
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, size, GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                memcpy(start + range.begin(), temp + range.begin(),
+                       (range.end() - range.begin()) * sizeof(uint32_t));
+            }
+        );
         assert(offset_left == left_count && offset_right == size);
 
-        /* Create an empty parent task */
-        tbb::task& c = *new (allocate_continuation()) tbb::empty_task;
-        c.set_ref_count(2);
+        /* Build both subtrees concurrently */
+        tbb::parallel_invoke(
+            [&] { build(node_idx_left, start, start + left_count, temp); },
+            [&] { build(node_idx_right, start + left_count, end, temp + left_count); }
+        );
+    }
 
-        /* Post right subtree to scheduler */
-        BVHBuildTask &b = *new (c.allocate_child())
-            BVHBuildTask(bvh, node_idx_right, start + left_count,
-                         end, temp + left_count);
-        spawn(b);
+private:
+    /// Scratch space of \ref buildSerially()
+    struct SerialState {
+        std::vector<uint32_t> prims;   ///< Primitive of each local index
+        std::vector<uint32_t> scratch; ///< Temporary storage for partitioning
+        std::vector<float> areas;      ///< Surface areas of the left sweep
+        std::vector<uint8_t> isLeft;   ///< Side of each local index after a split
+    };
 
-        /* Directly start working on left subtree */
-        recycle_as_child_of(c);
-        node_idx = node_idx_left;
-        end = start + left_count;
+    /**
+     * \brief Single-threaded build function
+     *
+     * The primitives are sorted along each axis only once. Splits then
+     * partition the three sorted lists stably, so that every node can
+     * evaluate all split positions with linear sweeps.
+     */
+    void buildSerially(uint32_t node_idx, uint32_t *start, uint32_t *end) {
+        uint32_t size = (uint32_t) (end - start);
+        SerialState state;
+        state.prims.assign(start, end);
+        state.scratch.resize(size);
+        state.areas.resize(size);
+        state.isLeft.assign(size, 0);
+
+        std::vector<uint32_t> sorted(3 * size);
+        uint32_t *lists[3];
+        for (int axis = 0; axis < 3; ++axis) {
+            lists[axis] = sorted.data() + axis * size;
+            for (uint32_t i = 0; i < size; ++i)
+                lists[axis][i] = i;
+            std::sort(lists[axis], lists[axis] + size, [&](uint32_t i1, uint32_t i2) {
+                float c1 = m_centroids[state.prims[i1]][axis],
+                      c2 = m_centroids[state.prims[i2]][axis];
+                return c1 < c2 || (c1 == c2 && i1 < i2);
+            });
+        }
 
-        return this;
+        buildSerially(node_idx, start, lists, size, state);
     }
 
-    /// Single-threaded build function
-    static void execute_serially(BVH &bvh, uint32_t node_idx, uint32_t *start, uint32_t *end, uint32_t *temp) {
+    /// Recursive helper of \ref buildSerially() operating on the presorted lists
+    void buildSerially(uint32_t node_idx, uint32_t *start, uint32_t *lists[3],
+                       uint32_t size, SerialState &state) {
         BVH::BVHNode &node = bvh.m_nodes[node_idx];
-        uint32_t size = (uint32_t) (end - start);
         float best_cost = (float) INTERSECTION_COST * size;
         int64_t best_index = -1, best_axis = -1;
-        float *left_areas = (float *) temp;
+        float *left_areas = state.areas.data();
 
         /* Try splitting along every axis */
         for (int axis=0; axis<3; ++axis) {
-            /* Sort all triangles based on their centroid positions projected on the axis */
-            std::sort(start, end, [&](uint32_t f1, uint32_t f2) {
-                return bvh.getCentroid(f1)[axis] < bvh.getCentroid(f2)[axis];
-            });
+            const uint32_t *list = lists[axis];
 
             BoundingBox3f bbox;
             for (uint32_t i = 0; i<size; ++i) {
-                uint32_t f = *(start + i);
-                bbox.expandBy(bvh.getBoundingBox(f));
+                bbox.expandBy(m_bboxes[state.prims[list[i]]]);
                 left_areas[i] = (float) bbox.getSurfaceArea();
             }
             if (axis == 0)
@@ -261,8 +304,7 @@ public:
             /* Choose the best split plane */
             float tri_factor = INTERSECTION_COST / node.bbox.getSurfaceArea();
             for (uint32_t i = size-1; i>=1; --i) {
-                uint32_t f = *(start + i);
-                bbox.expandBy(bvh.getBoundingBox(f));
+                bbox.expandBy(m_bboxes[state.prims[list[i]]]);
 
                 float left_area = left_areas[i-1];
                 float right_area = bbox.getSurfaceArea();
@@ -283,26 +325,49 @@ public:
 
         if (best_index == -1) {
             /* Splitting does not reduce the cost, make a leaf */
+            for (uint32_t i = 0; i < size; ++i)
+                start[i] = state.prims[lists[0][i]];
             node.leaf.flag = 1;
             node.leaf.start = (uint32_t) (start - bvh.m_indices.data());
             node.leaf.size  = size;
             return;
         }
 
-        std::sort(start, end, [&](uint32_t f1, uint32_t f2) {
-            return bvh.getCentroid(f1)[best_axis] < bvh.getCentroid(f2)[best_axis];
-        });
-
+        /* Partition the other two lists while preserving their order */
         uint32_t left_count = (uint32_t) best_index;
+        for (uint32_t i = 0; i < left_count; ++i)
+            state.isLeft[lists[best_axis][i]] = 1;
+        for (int axis = 0; axis < 3; ++axis) {
+            if (axis == best_axis)
+                continue;
+            uint32_t *list = lists[axis], idx_l = 0, idx_r = left_count;
+            for (uint32_t i = 0; i < size; ++i) {
+                uint32_t id = list[i];
+                state.scratch[state.isLeft[id] ? idx_l++ : idx_r++] = id;
+            }
+            memcpy(list, state.scratch.data(), size * sizeof(uint32_t));
+        }
+        for (uint32_t i = 0; i < left_count; ++i)
+            state.isLeft[lists[best_axis][i]] = 0;
+
         uint32_t node_idx_left = node_idx + 1;
         uint32_t node_idx_right = node_idx + 2 * left_count;
+        node.inner.leftChild = node_idx_left;
         node.inner.rightChild = node_idx_right;
         node.inner.axis = best_axis;
         node.inner.flag = 0;
 
-        execute_serially(bvh, node_idx_left, start, start + left_count, temp);
-        execute_serially(bvh, node_idx_right, start+left_count, end, temp + left_count);
+        uint32_t *lists_right[3] = {
+            lists[0] + left_count, lists[1] + left_count, lists[2] + left_count
+        };
+        buildSerially(node_idx_left, start, lists, left_count, state);
+        buildSerially(node_idx_right, start + left_count, lists_right, size - left_count, state);
     }
+
+private:
+    BVH &bvh;
+    std::vector<BoundingBox3f> m_bboxes;
+    std::vector<Point3f> m_centroids;
 };
 
 void BVH::addShape(Shape *shape) {
@@ -319,17 +384,58 @@ void BVH::clear() {
     m_shapeOffset.push_back(0u);
     m_nodes.clear();
     m_indices.clear();
+    m_nodes4.clear();
+    m_nodes8.clear();
+    m_compressedNodes4.clear();
+    m_compressedNodes8.clear();
+    m_triangles.clear();
     m_bbox.reset();
     m_nodes.shrink_to_fit();
     m_shapes.shrink_to_fit();
     m_shapeOffset.shrink_to_fit();
     m_indices.shrink_to_fit();
+    m_nodes4.shrink_to_fit();
+    m_nodes8.shrink_to_fit();
+    m_compressedNodes4.shrink_to_fit();
+    m_compressedNodes8.shrink_to_fit();
+    m_triangles.shrink_to_fit();
+    m_pager.reset();
+    m_clusterStart.clear();
+    if (!m_clusterFile.empty()) {
+        std::remove(m_clusterFile.c_str());
+        m_clusterFile.clear();
+    }
+    m_cacheFile.reset();
+    m_generation = 0;
 }
 
-void BVH::build() {
+BVH::EBuildMethod BVH::parseBuildMethod(const std::string &name) {
+    if (name == "sah")
+        return EBinnedSAH;
+    else if (name == "sbvh")
+        return ESpatialSplits;
+    else if (name == "lbvh")
+        return ELinear;
+    else if (name == "hlbvh")
+        return EHierarchicalLinear;
+    else
+        throw NoriException("BVH: unknown builder \"%s\" (must be \"sah\", \"sbvh\", \"lbvh\" or \"hlbvh\")", name);
+}
+
+void BVH::setSplitBudget(float budget) {
+    if (!(budget >= 0))
+        throw NoriException("BVH: the duplication budget must be nonnegative (got %f)", budget);
+    m_splitBudget = budget;
+}
+
+void BVH::setWidth(int width) {
+    if (width != 2 && width != 4 && width != 8)
+        throw NoriException("BVH: unsupported branching factor %i (must be 2, 4 or 8)", width);
+    m_width = width;
+}
+
+void BVH::buildBinnedSAH() {
     uint32_t size  = getPrimitiveCount();
-    if (size == 0)
-        return;
     cout << "Constructing a SAH BVH (" << m_shapes.size()
         << (m_shapes.size() == 1 ? " shape, " : " shapes, ")
         << size << " primitives) .. ";
@@ -342,57 +448,234 @@ void BVH::build() {
     m_nodes[0].bbox = m_bbox;
     m_indices.resize(size);
 
-    if (sizeof(BVHNode) != 32)
-        throw NoriException("BVH Node is not packed! Investigate compiler settings.");
-
     for (uint32_t i = 0; i < size; ++i)
         m_indices[i] = i;
 
-    uint32_t *indices = m_indices.data(), *temp = new uint32_t[size];
-    BVHBuildTask& task = *new(tbb::task::allocate_root())
-        BVHBuildTask(*this, 0u, indices, indices + size , temp);
-    tbb::task::spawn_root_and_wait(task);
-    delete[] temp;
+    std::vector<uint32_t> temp(size);
+    BVHBuilder builder(*this);
+    builder.build(0u, m_indices.data(), m_indices.data() + size, temp.data());
     std::pair<float, uint32_t> stats = statistics();
 
     /* The node array was allocated conservatively and now contains
        many unused entries -- do a compactification pass. */
-    std::vector<BVHNode> compactified(stats.second);
-    std::vector<uint32_t> skipped_accum(m_nodes.size());
-
-    for (int64_t i = stats.second-1, j = m_nodes.size(), skipped = 0; i >= 0; --i) {
-        while (m_nodes[--j].isUnused())
-            skipped++;
-        BVHNode &new_node = compactified[i];
-        new_node = m_nodes[j];
-        skipped_accum[j] = (uint32_t) skipped;
-
-        if (new_node.isInner()) {
-            new_node.inner.rightChild = (uint32_t)
-                (i + new_node.inner.rightChild - j -
-                (skipped - skipped_accum[new_node.inner.rightChild]));
-        }
-    }
+    compactNodes(stats.second);
+
     cout << "done (took " << timer.elapsedString() << " and "
         << memString(sizeof(BVHNode) * m_nodes.size() + sizeof(uint32_t)*m_indices.size())
         << ", SAH cost = " << stats.first
         << ")." << endl;
+}
+
+void BVH::compactNodes(uint32_t nodeCount) {
+    /* Each chunk first counts its used nodes, which yields the new
+       node indices after an exclusive scan over the chunks. */
+    const uint32_t chunkSize = 4 * BVHBuilder::GRAIN_SIZE;
+    uint32_t chunkCount = (uint32_t) ((m_nodes.size() + chunkSize - 1) / chunkSize);
+    std::vector<uint32_t> chunkOffset(chunkCount + 1, 0u);
+    std::vector<uint32_t> newIndex(m_nodes.size());
+
+    tbb::parallel_for(0u, chunkCount, [&](uint32_t chunk) {
+        uint32_t end = std::min((chunk + 1) * chunkSize, (uint32_t) m_nodes.size());
+        for (uint32_t j = chunk * chunkSize; j < end; ++j)
+            chunkOffset[chunk + 1] += m_nodes[j].isUnused() ? 0u : 1u;
+    });
+    for (uint32_t chunk = 0; chunk < chunkCount; ++chunk)
+        chunkOffset[chunk + 1] += chunkOffset[chunk];
+    assert(chunkOffset[chunkCount] == nodeCount);
+
+    std::vector<BVHNode> compactified(nodeCount);
+    tbb::parallel_for(0u, chunkCount, [&](uint32_t chunk) {
+        uint32_t end = std::min((chunk + 1) * chunkSize, (uint32_t) m_nodes.size());
+        for (uint32_t j = chunk * chunkSize, i = chunkOffset[chunk]; j < end; ++j) {
+            if (!m_nodes[j].isUnused())
+                newIndex[j] = i++;
+        }
+    });
+    tbb::parallel_for(0u, chunkCount, [&](uint32_t chunk) {
+        uint32_t end = std::min((chunk + 1) * chunkSize, (uint32_t) m_nodes.size());
+        for (uint32_t j = chunk * chunkSize; j < end; ++j) {
+            if (m_nodes[j].isUnused())
+                continue;
+            BVHNode &new_node = compactified[newIndex[j]];
+            new_node = m_nodes[j];
+            if (new_node.isInner()) {
+                new_node.inner.leftChild = newIndex[new_node.inner.leftChild];
+                new_node.inner.rightChild = newIndex[new_node.inner.rightChild];
+            }
+        }
+    });
 
     m_nodes = std::move(compactified);
 }
 
-std::pair<float, uint32_t> BVH::statistics(uint32_t node_idx) const {
+/// Source of \ref BVH::m_generation (0 marks a hierarchy that was not built)
+static std::atomic<uint64_t> nextGeneration(1);
+
+void BVH::build() {
+    uint32_t size  = getPrimitiveCount();
+    if (size == 0)
+        return;
+
+    /* Shadow rays must not reuse occluders of a previous hierarchy, even
+       if this one is allocated at the same address */
+    m_generation = nextGeneration++;
+
+    if (sizeof(BVHNode) != 32)
+        throw NoriException("BVH Node is not packed! Investigate compiler settings.");
+
+    if (m_compressed && m_width == 2)
+        throw NoriException("BVH: compressed nodes require a branching factor of 4 or 8");
+
+    /* Node indices are stored with 29 bits (before compaction, the
+       builders may use up to two nodes per reference) */
+    double maxReferences = m_buildMethod == ESpatialSplits ? (1.0 + m_splitBudget) * size : size;
+    if (2.0 * maxReferences >= (double) (1u << 29))
+        throw NoriException("BVH: too many primitives (%i)", size);
+
+    uint64_t cacheKey = 0;
+    if (!m_cacheDirectory.empty() || m_pagingBudget > 0)
+        cacheKey = getCacheKey();
+    if (!m_cacheDirectory.empty() && loadCache(cacheKey)) {
+        if (m_pagingBudget > 0)
+            pageGeometry(cacheKey);
+        return;
+    }
+
+    if (m_buildMethod == ESpatialSplits) {
+        cout << "Constructing a SBVH (" << m_shapes.size()
+            << (m_shapes.size() == 1 ? " shape, " : " shapes, ")
+            << size << " primitives) .. ";
+        cout.flush();
+        Timer timer;
+
+        uint32_t references = buildSpatialSplits();
+        std::pair<float, uint32_t> stats = statistics();
+
+        cout << "done (took " << timer.elapsedString() << " and "
+            << memString(sizeof(BVHNode) * m_nodes.size() + sizeof(uint32_t)*m_indices.size())
+            << ", SAH cost = " << stats.first
+            << ", " << references << " references, "
+            << (int) std::round(100.0 * (references - size) / size) << "% duplicates"
+            << ")." << endl;
+    } else if (m_buildMethod == ELinear || m_buildMethod == EHierarchicalLinear) {
+        buildLinear(m_buildMethod == EHierarchicalLinear);
+    } else {
+        buildBinnedSAH();
+    }
+
+    Timer timer;
+    if (m_triangleBlocks) {
+        cout << "Packing triangles .. ";
+        cout.flush();
+        packTriangles();
+        cout << "done (took " << timer.elapsedString() << " and "
+            << memString(sizeof(TriangleBlock) * m_triangles.size()) << ")." << endl;
+    }
+
+    size_t nodeCount = m_nodes.size(), nodeSize = sizeof(BVHNode);
+    if (m_width > 2) {
+        cout << "Collapsing into a " << m_width << "-wide BVH .. ";
+        cout.flush();
+        timer.reset();
+        if (m_width == 4) {
+            collapse<4>();
+            nodeCount = m_nodes4.size();
+            nodeSize = sizeof(WideNode<4>);
+        } else {
+            collapse<8>();
+            nodeCount = m_nodes8.size();
+            nodeSize = sizeof(WideNode<8>);
+        }
+        cout << "done (took " << timer.elapsedString() << ", "
+            << nodeCount << " nodes, " << memString(nodeSize * nodeCount)
+            << ")." << endl;
+    }
+
+    if (m_nodeOrder != EDepthFirstOrder) {
+        cout << "Arranging the nodes in " << (m_nodeOrder == ETreeletOrder ?
+            "treelets" : "van Emde Boas order") << " .. ";
+        cout.flush();
+        timer.reset();
+        reorderNodes();
+        cout << "done (took " << timer.elapsedString() << ")." << endl;
+    }
+
+    if (m_compressed) {
+        cout << "Compressing the " << m_width << "-wide nodes .. ";
+        cout.flush();
+        timer.reset();
+        size_t compressedSize;
+        if (m_width == 4) {
+            compress<4>();
+            compressedSize = sizeof(CompressedNode<4>);
+        } else {
+            compress<8>();
+            compressedSize = sizeof(CompressedNode<8>);
+        }
+        cout << "done (took " << timer.elapsedString() << ", "
+            << memString(compressedSize * nodeCount) << " instead of "
+            << memString(nodeSize * nodeCount) << ")." << endl;
+    }
+
+    if (!m_cacheDirectory.empty())
+        saveCache(cacheKey);
+
+    if (m_pagingBudget > 0)
+        pageGeometry(cacheKey);
+}
+
+size_t BVH::getMemoryUsage() const {
+    return sizeof(BVHNode) * m_nodes.size() +
+           sizeof(uint32_t) * m_indices.size() +
+           sizeof(WideNode<4>) * m_nodes4.size() +
+           sizeof(WideNode<8>) * m_nodes8.size() +
+           sizeof(CompressedNode<4>) * m_compressedNodes4.size() +
+           sizeof(CompressedNode<8>) * m_compressedNodes8.size() +
+           sizeof(TriangleBlock) * m_triangles.size() +
+           (m_pager ? m_pager->getResidentBytes() : 0);
+}
+
+BVH::TraversalStats BVH::getTraversalStats() const {
+    TraversalStats result;
+#if defined(NORI_BVH_STATS)
+    for (const TraversalStats &stats : m_stats) {
+        result.rays += stats.rays;
+        result.nodes += stats.nodes;
+        result.primitives += stats.primitives;
+        result.shadowRays += stats.shadowRays;
+        result.shadowNodes += stats.shadowNodes;
+    }
+#endif
+    return result;
+}
+
+void BVH::resetTraversalStats() {
+#if defined(NORI_BVH_STATS)
+    m_stats.clear();
+#endif
+}
+
+std::pair<float, uint32_t> BVH::statistics(uint32_t node_idx, uint32_t depth) const {
     const BVHNode &node = m_nodes[node_idx];
     if (node.isLeaf()) {
-        return std::make_pair((float) BVHBuildTask::INTERSECTION_COST * node.leaf.size, 1u);
+        return std::make_pair((float) BVHBuilder::INTERSECTION_COST * node.leaf.size, 1u);
     } else {
-        std::pair<float, uint32_t> stats_left = statistics(node_idx + 1u);
-        std::pair<float, uint32_t> stats_right = statistics(node.inner.rightChild);
-        float saLeft = m_nodes[node_idx + 1u].bbox.getSurfaceArea();
+        std::pair<float, uint32_t> stats_left, stats_right;
+        if (depth < 8) {
+            /* Visit the upper levels of large trees in parallel */
+            tbb::parallel_invoke(
+                [&] { stats_left = statistics(node.inner.leftChild, depth + 1); },
+                [&] { stats_right = statistics(node.inner.rightChild, depth + 1); }
+            );
+        } else {
+            stats_left = statistics(node.inner.leftChild, depth + 1);
+            stats_right = statistics(node.inner.rightChild, depth + 1);
+        }
+        float saLeft = m_nodes[node.inner.leftChild].bbox.getSurfaceArea();
         float saRight = m_nodes[node.inner.rightChild].bbox.getSurfaceArea();
         float saCur = node.bbox.getSurfaceArea();
         float sahCost =
-            2 * BVHBuildTask::TRAVERSAL_COST +
+            2 * BVHBuilder::TRAVERSAL_COST +
             (saLeft * stats_left.first + saRight * stats_right.first) / saCur;
         return std::make_pair(
             sahCost,
@@ -401,24 +684,113 @@ std::pair<float, uint32_t> BVH::statistics(uint32_t node_idx) const {
     }
 }
 
-bool BVH::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) const {
-    uint32_t node_idx = 0, stack_idx = 0, stack[64];
+bool BVH::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay,
+                       const HitFilter *filter) const {
+    if (shadowRay)
+        return occluded(_ray, filter);
+
+    Ray3f ray(_ray);
+    uint32_t f = 0;
+    if (!rayIntersectClosest(ray, its, f, filter))
+        return false;
+
+    its.mesh->setHitInformation(f, ray, its);
+    return true;
+}
+
+uint32_t BVH::rayIntersectMulti(const Ray3f &_ray, Intersection *its, MultiHit *hits,
+                                uint32_t k, const HitFilter *filter) const {
+    if (k == 0)
+        return 0;
+
+    /* Order by distance, then by shape and primitive */
+    auto less = [](const MultiHit &a, const MultiHit &b) {
+        if (a.t != b.t)
+            return a.t < b.t;
+        if (a.shape != b.shape)
+            return std::less<const Shape *>()(a.shape, b.shape);
+        return a.index < b.index;
+    };
+
+    /* Record every hit and reject it, so that the traversal continues.
+       The filter sees the traversal's own ray, which is shortened to the
+       k-th closest hit once k hits are known. */
+    Ray3f ray(_ray);
+    uint32_t count = 0;
+    HitFilter collect = [&](const Shape *shape, uint32_t index, const Ray3f &,
+                            const Point2f &uv, float t) {
+        MultiHit hit { t, uv, shape, index };
+        if (count == k && !less(hit, hits[k - 1]))
+            return false;
+        if (filter && !(*filter)(shape, index, ray, uv, t))
+            return false;
+
+        /* A primitive that several leaves reference is hit at the same distance */
+        MultiHit *pos = std::lower_bound(hits, hits + count, hit, less);
+        if (pos != hits + count && pos->t == t && pos->shape == shape && pos->index == index)
+            return false;
+
+        if (count < k)
+            ++count;
+        std::move_backward(pos, hits + count - 1, hits + count);
+        *pos = hit;
+        if (count == k)
+            ray.maxt = hits[k - 1].t;
+        return false;
+    };
+
+    Intersection temp;
+    uint32_t f;
+    rayIntersectClosest(ray, temp, f, &collect);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        its[i].t = hits[i].t;
+        its[i].uv = hits[i].uv;
+        its[i].mesh = hits[i].shape;
+        hits[i].shape->setHitInformation(hits[i].index, ray, its[i]);
+    }
+    return count;
+}
 
+bool BVH::rayIntersectClosest(Ray3f &ray, Intersection &its, uint32_t &f,
+                              const HitFilter *filter) const {
     its.t = std::numeric_limits<float>::infinity();
 
     /* Use an adaptive ray epsilon */
-    Ray3f ray(_ray);
     if (ray.mint == Epsilon)
         ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
 
     if (m_nodes.empty() || ray.maxt < ray.mint)
         return false;
 
+    if (m_width == 4)
+        return m_compressed ? rayIntersectWide(m_compressedNodes4, ray, its, f, filter)
+                            : rayIntersectWide(m_nodes4, ray, its, f, filter);
+    else if (m_width == 8)
+        return m_compressed ? rayIntersectWide(m_compressedNodes8, ray, its, f, filter)
+                            : rayIntersectWide(m_nodes8, ray, its, f, filter);
+    else
+        return rayIntersectBinary(ray, its, f, filter);
+}
+
+bool BVH::rayIntersectBinary(Ray3f &ray, Intersection &its, uint32_t &f,
+                             const HitFilter *filter) const {
+    uint32_t node_idx = 0, stack_idx = 0, stack[64];
+
+    TraversalStats *stats = localStats();
+    if (stats)
+        stats->rays++;
+
+    /* Visit the child on the side the ray enters from first, so that
+       ray.maxt shrinks early and the far child can often be culled */
+    bool dirIsNeg[3] = { ray.d.x() < 0, ray.d.y() < 0, ray.d.z() < 0 };
+
     bool foundIntersection = false;
-    uint32_t f = 0;
 
     while (true) {
         const BVHNode &node = m_nodes[node_idx];
+        if (stats)
+            stats->nodes++;
 
         if (!node.bbox.rayIntersect(ray)) {
             if (stack_idx == 0)
@@ -428,25 +800,19 @@ bool BVH::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) con
         }
 
         if (node.isInner()) {
-            stack[stack_idx++] = node.inner.rightChild;
-            node_idx++;
+            if (dirIsNeg[node.inner.axis]) {
+                stack[stack_idx++] = node.inner.leftChild;
+                node_idx = node.inner.rightChild;
+            } else {
+                stack[stack_idx++] = node.inner.rightChild;
+                node_idx = node.inner.leftChild;
+            }
             assert(stack_idx<64);
         } else {
-            for (uint32_t i = node.start(), end = node.end(); i < end; ++i) {
-                uint32_t idx = m_indices[i];
-                const Shape *shape = m_shapes[findShape(idx)];
-
-                float u, v, t;
-                if (shape->rayIntersect(idx, ray, u, v, t)) {
-                    if (shadowRay)
-                        return true;
-                    foundIntersection = true;
-                    ray.maxt = its.t = t;
-                    its.uv = Point2f(u, v);
-                    its.mesh = shape;
-                    f = idx;
-                }
-            }
+            if (stats)
+                stats->primitives += node.leaf.size;
+            if (rayIntersectLeaf(node.start(), node.end(), ray, its, f, filter))
+                foundIntersection = true;
             if (stack_idx == 0)
                 break;
             node_idx = stack[--stack_idx];
@@ -454,11 +820,105 @@ bool BVH::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) con
         }
     }
 
-    if (foundIntersection) {
-        its.mesh->setHitInformation(f,ray,its);
+    return foundIntersection;
+}
+
+/// Primitive that occluded the most recent shadow ray of the current thread
+static thread_local struct {
+    uint64_t generation = 0;  ///< \ref BVH::m_generation of the hierarchy
+    uint32_t prim = 0;
+} lastOccluder;
+
+bool BVH::occluded(const Ray3f &_ray, const HitFilter *filter) const {
+    /* Use an adaptive ray epsilon */
+    Ray3f ray(_ray);
+    if (ray.mint == Epsilon)
+        ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+
+    if (m_nodes.empty() || ray.maxt < ray.mint)
+        return false;
+
+    if (TraversalStats *stats = localStats())
+        stats->shadowRays++;
+
+    /* Try the previous occluder first */
+    if (lastOccluder.generation == m_generation && lastOccluder.prim < getPrimitiveCount()) {
+        uint32_t idx = lastOccluder.prim;
+        const Shape *shape = m_shapes[findShape(idx)];
+        if (!filter) {
+            if (shape->occluded(idx, ray))
+                return true;
+        } else {
+            float u, v, t;
+            if (shape->rayIntersect(idx, ray, u, v, t) && (*filter)(shape, idx, ray, Point2f(u, v), t))
+                return true;
+        }
+    }
+
+    uint32_t prim;
+    bool hit;
+    if (m_width == 4)
+        hit = m_compressed ? occludedWide(m_compressedNodes4, ray, prim, filter)
+                           : occludedWide(m_nodes4, ray, prim, filter);
+    else if (m_width == 8)
+        hit = m_compressed ? occludedWide(m_compressedNodes8, ray, prim, filter)
+                           : occludedWide(m_nodes8, ray, prim, filter);
+    else
+        hit = occludedBinary(ray, prim, filter);
+
+    if (hit) {
+        lastOccluder.generation = m_generation;
+        lastOccluder.prim = prim;
     }
+    return hit;
+}
 
-    return foundIntersection;
+bool BVH::occludedBinary(const Ray3f &ray, uint32_t &prim, const HitFilter *filter) const {
+    uint32_t node_idx = 0, stack_idx = 0, stack[64];
+    TraversalStats *stats = localStats();
+
+    /* Select the entry and exit planes once per ray */
+    float org[3], rcp[3];
+    int nearPlane[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        float d = ray.d[axis];
+        if (std::abs(d) < 1e-20f)
+            d = std::copysign(1e-20f, d);
+        org[axis] = ray.o[axis];
+        rcp[axis] = 1.0f / d;
+        nearPlane[axis] = d >= 0 ? 0 : 1;
+    }
+
+    while (true) {
+        const BVHNode &node = m_nodes[node_idx];
+        const Point3f *planes[2] = { &node.bbox.min, &node.bbox.max };
+        if (stats)
+            stats->shadowNodes++;
+
+        float tNear = ray.mint, tFar = ray.maxt;
+        for (int axis = 0; axis < 3; ++axis) {
+            tNear = std::max(tNear, ((*planes[nearPlane[axis]])[axis]     - org[axis]) * rcp[axis]);
+            tFar  = std::min(tFar,  ((*planes[1 - nearPlane[axis]])[axis] - org[axis]) * rcp[axis]);
+        }
+
+        if (tNear <= tFar) {
+            if (node.isInner()) {
+                stack[stack_idx++] = node.inner.rightChild;
+                node_idx = node.inner.leftChild;
+                assert(stack_idx<64);
+                continue;
+            }
+
+            if (occludedLeaf(node.start(), node.end(), ray, prim, filter))
+                return true;
+        }
+
+        if (stack_idx == 0)
+            break;
+        node_idx = stack[--stack_idx];
+    }
+
+    return false;
 }
 
 NORI_NAMESPACE_END
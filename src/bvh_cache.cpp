@@ -0,0 +1,226 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bvh.h>
+#include <nori/timer.h>
+#include <filesystem/path.h>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+
+/*
+ * On-disk cache of built hierarchies. A cache file consists of a header
+ * followed by the raw contents of all node, index and triangle arrays,
+ * each starting at a 64-byte aligned offset. Files are named after the
+ * hash returned by BVH::getCacheKey(). The header also records the
+ * primitive and shape counts and the layout settings that the file was
+ * built with, so that a file whose key collides with the one of a
+ * different scene is rebuilt instead of being mapped. Files are only
+ * ever replaced as a
+ * whole (by renaming a temporary file), so a mapping that is in use is
+ * never modified by concurrent renders of the same scene.
+ */
+
+NORI_NAMESPACE_BEGIN
+
+/// Bump this whenever the node layout or a builder changes
+static const uint32_t BVH_CACHE_VERSION = 4;
+
+static const char BVH_CACHE_MAGIC[8] = { 'N', 'O', 'R', 'I', 'B', 'V', 'H', '\0' };
+
+enum EBVHCacheArray {
+    ECacheNodes = 0,
+    ECacheIndices,
+    ECacheNodes4,
+    ECacheNodes8,
+    ECacheCompressedNodes4,
+    ECacheCompressedNodes8,
+    ECacheTriangles,
+    ECacheArrayCount
+};
+
+struct BVHCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t elementSize[ECacheArrayCount];
+    uint64_t key;
+    uint32_t primitiveCount, shapeCount;
+    uint32_t method, width, compressed, order, blocks;
+    uint64_t offset[ECacheArrayCount];
+    uint64_t count[ECacheArrayCount];
+};
+
+static const uint64_t BVH_CACHE_ALIGNMENT = 64;
+
+static std::string cacheFilename(const std::string &directory, uint64_t key) {
+    return (filesystem::path(directory) / tfm::format("%016x.bvh", key)).str();
+}
+
+uint64_t BVH::getCacheKey() const {
+    struct {
+        uint32_t version, method, width, compressed, order, blocks, shapes;
+        float splitBudget;
+    } params = {
+        BVH_CACHE_VERSION, (uint32_t) m_buildMethod, (uint32_t) m_width,
+        (uint32_t) m_compressed, (uint32_t) m_nodeOrder, (uint32_t) m_triangleBlocks,
+        (uint32_t) m_shapes.size(), m_buildMethod == ESpatialSplits ? m_splitBudget : 0.f
+    };
+
+    uint64_t hash = hashBytes(&params, sizeof(params));
+    for (const Shape *shape : m_shapes) {
+        uint64_t shapeHash = shape->getGeometryHash();
+        hash = hashBytes(&shapeHash, sizeof(uint64_t), hash);
+    }
+    return hash;
+}
+
+bool BVH::loadCache(uint64_t key) {
+    std::string filename = cacheFilename(m_cacheDirectory, key);
+    if (!filesystem::path(filename).exists())
+        return false;
+
+    Timer timer;
+    std::unique_ptr<MemoryMappedFile> file;
+    try {
+        file.reset(new MemoryMappedFile(filename));
+    } catch (const NoriException &e) {
+        cerr << "Warning: " << e.what() << endl;
+        return false;
+    }
+
+    const uint32_t elementSize[ECacheArrayCount] = {
+        sizeof(BVHNode), sizeof(uint32_t), sizeof(WideNode<4>), sizeof(WideNode<8>),
+        sizeof(CompressedNode<4>), sizeof(CompressedNode<8>), sizeof(TriangleBlock)
+    };
+
+    /* Reject stale files and files written by an incompatible build */
+    BVHCacheHeader header;
+    bool valid = file->size() >= sizeof(BVHCacheHeader);
+    if (valid) {
+        memcpy(&header, file->data(), sizeof(BVHCacheHeader));
+        valid = memcmp(header.magic, BVH_CACHE_MAGIC, sizeof(BVH_CACHE_MAGIC)) == 0 &&
+                header.version == BVH_CACHE_VERSION && header.key == key;
+    }
+
+    /* Guard against hash collisions between different scenes */
+    if (valid) {
+        valid = header.primitiveCount == getPrimitiveCount() &&
+                header.shapeCount == (uint32_t) m_shapes.size() &&
+                header.method == (uint32_t) m_buildMethod &&
+                header.width == (uint32_t) m_width &&
+                header.compressed == (uint32_t) m_compressed &&
+                header.order == (uint32_t) m_nodeOrder &&
+                header.blocks == (uint32_t) m_triangleBlocks;
+    }
+    for (int i = 0; valid && i < ECacheArrayCount; ++i) {
+        valid = header.elementSize[i] == elementSize[i] &&
+                header.offset[i] % BVH_CACHE_ALIGNMENT == 0 &&
+                header.offset[i] <= file->size() &&
+                header.count[i] <= (file->size() - header.offset[i]) / elementSize[i];
+    }
+    if (valid) {
+        const uint32_t K = TRIANGLE_BLOCK_SIZE;
+        valid = header.count[ECacheNodes] > 0 &&
+                header.count[ECacheTriangles] == (header.count[ECacheIndices] + K - 1) / K &&
+                (header.count[ECacheNodes4] > 0) == (m_width == 4 && !m_compressed) &&
+                (header.count[ECacheNodes8] > 0) == (m_width == 8 && !m_compressed) &&
+                (header.count[ECacheCompressedNodes4] > 0) == (m_width == 4 && m_compressed) &&
+                (header.count[ECacheCompressedNodes8] > 0) == (m_width == 8 && m_compressed);
+    }
+    if (!valid) {
+        cerr << "Warning: ignoring invalid BVH cache file \"" << filename << "\"" << endl;
+        return false;
+    }
+
+    const uint8_t *data = file->data();
+    m_nodes.map((const BVHNode *) (data + header.offset[ECacheNodes]), header.count[ECacheNodes]);
+    m_indices.map((const uint32_t *) (data + header.offset[ECacheIndices]), header.count[ECacheIndices]);
+    m_nodes4.map((const WideNode<4> *) (data + header.offset[ECacheNodes4]), header.count[ECacheNodes4]);
+    m_nodes8.map((const WideNode<8> *) (data + header.offset[ECacheNodes8]), header.count[ECacheNodes8]);
+    m_compressedNodes4.map((const CompressedNode<4> *) (data + header.offset[ECacheCompressedNodes4]),
+                           header.count[ECacheCompressedNodes4]);
+    m_compressedNodes8.map((const CompressedNode<8> *) (data + header.offset[ECacheCompressedNodes8]),
+                           header.count[ECacheCompressedNodes8]);
+    m_triangles.map((const TriangleBlock *) (data + header.offset[ECacheTriangles]), header.count[ECacheTriangles]);
+    m_cacheFile = std::move(file);
+
+    cout << "Mapped a cached BVH from \"" << filename << "\" (took "
+        << timer.elapsedString() << ", " << memString(m_cacheFile->size()) << ")." << endl;
+    return true;
+}
+
+void BVH::saveCache(uint64_t key) const {
+    BVHCacheHeader header;
+    memset(&header, 0, sizeof(BVHCacheHeader));
+    memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(BVH_CACHE_MAGIC));
+    header.version = BVH_CACHE_VERSION;
+    header.key = key;
+    header.primitiveCount = getPrimitiveCount();
+    header.shapeCount = (uint32_t) m_shapes.size();
+    header.method = (uint32_t) m_buildMethod;
+    header.width = (uint32_t) m_width;
+    header.compressed = (uint32_t) m_compressed;
+    header.order = (uint32_t) m_nodeOrder;
+    header.blocks = (uint32_t) m_triangleBlocks;
+
+    const void *arrays[ECacheArrayCount] = {
+        m_nodes.data(), m_indices.data(), m_nodes4.data(), m_nodes8.data(),
+        m_compressedNodes4.data(), m_compressedNodes8.data(), m_triangles.data()
+    };
+    const size_t counts[ECacheArrayCount] = {
+        m_nodes.size(), m_indices.size(), m_nodes4.size(), m_nodes8.size(),
+        m_compressedNodes4.size(), m_compressedNodes8.size(), m_triangles.size()
+    };
+    const uint32_t elementSize[ECacheArrayCount] = {
+        sizeof(BVHNode), sizeof(uint32_t), sizeof(WideNode<4>), sizeof(WideNode<8>),
+        sizeof(CompressedNode<4>), sizeof(CompressedNode<8>), sizeof(TriangleBlock)
+    };
+
+    uint64_t offset = sizeof(BVHCacheHeader);
+    for (int i = 0; i < ECacheArrayCount; ++i) {
+        offset = (offset + BVH_CACHE_ALIGNMENT - 1) / BVH_CACHE_ALIGNMENT * BVH_CACHE_ALIGNMENT;
+        header.elementSize[i] = elementSize[i];
+        header.offset[i] = offset;
+        header.count[i] = counts[i];
+        offset += counts[i] * elementSize[i];
+    }
+
+    /* Write to a temporary file and atomically move it into place */
+    std::string filename = cacheFilename(m_cacheDirectory, key);
+    std::string tempFilename = tfm::format("%s.%x.tmp", filename,
+        (uint64_t) std::chrono::steady_clock::now().time_since_epoch().count());
+
+    std::ofstream os(tempFilename, std::ios::binary);
+    os.write((const char *) &header, sizeof(BVHCacheHeader));
+    for (int i = 0; i < ECacheArrayCount && os; ++i) {
+        static const char padding[BVH_CACHE_ALIGNMENT] = { 0 };
+        os.write(padding, (std::streamsize) (header.offset[i] - (uint64_t) os.tellp()));
+        os.write((const char *) arrays[i], (std::streamsize) (counts[i] * elementSize[i]));
+    }
+    os.close();
+
+    if (!os.good()) {
+        cerr << "Warning: could not write the BVH cache file \"" << tempFilename << "\"" << endl;
+        std::remove(tempFilename.c_str());
+    } else if (std::rename(tempFilename.c_str(), filename.c_str()) != 0) {
+        /* Another process may have written the same file in the meantime */
+        std::remove(tempFilename.c_str());
+    }
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,452 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bvh.h>
+#include <nori/timer.h>
+#include <tbb/tbb.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Linear BVH builder
+ *
+ * Sorts the primitives along a Morton curve through their centroids and
+ * emits the hierarchy top-down by splitting every range at the highest
+ * bit in which its Morton codes differ. Both steps are parallel and do
+ * not depend on the geometry, which makes this builder much faster than
+ * the SAH builders at the cost of lower tree quality.
+ *
+ * With \c refineTop, the sorted primitives are grouped into clusters that
+ * share the upper Morton bits. The hierarchy above the clusters is then
+ * built with a binned SAH, while the hierarchies inside each cluster
+ * are emitted as before. This recovers most of the quality lost in the
+ * upper levels, where it matters the most.
+ *
+ * The methodology is described in
+ * "Fast BVH Construction on GPUs" by Christian Lauterbach et al.
+ * (Eurographics 2009) and
+ * "HLBVH: Hierarchical LBVH Construction for Real-Time Ray Tracing of
+ * Dynamic Geometry" by Jacopo Pantaleoni and David Luebke (HPG 2010)
+ *
+ * The nodes use the layout of \ref BVHBuilder (the left child follows
+ * its parent, the right child of a node over \c n primitives with \c k
+ * primitives on the left is stored <tt>2k</tt> entries later), so the
+ * result is compacted by the same function.
+ */
+class LBVHBuilder {
+public:
+    /// Build-related parameters
+    enum {
+        /// Create leaves with up to 4 primitives
+        LEAF_SIZE = 4,
+
+        /// Process primitives in batches of 4K for the purpose of parallelization
+        GRAIN_SIZE = 4096,
+
+        /// Bits per Morton code (10 bits per axis)
+        MORTON_BITS = 30,
+
+        /// Bits per radix sort pass
+        RADIX_BITS = 10,
+
+        /// Upper Morton bits shared by the primitives of a cluster
+        CLUSTER_BITS = 15,
+
+        /// Number of bins for the SAH build over the clusters
+        BIN_COUNT = 32,
+
+        /// Heuristic cost value for traversal operations (same as BVHBuilder)
+        TRAVERSAL_COST = 1,
+
+        /// Heuristic cost value for intersection operations (same as BVHBuilder)
+        INTERSECTION_COST = 1
+    };
+
+    LBVHBuilder(BVH &bvh) : bvh(bvh) { }
+
+    void build(bool refineTop) {
+        uint32_t size = bvh.getPrimitiveCount();
+        computeCodes();
+
+        bvh.m_nodes.resize(2 * size);
+        std::fill(bvh.m_nodes.begin(), bvh.m_nodes.end(), BVH::BVHNode());
+        bvh.m_indices.resize(size);
+
+        if (!refineTop) {
+            tbb::parallel_for(
+                tbb::blocked_range<uint32_t>(0u, size, GRAIN_SIZE),
+                [&](const tbb::blocked_range<uint32_t> &range) {
+                    for (uint32_t i = range.begin(); i != range.end(); ++i)
+                        bvh.m_indices[i] = m_prims[i];
+                }
+            );
+            emit(0u, m_codes.data(), bvh.m_indices.data(), size);
+        } else {
+            /* Find the ranges of primitives that share the upper Morton bits */
+            const int shift = MORTON_BITS - CLUSTER_BITS;
+            std::vector<Cluster> clusters;
+            for (uint32_t i = 0; i < size; ++i) {
+                if (i == 0 || (m_codes[i] >> shift) != (m_codes[i - 1] >> shift))
+                    clusters.push_back(Cluster { i, 0u, BoundingBox3f() });
+                clusters.back().size++;
+            }
+            tbb::parallel_for(
+                tbb::blocked_range<size_t>(0, clusters.size(), 16),
+                [&](const tbb::blocked_range<size_t> &range) {
+                    for (size_t c = range.begin(); c != range.end(); ++c) {
+                        Cluster &cluster = clusters[c];
+                        for (uint32_t i = cluster.start; i < cluster.start + cluster.size; ++i)
+                            cluster.bbox.expandBy(m_bboxes[m_prims[i]]);
+                    }
+                }
+            );
+            emitClusters(0u, clusters.data(), (uint32_t) clusters.size(), 0u);
+        }
+    }
+
+private:
+    /// Contiguous range of Morton-sorted primitives that is built as a unit
+    struct Cluster {
+        uint32_t start, size;
+        BoundingBox3f bbox;
+    };
+
+    /// Return the index of the highest set bit of a nonzero value
+    static int highestBit(uint32_t value) {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanReverse(&index, value);
+        return (int) index;
+#else
+        return 31 - __builtin_clz(value);
+#endif
+    }
+
+    /// Insert two zero bits after each of the lower 10 bits of \c x
+    static uint32_t expandBits(uint32_t x) {
+        x = (x | (x << 16)) & 0x030000FF;
+        x = (x | (x <<  8)) & 0x0300F00F;
+        x = (x | (x <<  4)) & 0x030C30C3;
+        x = (x | (x <<  2)) & 0x09249249;
+        return x;
+    }
+
+    /// Compute the sorted Morton codes (\ref m_codes) and primitive order (\ref m_prims)
+    void computeCodes() {
+        uint32_t size = bvh.getPrimitiveCount();
+        m_bboxes.resize(size);
+        std::vector<Point3f> centroids(size);
+
+        BoundingBox3f bounds = tbb::parallel_reduce(
+            tbb::blocked_range<uint32_t>(0u, size, GRAIN_SIZE),
+            BoundingBox3f(),
+            [&](const tbb::blocked_range<uint32_t> &range, BoundingBox3f result) {
+                for (uint32_t f = range.begin(); f != range.end(); ++f) {
+                    m_bboxes[f] = bvh.getBoundingBox(f);
+                    centroids[f] = bvh.getCentroid(f);
+                    result.expandBy(centroids[f]);
+                }
+                return result;
+            },
+            [](const BoundingBox3f &b1, const BoundingBox3f &b2) {
+                return BoundingBox3f::merge(b1, b2);
+            }
+        );
+
+        /* Quantize the centroids to a 1024^3 grid. The sort keys hold the
+           Morton code in the upper and the primitive in the lower half */
+        Vector3f extents = bounds.getExtents();
+        Vector3f scale;
+        for (int axis = 0; axis < 3; ++axis)
+            scale[axis] = extents[axis] > 0 ? 1023.f / extents[axis] : 0.f;
+
+        std::vector<uint64_t> keys(size), temp(size);
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, size, GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t f = range.begin(); f != range.end(); ++f) {
+                    Vector3f p = (centroids[f] - bounds.min).cwiseProduct(scale);
+                    uint32_t code = (expandBits((uint32_t) p.x()) << 2) |
+                                    (expandBits((uint32_t) p.y()) << 1) |
+                                     expandBits((uint32_t) p.z());
+                    keys[f] = ((uint64_t) code << 32) | f;
+                }
+            }
+        );
+
+        /* The primitives are already ordered, so only the codes are sorted */
+        for (int shift = 32; shift < 32 + MORTON_BITS; shift += RADIX_BITS) {
+            radixSortPass(keys, temp, shift);
+            keys.swap(temp);
+        }
+
+        m_codes.resize(size);
+        m_prims.resize(size);
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, size, GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    m_codes[i] = (uint32_t) (keys[i] >> 32);
+                    m_prims[i] = (uint32_t) keys[i];
+                }
+            }
+        );
+    }
+
+    /// Stable parallel counting sort of \c keys into \c result by the digit at \c shift
+    void radixSortPass(const std::vector<uint64_t> &keys, std::vector<uint64_t> &result, int shift) {
+        const uint32_t bucketCount = 1u << RADIX_BITS, mask = bucketCount - 1;
+        const uint32_t chunkSize = 16 * GRAIN_SIZE;
+        uint32_t size = (uint32_t) keys.size();
+        uint32_t chunkCount = (size + chunkSize - 1) / chunkSize;
+
+        /* Histogram of every chunk */
+        std::vector<uint32_t> offsets(chunkCount * bucketCount, 0u);
+        tbb::parallel_for(0u, chunkCount, [&](uint32_t chunk) {
+            uint32_t *histogram = offsets.data() + chunk * bucketCount;
+            uint32_t end = std::min(size, (chunk + 1) * chunkSize);
+            for (uint32_t i = chunk * chunkSize; i < end; ++i)
+                histogram[(keys[i] >> shift) & mask]++;
+        });
+
+        /* Turn the histograms into the output offsets of every chunk and bucket */
+        uint32_t sum = 0;
+        for (uint32_t bucket = 0; bucket < bucketCount; ++bucket) {
+            for (uint32_t chunk = 0; chunk < chunkCount; ++chunk) {
+                uint32_t &offset = offsets[chunk * bucketCount + bucket];
+                uint32_t count = offset;
+                offset = sum;
+                sum += count;
+            }
+        }
+
+        tbb::parallel_for(0u, chunkCount, [&](uint32_t chunk) {
+            uint32_t *offset = offsets.data() + chunk * bucketCount;
+            uint32_t end = std::min(size, (chunk + 1) * chunkSize);
+            for (uint32_t i = chunk * chunkSize; i < end; ++i)
+                result[offset[(keys[i] >> shift) & mask]++] = keys[i];
+        });
+    }
+
+    /// Return the number of entries of a sorted code range that go to the left child
+    static uint32_t findSplit(const uint32_t *codes, uint32_t size) {
+        uint32_t first = codes[0], last = codes[size - 1];
+        if (first == last)
+            return size / 2;
+
+        /* Binary search for the last code that agrees with the first one
+           in the highest bit where the first and last code differ */
+        int bit = highestBit(first ^ last);
+        uint32_t split = 0, step = size - 1;
+        do {
+            step = (step + 1) / 2;
+            uint32_t candidate = split + step;
+            if (candidate < size - 1 && (first ^ codes[candidate]) < (1u << bit))
+                split = candidate;
+        } while (step > 1);
+        return split + 1;
+    }
+
+    /**
+     * \brief Emit the subtree over a Morton-sorted range of primitives
+     *
+     * \c codes and \c indices point to the range within the sorted codes
+     * and within \ref BVH::m_indices. Returns the bounding box of the subtree.
+     */
+    BoundingBox3f emit(uint32_t node_idx, const uint32_t *codes, uint32_t *indices, uint32_t size) {
+        BVH::BVHNode &node = bvh.m_nodes[node_idx];
+
+        if (size <= LEAF_SIZE) {
+            node.bbox.reset();
+            for (uint32_t i = 0; i < size; ++i)
+                node.bbox.expandBy(m_bboxes[indices[i]]);
+            node.leaf.flag = 1;
+            node.leaf.start = (uint32_t) (indices - bvh.m_indices.data());
+            node.leaf.size = size;
+            return node.bbox;
+        }
+
+        uint32_t left_count = findSplit(codes, size);
+        uint32_t node_idx_left = node_idx + 1;
+        uint32_t node_idx_right = node_idx + 2 * left_count;
+
+        BoundingBox3f bbox_left, bbox_right;
+        if (size > GRAIN_SIZE) {
+            tbb::parallel_invoke(
+                [&] { bbox_left = emit(node_idx_left, codes, indices, left_count); },
+                [&] { bbox_right = emit(node_idx_right, codes + left_count,
+                                        indices + left_count, size - left_count); }
+            );
+        } else {
+            bbox_left = emit(node_idx_left, codes, indices, left_count);
+            bbox_right = emit(node_idx_right, codes + left_count,
+                              indices + left_count, size - left_count);
+        }
+
+        /* Morton bits cycle through the z, y and x axes */
+        uint32_t difference = codes[0] ^ codes[size - 1];
+        node.bbox = BoundingBox3f::merge(bbox_left, bbox_right);
+        node.inner.leftChild = node_idx_left;
+        node.inner.rightChild = node_idx_right;
+        node.inner.axis = difference ? 2 - highestBit(difference) % 3
+                                     : node.bbox.getLargestAxis();
+        node.inner.flag = 0;
+        return node.bbox;
+    }
+
+    /**
+     * \brief Build the SAH hierarchy over a set of clusters
+     *
+     * The clusters are reordered in place. \c start is the position in
+     * \ref BVH::m_indices where the primitives of the first cluster go.
+     */
+    void emitClusters(uint32_t node_idx, Cluster *clusters, uint32_t count, uint32_t start) {
+        if (count == 1) {
+            /* Copy the primitives of the cluster and build its hierarchy */
+            const Cluster &cluster = clusters[0];
+            memcpy(bvh.m_indices.data() + start, m_prims.data() + cluster.start,
+                   cluster.size * sizeof(uint32_t));
+            emit(node_idx, m_codes.data() + cluster.start,
+                 bvh.m_indices.data() + start, cluster.size);
+            return;
+        }
+
+        BVH::BVHNode &node = bvh.m_nodes[node_idx];
+        BoundingBox3f centers;
+        node.bbox.reset();
+        for (uint32_t c = 0; c < count; ++c) {
+            node.bbox.expandBy(clusters[c].bbox);
+            centers.expandBy(clusters[c].bbox.getCenter());
+        }
+
+        /* Bin the cluster centers along every axis and evaluate the SAH
+           at the bin boundaries */
+        float best_cost = std::numeric_limits<float>::infinity();
+        int best_axis = -1, best_bin = 0;
+        float tri_factor = INTERSECTION_COST / node.bbox.getSurfaceArea();
+
+        for (int axis = 0; axis < 3; ++axis) {
+            float min = centers.min[axis], extent = centers.max[axis] - min;
+            if (extent <= 0)
+                continue;
+            float inv_bin_size = BIN_COUNT / extent;
+
+            uint32_t counts[BIN_COUNT] = { 0 };
+            BoundingBox3f bboxes[BIN_COUNT];
+            for (uint32_t c = 0; c < count; ++c) {
+                int bin = binIndex(clusters[c], axis, min, inv_bin_size);
+                counts[bin] += clusters[c].size;
+                bboxes[bin].expandBy(clusters[c].bbox);
+            }
+
+            float left_areas[BIN_COUNT];
+            uint32_t left_prims[BIN_COUNT];
+            BoundingBox3f bbox;
+            uint32_t prims = 0;
+            for (int i = 0; i < BIN_COUNT; ++i) {
+                bbox.expandBy(bboxes[i]);
+                prims += counts[i];
+                left_areas[i] = bbox.isValid() ? bbox.getSurfaceArea() : 0.f;
+                left_prims[i] = prims;
+            }
+
+            bbox.reset();
+            for (int i = BIN_COUNT - 1; i >= 1; --i) {
+                bbox.expandBy(bboxes[i]);
+                if (left_prims[i - 1] == 0 || left_prims[i - 1] == prims)
+                    continue;
+                float sah_cost = 2.0f * TRAVERSAL_COST + tri_factor *
+                    (left_prims[i - 1] * left_areas[i - 1] +
+                     (prims - left_prims[i - 1]) * bbox.getSurfaceArea());
+                if (sah_cost < best_cost) {
+                    best_cost = sah_cost;
+                    best_axis = axis;
+                    best_bin = i;
+                }
+            }
+        }
+
+        /* Clusters cannot be split, so the recursion continues until each
+           of them forms a subtree of its own */
+        uint32_t best_index;
+        if (best_axis == -1) {
+            /* All centers coincide, split the list in the middle */
+            best_index = count / 2;
+            best_axis = node.bbox.getLargestAxis();
+        } else {
+            float min = centers.min[best_axis],
+                  inv_bin_size = BIN_COUNT / (centers.max[best_axis] - min);
+            Cluster *middle = std::partition(clusters, clusters + count, [&](const Cluster &cluster) {
+                return binIndex(cluster, best_axis, min, inv_bin_size) < best_bin;
+            });
+            best_index = (uint32_t) (middle - clusters);
+        }
+
+        uint32_t left_count = 0;
+        for (uint32_t c = 0; c < best_index; ++c)
+            left_count += clusters[c].size;
+
+        uint32_t node_idx_left = node_idx + 1;
+        uint32_t node_idx_right = node_idx + 2 * left_count;
+        node.inner.leftChild = node_idx_left;
+        node.inner.rightChild = node_idx_right;
+        node.inner.axis = best_axis;
+        node.inner.flag = 0;
+
+        tbb::parallel_invoke(
+            [&] { emitClusters(node_idx_left, clusters, best_index, start); },
+            [&] { emitClusters(node_idx_right, clusters + best_index,
+                               count - best_index, start + left_count); }
+        );
+    }
+
+    /// Return the bin of a cluster center in \ref emitClusters()
+    static int binIndex(const Cluster &cluster, int axis, float min, float inv_bin_size) {
+        float center = 0.5f * (cluster.bbox.min[axis] + cluster.bbox.max[axis]);
+        return std::min(std::max((int) ((center - min) * inv_bin_size), 0), BIN_COUNT - 1);
+    }
+
+    BVH &bvh;
+    std::vector<BoundingBox3f> m_bboxes; ///< Bounding box of every primitive
+    std::vector<uint32_t> m_codes;       ///< Sorted Morton codes
+    std::vector<uint32_t> m_prims;       ///< Primitives in the order of \ref m_codes
+};
+
+void BVH::buildLinear(bool refineTop) {
+    uint32_t size = getPrimitiveCount();
+    cout << "Constructing a " << (refineTop ? "HLBVH" : "LBVH") << " ("
+        << m_shapes.size() << (m_shapes.size() == 1 ? " shape, " : " shapes, ")
+        << size << " primitives) .. ";
+    cout.flush();
+    Timer timer;
+
+    LBVHBuilder(*this).build(refineTop);
+    std::pair<float, uint32_t> stats = statistics();
+    compactNodes(stats.second);
+
+    cout << "done (took " << timer.elapsedString() << " and "
+        << memString(sizeof(BVHNode) * m_nodes.size() + sizeof(uint32_t)*m_indices.size())
+        << ", SAH cost = " << stats.first
+        << ")." << endl;
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,254 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bvh.h>
+#include <tbb/parallel_for.h>
+#include <algorithm>
+
+/*
+ * Node layouts. The builders emit nodes in depth-first order, so a parent
+ * is always followed by its first child, but the other children may be
+ * arbitrarily far away. After construction, the nodes used by the
+ * traversal can be permuted into one of two layouts:
+ *
+ * - Treelets: starting from a root, the candidate node with the largest
+ *   surface area (i.e. the one most likely to be visited next) is added
+ *   until the treelet fills TREELET_BYTES. The remaining candidates become
+ *   the roots of the following treelets. Nodes that are visited together
+ *   thus tend to share cache lines and pages.
+ *
+ * - van Emde Boas: the tree is cut at half its height, the top part is laid
+ *   out recursively, followed by each of the bottom subtrees. Every subtree
+ *   of height 2^k is then contiguous, independently of the cache line size.
+ *
+ * Both layouts keep the root at index 0 and rely on children being stored
+ * after their parent in the original order.
+ */
+
+NORI_NAMESPACE_BEGIN
+
+/// Target size of a treelet in bytes (one page)
+static const size_t TREELET_BYTES = 4096;
+
+BVH::ENodeOrder BVH::parseNodeOrder(const std::string &name) {
+    if (name == "depthfirst")
+        return EDepthFirstOrder;
+    else if (name == "treelet")
+        return ETreeletOrder;
+    else if (name == "veb")
+        return EVanEmdeBoasOrder;
+    else
+        throw NoriException("BVH: unknown node order \"%s\" (must be \"depthfirst\", \"treelet\" or \"veb\")", name);
+}
+
+/**
+ * \brief Computes a new arrangement of a tree with \c nodeCount nodes
+ *
+ * <tt>children(i, f)</tt> must call <tt>f(child, area)</tt> for every inner
+ * child of node \c i, where \c area is the surface area of the child's
+ * bounding box. Returns the original node indices in their new order.
+ */
+template <typename Children> class NodeOrder {
+public:
+    NodeOrder(uint32_t nodeCount, const Children &children)
+        : m_children(children) {
+        m_order.reserve(nodeCount);
+        m_nodeCount = nodeCount;
+    }
+
+    std::vector<uint32_t> treelets(uint32_t treeletSize) {
+        std::vector<uint32_t> roots(1, 0u), stack;
+        std::vector<std::pair<float, uint32_t>> candidates;
+        std::vector<bool> selected(m_nodeCount, false);
+
+        while (!roots.empty()) {
+            uint32_t root = roots.back();
+            roots.pop_back();
+            candidates.clear();
+            candidates.emplace_back(0.f, root);
+
+            /* Grow the treelet by the candidate with the largest surface area */
+            for (uint32_t size = 0; size < treeletSize && !candidates.empty(); ++size) {
+                std::pop_heap(candidates.begin(), candidates.end());
+                uint32_t node_idx = candidates.back().second;
+                candidates.pop_back();
+                selected[node_idx] = true;
+
+                m_children(node_idx, [&](uint32_t child, float area) {
+                    candidates.emplace_back(area, child);
+                    std::push_heap(candidates.begin(), candidates.end());
+                });
+            }
+
+            /* Emit the treelet in depth-first order, so that the first child
+               still directly follows its parent. Its remaining candidates
+               become the roots of the next treelets (in the same order) */
+            size_t firstRoot = roots.size();
+            stack.push_back(root);
+            while (!stack.empty()) {
+                uint32_t node_idx = stack.back();
+                stack.pop_back();
+                if (!selected[node_idx]) {
+                    roots.push_back(node_idx);
+                    continue;
+                }
+                m_order.push_back(node_idx);
+                size_t firstChild = stack.size();
+                m_children(node_idx, [&](uint32_t child, float) { stack.push_back(child); });
+                std::reverse(stack.begin() + firstChild, stack.end());
+            }
+            std::reverse(roots.begin() + firstRoot, roots.end());
+        }
+
+        assert(m_order.size() == m_nodeCount);
+        return std::move(m_order);
+    }
+
+    std::vector<uint32_t> vanEmdeBoas() {
+        /* Children are stored after their parents, so one backward pass
+           yields the height of every subtree */
+        m_height.assign(m_nodeCount, 1u);
+        for (uint32_t i = m_nodeCount; i-- > 0; ) {
+            m_children(i, [&](uint32_t child, float) {
+                assert(child > i);
+                m_height[i] = std::max(m_height[i], m_height[child] + 1);
+            });
+        }
+
+        vanEmdeBoas(0u, m_height[0]);
+        assert(m_order.size() == m_nodeCount);
+        return std::move(m_order);
+    }
+
+private:
+    /// Lay out the first \c levels levels of the subtree at \c node_idx
+    void vanEmdeBoas(uint32_t node_idx, uint32_t levels) {
+        if (levels == 1) {
+            m_order.push_back(node_idx);
+            return;
+        }
+
+        uint32_t top = levels / 2;
+        vanEmdeBoas(node_idx, top);
+
+        std::vector<uint32_t> bottom;
+        collect(node_idx, top, bottom);
+        for (uint32_t root : bottom)
+            vanEmdeBoas(root, std::min(levels - top, m_height[root]));
+    }
+
+    /// Append the descendants \c depth levels below \c node_idx to \c result
+    void collect(uint32_t node_idx, uint32_t depth, std::vector<uint32_t> &result) {
+        m_children(node_idx, [&](uint32_t child, float) {
+            if (depth == 1)
+                result.push_back(child);
+            else
+                collect(child, depth - 1, result);
+        });
+    }
+
+    const Children &m_children;
+    uint32_t m_nodeCount;
+    std::vector<uint32_t> m_order;
+    std::vector<uint32_t> m_height;
+};
+
+/**
+ * \brief Permute \c nodes according to \c order
+ *
+ * <tt>remap(node, newIndex)</tt> must rewrite the child indices of \c node.
+ */
+template <typename Node, typename Children, typename Remap>
+static void reorder(MappedArray<Node> &nodes, BVH::ENodeOrder nodeOrder,
+                    const Children &children, const Remap &remap) {
+    uint32_t nodeCount = (uint32_t) nodes.size();
+    NodeOrder<Children> builder(nodeCount, children);
+    std::vector<uint32_t> order = nodeOrder == BVH::ETreeletOrder
+        ? builder.treelets((uint32_t) std::max(TREELET_BYTES / sizeof(Node), (size_t) 1))
+        : builder.vanEmdeBoas();
+
+    std::vector<uint32_t> newIndex(nodeCount);
+    tbb::parallel_for(0u, nodeCount, [&](uint32_t i) { newIndex[order[i]] = i; });
+
+    std::vector<Node> result(nodeCount);
+    tbb::parallel_for(
+        tbb::blocked_range<uint32_t>(0u, nodeCount, 1024),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                result[i] = nodes[order[i]];
+                remap(result[i], newIndex);
+            }
+        }
+    );
+    nodes = std::move(result);
+}
+
+/// Reorder the nodes of an \c N-wide hierarchy
+template <typename WideNode>
+static void reorderWide(MappedArray<WideNode> &nodes, BVH::ENodeOrder nodeOrder) {
+    const int N = WideNode::Width;
+
+    auto children = [&](uint32_t node_idx, auto f) {
+        const WideNode &node = nodes[node_idx];
+        for (int i = 0; i < N; ++i) {
+            /* Unused slots have child = count = 0, and the root is never a child */
+            if (node.count[i] != 0 || node.child[i] == 0)
+                continue;
+            Vector3f extents(node.upper[0][i] - node.lower[0][i],
+                             node.upper[1][i] - node.lower[1][i],
+                             node.upper[2][i] - node.lower[2][i]);
+            f(node.child[i], extents.x() * extents.y() + extents.y() * extents.z() +
+                             extents.z() * extents.x());
+        }
+    };
+
+    reorder(nodes, nodeOrder, children, [](WideNode &node, const std::vector<uint32_t> &newIndex) {
+        for (int i = 0; i < N; ++i) {
+            if (node.count[i] == 0)
+                node.child[i] = newIndex[node.child[i]];
+        }
+    });
+}
+
+void BVH::reorderNodes() {
+    if (m_nodeOrder == EDepthFirstOrder)
+        return;
+
+    if (m_width == 4) {
+        reorderWide(m_nodes4, m_nodeOrder);
+    } else if (m_width == 8) {
+        reorderWide(m_nodes8, m_nodeOrder);
+    } else {
+        auto children = [&](uint32_t node_idx, auto f) {
+            const BVHNode &node = m_nodes[node_idx];
+            if (node.isInner()) {
+                f(node.inner.leftChild, m_nodes[node.inner.leftChild].bbox.getSurfaceArea());
+                f(node.inner.rightChild, m_nodes[node.inner.rightChild].bbox.getSurfaceArea());
+            }
+        };
+
+        reorder(m_nodes, m_nodeOrder, children, [](BVHNode &node, const std::vector<uint32_t> &newIndex) {
+            if (node.isInner()) {
+                node.inner.leftChild = newIndex[node.inner.leftChild];
+                node.inner.rightChild = newIndex[node.inner.rightChild];
+            }
+        });
+    }
+}
+
+NORI_NAMESPACE_END
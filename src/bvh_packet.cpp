@@ -0,0 +1,241 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bvh.h>
+#include <nori/simd.h>
+
+/*
+ * Packet traversal of the binary BVH. All rays of a packet descend the
+ * tree together and carry a bit mask of the lanes that are still
+ * active in the current subtree. Before the per-lane slab test, a node
+ * is tested against the bounding frustum of the packet using interval
+ * arithmetic ("Large Ray Packets for Real-time Whitted Ray Tracing",
+ * Overbeck et al. 2008), which rejects most missed nodes for the cost
+ * of a single scalar test. Packets whose directions disagree in sign
+ * fall back to tracing their rays one by one.
+ *
+ * Only the binary layout is traversed in packets. The 4- and 8-wide
+ * layouts already test all children of a node at once, so with those
+ * the rays of a packet are traced one by one through the active layout
+ * instead of through the binary nodes that it was collapsed from.
+ */
+
+NORI_NAMESPACE_BEGIN
+
+/// Lower and upper bound of the product of two intervals
+static inline void intervalMul(float a0, float a1, float b0, float b1, float &lo, float &hi) {
+    float p0 = a0 * b0, p1 = a0 * b1, p2 = a1 * b0, p3 = a1 * b1;
+    lo = std::min(std::min(p0, p1), std::min(p2, p3));
+    hi = std::max(std::max(p0, p1), std::max(p2, p3));
+}
+
+template <int N> uint32_t BVH::rayIntersectPacket(const Ray3f *rays, Intersection *its, uint32_t activeMask) const {
+    typedef SimdFloat<N> FloatN;
+
+    Ray3f ray[N];
+    alignas(32) float org[3][N], rcp[3][N], mint[N], maxt[N];
+    uint32_t prim[N];
+
+    /* Setup: inactive lanes get an empty interval so they never hit */
+    for (int i = 0; i < N; ++i) {
+        prim[i] = 0;
+        if (activeMask & (1u << i)) {
+            its[i].t = std::numeric_limits<float>::infinity();
+
+            /* Use an adaptive ray epsilon */
+            ray[i] = rays[i];
+            if (ray[i].mint == Epsilon)
+                ray[i].mint = std::max(ray[i].mint, ray[i].mint * ray[i].o.array().abs().maxCoeff());
+            if (ray[i].maxt < ray[i].mint)
+                activeMask &= ~(1u << i);
+        }
+
+        if (activeMask & (1u << i)) {
+            for (int axis = 0; axis < 3; ++axis) {
+                float d = ray[i].d[axis];
+                if (std::abs(d) < 1e-20f)
+                    d = std::copysign(1e-20f, d);
+                org[axis][i] = ray[i].o[axis];
+                rcp[axis][i] = 1.0f / d;
+            }
+            mint[i] = ray[i].mint;
+            maxt[i] = ray[i].maxt;
+        } else {
+            for (int axis = 0; axis < 3; ++axis) {
+                org[axis][i] = 0.f;
+                rcp[axis][i] = 1.f;
+            }
+            mint[i] =  std::numeric_limits<float>::infinity();
+            maxt[i] = -std::numeric_limits<float>::infinity();
+        }
+    }
+
+    if (m_nodes.empty() || activeMask == 0)
+        return 0u;
+
+    /* Bounding frustum of the packet. The interval test is only valid if
+       all active rays agree on the sign of every direction component */
+    bool coherent = true;
+    int dirSign[3];
+    float orgMin[3], orgMax[3], rcpMin[3], rcpMax[3];
+    float packetMinT = std::numeric_limits<float>::infinity(),
+          packetMaxT = -std::numeric_limits<float>::infinity();
+    for (int axis = 0; axis < 3; ++axis) {
+        orgMin[axis] = rcpMin[axis] =  std::numeric_limits<float>::infinity();
+        orgMax[axis] = rcpMax[axis] = -std::numeric_limits<float>::infinity();
+        dirSign[axis] = -1;
+    }
+    for (int i = 0; i < N; ++i) {
+        if (!(activeMask & (1u << i)))
+            continue;
+        for (int axis = 0; axis < 3; ++axis) {
+            int sign = rcp[axis][i] < 0 ? 1 : 0;
+            if (dirSign[axis] == -1)
+                dirSign[axis] = sign;
+            else if (dirSign[axis] != sign)
+                coherent = false;
+            orgMin[axis] = std::min(orgMin[axis], org[axis][i]);
+            orgMax[axis] = std::max(orgMax[axis], org[axis][i]);
+            rcpMin[axis] = std::min(rcpMin[axis], rcp[axis][i]);
+            rcpMax[axis] = std::max(rcpMax[axis], rcp[axis][i]);
+        }
+        packetMinT = std::min(packetMinT, mint[i]);
+        packetMaxT = std::max(packetMaxT, maxt[i]);
+    }
+
+    /* Incoherent packets gain nothing from shared traversal, and the wide
+       layouts are traversed per ray (see the comment at the top) */
+    if (!coherent || m_width != 2) {
+        uint32_t hitMask = 0, lanes = activeMask;
+        while (lanes) {
+            int lane = lowestBit(lanes);
+            lanes &= lanes - 1;
+            if (rayIntersect(rays[lane], its[lane], false))
+                hitMask |= 1u << lane;
+        }
+        return hitMask;
+    }
+
+    TraversalStats *stats = localStats();
+    if (stats) {
+        for (int i = 0; i < N; ++i)
+            stats->rays += (activeMask >> i) & 1u;
+    }
+
+    struct StackEntry {
+        uint32_t node_idx, mask;
+    };
+    StackEntry stack[64];
+    uint32_t stack_idx = 0, node_idx = 0, mask = activeMask, hitMask = 0;
+
+    while (true) {
+        const BVHNode &node = m_nodes[node_idx];
+        const BoundingBox3f &bbox = node.bbox;
+        if (stats)
+            stats->nodes++;
+
+        /* Frustum culling: conservative test of the whole packet */
+        float tNear = packetMinT, tFar = packetMaxT;
+        for (int axis = 0; axis < 3 && tNear <= tFar; ++axis) {
+            float nearPlane = dirSign[axis] ? bbox.max[axis] : bbox.min[axis];
+            float farPlane  = dirSign[axis] ? bbox.min[axis] : bbox.max[axis];
+            float lo, hi, unused;
+            intervalMul(nearPlane - orgMax[axis], nearPlane - orgMin[axis],
+                        rcpMin[axis], rcpMax[axis], lo, unused);
+            tNear = std::max(tNear, lo);
+            intervalMul(farPlane - orgMax[axis], farPlane - orgMin[axis],
+                        rcpMin[axis], rcpMax[axis], unused, hi);
+            tFar = std::min(tFar, hi);
+        }
+        bool visit = tNear <= tFar;
+
+        /* Interval culling: precise slab test for the active lanes */
+        if (visit) {
+            FloatN laneNear = FloatN::load(mint), laneFar = FloatN::load(maxt);
+            for (int axis = 0; axis < 3; ++axis) {
+                FloatN o = FloatN::load(org[axis]), r = FloatN::load(rcp[axis]);
+                FloatN t0 = (FloatN(bbox.min[axis]) - o) * r;
+                FloatN t1 = (FloatN(bbox.max[axis]) - o) * r;
+                laneNear = max(laneNear, min(t0, t1));
+                laneFar  = min(laneFar, max(t0, t1));
+            }
+            mask &= maskLessEqual(laneNear, laneFar);
+            visit = mask != 0;
+        }
+
+        if (visit && node.isInner()) {
+            /* Visit the near child first */
+            uint32_t near = node.inner.leftChild, far = node.inner.rightChild;
+            if (dirSign[node.inner.axis])
+                std::swap(near, far);
+            stack[stack_idx++] = StackEntry { far, mask };
+            node_idx = near;
+            assert(stack_idx < 64);
+            continue;
+        }
+
+        if (visit) {
+            uint32_t lanes = mask;
+            while (lanes) {
+                int lane = lowestBit(lanes);
+                lanes &= lanes - 1;
+
+                if (stats)
+                    stats->primitives += node.leaf.size;
+
+                if (rayIntersectLeaf(node.start(), node.end(), ray[lane], its[lane], prim[lane], nullptr)) {
+                    maxt[lane] = ray[lane].maxt;
+                    hitMask |= 1u << lane;
+                }
+            }
+
+            /* Shrink the frustum's far distance */
+            packetMaxT = -std::numeric_limits<float>::infinity();
+            for (int lane = 0; lane < N; ++lane)
+                if (activeMask & (1u << lane))
+                    packetMaxT = std::max(packetMaxT, maxt[lane]);
+        }
+
+        if (stack_idx == 0)
+            break;
+        --stack_idx;
+        node_idx = stack[stack_idx].node_idx;
+        mask = stack[stack_idx].mask;
+    }
+
+    for (int lane = 0; lane < N; ++lane) {
+        if (hitMask & (1u << lane))
+            its[lane].mesh->setHitInformation(prim[lane], ray[lane], its[lane]);
+    }
+
+    return hitMask;
+}
+
+uint32_t BVH::rayIntersect4(const Ray3f *rays, Intersection *its, uint32_t mask) const {
+    return rayIntersectPacket<4>(rays, its, mask & 0xFu);
+}
+
+uint32_t BVH::rayIntersect8(const Ray3f *rays, Intersection *its, uint32_t mask) const {
+    return rayIntersectPacket<8>(rays, its, mask & 0xFFu);
+}
+
+uint32_t BVH::rayIntersect16(const Ray3f *rays, Intersection *its, uint32_t mask) const {
+    return rayIntersectPacket<16>(rays, its, mask & 0xFFFFu);
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,253 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bvh.h>
+#include <nori/mesh.h>
+#include <nori/timer.h>
+#include <filesystem/path.h>
+#include <tbb/parallel_for.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+/*
+ * Out-of-core geometry. The builders keep the references of every subtree
+ * contiguous in m_indices, so a subtree owns a contiguous range of
+ * triangle blocks. The tree is cut into the largest subtrees that fit into
+ * a cluster, neighboring small subtrees are merged, and the cluster
+ * boundaries are rounded to whole blocks. A leaf hence touches one or (if
+ * it straddles a boundary) two clusters, and rays that traverse a region
+ * of the scene keep hitting the same few clusters.
+ *
+ * The meshes are paged as well: the vertex data of every triangle
+ * (positions, normals, texture coordinates and tangents) is written as
+ * one Mesh::Triangle record, and the mesh arrays are released. The records
+ * of a mesh are ordered by the first reference to each triangle in
+ * m_indices, so the records of a subtree also end up in the same few
+ * clusters, and hit information, alpha tests and surface samples pin the
+ * cluster of their triangle while they read it. Only the slot of every
+ * triangle and its area CDF (8 bytes per triangle) stay in memory.
+ *
+ * Blocks and records share one file and one budget. The file is written
+ * to the cache directory (or the temporary directory) and deleted right
+ * after it has been mapped; on Windows, where mapped files cannot be
+ * deleted, clear() removes it. The pages of the mapping are dropped again
+ * after a cluster has been copied, so that only the resident clusters
+ * count towards the memory of the process.
+ */
+
+NORI_NAMESPACE_BEGIN
+
+/// Directory for cluster files when no cache directory is set
+static std::string temporaryDirectory() {
+#if defined(PLATFORM_WINDOWS)
+    const char *directory = getenv("TEMP");
+#else
+    const char *directory = getenv("TMPDIR");
+#endif
+    if (directory && *directory)
+        return directory;
+#if defined(PLATFORM_WINDOWS)
+    return ".";
+#else
+    return "/tmp";
+#endif
+}
+
+/// Number of clusters of triangle records that are gathered at once
+static const uint32_t RECORD_BATCH_CLUSTERS = 64;
+
+void BVH::pageGeometry(uint64_t key) {
+    if (m_nodes.empty())
+        return;
+
+    cout << "Paging the geometry .. ";
+    cout.flush();
+    Timer timer;
+
+    const uint32_t K = TRIANGLE_BLOCK_SIZE;
+    const uint32_t blockCount = (uint32_t) m_triangles.size();
+    const uint32_t clusterBlocks = std::max(PAGING_CLUSTER_SIZE / (uint32_t) sizeof(TriangleBlock), 1u);
+
+    m_clusterStart.clear();
+    if (blockCount > 0) {
+        /* Range of references covered by every subtree (children may have
+           been rearranged in memory, so visit them recursively) */
+        std::vector<uint32_t> first(m_nodes.size()), last(m_nodes.size());
+        std::function<void(uint32_t)> computeRange = [&](uint32_t idx) {
+            const BVHNode &node = m_nodes[idx];
+            if (node.isLeaf()) {
+                first[idx] = node.start();
+                last[idx] = node.end();
+            } else {
+                computeRange(node.inner.leftChild);
+                computeRange(node.inner.rightChild);
+                first[idx] = std::min(first[node.inner.leftChild], first[node.inner.rightChild]);
+                last[idx] = std::max(last[node.inner.leftChild], last[node.inner.rightChild]);
+            }
+        };
+        computeRange(0u);
+
+        /* Ends of the largest subtrees that fit into a cluster */
+        std::vector<uint32_t> ends;
+        std::function<void(uint32_t)> selectSubtrees = [&](uint32_t idx) {
+            const BVHNode &node = m_nodes[idx];
+            if (node.isLeaf() || last[idx] - first[idx] <= clusterBlocks * K) {
+                ends.push_back(last[idx]);
+            } else {
+                selectSubtrees(node.inner.leftChild);
+                selectSubtrees(node.inner.rightChild);
+            }
+        };
+        selectSubtrees(0u);
+        std::sort(ends.begin(), ends.end());
+
+        /* Round to whole blocks and merge neighbors that fit together */
+        m_clusterStart.assign(1, 0u);
+        for (uint32_t end : ends) {
+            uint32_t block = std::min((end + K / 2) / K, blockCount);
+            if (block <= m_clusterStart.back())
+                continue;
+            if (m_clusterStart.size() > 1 &&
+                block - m_clusterStart[m_clusterStart.size() - 2] <= clusterBlocks)
+                m_clusterStart.back() = block;
+            else
+                m_clusterStart.push_back(block);
+        }
+        if (m_clusterStart.back() != blockCount)
+            m_clusterStart.push_back(blockCount);
+    }
+
+    /* Order the triangles of every mesh by their first reference */
+    std::vector<Mesh *> meshes(m_shapes.size(), nullptr);
+    std::vector<std::vector<uint32_t>> slots(m_shapes.size()), order(m_shapes.size());
+    const uint32_t unassigned = (uint32_t) -1;
+    for (size_t i = 0; i < m_shapes.size(); ++i) {
+        Mesh *mesh = dynamic_cast<Mesh *>(m_shapes[i]);
+        if (!mesh || mesh->isPaged())
+            continue;
+        meshes[i] = mesh;
+        slots[i].assign(mesh->getPrimitiveCount(), unassigned);
+        order[i].reserve(mesh->getPrimitiveCount());
+    }
+    for (uint32_t i = 0; i < (uint32_t) m_indices.size(); ++i) {
+        uint32_t idx = m_indices[i];
+        uint32_t shapeIdx = findShape(idx);
+        if (meshes[shapeIdx] && slots[shapeIdx][idx] == unassigned) {
+            slots[shapeIdx][idx] = (uint32_t) order[shapeIdx].size();
+            order[shapeIdx].push_back(idx);
+        }
+    }
+    for (size_t i = 0; i < m_shapes.size(); ++i) {
+        /* Triangles that the builder dropped (e.g. degenerate ones) */
+        for (uint32_t idx = 0; idx < (uint32_t) slots[i].size(); ++idx) {
+            if (slots[i][idx] == unassigned) {
+                slots[i][idx] = (uint32_t) order[i].size();
+                order[i].push_back(idx);
+            }
+        }
+    }
+
+    /* Cluster boundaries: the blocks, followed by the records of every mesh */
+    const uint32_t recordSize = (uint32_t) sizeof(Mesh::Triangle);
+    const uint32_t clusterRecords = std::max(PAGING_CLUSTER_SIZE / recordSize, 1u);
+    std::vector<uint64_t> offsets;
+    for (uint32_t block : m_clusterStart)
+        offsets.push_back((uint64_t) block * sizeof(TriangleBlock));
+    uint64_t offset = (uint64_t) blockCount * sizeof(TriangleBlock);
+    if (offsets.empty())
+        offsets.push_back(0);
+    std::vector<uint32_t> firstCluster(m_shapes.size(), 0u);
+    for (size_t i = 0; i < m_shapes.size(); ++i) {
+        firstCluster[i] = (uint32_t) offsets.size() - 1;
+        uint32_t count = (uint32_t) order[i].size();
+        for (uint32_t start = 0; start < count; start += clusterRecords) {
+            offset += (uint64_t) std::min(clusterRecords, count - start) * recordSize;
+            offsets.push_back(offset);
+        }
+    }
+
+    /* Write the cluster file */
+    std::string directory = m_cacheDirectory.empty() ? temporaryDirectory() : m_cacheDirectory;
+    std::string filename = (filesystem::path(directory) / tfm::format("%016x.%x.clusters", key,
+        (uint64_t) std::chrono::steady_clock::now().time_since_epoch().count())).str();
+    std::ofstream os(filename, std::ios::binary);
+    os.write((const char *) m_triangles.data(), (std::streamsize) (sizeof(TriangleBlock) * blockCount));
+
+    std::vector<Mesh::Triangle> records;
+    for (size_t i = 0; i < m_shapes.size(); ++i) {
+        const std::vector<uint32_t> &faces = order[i];
+        uint32_t batch = clusterRecords * RECORD_BATCH_CLUSTERS;
+        for (uint32_t start = 0; start < (uint32_t) faces.size() && os.good(); start += batch) {
+            uint32_t count = std::min(batch, (uint32_t) faces.size() - start);
+            records.resize(count);
+            tbb::parallel_for(0u, count, [&](uint32_t j) {
+                /* Attributes that the mesh does not have are stored as zeros */
+                memset((void *) &records[j], 0, sizeof(Mesh::Triangle));
+                meshes[i]->getTriangle(faces[start + j], records[j], Mesh::ETriangleAll);
+            });
+            os.write((const char *) records.data(), (std::streamsize) (recordSize * count));
+        }
+    }
+    os.close();
+    if (!os.good()) {
+        std::remove(filename.c_str());
+        throw NoriException("BVH: could not write the cluster file \"%s\"", filename);
+    }
+
+    try {
+        m_pager.reset(new ClusterCache(filename, offsets, m_pagingBudget));
+    } catch (...) {
+        std::remove(filename.c_str());
+        throw;
+    }
+#if defined(PLATFORM_WINDOWS)
+    /* Mapped files cannot be deleted, so clear() removes it */
+    m_clusterFile = filename;
+#else
+    /* The mapping keeps the contents alive until the cache is destroyed */
+    std::remove(filename.c_str());
+#endif
+
+    /* Release the in-memory blocks (or the pages of the cache mapping) and the meshes */
+    size_t size = (size_t) offset;
+    if (m_triangles.isMapped())
+        m_cacheFile->discard((size_t) ((const uint8_t *) m_triangles.data() - m_cacheFile->data()),
+                             sizeof(TriangleBlock) * blockCount);
+    m_triangles.map(nullptr, 0);
+    for (size_t i = 0; i < m_shapes.size(); ++i) {
+        if (meshes[i])
+            meshes[i]->page(m_pager.get(), firstCluster[i], clusterRecords, std::move(slots[i]));
+    }
+
+    cout << "done (took " << timer.elapsedString() << ", "
+        << m_pager->getClusterCount() << " clusters of " << memString(size)
+        << ", budget " << memString(m_pagingBudget) << ")." << endl;
+}
+
+std::vector<ClusterCache::Stats> BVH::getPagingStats() const {
+    return m_pager ? m_pager->getStats() : std::vector<ClusterCache::Stats>();
+}
+
+void BVH::resetPagingStats() {
+    if (m_pager)
+        m_pager->resetStats();
+}
+
+NORI_NAMESPACE_END
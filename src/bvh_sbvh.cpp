@@ -0,0 +1,440 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bvh.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Spatial split BVH builder
+ *
+ * Besides the usual object partitioning, this builder also considers
+ * splitting the space of a node with an axis-aligned plane. Primitives
+ * straddling the plane are then referenced from both children, with
+ * their bounding boxes clipped to the respective side. This removes the
+ * large overlap between sibling boxes that object splits produce for
+ * long and thin triangles, at the cost of duplicated references.
+ *
+ * The methodology is described in
+ * "Spatial Splits in Bounding Volume Hierarchies"
+ * by Martin Stich, Heiko Friedrich and Andreas Dietrich (HPG 2009)
+ *
+ * The builder writes the nodes in depth-first order, so the result
+ * has the same layout as the output of the compaction pass in
+ * \ref BVH::build().
+ */
+class SBVHBuilder {
+public:
+    /// Build-related parameters
+    enum {
+        /// Use an exhaustive object split sweep below 32 references
+        SWEEP_THRESHOLD = 32,
+
+        /// Number of bins for the binned object and spatial split searches
+        BIN_COUNT = 32,
+
+        /// Create a leaf at this depth at the latest (the traversal stacks hold 64 entries)
+        MAX_DEPTH = 48,
+
+        /// Heuristic cost value for traversal operations (same as BVHBuilder)
+        TRAVERSAL_COST = 1,
+
+        /// Heuristic cost value for intersection operations (same as BVHBuilder)
+        INTERSECTION_COST = 1
+    };
+
+    /// Spatial splits are only attempted if the children of the best object split overlap by this fraction of the root area
+    static constexpr float OVERLAP_THRESHOLD = 1e-5f;
+
+    SBVHBuilder(BVH &bvh, float budget) : bvh(bvh), m_budget(budget) { }
+
+    /// Build the hierarchy, returns the total number of references
+    uint32_t build() {
+        uint32_t size = bvh.getPrimitiveCount();
+
+        std::vector<Reference> refs(size);
+        for (uint32_t i = 0; i < size; ++i)
+            refs[i] = Reference { i, bvh.getBoundingBox(i) };
+
+        m_rootArea = bvh.m_bbox.getSurfaceArea();
+        m_references = size;
+        m_maxReferences = (uint32_t) std::min((double) std::numeric_limits<uint32_t>::max() / 2,
+                                              size * (1.0 + (double) m_budget));
+
+        bvh.m_nodes.clear();
+        bvh.m_indices.clear();
+        bvh.m_nodes.reserve(2 * size);
+        bvh.m_indices.reserve(m_maxReferences);
+
+        buildNode(refs, 0);
+        return (uint32_t) bvh.m_indices.size();
+    }
+
+private:
+    /// A (possibly clipped) reference to a primitive
+    struct Reference {
+        uint32_t prim;
+        BoundingBox3f bbox;
+    };
+
+    /// Candidate split of a node
+    struct Split {
+        float cost = std::numeric_limits<float>::infinity();
+        int axis = -1;
+        float position = 0.f;           ///< Plane position (spatial splits) or bin/sweep index (object splits)
+        BoundingBox3f left, right;
+    };
+
+    static float area(const BoundingBox3f &bbox) {
+        return bbox.isValid() ? bbox.getSurfaceArea() : 0.f;
+    }
+
+    static float center(const Reference &ref, int axis) {
+        return 0.5f * (ref.bbox.min[axis] + ref.bbox.max[axis]);
+    }
+
+    float splitCost(const BoundingBox3f &node, uint32_t nLeft, float aLeft, uint32_t nRight, float aRight) const {
+        return 2.0f * TRAVERSAL_COST +
+            INTERSECTION_COST * (nLeft * aLeft + nRight * aRight) / node.getSurfaceArea();
+    }
+
+    /// Return the part of a reference that lies inside \c clip
+    BoundingBox3f clipReference(const Reference &ref, const BoundingBox3f &clip) const {
+        BoundingBox3f bounds = ref.bbox;
+        bounds.clip(clip);
+        if (!bounds.isValid())
+            return bounds;
+        uint32_t idx = ref.prim;
+        const Shape *shape = bvh.m_shapes[bvh.findShape(idx)];
+        BoundingBox3f result = shape->getClippedBoundingBox(idx, bounds);
+        result.clip(bounds);
+        return result;
+    }
+
+    /// Split a reference at an axis-aligned plane
+    void splitReference(const Reference &ref, int axis, float position, Reference &left, Reference &right) const {
+        BoundingBox3f leftClip = ref.bbox, rightClip = ref.bbox;
+        leftClip.max[axis] = position;
+        rightClip.min[axis] = position;
+        left = Reference { ref.prim, clipReference(ref, leftClip) };
+        right = Reference { ref.prim, clipReference(ref, rightClip) };
+    }
+
+    /// Find the best object partition (binned, or exhaustive for small nodes)
+    Split findObjectSplit(std::vector<Reference> &refs, const BoundingBox3f &bbox) const {
+        Split best;
+        uint32_t size = (uint32_t) refs.size();
+
+        if (size < SWEEP_THRESHOLD) {
+            std::vector<float> leftAreas(size);
+            for (int axis = 0; axis < 3; ++axis) {
+                std::sort(refs.begin(), refs.end(), [&](const Reference &r1, const Reference &r2) {
+                    return center(r1, axis) < center(r2, axis);
+                });
+
+                BoundingBox3f left;
+                for (uint32_t i = 0; i < size; ++i) {
+                    left.expandBy(refs[i].bbox);
+                    leftAreas[i] = left.getSurfaceArea();
+                }
+
+                BoundingBox3f right;
+                for (uint32_t i = size - 1; i >= 1; --i) {
+                    right.expandBy(refs[i].bbox);
+                    float cost = splitCost(bbox, i, leftAreas[i - 1], size - i, right.getSurfaceArea());
+                    if (cost < best.cost) {
+                        best.cost = cost;
+                        best.axis = axis;
+                        best.position = (float) i;
+                    }
+                }
+            }
+
+            if (best.axis >= 0) {
+                std::sort(refs.begin(), refs.end(), [&](const Reference &r1, const Reference &r2) {
+                    return center(r1, best.axis) < center(r2, best.axis);
+                });
+                uint32_t index = (uint32_t) best.position;
+                for (uint32_t i = 0; i < size; ++i)
+                    (i < index ? best.left : best.right).expandBy(refs[i].bbox);
+            }
+            return best;
+        }
+
+        BoundingBox3f centroids;
+        for (const Reference &ref : refs)
+            centroids.expandBy(ref.bbox.getCenter());
+
+        for (int axis = 0; axis < 3; ++axis) {
+            float min = centroids.min[axis], extent = centroids.max[axis] - min;
+            if (!(extent > 0))
+                continue;
+            float invBinSize = BIN_COUNT / extent;
+
+            uint32_t counts[BIN_COUNT] = { };
+            BoundingBox3f bins[BIN_COUNT];
+            for (const Reference &ref : refs) {
+                int index = std::min((int) ((center(ref, axis) - min) * invBinSize), BIN_COUNT - 1);
+                counts[index]++;
+                bins[index].expandBy(ref.bbox);
+            }
+
+            BoundingBox3f right[BIN_COUNT];
+            right[BIN_COUNT - 1] = bins[BIN_COUNT - 1];
+            for (int i = BIN_COUNT - 2; i >= 0; --i)
+                right[i] = BoundingBox3f::merge(right[i + 1], bins[i]);
+
+            BoundingBox3f left;
+            uint32_t nLeft = 0;
+            for (int i = 0; i < BIN_COUNT - 1; ++i) {
+                left.expandBy(bins[i]);
+                nLeft += counts[i];
+                if (nLeft == 0 || nLeft == size)
+                    continue;
+                float cost = splitCost(bbox, nLeft, area(left), size - nLeft, area(right[i + 1]));
+                if (cost < best.cost) {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.position = (float) i;
+                    best.left = left;
+                    best.right = right[i + 1];
+                }
+            }
+        }
+        return best;
+    }
+
+    /// Find the best spatial split using binning along all three axes
+    Split findSpatialSplit(const std::vector<Reference> &refs, const BoundingBox3f &bbox) const {
+        Split best;
+
+        for (int axis = 0; axis < 3; ++axis) {
+            float origin = bbox.min[axis], extent = bbox.max[axis] - origin;
+            if (!(extent > 0))
+                continue;
+            float binSize = extent / BIN_COUNT, invBinSize = BIN_COUNT / extent;
+
+            uint32_t entering[BIN_COUNT] = { }, exiting[BIN_COUNT] = { };
+            BoundingBox3f bins[BIN_COUNT];
+
+            for (const Reference &ref : refs) {
+                int first = std::max(0, std::min((int) ((ref.bbox.min[axis] - origin) * invBinSize), BIN_COUNT - 1));
+                int last  = std::max(first, std::min((int) ((ref.bbox.max[axis] - origin) * invBinSize), BIN_COUNT - 1));
+
+                if (first == last) {
+                    bins[first].expandBy(ref.bbox);
+                } else {
+                    /* Clip the reference against every bin it overlaps */
+                    for (int i = first; i <= last; ++i) {
+                        BoundingBox3f slab = bbox;
+                        slab.min[axis] = origin + i * binSize;
+                        if (i + 1 < BIN_COUNT)
+                            slab.max[axis] = origin + (i + 1) * binSize;
+                        BoundingBox3f clipped = clipReference(ref, slab);
+                        if (clipped.isValid())
+                            bins[i].expandBy(clipped);
+                    }
+                }
+                entering[first]++;
+                exiting[last]++;
+            }
+
+            BoundingBox3f right[BIN_COUNT];
+            uint32_t nRight[BIN_COUNT];
+            right[BIN_COUNT - 1] = bins[BIN_COUNT - 1];
+            nRight[BIN_COUNT - 1] = exiting[BIN_COUNT - 1];
+            for (int i = BIN_COUNT - 2; i >= 0; --i) {
+                right[i] = BoundingBox3f::merge(right[i + 1], bins[i]);
+                nRight[i] = nRight[i + 1] + exiting[i];
+            }
+
+            BoundingBox3f left;
+            uint32_t nLeft = 0;
+            for (int i = 0; i < BIN_COUNT - 1; ++i) {
+                left.expandBy(bins[i]);
+                nLeft += entering[i];
+                if (nLeft == 0 || nRight[i + 1] == 0)
+                    continue;
+                float cost = splitCost(bbox, nLeft, area(left), nRight[i + 1], area(right[i + 1]));
+                if (cost < best.cost) {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.position = origin + (i + 1) * binSize;
+                    best.left = left;
+                    best.right = right[i + 1];
+                }
+            }
+        }
+        return best;
+    }
+
+    /// Distribute the references of a node according to an object split
+    void partitionObjects(std::vector<Reference> &refs, const Split &split,
+                          std::vector<Reference> &left, std::vector<Reference> &right) const {
+        if (refs.size() < SWEEP_THRESHOLD) {
+            /* 'refs' is already sorted along the split axis */
+            uint32_t index = (uint32_t) split.position;
+            left.assign(refs.begin(), refs.begin() + index);
+            right.assign(refs.begin() + index, refs.end());
+            return;
+        }
+
+        BoundingBox3f centroids;
+        for (const Reference &ref : refs)
+            centroids.expandBy(ref.bbox.getCenter());
+        float min = centroids.min[split.axis];
+        float invBinSize = BIN_COUNT / (centroids.max[split.axis] - min);
+
+        for (const Reference &ref : refs) {
+            int index = std::min((int) ((center(ref, split.axis) - min) * invBinSize), BIN_COUNT - 1);
+            (index <= (int) split.position ? left : right).push_back(ref);
+        }
+    }
+
+    /**
+     * \brief Distribute the references of a node according to a spatial split
+     *
+     * Straddling references are split unless moving them entirely to
+     * one side is cheaper ("reference unsplitting").
+     */
+    void partitionSpatial(std::vector<Reference> &refs, const Split &split,
+                          std::vector<Reference> &left, std::vector<Reference> &right) {
+        int axis = split.axis;
+        BoundingBox3f leftBox, rightBox;
+        std::vector<Reference> straddling;
+
+        for (const Reference &ref : refs) {
+            if (ref.bbox.max[axis] <= split.position) {
+                left.push_back(ref);
+                leftBox.expandBy(ref.bbox);
+            } else if (ref.bbox.min[axis] >= split.position) {
+                right.push_back(ref);
+                rightBox.expandBy(ref.bbox);
+            } else {
+                straddling.push_back(ref);
+            }
+        }
+
+        for (const Reference &ref : straddling) {
+            Reference l, r;
+            splitReference(ref, axis, split.position, l, r);
+
+            float nLeft = (float) left.size(), nRight = (float) right.size();
+            float costSplit = area(BoundingBox3f::merge(leftBox, l.bbox)) * (nLeft + 1) +
+                              area(BoundingBox3f::merge(rightBox, r.bbox)) * (nRight + 1);
+            float costLeft  = area(BoundingBox3f::merge(leftBox, ref.bbox)) * (nLeft + 1) +
+                              area(rightBox) * nRight;
+            float costRight = area(leftBox) * nLeft +
+                              area(BoundingBox3f::merge(rightBox, ref.bbox)) * (nRight + 1);
+
+            bool duplicate = l.bbox.isValid() && r.bbox.isValid() &&
+                costSplit < costLeft && costSplit < costRight &&
+                m_references < m_maxReferences;
+
+            if (duplicate) {
+                left.push_back(l);
+                right.push_back(r);
+                leftBox.expandBy(l.bbox);
+                rightBox.expandBy(r.bbox);
+                m_references++;
+            } else if (!r.bbox.isValid() || (l.bbox.isValid() && costLeft <= costRight)) {
+                left.push_back(ref);
+                leftBox.expandBy(ref.bbox);
+            } else {
+                right.push_back(ref);
+                rightBox.expandBy(ref.bbox);
+            }
+        }
+    }
+
+    /// Recursively build the subtree for a set of references, returns its node index
+    uint32_t buildNode(std::vector<Reference> &refs, int depth) {
+        uint32_t node_idx = (uint32_t) bvh.m_nodes.size();
+        bvh.m_nodes.push_back(BVH::BVHNode());
+
+        BoundingBox3f bbox;
+        for (const Reference &ref : refs)
+            bbox.expandBy(ref.bbox);
+        bvh.m_nodes[node_idx].bbox = bbox;
+
+        uint32_t size = (uint32_t) refs.size();
+        float leafCost = (float) INTERSECTION_COST * size;
+
+        Split objectSplit, spatialSplit;
+        if (size > 1 && depth < MAX_DEPTH && bbox.getSurfaceArea() > 0) {
+            objectSplit = findObjectSplit(refs, bbox);
+
+            /* Only look for a spatial split if the object split leaves overlapping children */
+            if (objectSplit.axis >= 0 && m_references < m_maxReferences) {
+                BoundingBox3f overlap = objectSplit.left;
+                overlap.clip(objectSplit.right);
+                if (area(overlap) > OVERLAP_THRESHOLD * m_rootArea)
+                    spatialSplit = findSpatialSplit(refs, bbox);
+            }
+        }
+
+        std::vector<Reference> left, right;
+        if (spatialSplit.cost < objectSplit.cost && spatialSplit.cost < leafCost) {
+            partitionSpatial(refs, spatialSplit, left, right);
+
+            /* Unsplitting may have moved everything to one side */
+            if (left.empty() || right.empty()) {
+                left.clear();
+                right.clear();
+            } else {
+                objectSplit.axis = spatialSplit.axis;
+            }
+        }
+        if (left.empty() && objectSplit.axis >= 0 && objectSplit.cost < leafCost)
+            partitionObjects(refs, objectSplit, left, right);
+
+        if (left.empty() || right.empty()) {
+            /* Splitting does not reduce the cost, make a leaf */
+            BVH::BVHNode &node = bvh.m_nodes[node_idx];
+            node.leaf.flag = 1;
+            node.leaf.start = (uint32_t) bvh.m_indices.size();
+            node.leaf.size = size;
+            for (const Reference &ref : refs)
+                bvh.m_indices.push_back(ref.prim);
+            return node_idx;
+        }
+
+        /* Release the memory of this level before descending */
+        std::vector<Reference>().swap(refs);
+
+        bvh.m_nodes[node_idx].inner.axis = objectSplit.axis;
+        bvh.m_nodes[node_idx].inner.flag = 0;
+        uint32_t left_idx = buildNode(left, depth + 1);
+        uint32_t right_idx = buildNode(right, depth + 1);
+        bvh.m_nodes[node_idx].inner.leftChild = left_idx;
+        bvh.m_nodes[node_idx].inner.rightChild = right_idx;
+        return node_idx;
+    }
+
+    BVH &bvh;
+    float m_budget;
+    float m_rootArea = 0.f;
+    uint32_t m_references = 0;
+    uint32_t m_maxReferences = 0;
+};
+
+uint32_t BVH::buildSpatialSplits() {
+    return SBVHBuilder(*this, m_splitBudget).build();
+}
+
+NORI_NAMESPACE_END
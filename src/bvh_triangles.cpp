@@ -0,0 +1,343 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bvh.h>
+#include <nori/mesh.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+/*
+ * Leaf intersection kernels. After construction, the primitives are
+ * copied into SoA blocks that follow the order of m_indices, so the
+ * primitives of a leaf occupy one or two consecutive blocks. Each
+ * block is tested with a SIMD version of the Moeller-Trumbore
+ * algorithm that performs the same operations as Mesh::rayIntersect().
+ * Candidate hits are passed to the optional any-hit filter lane by lane,
+ * in the same order as the sequential test would find them. When the
+ * blocks are paged (see bvh_paging.cpp), the leaf tests pin the cluster
+ * of the current block and load it first if it is not resident.
+ *
+ * The blocks can be disabled to save their memory, in which case the
+ * leaf tests fall back to one Shape::rayIntersect() call per primitive.
+ */
+
+NORI_NAMESPACE_BEGIN
+
+typedef SimdFloat<NORI_SIMD_WIDTH> FloatN;
+
+void BVH::packTriangles() {
+    const uint32_t K = TRIANGLE_BLOCK_SIZE;
+    uint32_t size = (uint32_t) m_indices.size();
+    m_triangles.resize((size + K - 1) / K);
+
+    /* Resolve the type of every shape once instead of for every lane */
+    std::vector<const Mesh *> meshes(m_shapes.size());
+    for (size_t i = 0; i < m_shapes.size(); ++i)
+        meshes[i] = dynamic_cast<const Mesh *>(m_shapes[i]);
+
+    tbb::parallel_for(
+        tbb::blocked_range<uint32_t>(0u, (uint32_t) m_triangles.size()),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t b = range.begin(); b != range.end(); ++b) {
+                TriangleBlock &block = m_triangles[b];
+                memset(&block, 0, sizeof(TriangleBlock));
+
+                for (uint32_t lane = 0; lane < K && b * K + lane < size; ++lane) {
+                    uint32_t idx = m_indices[b * K + lane];
+                    uint32_t shapeIdx = findShape(idx);
+                    block.shape[lane] = shapeIdx;
+                    block.index[lane] = idx;
+
+                    const Mesh *mesh = meshes[shapeIdx];
+                    if (!mesh) {
+                        /* Zero edges make the triangle test reject this lane */
+                        block.virtualMask |= 1u << lane;
+                        continue;
+                    }
+
+                    const MatrixXf &V = mesh->getVertexPositions();
+                    const Point3f p0 = V.col(mesh->getVertexIndex(idx, 0)),
+                                  p1 = V.col(mesh->getVertexIndex(idx, 1)),
+                                  p2 = V.col(mesh->getVertexIndex(idx, 2));
+                    Vector3f edge1 = p1 - p0, edge2 = p2 - p0;
+                    for (int axis = 0; axis < 3; ++axis) {
+                        block.p0[axis][lane] = p0[axis];
+                        block.e1[axis][lane] = edge1[axis];
+                        block.e2[axis][lane] = edge2[axis];
+                    }
+                }
+            }
+        }
+    );
+}
+
+/**
+ * \brief Access to the triangle blocks of a leaf
+ *
+ * Without paging, this simply indexes the block array. Otherwise, the
+ * cluster that holds the current block stays pinned until a block of
+ * another cluster is needed or the leaf test is done, so every thread
+ * pins at most one cluster at a time.
+ */
+template <typename TriangleBlock> class LeafBlocks {
+public:
+    LeafBlocks(const TriangleBlock *blocks, const ClusterCache *pager,
+               const std::vector<uint32_t> &clusterStart)
+        : m_blocks(blocks), m_pager(pager), m_clusterStart(clusterStart) { }
+
+    ~LeafBlocks() {
+        if (m_cluster != INVALID)
+            m_pager->release(m_cluster);
+    }
+
+    const TriangleBlock &operator[](uint32_t b) {
+        if (!m_pager)
+            return m_blocks[b];
+
+        if (m_cluster == INVALID || b < m_first || b >= m_clusterStart[m_cluster + 1]) {
+            if (m_cluster != INVALID)
+                m_pager->release(m_cluster);
+            m_cluster = (uint32_t) (std::upper_bound(m_clusterStart.begin(),
+                m_clusterStart.end(), b) - m_clusterStart.begin()) - 1;
+            m_first = m_clusterStart[m_cluster];
+            m_data = (const TriangleBlock *) m_pager->acquire(m_cluster);
+        }
+        return m_data[b - m_first];
+    }
+
+private:
+    static const uint32_t INVALID = (uint32_t) -1;
+
+    const TriangleBlock *m_blocks;
+    const ClusterCache *m_pager;
+    const std::vector<uint32_t> &m_clusterStart;
+    const TriangleBlock *m_data = nullptr;
+    uint32_t m_cluster = INVALID, m_first = 0;
+};
+
+/// Bit mask of the lanes of block \c b that lie within <tt>[start, end)</tt>
+static inline uint32_t laneMask(uint32_t b, uint32_t start, uint32_t end) {
+    const uint32_t K = NORI_SIMD_WIDTH;
+    uint32_t first = start > b * K ? start - b * K : 0u;
+    uint32_t last = std::min(end - b * K, K);
+    return ((1u << last) - 1u) & ~((1u << first) - 1u);
+}
+
+/**
+ * \brief Moeller-Trumbore test of a ray against all lanes of a block
+ *
+ * Returns the mask of lanes that were hit within <tt>[mint, maxt]</tt>
+ * and writes their barycentric coordinates and distances.
+ */
+template <typename TriangleBlock>
+static inline uint32_t intersectBlock(const TriangleBlock &block, const Ray3f &ray,
+                                      FloatN &u, FloatN &v, FloatN &t) {
+    FloatN dx(ray.d.x()), dy(ray.d.y()), dz(ray.d.z());
+    FloatN e1x = FloatN::load(block.e1[0]), e1y = FloatN::load(block.e1[1]), e1z = FloatN::load(block.e1[2]);
+    FloatN e2x = FloatN::load(block.e2[0]), e2y = FloatN::load(block.e2[1]), e2z = FloatN::load(block.e2[2]);
+
+    /* Begin calculating determinant - also used to calculate U parameter */
+    FloatN px = dy * e2z - dz * e2y, py = dz * e2x - dx * e2z, pz = dx * e2y - dy * e2x;
+
+    /* If determinant is near zero, ray lies in plane of triangle */
+    FloatN det = e1x * px + e1y * py + e1z * pz;
+    uint32_t mask = maskLessEqual(det, FloatN(-1e-8f)) | maskLessEqual(FloatN(1e-8f), det);
+    if (!mask)
+        return 0u;
+    FloatN invDet = FloatN(1.0f) / det;
+
+    /* Calculate distance from v[0] to ray origin */
+    FloatN tx = FloatN(ray.o.x()) - FloatN::load(block.p0[0]),
+           ty = FloatN(ray.o.y()) - FloatN::load(block.p0[1]),
+           tz = FloatN(ray.o.z()) - FloatN::load(block.p0[2]);
+
+    /* Calculate U parameter and test bounds */
+    u = (tx * px + ty * py + tz * pz) * invDet;
+    mask &= maskLessEqual(FloatN(0.f), u) & maskLessEqual(u, FloatN(1.f));
+    if (!mask)
+        return 0u;
+
+    /* Calculate V parameter and test bounds */
+    FloatN qx = ty * e1z - tz * e1y, qy = tz * e1x - tx * e1z, qz = tx * e1y - ty * e1x;
+    v = (dx * qx + dy * qy + dz * qz) * invDet;
+    mask &= maskLessEqual(FloatN(0.f), v) & maskLessEqual(u + v, FloatN(1.f));
+    if (!mask)
+        return 0u;
+
+    /* Ray intersects triangle -> compute t */
+    t = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+    return mask & maskLessEqual(FloatN(ray.mint), t) & maskLessEqual(t, FloatN(ray.maxt));
+}
+
+bool BVH::rayIntersectLeaf(uint32_t start, uint32_t end, Ray3f &ray,
+                           Intersection &its, uint32_t &f, const HitFilter *filter) const {
+    if (!m_triangleBlocks)
+        return rayIntersectLeafScalar(start, end, ray, its, f, filter);
+
+    bool foundIntersection = false;
+    LeafBlocks<TriangleBlock> blocks(m_triangles.data(), m_pager.get(), m_clusterStart);
+
+    for (uint32_t b = start / TRIANGLE_BLOCK_SIZE; b * TRIANGLE_BLOCK_SIZE < end; ++b) {
+        const TriangleBlock &block = blocks[b];
+        uint32_t active = laneMask(b, start, end);
+
+        FloatN u, v, t;
+        uint32_t mask = intersectBlock(block, ray, u, v, t) & active;
+        if (mask) {
+            alignas(32) float uArray[TRIANGLE_BLOCK_SIZE], vArray[TRIANGLE_BLOCK_SIZE], tArray[TRIANGLE_BLOCK_SIZE];
+            u.store(uArray); v.store(vArray); t.store(tArray);
+
+            /* Keep the closest hit, like a sequential test of the lanes would */
+            while (mask) {
+                int lane = lowestBit(mask);
+                mask &= mask - 1;
+                if (tArray[lane] <= ray.maxt &&
+                    (!filter || (*filter)(m_shapes[block.shape[lane]], block.index[lane], ray,
+                                          Point2f(uArray[lane], vArray[lane]), tArray[lane]))) {
+                    foundIntersection = true;
+                    ray.maxt = its.t = tArray[lane];
+                    its.uv = Point2f(uArray[lane], vArray[lane]);
+                    its.mesh = m_shapes[block.shape[lane]];
+                    f = block.index[lane];
+                }
+            }
+        }
+
+        /* Remaining lanes hold other kinds of shapes */
+        mask = block.virtualMask & active;
+        while (mask) {
+            int lane = lowestBit(mask);
+            mask &= mask - 1;
+
+            const Shape *shape = m_shapes[block.shape[lane]];
+            float su, sv, st;
+            if (shape->rayIntersect(block.index[lane], ray, su, sv, st) &&
+                (!filter || (*filter)(shape, block.index[lane], ray, Point2f(su, sv), st))) {
+                foundIntersection = true;
+                ray.maxt = its.t = st;
+                its.uv = Point2f(su, sv);
+                its.mesh = shape;
+                f = block.index[lane];
+            }
+        }
+    }
+
+    return foundIntersection;
+}
+
+bool BVH::occludedLeaf(uint32_t start, uint32_t end, const Ray3f &ray, uint32_t &prim,
+                       const HitFilter *filter) const {
+    if (!m_triangleBlocks)
+        return occludedLeafScalar(start, end, ray, prim, filter);
+
+    LeafBlocks<TriangleBlock> blocks(m_triangles.data(), m_pager.get(), m_clusterStart);
+
+    for (uint32_t b = start / TRIANGLE_BLOCK_SIZE; b * TRIANGLE_BLOCK_SIZE < end; ++b) {
+        const TriangleBlock &block = blocks[b];
+        uint32_t active = laneMask(b, start, end);
+
+        FloatN u, v, t;
+        uint32_t mask = intersectBlock(block, ray, u, v, t) & active;
+        if (mask && !filter) {
+            prim = m_indices[b * TRIANGLE_BLOCK_SIZE + lowestBit(mask)];
+            return true;
+        } else if (mask) {
+            alignas(32) float uArray[TRIANGLE_BLOCK_SIZE], vArray[TRIANGLE_BLOCK_SIZE], tArray[TRIANGLE_BLOCK_SIZE];
+            u.store(uArray); v.store(vArray); t.store(tArray);
+
+            while (mask) {
+                int lane = lowestBit(mask);
+                mask &= mask - 1;
+                if ((*filter)(m_shapes[block.shape[lane]], block.index[lane], ray,
+                              Point2f(uArray[lane], vArray[lane]), tArray[lane])) {
+                    prim = m_indices[b * TRIANGLE_BLOCK_SIZE + lane];
+                    return true;
+                }
+            }
+        }
+
+        mask = block.virtualMask & active;
+        while (mask) {
+            int lane = lowestBit(mask);
+            mask &= mask - 1;
+
+            const Shape *shape = m_shapes[block.shape[lane]];
+            bool hit;
+            if (!filter) {
+                hit = shape->occluded(block.index[lane], ray);
+            } else {
+                float su, sv, st;
+                hit = shape->rayIntersect(block.index[lane], ray, su, sv, st) &&
+                      (*filter)(shape, block.index[lane], ray, Point2f(su, sv), st);
+            }
+            if (hit) {
+                prim = m_indices[b * TRIANGLE_BLOCK_SIZE + lane];
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+bool BVH::rayIntersectLeafScalar(uint32_t start, uint32_t end, Ray3f &ray,
+                                 Intersection &its, uint32_t &f, const HitFilter *filter) const {
+    bool foundIntersection = false;
+
+    for (uint32_t i = start; i < end; ++i) {
+        uint32_t idx = m_indices[i];
+        const Shape *shape = m_shapes[findShape(idx)];
+
+        float u, v, t;
+        if (shape->rayIntersect(idx, ray, u, v, t) &&
+            (!filter || (*filter)(shape, idx, ray, Point2f(u, v), t))) {
+            foundIntersection = true;
+            ray.maxt = its.t = t;
+            its.uv = Point2f(u, v);
+            its.mesh = shape;
+            f = idx;
+        }
+    }
+
+    return foundIntersection;
+}
+
+bool BVH::occludedLeafScalar(uint32_t start, uint32_t end, const Ray3f &ray, uint32_t &prim,
+                             const HitFilter *filter) const {
+    for (uint32_t i = start; i < end; ++i) {
+        uint32_t idx = m_indices[i];
+        const Shape *shape = m_shapes[findShape(idx)];
+
+        bool hit;
+        if (!filter) {
+            hit = shape->occluded(idx, ray);
+        } else {
+            float u, v, t;
+            hit = shape->rayIntersect(idx, ray, u, v, t) &&
+                  (*filter)(shape, idx, ray, Point2f(u, v), t);
+        }
+        if (hit) {
+            prim = m_indices[i];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,365 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bvh.h>
+#include <nori/simd.h>
+#include <tbb/parallel_for.h>
+
+/*
+ * Wide (4/8-ary) BVH support. The hierarchy is not built directly;
+ * instead, the binary SAH tree produced by BVH::build() is collapsed
+ * by repeatedly opening the child with the largest surface area until
+ * a node holds N children. The traversal then tests a ray against all
+ * N child boxes at once using the slab test on SoA data.
+ *
+ * Compressed nodes quantize the child boxes to 8 bits per plane. They
+ * are converted from the collapsed nodes and share their traversal
+ * code, which only accesses the boxes through Node::planes().
+ */
+
+NORI_NAMESPACE_BEGIN
+
+template <> MappedArray<BVH::WideNode<4>> &BVH::getWideNodes<4>() { return m_nodes4; }
+template <> MappedArray<BVH::WideNode<8>> &BVH::getWideNodes<8>() { return m_nodes8; }
+template <> const MappedArray<BVH::WideNode<4>> &BVH::getWideNodes<4>() const { return m_nodes4; }
+template <> const MappedArray<BVH::WideNode<8>> &BVH::getWideNodes<8>() const { return m_nodes8; }
+template <> MappedArray<BVH::CompressedNode<4>> &BVH::getCompressedNodes<4>() { return m_compressedNodes4; }
+template <> MappedArray<BVH::CompressedNode<8>> &BVH::getCompressedNodes<8>() { return m_compressedNodes8; }
+
+/// Mark all child slots of a wide node as unused
+template <typename WideNode> static void clearSlots(WideNode &node) {
+    for (int axis = 0; axis < 3; ++axis) {
+        std::fill(std::begin(node.lower[axis]), std::end(node.lower[axis]),
+                   std::numeric_limits<float>::infinity());
+        std::fill(std::begin(node.upper[axis]), std::end(node.upper[axis]),
+                  -std::numeric_limits<float>::infinity());
+    }
+    memset(node.child, 0, sizeof(node.child));
+    memset(node.count, 0, sizeof(node.count));
+}
+
+template <int N> void BVH::collapse() {
+    MappedArray<WideNode<N>> &nodes = getWideNodes<N>();
+    nodes.clear();
+
+    if (m_nodes.empty())
+        return;
+
+    if (m_nodes[0].isInner()) {
+        collapse<N>(0u);
+    } else {
+        /* Degenerate case: the entire tree is a single leaf */
+        WideNode<N> node;
+        clearSlots(node);
+        for (int axis = 0; axis < 3; ++axis) {
+            node.lower[axis][0] = m_nodes[0].bbox.min[axis];
+            node.upper[axis][0] = m_nodes[0].bbox.max[axis];
+        }
+        node.child[0] = m_nodes[0].start();
+        node.count[0] = m_nodes[0].leaf.size;
+        nodes.push_back(node);
+    }
+}
+
+template <int N> uint32_t BVH::collapse(uint32_t node_idx) {
+    MappedArray<WideNode<N>> &nodes = getWideNodes<N>();
+
+    /* Open up the child with the largest surface area until N slots are used */
+    uint32_t slots[N], slotCount = 2;
+    slots[0] = m_nodes[node_idx].inner.leftChild;
+    slots[1] = m_nodes[node_idx].inner.rightChild;
+
+    while (slotCount < N) {
+        int best = -1;
+        float bestArea = -1.f;
+        for (uint32_t i = 0; i < slotCount; ++i) {
+            const BVHNode &child = m_nodes[slots[i]];
+            if (child.isInner() && child.bbox.getSurfaceArea() > bestArea) {
+                bestArea = child.bbox.getSurfaceArea();
+                best = (int) i;
+            }
+        }
+        if (best < 0)
+            break;
+        uint32_t opened = slots[best];
+        slots[best] = m_nodes[opened].inner.leftChild;
+        slots[slotCount++] = m_nodes[opened].inner.rightChild;
+    }
+
+    uint32_t result = (uint32_t) nodes.size();
+    nodes.emplace_back();
+
+    WideNode<N> node;
+    clearSlots(node);
+
+    for (uint32_t i = 0; i < slotCount; ++i) {
+        const BVHNode &child = m_nodes[slots[i]];
+        for (int axis = 0; axis < 3; ++axis) {
+            node.lower[axis][i] = child.bbox.min[axis];
+            node.upper[axis][i] = child.bbox.max[axis];
+        }
+        if (child.isLeaf()) {
+            node.child[i] = child.start();
+            node.count[i] = child.leaf.size;
+        } else {
+            node.child[i] = collapse<N>(slots[i]);
+        }
+    }
+
+    /* 'nodes' may have been reallocated by the recursive calls */
+    nodes[result] = node;
+    return result;
+}
+
+/// Quantize the child bounding boxes of a wide node
+template <typename WideNode, typename CompressedNode>
+static void compressNode(const WideNode &node, CompressedNode &result) {
+    const int N = WideNode::Width;
+
+    for (int axis = 0; axis < 3; ++axis) {
+        float lo = std::numeric_limits<float>::infinity(),
+              hi = -std::numeric_limits<float>::infinity();
+        for (int i = 0; i < N; ++i) {
+            if (node.lower[axis][i] <= node.upper[axis][i]) {
+                lo = std::min(lo, node.lower[axis][i]);
+                hi = std::max(hi, node.upper[axis][i]);
+            }
+        }
+        if (!(lo <= hi))
+            lo = hi = 0.f;
+
+        /* Smallest power of two that covers the node with 255 steps */
+        int exponent;
+        std::frexp((hi - lo) / 255.f, &exponent);
+        float scale = std::ldexp(1.f, std::max(exponent, -126));
+        while (lo + 255.f * scale < hi)
+            scale *= 2.f;
+
+        result.origin[axis] = lo;
+        result.scale[axis] = scale;
+
+        for (int i = 0; i < N; ++i) {
+            float lower = node.lower[axis][i], upper = node.upper[axis][i];
+            if (!(lower <= upper)) {
+                result.lower[axis][i] = 255;
+                result.upper[axis][i] = 0;
+                continue;
+            }
+
+            /* Round outwards, checking against the decoding used by the traversal */
+            int qLower = std::min(std::max((int) std::floor((lower - lo) / scale), 0), 255);
+            int qUpper = std::min(std::max((int) std::ceil((upper - lo) / scale), 0), 255);
+            while (qLower > 0 && lo + (float) qLower * scale > lower)
+                qLower--;
+            while (qUpper < 255 && lo + (float) qUpper * scale < upper)
+                qUpper++;
+            result.lower[axis][i] = (uint8_t) qLower;
+            result.upper[axis][i] = (uint8_t) qUpper;
+        }
+    }
+
+    for (int i = 0; i < N; ++i) {
+        result.child[i] = node.child[i];
+        result.count[i] = node.count[i];
+    }
+}
+
+template <int N> void BVH::compress() {
+    MappedArray<WideNode<N>> &nodes = getWideNodes<N>();
+    std::vector<CompressedNode<N>> result(nodes.size());
+
+    tbb::parallel_for(
+        tbb::blocked_range<size_t>(0, nodes.size(), 1024),
+        [&](const tbb::blocked_range<size_t> &range) {
+            for (size_t i = range.begin(); i != range.end(); ++i)
+                compressNode(nodes[i], result[i]);
+        }
+    );
+
+    getCompressedNodes<N>() = std::move(result);
+    nodes.clear();
+    nodes.shrink_to_fit();
+}
+
+template <typename Node> bool BVH::rayIntersectWide(const MappedArray<Node> &nodes,
+        Ray3f &ray, Intersection &its, uint32_t &f, const HitFilter *filter) const {
+    const int N = Node::Width;
+    typedef SimdFloat<N> FloatN;
+
+    struct StackEntry {
+        uint32_t child, count;
+        float t;
+    };
+
+    if (nodes.empty())
+        return false;
+
+    /* Per-ray setup: clamp tiny direction components so that the slab
+       test never produces NaNs, and select the near/far planes based on
+       the direction signs. Empty child slots (+inf/-inf bounds) then
+       yield tNear = +inf and are rejected without a separate mask. */
+    FloatN org[3], rcp[3];
+    int nearPlane[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        float d = ray.d[axis];
+        if (std::abs(d) < 1e-20f)
+            d = std::copysign(1e-20f, d);
+        org[axis] = FloatN(ray.o[axis]);
+        rcp[axis] = FloatN(1.0f / d);
+        nearPlane[axis] = d >= 0 ? 0 : 1;
+    }
+
+    TraversalStats *stats = localStats();
+    if (stats)
+        stats->rays++;
+
+    StackEntry stack[64 * N];
+    uint32_t stack_idx = 0;
+    stack[stack_idx++] = StackEntry { 0u, 0u, -std::numeric_limits<float>::infinity() };
+
+    bool foundIntersection = false;
+
+    while (stack_idx > 0) {
+        const StackEntry entry = stack[--stack_idx];
+
+        /* The entry may have become irrelevant after a closer hit was found */
+        if (entry.t > ray.maxt)
+            continue;
+
+        if (entry.count > 0) {
+            if (stats)
+                stats->primitives += entry.count;
+            if (rayIntersectLeaf(entry.child, entry.child + entry.count, ray, its, f, filter))
+                foundIntersection = true;
+            continue;
+        }
+
+        const Node &node = nodes[entry.child];
+        if (stats)
+            stats->nodes++;
+
+        FloatN tNear(ray.mint), tFar(ray.maxt);
+        for (int axis = 0; axis < 3; ++axis) {
+            FloatN t0 = (node.planes(nearPlane[axis], axis)     - org[axis]) * rcp[axis];
+            FloatN t1 = (node.planes(1 - nearPlane[axis], axis) - org[axis]) * rcp[axis];
+            tNear = max(tNear, t0);
+            tFar  = min(tFar, t1);
+        }
+
+        uint32_t mask = maskLessEqual(tNear, tFar);
+        if (mask == 0)
+            continue;
+
+        alignas(32) float tNearArray[N];
+        tNear.store(tNearArray);
+
+        /* Push the intersected children so that the closest one is popped first */
+        uint32_t first = stack_idx;
+        while (mask) {
+            int i = lowestBit(mask);
+            mask &= mask - 1;
+
+            StackEntry child { node.child[i], node.count[i], tNearArray[i] };
+            uint32_t pos = stack_idx++;
+            while (pos > first && stack[pos - 1].t < child.t) {
+                stack[pos] = stack[pos - 1];
+                --pos;
+            }
+            stack[pos] = child;
+        }
+        assert(stack_idx <= 64 * N);
+    }
+
+    return foundIntersection;
+}
+
+template <typename Node> bool BVH::occludedWide(const MappedArray<Node> &nodes,
+        const Ray3f &ray, uint32_t &prim, const HitFilter *filter) const {
+    const int N = Node::Width;
+    typedef SimdFloat<N> FloatN;
+
+    struct StackEntry {
+        uint32_t child, count;
+    };
+
+    FloatN org[3], rcp[3];
+    int nearPlane[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        float d = ray.d[axis];
+        if (std::abs(d) < 1e-20f)
+            d = std::copysign(1e-20f, d);
+        org[axis] = FloatN(ray.o[axis]);
+        rcp[axis] = FloatN(1.0f / d);
+        nearPlane[axis] = d >= 0 ? 0 : 1;
+    }
+    const FloatN mint(ray.mint), maxt(ray.maxt);
+
+    TraversalStats *stats = localStats();
+
+    /* Any hit terminates the traversal, so children are visited in slot order */
+    StackEntry stack[64 * N];
+    uint32_t stack_idx = 0;
+    stack[stack_idx++] = StackEntry { 0u, 0u };
+
+    while (stack_idx > 0) {
+        const StackEntry entry = stack[--stack_idx];
+
+        if (entry.count > 0) {
+            if (occludedLeaf(entry.child, entry.child + entry.count, ray, prim, filter))
+                return true;
+            continue;
+        }
+
+        const Node &node = nodes[entry.child];
+        if (stats)
+            stats->shadowNodes++;
+
+        FloatN tNear(mint), tFar(maxt);
+        for (int axis = 0; axis < 3; ++axis) {
+            FloatN t0 = (node.planes(nearPlane[axis], axis)     - org[axis]) * rcp[axis];
+            FloatN t1 = (node.planes(1 - nearPlane[axis], axis) - org[axis]) * rcp[axis];
+            tNear = max(tNear, t0);
+            tFar  = min(tFar, t1);
+        }
+
+        uint32_t mask = maskLessEqual(tNear, tFar);
+        while (mask) {
+            int i = lowestBit(mask);
+            mask &= mask - 1;
+            stack[stack_idx++] = StackEntry { node.child[i], node.count[i] };
+        }
+        assert(stack_idx <= 64 * N);
+    }
+
+    return false;
+}
+
+template void BVH::collapse<4>();
+template void BVH::collapse<8>();
+template void BVH::compress<4>();
+template void BVH::compress<8>();
+template bool BVH::rayIntersectWide(const MappedArray<WideNode<4>> &, Ray3f &, Intersection &, uint32_t &, const HitFilter *) const;
+template bool BVH::rayIntersectWide(const MappedArray<WideNode<8>> &, Ray3f &, Intersection &, uint32_t &, const HitFilter *) const;
+template bool BVH::rayIntersectWide(const MappedArray<CompressedNode<4>> &, Ray3f &, Intersection &, uint32_t &, const HitFilter *) const;
+template bool BVH::rayIntersectWide(const MappedArray<CompressedNode<8>> &, Ray3f &, Intersection &, uint32_t &, const HitFilter *) const;
+template bool BVH::occludedWide(const MappedArray<WideNode<4>> &, const Ray3f &, uint32_t &, const HitFilter *) const;
+template bool BVH::occludedWide(const MappedArray<WideNode<8>> &, const Ray3f &, uint32_t &, const HitFilter *) const;
+template bool BVH::occludedWide(const MappedArray<CompressedNode<4>> &, const Ray3f &, uint32_t &, const HitFilter *) const;
+template bool BVH::occludedWide(const MappedArray<CompressedNode<8>> &, const Ray3f &, uint32_t &, const HitFilter *) const;
+
+NORI_NAMESPACE_END
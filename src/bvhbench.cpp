@@ -0,0 +1,411 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bvh.h>
+#include <nori/mesh.h>
+#include <nori/timer.h>
+#include <nori/warp.h>
+#include <pcg32.h>
+#include <tbb/parallel_for.h>
+#include <atomic>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Procedurally generated mesh for construction benchmarks
+ *
+ * Tessellates a sphere with a randomly displaced surface, which gives
+ * a large mesh with a realistic spatial distribution of triangles
+ * without requiring any external files. With \c compress, the attributes
+ * are stored in the compact representation (see \ref compressAttributes()).
+ */
+class BenchmarkMesh : public Mesh {
+public:
+    BenchmarkMesh(uint32_t triangleCount, bool compress) {
+        /* The grid has 2 * res * res triangles */
+        uint32_t res = std::max(2u, (uint32_t) std::ceil(std::sqrt(triangleCount / 2.f)));
+        pcg32 rng;
+
+        m_V.resize(3, (res + 1) * (res + 1));
+        for (uint32_t y = 0; y <= res; ++y) {
+            float theta = M_PI * y / res;
+            for (uint32_t x = 0; x <= res; ++x) {
+                float phi = 2 * M_PI * x / res;
+                float r = 1.f + 0.02f * rng.nextFloat();
+                Point3f p(r * std::sin(theta) * std::cos(phi),
+                          r * std::sin(theta) * std::sin(phi),
+                          r * std::cos(theta));
+                m_V.col(y * (res + 1) + x) = p;
+                m_bbox.expandBy(p);
+            }
+        }
+
+        m_F.resize(3, 2 * res * res);
+        for (uint32_t y = 0; y < res; ++y) {
+            for (uint32_t x = 0; x < res; ++x) {
+                uint32_t i0 = y * (res + 1) + x, i1 = i0 + 1,
+                         i2 = i0 + res + 1, i3 = i2 + 1,
+                         f = 2 * (y * res + x);
+                m_F(0, f) = i0; m_F(1, f) = i1; m_F(2, f) = i3;
+                m_F(0, f + 1) = i0; m_F(1, f + 1) = i3; m_F(2, f + 1) = i2;
+            }
+        }
+
+        /* Swap the first and the last triangle, so that the first and the
+           last index cluster span the whole vertex range. Above 2^16
+           vertices, they need the 32-bit fallback of the compact indices
+           while all other clusters stay 16-bit */
+        m_F.col(0).swap(m_F.col(m_F.cols() - 1));
+        m_compressAttributes = compress;
+        m_name = "benchmark";
+    }
+};
+
+/**
+ * \brief Measures the construction time of the BVH builders
+ *
+ * Builds a hierarchy over a large mesh several times for every requested
+ * builder, branching factor, node layout, node order and leaf test and
+ * reports the timings and the memory usage. When \c rays is nonzero, the throughput of
+ * closest-hit queries for rays between random points around and inside the
+ * mesh is measured as well. The mesh is either generated procedurally or
+ * loaded from one or more OBJ files, which are benchmarked one after another:
+ *
+ *     <test type="bvhbench">
+ *         <string name="filename" value="../pa1/sponza.obj, ../pa1/ajax.obj"/>
+ *         <string name="builders" value="sah, lbvh, hlbvh"/>
+ *         <string name="widths" value="2, 8"/>
+ *         <string name="layouts" value="full, compressed"/>
+ *         <string name="orders" value="depthfirst, treelet, veb"/>
+ *         <string name="leaves" value="blocks, scalar"/>
+ *         <integer name="rays" value="1000000"/>
+ *     </test>
+ *
+ * With the boolean property \c verify, every configuration is also checked
+ * against a binary SAH hierarchy with the default settings: the closest
+ * hits of single rays and of packets of 8 rays, and the results of shadow
+ * rays, must agree for \c rays rays, and the test fails otherwise.
+ * The boolean property \c compressAttributes stores the benchmarked meshes
+ * in the compact representation, which the verification then covers too.
+ */
+class BVHBenchmark : public NoriObject {
+public:
+    BVHBenchmark(const PropertyList &propList) {
+        /* OBJ files to load (a procedural mesh is used when empty) */
+        m_filenames = tokenize(propList.getString("filename", ""));
+        if (m_filenames.empty())
+            m_filenames.push_back("");
+
+        /* Size of the procedural mesh */
+        m_triangleCount = propList.getInteger("triangles", 1000000);
+
+        /* Builders ("sah", "sbvh", "lbvh" or "hlbvh") and branching factors to test */
+        m_builders = tokenize(propList.getString("builders", "sah"));
+        for (const std::string &builder : m_builders)
+            BVH::parseBuildMethod(builder);
+        for (auto width : tokenize(propList.getString("widths", "2")))
+            m_widths.push_back((int) toUInt(width));
+
+        /* Node layouts ("full" or "compressed") to test. Compressed
+           nodes are skipped for the binary hierarchy */
+        for (auto layout : tokenize(propList.getString("layouts", "full"))) {
+            if (layout != "full" && layout != "compressed")
+                throw NoriException("BVHBenchmark: unknown node layout \"%s\" (must be \"full\" or \"compressed\")", layout);
+            m_compressed.push_back(layout == "compressed");
+        }
+
+        /* Node orders ("depthfirst", "treelet" or "veb") to test */
+        m_orders = tokenize(propList.getString("orders", "depthfirst"));
+        for (const std::string &order : m_orders)
+            BVH::parseNodeOrder(order);
+
+        /* Leaf tests ("blocks": SIMD tests of the triangle blocks, or
+           "scalar": one Shape::rayIntersect() call per primitive) */
+        for (auto leaves : tokenize(propList.getString("leaves", "blocks"))) {
+            if (leaves != "blocks" && leaves != "scalar")
+                throw NoriException("BVHBenchmark: unknown leaf test \"%s\" (must be \"blocks\" or \"scalar\")", leaves);
+            m_triangleBlocks.push_back(leaves == "blocks");
+        }
+
+        /* Number of rays traced through the last hierarchy of every configuration */
+        m_rayCount = propList.getInteger("rays", 0);
+
+        /* Store the mesh attributes and indices in the compact
+           representation (the reference hierarchy does not) */
+        m_compressAttributes = propList.getBoolean("compressAttributes", false);
+
+        /* Number of builds per configuration */
+        m_runs = propList.getInteger("runs", 3);
+
+        /* Compare the hits of every configuration against a binary SAH hierarchy */
+        m_verify = propList.getBoolean("verify", false);
+
+        if (m_triangleCount <= 0 || m_runs <= 0 || m_rayCount < 0)
+            throw NoriException("BVHBenchmark: invalid triangle, run or ray count!");
+        if (m_verify && m_rayCount == 0)
+            throw NoriException("BVHBenchmark: verification needs a nonzero ray count!");
+    }
+
+    virtual void activate() override {
+        std::vector<std::string> results;
+        size_t failed = 0;
+
+        for (const std::string &filename : m_filenames) {
+            results.push_back(filename.empty() ? tfm::format("procedural mesh (%i triangles)",
+                m_triangleCount) : tfm::format("\"%s\"", filename));
+
+            std::unique_ptr<BVH> reference;
+            if (m_verify) {
+                reference.reset(new BVH());
+                Mesh *mesh = createMesh(filename, false);
+                mesh->activate();
+                reference->addShape(mesh);
+                reference->build();
+            }
+
+            for (const std::string &builder : m_builders) {
+                for (int width : m_widths) {
+                    for (bool compressed : m_compressed) {
+                        if (compressed && width == 2)
+                            continue;
+                        for (const std::string &order : m_orders) {
+                            for (bool blocks : m_triangleBlocks) {
+                                results.push_back(tfm::format("  %-5s width=%i %-10s %-10s %-6s: %s", builder,
+                                    width, compressed ? "compressed" : "full", order,
+                                    blocks ? "blocks" : "scalar",
+                                    run(filename, builder, width, compressed, order, blocks,
+                                        reference.get(), failed)));
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        cout << "------------------------------------------------------" << endl;
+        cout << "BVH construction (" << m_runs << (m_runs == 1 ? " run" : " runs")
+             << " per configuration):" << endl;
+        for (const std::string &result : results)
+            cout << "  " << result << endl;
+
+        if (failed > 0)
+            throw NoriException("BVHBenchmark: %i configurations disagree with the reference hierarchy!", failed);
+    }
+
+    virtual std::string toString() const override {
+        return tfm::format(
+            "BVHBenchmark[\n"
+            "  filenames = %i,\n"
+            "  triangles = %i,\n"
+            "  runs = %i,\n"
+            "  rays = %i,\n"
+            "  compressAttributes = %s,\n"
+            "  verify = %s\n"
+            "]",
+            m_filenames.size(),
+            m_triangleCount,
+            m_runs,
+            m_rayCount,
+            m_compressAttributes ? "yes" : "no",
+            m_verify ? "yes" : "no"
+        );
+    }
+
+    virtual EClassType getClassType() const override { return ETest; }
+
+private:
+    /**
+     * \brief Benchmark one configuration and return a summary of the results
+     *
+     * If \c reference is given, the hits are compared against it, and
+     * \c failed is incremented if they disagree.
+     */
+    std::string run(const std::string &filename, const std::string &builder,
+                    int width, bool compressed, const std::string &order, bool blocks,
+                    const BVH *reference, size_t &failed) const {
+        double best = std::numeric_limits<double>::infinity(), total = 0;
+        std::unique_ptr<BVH> bvh;
+
+        for (int run = 0; run < m_runs; ++run) {
+            /* The BVH owns its shapes, so every run needs a new mesh */
+            bvh.reset(new BVH());
+            bvh->setWidth(width);
+            bvh->setCompressed(compressed);
+            bvh->setBuildMethod(BVH::parseBuildMethod(builder));
+            bvh->setNodeOrder(BVH::parseNodeOrder(order));
+            bvh->setTriangleBlocks(blocks);
+            Mesh *mesh = createMesh(filename, m_compressAttributes);
+            mesh->activate();
+            bvh->addShape(mesh);
+
+            Timer timer;
+            bvh->build();
+            double elapsed = timer.elapsed();
+            best = std::min(best, elapsed);
+            total += elapsed;
+        }
+
+        std::string result = tfm::format(
+            "build best %s, average %s (%.2f M triangles/s), %s",
+            timeString(best, true), timeString(total / m_runs, true),
+            bvh->getPrimitiveCount() / (1000.0 * std::max(best, 1.0)),
+            memString(bvh->getMemoryUsage()));
+
+        if (m_rayCount > 0) {
+            double elapsed = trace(*bvh);
+            result += tfm::format(", %.2f M rays/s", m_rayCount / (1000.0 * std::max(elapsed, 1.0)));
+        }
+
+        if (reference) {
+            size_t mismatches[3];
+            verify(*bvh, *reference, mismatches);
+            if (mismatches[0] + mismatches[1] + mismatches[2] == 0) {
+                result += ", hits verified";
+            } else {
+                result += tfm::format(", MISMATCHES: %i closest hits, %i packet hits, %i shadow rays",
+                                      mismatches[0], mismatches[1], mismatches[2]);
+                ++failed;
+            }
+        }
+        return result;
+    }
+
+    /// Do two closest-hit queries agree?
+    static bool sameHit(bool hit1, const Intersection &its1, bool hit2, const Intersection &its2) {
+        if (hit1 != hit2)
+            return false;
+        return !hit1 || std::abs(its1.t - its2.t) <= 1e-5f * std::max(1.f, its2.t);
+    }
+
+    /**
+     * \brief Count the rays for which \c bvh and \c reference disagree
+     *
+     * The rays come in packets of 8 that start at the same point on the
+     * bounding sphere and go through nearby points of the box, so that
+     * the packets are mostly coherent. The closest hits of every ray are
+     * compared one by one and as a packet, and a shadow ray is traced up
+     * to the point of the box. \c mismatches receives the counts of these
+     * three queries.
+     */
+    void verify(const BVH &bvh, const BVH &reference, size_t mismatches[3]) const {
+        const BoundingBox3f &bbox = reference.getBoundingBox();
+        Point3f center = bbox.getCenter();
+        float radius = (bbox.max - center).norm();
+
+        std::vector<Ray3f> rays(((size_t) m_rayCount + 7) / 8 * 8);
+        pcg32 rng;
+        for (size_t i = 0; i < rays.size(); i += 8) {
+            Point3f o = center + radius * Warp::squareToUniformSphere(
+                Point2f(rng.nextFloat(), rng.nextFloat()));
+            Point3f target = bbox.min + bbox.getExtents().cwiseProduct(
+                Vector3f(rng.nextFloat(), rng.nextFloat(), rng.nextFloat()));
+            for (size_t lane = 0; lane < 8; ++lane) {
+                Vector3f jitter = 0.05f * bbox.getExtents().cwiseProduct(
+                    Vector3f(rng.nextFloat(), rng.nextFloat(), rng.nextFloat()) - Vector3f::Constant(0.5f));
+                Vector3f d = target + jitter - o;
+                rays[i + lane] = Ray3f(o, d.normalized(), Epsilon, d.norm());
+            }
+        }
+
+        std::atomic<size_t> closest(0), packet(0), shadow(0);
+        tbb::parallel_for(
+            tbb::blocked_range<size_t>(0, rays.size() / 8, 64),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i) {
+                    const Ray3f *packetRays = &rays[8 * i];
+                    Intersection packetIts[8];
+                    uint32_t packetHits = bvh.rayIntersect8(packetRays, packetIts);
+
+                    for (int lane = 0; lane < 8; ++lane) {
+                        const Ray3f &ray = packetRays[lane];
+                        Ray3f unbounded(ray.o, ray.d);
+                        Intersection refIts, its;
+                        bool refHit = reference.rayIntersect(unbounded, refIts),
+                             hit = bvh.rayIntersect(unbounded, its);
+                        if (!sameHit(hit, its, refHit, refIts))
+                            ++closest;
+
+                        Intersection refSegmentIts;
+                        bool refSegmentHit = reference.rayIntersect(ray, refSegmentIts);
+                        if (!sameHit((packetHits >> lane) & 1, packetIts[lane], refSegmentHit, refSegmentIts))
+                            ++packet;
+                        if (bvh.occluded(ray) != reference.occluded(ray))
+                            ++shadow;
+                    }
+                }
+            }
+        );
+        mismatches[0] = closest;
+        mismatches[1] = packet;
+        mismatches[2] = shadow;
+    }
+
+    /// Trace \ref m_rayCount rays in parallel and return the elapsed time in milliseconds
+    double trace(const BVH &bvh) const {
+        /* Rays start on the bounding sphere and go through a random point of the box */
+        const BoundingBox3f &bbox = bvh.getBoundingBox();
+        Point3f center = bbox.getCenter();
+        float radius = (bbox.max - center).norm();
+
+        std::vector<Ray3f> rays(m_rayCount);
+        pcg32 rng;
+        for (Ray3f &ray : rays) {
+            Point3f o = center + radius * Warp::squareToUniformSphere(
+                Point2f(rng.nextFloat(), rng.nextFloat()));
+            Point3f target = bbox.min + bbox.getExtents().cwiseProduct(
+                Vector3f(rng.nextFloat(), rng.nextFloat(), rng.nextFloat()));
+            ray = Ray3f(o, (target - o).normalized());
+        }
+
+        Timer timer;
+        tbb::parallel_for(
+            tbb::blocked_range<size_t>(0, rays.size(), 1024),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i) {
+                    Intersection its;
+                    bvh.rayIntersect(rays[i], its);
+                }
+            }
+        );
+        return timer.elapsed();
+    }
+
+    Mesh *createMesh(const std::string &filename, bool compress) const {
+        if (filename.empty())
+            return new BenchmarkMesh((uint32_t) m_triangleCount, compress);
+        PropertyList props;
+        props.setString("filename", filename);
+        props.setBoolean("compressAttributes", compress);
+        return static_cast<Mesh *>(NoriObjectFactory::createInstance("obj", props));
+    }
+
+    std::vector<std::string> m_filenames;
+    int m_triangleCount;
+    std::vector<std::string> m_builders;
+    std::vector<int> m_widths;
+    std::vector<bool> m_compressed;
+    std::vector<std::string> m_orders;
+    std::vector<bool> m_triangleBlocks;
+    bool m_compressAttributes;
+    int m_runs;
+    int m_rayCount;
+    bool m_verify;
+};
+
+NORI_REGISTER_CLASS(BVHBenchmark, "bvhbench");
+NORI_NAMESPACE_END
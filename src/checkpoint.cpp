@@ -0,0 +1,215 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/checkpoint.h>
+#include <filesystem/path.h>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+/*
+ * A checkpoint file consists of a header, the raw pixels of the image
+ * (four floats each, row by row and including the border), one record per
+ * tile, the queues of the scheduler, and the raw per-pixel statistics if
+ * the rendering keeps them. A tile record holds the number of finished
+ * samples per pixel, the number of active pixels and the size of the
+ * sampler state, followed by the state itself (which is empty for tiles
+ * that were not visited yet). Every queue is stored as its length followed
+ * by the indices of its tiles.
+ *
+ * Nothing in the file is converted, so checkpoints can only be resumed on
+ * machines with the same byte order and the same build.
+ */
+
+NORI_NAMESPACE_BEGIN
+
+/// Bump this whenever the file layout changes
+static const uint32_t CHECKPOINT_VERSION = 1;
+
+static const char CHECKPOINT_MAGIC[8] = { 'N', 'O', 'R', 'I', 'C', 'K', 'P', 'T' };
+
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t tileCount;
+    uint64_t key;
+    uint32_t rows;
+    uint32_t cols;
+    uint32_t hasStatistics;
+    uint32_t queueCount;
+    uint64_t finishedSamples;
+};
+
+struct CheckpointTile {
+    uint32_t samples;
+    uint32_t activePixels;
+    uint32_t samplerSize;
+};
+
+RenderCheckpoint::RenderCheckpoint(const std::string &filename, uint64_t key, float interval)
+    : m_filename(filename), m_key(key), m_interval(interval),
+      m_nextCapture(1000.0 * interval) { }
+
+RenderCheckpoint::~RenderCheckpoint() {
+    if (m_writer.joinable())
+        m_writer.join();
+}
+
+bool RenderCheckpoint::restore(ImageBlock &film, TileScheduler &scheduler, const Sampler &sampler,
+                               PixelStatistics *statistics) const {
+    if (!filesystem::path(m_filename).exists())
+        return false;
+
+    std::ifstream is(m_filename, std::ios::binary);
+    CheckpointHeader header;
+    is.read((char *) &header, sizeof(CheckpointHeader));
+    if (!is || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0 ||
+        header.version != CHECKPOINT_VERSION)
+        throw NoriException("\"%s\" is not a checkpoint of this version of Nori!", m_filename);
+    if (header.key != m_key || header.tileCount != scheduler.getTileCount() ||
+        header.rows != (uint32_t) film.rows() || header.cols != (uint32_t) film.cols() ||
+        (header.hasStatistics != 0) != (statistics != nullptr))
+        throw NoriException("The checkpoint \"%s\" was written for a different scene or "
+                            "different render settings!", m_filename);
+
+    /* Read everything before modifying the rendering */
+    ImageBlock::PlainObject pixels(film.rows(), film.cols());
+    is.read((char *) pixels.data(), (std::streamsize) (pixels.size() * sizeof(Color4f)));
+
+    std::vector<CheckpointTile> tiles(header.tileCount);
+    std::vector<std::unique_ptr<Sampler>> samplers(header.tileCount);
+    for (uint32_t i = 0; i < header.tileCount && is; ++i) {
+        is.read((char *) &tiles[i], sizeof(CheckpointTile));
+        if (!is || tiles[i].samplerSize == 0)
+            continue;
+        std::string state(tiles[i].samplerSize, '\0');
+        is.read(&state[0], (std::streamsize) state.size());
+        std::istringstream stateStream(state, std::ios::binary);
+        samplers[i] = sampler.clone();
+        samplers[i]->unserialize(stateStream);
+    }
+
+    std::vector<std::vector<uint32_t>> queues(header.queueCount);
+    for (uint32_t i = 0; i < header.queueCount && is; ++i) {
+        uint32_t length = 0;
+        is.read((char *) &length, sizeof(uint32_t));
+        if (!is || length > header.tileCount)
+            break;
+        queues[i].resize(length);
+        is.read((char *) queues[i].data(), (std::streamsize) (length * sizeof(uint32_t)));
+        for (uint32_t id : queues[i])
+            if (id >= header.tileCount)
+                throw NoriException("The checkpoint \"%s\" is corrupted!", m_filename);
+    }
+
+    std::unique_ptr<PixelStatistics> restoredStatistics;
+    if (statistics) {
+        restoredStatistics.reset(new PixelStatistics(*statistics));
+        restoredStatistics->unserialize(is);
+    }
+    if (!is)
+        throw NoriException("The checkpoint \"%s\" is truncated!", m_filename);
+
+    film.topLeftCorner(film.rows(), film.cols()) = pixels;
+    for (uint32_t i = 0; i < header.tileCount; ++i) {
+        TileScheduler::Tile &tile = scheduler.getTile(i);
+        tile.samples = tiles[i].samples;
+        tile.activePixels = tiles[i].activePixels;
+        tile.sampler = std::move(samplers[i]);
+    }
+    if (statistics)
+        *statistics = std::move(*restoredStatistics);
+    scheduler.restore(queues, header.finishedSamples);
+    return true;
+}
+
+void RenderCheckpoint::capture(const ImageBlock &film, TileScheduler &scheduler,
+                               const PixelStatistics *statistics) {
+    bool writing = false;
+    if (!m_writing.compare_exchange_strong(writing, true))
+        return;
+    if (m_writer.joinable())
+        m_writer.join();
+
+    std::ostringstream os(std::ios::binary);
+    {
+        /* Wait for the visits in progress and hold off new ones */
+        std::lock_guard<std::mutex> gate(m_gate);
+        std::unique_lock<std::shared_mutex> lock(m_visits);
+
+        CheckpointHeader header;
+        memset(&header, 0, sizeof(CheckpointHeader));
+        memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+        header.version = CHECKPOINT_VERSION;
+        header.tileCount = scheduler.getTileCount();
+        header.key = m_key;
+        header.rows = (uint32_t) film.rows();
+        header.cols = (uint32_t) film.cols();
+        header.hasStatistics = statistics ? 1 : 0;
+        header.queueCount = scheduler.getWorkerCount();
+        header.finishedSamples = scheduler.getFinishedSamples();
+        os.write((const char *) &header, sizeof(CheckpointHeader));
+        os.write((const char *) film.data(), (std::streamsize) (film.size() * sizeof(Color4f)));
+
+        for (uint32_t i = 0; i < scheduler.getTileCount(); ++i) {
+            const TileScheduler::Tile &tile = scheduler.getTile(i);
+            std::ostringstream state(std::ios::binary);
+            if (tile.sampler)
+                tile.sampler->serialize(state);
+            CheckpointTile record = { tile.samples, tile.activePixels, (uint32_t) state.str().size() };
+            os.write((const char *) &record, sizeof(CheckpointTile));
+            os << state.str();
+        }
+
+        for (uint32_t i = 0; i < scheduler.getWorkerCount(); ++i) {
+            std::vector<uint32_t> queue = scheduler.getQueue(i);
+            uint32_t length = (uint32_t) queue.size();
+            os.write((const char *) &length, sizeof(uint32_t));
+            os.write((const char *) queue.data(), (std::streamsize) (length * sizeof(uint32_t)));
+        }
+
+        if (statistics)
+            statistics->serialize(os);
+    }
+
+    m_nextCapture = m_timer.elapsed() + 1000.0 * m_interval;
+    m_writer = std::thread([this, data = os.str()] {
+        write(data);
+        m_writing = false;
+    });
+}
+
+void RenderCheckpoint::write(const std::string &data) {
+    std::string tempFilename = m_filename + ".tmp";
+    std::ofstream os(tempFilename, std::ios::binary);
+    os.write(data.data(), (std::streamsize) data.size());
+    os.close();
+
+    if (!os.good() || std::rename(tempFilename.c_str(), m_filename.c_str()) != 0) {
+        cerr << "Warning: could not write the checkpoint \"" << m_filename << "\"" << endl;
+        std::remove(tempFilename.c_str());
+    }
+}
+
+void RenderCheckpoint::remove() {
+    if (m_writer.joinable())
+        m_writer.join();
+    std::remove(m_filename.c_str());
+}
+
+NORI_NAMESPACE_END
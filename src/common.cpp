@@ -184,6 +184,48 @@ std::string memString(size_t size, bool precise) {
     return os.str();
 }
 
+/// Multiply two 64-bit numbers and fold the 128-bit product to 64 bits
+static inline uint64_t mulFold(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t product = (__uint128_t) a * b;
+    return (uint64_t) product ^ (uint64_t) (product >> 64);
+#else
+    uint64_t ll = (a & 0xFFFFFFFFu) * (b & 0xFFFFFFFFu), lh = (a & 0xFFFFFFFFu) * (b >> 32),
+             hl = (a >> 32) * (b & 0xFFFFFFFFu), hh = (a >> 32) * (b >> 32);
+    uint64_t mid = (ll >> 32) + (lh & 0xFFFFFFFFu) + (hl & 0xFFFFFFFFu);
+    uint64_t lo = (mid << 32) | (ll & 0xFFFFFFFFu);
+    uint64_t hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+    return lo ^ hi;
+#endif
+}
+
+uint64_t hashBytes(const void *data, size_t size, uint64_t hash) {
+    const uint64_t k0 = 0xa0761d6478bd642full, k1 = 0xe7037ed1a0b428dbull;
+    const uint8_t *ptr = (const uint8_t *) data;
+
+    /* Absorb 8 bytes at a time with a full-width multiply (as in wyhash),
+       so that every input bit affects all bits of the state */
+    hash = mulFold(hash ^ k0, (uint64_t) size ^ k1);
+    for (; size >= 8; ptr += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, ptr, 8);
+        hash = mulFold(hash ^ word ^ k0, k1);
+    }
+    if (size > 0) {
+        uint64_t word = 0;
+        memcpy(&word, ptr, size);
+        hash = mulFold(hash ^ word ^ k1, k0);
+    }
+
+    /* Finalizer of MurmurHash3 */
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
 filesystem::resolver *getFileResolver() {
     static filesystem::resolver *resolver = new filesystem::resolver();
     return resolver;
@@ -32,7 +32,13 @@ public:
     Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
         /* Find the surface that is visible in the requested direction */
         Intersection its;
-        if (!scene->rayIntersect(ray, its))
+        bool hit = scene->rayIntersect(ray, its);
+        return LiHit(scene, sampler, ray, its, hit);
+    }
+
+    Color3f LiHit(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                  const Intersection &its, bool hit) const {
+        if (!hit)
             return Color3f(0.0f); // No intersections, then return black
 
         Color3f Lo(0.0f);
@@ -58,6 +64,8 @@ public:
         return Lo; // outgoing radiance Lo
     }
 
+    bool supportsPrimaryHits() const { return true; }
+
     std::string toString() const {
         return tfm::format(
                 "DirectIntegrator[]");
@@ -32,7 +32,13 @@ public:
     Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
         /* Find the surface that is visible in the requested direction */
         Intersection its;
-        if (!scene->rayIntersect(ray, its))
+        bool hit = scene->rayIntersect(ray, its);
+        return LiHit(scene, sampler, ray, its, hit);
+    }
+
+    Color3f LiHit(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                  const Intersection &its, bool hit) const {
+        if (!hit)
             return Color3f(0.0f); // No intersections, then return black
 
         //outgoing radiance
@@ -62,6 +68,8 @@ public:
         return Lo;
     }
 
+    bool supportsPrimaryHits() const { return true; }
+
     std::string toString() const {
         return tfm::format(
                 "DirectEMSIntegrator[]");
@@ -32,7 +32,13 @@ public:
     Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
         /* Find the surface that is visible in the requested direction */
         Intersection its;
-        if (!scene->rayIntersect(ray, its))
+        bool hit = scene->rayIntersect(ray, its);
+        return LiHit(scene, sampler, ray, its, hit);
+    }
+
+    Color3f LiHit(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                  const Intersection &its, bool hit) const {
+        if (!hit)
             return Color3f(0.0f); // No intersections, then return black
 
         //outgoing radiance
@@ -55,18 +61,21 @@ public:
         eRec.shadowRay.mint = Epsilon;
 
         // intersection with emitter
-        if (scene->rayIntersect(eRec.shadowRay, its) && its.mesh->isEmitter()) {
+        Intersection emitterIts;
+        if (scene->rayIntersect(eRec.shadowRay, emitterIts) && emitterIts.mesh->isEmitter()) {
             // fill in properties of eRec
             // light source
-            eRec.p = its.p;
-            eRec.n = its.shFrame.n;
+            eRec.p = emitterIts.p;
+            eRec.n = emitterIts.shFrame.n;
             // incident radiance
-            Color3f Li = its.mesh->getEmitter()->eval(eRec);
+            Color3f Li = emitterIts.mesh->getEmitter()->eval(eRec);
             Lo += cosBsdfValue * Li;
         }
         return Lo;
     }
 
+    bool supportsPrimaryHits() const { return true; }
+
     std::string toString() const {
         return tfm::format(
                 "DirectMATSIntegrator[]");
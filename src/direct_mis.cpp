@@ -32,7 +32,13 @@ public:
     Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
         /* Find the surface that is visible in the requested direction */
         Intersection its1;
-        if (!scene->rayIntersect(ray, its1))
+        bool hit = scene->rayIntersect(ray, its1);
+        return LiHit(scene, sampler, ray, its1, hit);
+    }
+
+    Color3f LiHit(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                  const Intersection &its1, bool hit) const {
+        if (!hit)
             return Color3f(0.0f); // No intersections, then return black
 
         //outgoing radiance
@@ -120,6 +126,8 @@ public:
         return Lo;
     }
 
+    bool supportsPrimaryHits() const { return true; }
+
     std::string toString() const {
         return tfm::format(
                 "DirectMISIntegrator[]");
@@ -0,0 +1,211 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/block.h>
+#include <nori/rfilter.h>
+#include <nori/sampler.h>
+#include <nori/scheduler.h>
+#include <nori/timer.h>
+#include <chrono>
+#include <thread>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Measures the contention of merging image tiles into the film
+ *
+ * Renders an image with random sample values and the scheduling of the
+ * renderer (see \ref TileScheduler) on many threads, so that the time is
+ * dominated by merging the tiles into the full image. Every configuration
+ * is run with the locked \ref ImageBlock::put() and with
+ * \ref ImageBlock::putExclusive(), and the throughput as well as the share
+ * of the time that the threads spend merging are reported. The threads are
+ * created explicitly, so counts beyond the number of cores are possible:
+ *
+ *     <test type="filmbench">
+ *         <string name="threads" value="64, 128"/>
+ *         <string name="tileSizes" value="8, 32"/>
+ *         <integer name="sampleCount" value="16"/>
+ *     </test>
+ */
+class FilmBenchmark : public NoriObject {
+public:
+    FilmBenchmark(const PropertyList &propList) {
+        /* Size of the image */
+        m_size = Vector2i(propList.getInteger("width", 1920), propList.getInteger("height", 1080));
+
+        /* Thread counts and tile sizes to test */
+        for (auto threads : tokenize(propList.getString("threads", "64")))
+            m_threads.push_back(toUInt(threads));
+        for (auto tileSize : tokenize(propList.getString("tileSizes", "32")))
+            m_tileSizes.push_back((int) toUInt(tileSize));
+
+        /* Samples per pixel, and per visit of a tile */
+        m_sampleCount = propList.getInteger("sampleCount", 8);
+        m_samplesPerVisit = propList.getInteger("samplesPerVisit", 1);
+
+        if ((m_size.array() <= 0).any() || m_sampleCount <= 0 || m_samplesPerVisit <= 0)
+            throw NoriException("FilmBenchmark: invalid image size or sample count!");
+        for (uint32_t threads : m_threads)
+            if (threads == 0)
+                throw NoriException("FilmBenchmark: the thread counts must be positive!");
+        for (int tileSize : m_tileSizes)
+            if (tileSize <= 0)
+                throw NoriException("FilmBenchmark: the tile sizes must be positive!");
+    }
+
+    virtual void activate() override {
+        if (!m_filter) {
+            m_filter.reset(static_cast<ReconstructionFilter *>(
+                NoriObjectFactory::createInstance("gaussian", PropertyList())));
+            m_filter->activate();
+        }
+        m_sampler.reset(static_cast<Sampler *>(
+            NoriObjectFactory::createInstance("independent", PropertyList())));
+        m_sampler->activate();
+
+        std::vector<std::string> results;
+        for (uint32_t threads : m_threads) {
+            for (int tileSize : m_tileSizes) {
+                ImageBlock locked(m_size, m_filter.get()), exclusive(m_size, m_filter.get());
+                std::string lockedResult = run(threads, tileSize, false, locked);
+                std::string exclusiveResult = run(threads, tileSize, true, exclusive);
+
+                /* Both methods must produce the same image up to rounding */
+                float difference = 0.f, total = 0.f;
+                for (int y = 0; y < locked.rows(); ++y) {
+                    for (int x = 0; x < locked.cols(); ++x) {
+                        difference = std::max(difference, (locked(y, x) - exclusive(y, x)).abs().maxCoeff());
+                        total = std::max(total, locked(y, x).abs().maxCoeff());
+                    }
+                }
+
+                results.push_back(tfm::format("%3i threads, %2ix%-2i tiles:", threads, tileSize, tileSize));
+                results.push_back(tfm::format("  locked:    %s", lockedResult));
+                results.push_back(tfm::format("  exclusive: %s (relative difference %.1e)",
+                    exclusiveResult, difference / std::max(total, 1e-30f)));
+            }
+        }
+
+        cout << "------------------------------------------------------" << endl;
+        cout << "Film contention (" << m_size.x() << "x" << m_size.y() << " pixels, "
+             << m_sampleCount << " samples per pixel, " << m_samplesPerVisit
+             << " per visit):" << endl;
+        for (const std::string &result : results)
+            cout << "  " << result << endl;
+    }
+
+    virtual void addChild(NoriObject *obj) override {
+        if (obj->getClassType() != EReconstructionFilter)
+            throw NoriException("FilmBenchmark::addChild(<%s>) is not supported!",
+                                classTypeName(obj->getClassType()));
+        if (m_filter)
+            throw NoriException("FilmBenchmark: tried to register multiple reconstruction filters!");
+        m_filter.reset(static_cast<ReconstructionFilter *>(obj));
+    }
+
+    virtual std::string toString() const override {
+        return tfm::format(
+            "FilmBenchmark[\n"
+            "  size = %s,\n"
+            "  sampleCount = %i,\n"
+            "  samplesPerVisit = %i\n"
+            "]",
+            m_size.toString(),
+            m_sampleCount,
+            m_samplesPerVisit
+        );
+    }
+
+    virtual EClassType getClassType() const override { return ETest; }
+
+private:
+    /// Render the image into \c film and return a summary of the timings
+    std::string run(uint32_t threadCount, int tileSize, bool exclusive, ImageBlock &film) const {
+        TileScheduler scheduler(m_size, tileSize, (uint32_t) m_sampleCount,
+                                (uint32_t) m_samplesPerVisit, threadCount);
+        std::vector<double> mergeTime(threadCount, 0.0);
+        film.clear();
+
+        auto work = [&](uint32_t worker) {
+            ImageBlock block(Vector2i(tileSize), m_filter.get());
+            TileScheduler::Visit visit;
+            while (scheduler.next(worker, visit)) {
+                TileScheduler::Tile &tile = *visit.tile;
+                block.setOffset(tile.offset);
+                block.setSize(tile.size);
+                block.clear();
+                if (!tile.sampler) {
+                    tile.sampler = m_sampler->clone();
+                    tile.sampler->prepare(block);
+                }
+
+                Sampler *sampler = tile.sampler.get();
+                for (uint32_t k = visit.sampleBegin; k < visit.sampleEnd; ++k) {
+                    for (int y = 0; y < tile.size.y(); ++y) {
+                        for (int x = 0; x < tile.size.x(); ++x) {
+                            Point2f pixelSample = Point2f((float) (x + tile.offset.x()),
+                                (float) (y + tile.offset.y())) + sampler->next2D();
+                            block.put(pixelSample, Color3f(sampler->next1D()));
+                        }
+                    }
+                }
+
+                /* Timer only has a resolution of milliseconds */
+                auto start = std::chrono::steady_clock::now();
+                if (exclusive)
+                    film.putExclusive(block);
+                else
+                    film.put(block);
+                mergeTime[worker] += std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start).count();
+
+                uint32_t samples = visit.sampleEnd - visit.sampleBegin;
+                scheduler.finish(worker, visit, samples,
+                                 (uint64_t) tile.size.x() * tile.size.y() * samples);
+            }
+        };
+
+        Timer timer;
+        std::vector<std::thread> threads;
+        for (uint32_t i = 0; i < threadCount; ++i)
+            threads.emplace_back(work, i);
+        for (std::thread &thread : threads)
+            thread.join();
+        double elapsed = timer.elapsed();
+
+        double merging = 0;
+        for (double time : mergeTime)
+            merging += time;
+        double samples = (double) m_size.x() * m_size.y() * m_sampleCount;
+        return tfm::format("%s, %.2f M samples/s, %.1f%% of the thread time spent merging",
+            timeString(elapsed, true), samples / (1000.0 * std::max(elapsed, 1.0)),
+            100.0 * merging / std::max(elapsed * threadCount, 1e-9));
+    }
+
+    Vector2i m_size;
+    std::vector<uint32_t> m_threads;
+    std::vector<int> m_tileSizes;
+    int m_sampleCount;
+    int m_samplesPerVisit;
+    std::unique_ptr<ReconstructionFilter> m_filter;
+    std::unique_ptr<Sampler> m_sampler;
+};
+
+NORI_REGISTER_CLASS(FilmBenchmark, "filmbench");
+NORI_NAMESPACE_END
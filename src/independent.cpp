@@ -66,6 +66,16 @@ public:
         );
     }
 
+    virtual void serialize(std::ostream &os) const override {
+        os.write((const char *) &m_random.state, sizeof(uint64_t));
+        os.write((const char *) &m_random.inc, sizeof(uint64_t));
+    }
+
+    virtual void unserialize(std::istream &is) override {
+        is.read((char *) &m_random.state, sizeof(uint64_t));
+        is.read((char *) &m_random.inc, sizeof(uint64_t));
+    }
+
     virtual std::string toString() const override {
         return tfm::format("Independent[sampleCount=%i]", m_sampleCount);
     }
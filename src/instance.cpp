@@ -0,0 +1,259 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/shape.h>
+#include <nori/bvh.h>
+#include <nori/transform.h>
+#include <Eigen/Geometry>
+
+/*
+ * Two-level instancing. A <shapegroup> owns a set of shapes and builds a
+ * bottom-level BVH over them once. Each <instance> places the group with
+ * its own transformation and acts as a single primitive of the scene's
+ * (top-level) BVH, so memory scales with the unique geometry rather than
+ * with the number of placed copies:
+ *
+ *     <shapegroup id="chair">
+ *         <mesh type="obj"> ... </mesh>
+ *     </shapegroup>
+ *
+ *     <instance>
+ *         <ref id="chair"/>
+ *         <transform name="toWorld"> ... </transform>
+ *     </instance>
+ *
+ * Rays are transformed into object space without normalizing their
+ * direction, so distances along the ray agree in both spaces.
+ *
+ * The closest hit of a BVH query is the last hit that any shape reported
+ * to it, so an instance remembers (per thread) the primitive that its
+ * last successful intersection found, and the hit information reuses it
+ * instead of searching the group a second time. Queries that interleave
+ * rays (packets) or nest instances can overwrite this record; such hits
+ * are recognized by their ray and distance, and repeat the search over
+ * an open segment instead.
+ */
+
+NORI_NAMESPACE_BEGIN
+
+/// Object space hit that an instance found most recently on the current thread
+static thread_local struct {
+    const Shape *instance = nullptr; ///< Instance that found the hit
+    Point3f o;                      ///< World space ray of the query
+    Vector3f d;
+    float t = 0.f;
+    Point2f uv;                     ///< Barycentric coordinates within \c shape
+    const Shape *shape = nullptr;   ///< Shape of the group that was hit
+    uint32_t prim = 0;              ///< Primitive index within \c shape
+} lastHit;
+
+/// Group of shapes that can be placed several times via \ref Instance
+class ShapeGroup : public NoriObject {
+public:
+    ShapeGroup(const PropertyList &propList) {
+        m_bvh = new BVH();
+        m_bvh->setWidth(propList.getInteger("bvhWidth", 2));
+        m_bvh->setCompressed(propList.getBoolean("bvhCompressed", false));
+        m_bvh->setBuildMethod(BVH::parseBuildMethod(propList.getString("bvhBuilder", "sah")));
+        m_bvh->setNodeOrder(BVH::parseNodeOrder(propList.getString("bvhNodeOrder", "depthfirst")));
+        m_bvh->setTriangleBlocks(propList.getBoolean("bvhTriangleBlocks", true));
+    }
+
+    virtual ~ShapeGroup() {
+        delete m_bvh;
+    }
+
+    virtual void addChild(NoriObject *obj) override {
+        switch (obj->getClassType()) {
+            case EMesh: {
+                    Shape *shape = static_cast<Shape *>(obj);
+                    if (shape->isEmitter())
+                        throw NoriException("ShapeGroup: instanced emitters are not supported!");
+                    m_bvh->addShape(shape);
+                }
+                break;
+
+            default:
+                throw NoriException("ShapeGroup::addChild(<%s>) is not supported!",
+                                    classTypeName(obj->getClassType()));
+        }
+    }
+
+    virtual void activate() override {
+        if (m_bvh->getPrimitiveCount() == 0)
+            throw NoriException("ShapeGroup: the group is empty!");
+        m_bvh->build();
+
+        for (uint32_t i = 0; i < m_bvh->getShapeCount(); ++i) {
+            if (m_bvh->getShape(i)->isAlphaTested())
+                m_hitFilter = &Shape::alphaTest;
+        }
+    }
+
+    /// Return the bottom-level BVH over the shapes of this group
+    const BVH *getBVH() const { return m_bvh; }
+
+    /// Return the any-hit filter for queries of \ref getBVH() (\c nullptr if there is none)
+    const BVH::HitFilter *getHitFilter() const { return m_hitFilter ? &m_hitFilter : nullptr; }
+
+    virtual std::string toString() const override {
+        return tfm::format(
+            "ShapeGroup[\n"
+            "  shapes = %i,\n"
+            "  primitives = %i\n"
+            "]",
+            m_bvh->getShapeCount(),
+            m_bvh->getPrimitiveCount()
+        );
+    }
+
+    virtual EClassType getClassType() const override { return EShapeGroup; }
+
+private:
+    BVH *m_bvh = nullptr;
+    BVH::HitFilter m_hitFilter;
+};
+
+/// Placement of a \ref ShapeGroup with a per-instance transformation
+class Instance : public Shape {
+public:
+    Instance(const PropertyList &propList) {
+        m_toWorld = propList.getTransform("toWorld", Transform());
+        m_toObject = m_toWorld.inverse();
+    }
+
+    virtual void addChild(NoriObject *obj) override {
+        switch (obj->getClassType()) {
+            case EShapeGroup:
+                if (m_group)
+                    throw NoriException("Instance: tried to reference multiple shape groups!");
+                m_group = static_cast<ShapeGroup *>(obj);
+                break;
+
+            default:
+                throw NoriException("Instance::addChild(<%s>) is not supported!",
+                                    classTypeName(obj->getClassType()));
+        }
+    }
+
+    virtual void activate() override {
+        if (!m_group)
+            throw NoriException("Instance: no shape group was referenced!");
+
+        /* The shapes of the group provide the materials, so unlike other
+           shapes, instances do not receive a default BSDF */
+        const BoundingBox3f &bbox = m_group->getBVH()->getBoundingBox();
+        for (int i = 0; i < 8; ++i)
+            m_bbox.expandBy(m_toWorld * bbox.getCorner(i));
+    }
+
+    virtual BoundingBox3f getBoundingBox(uint32_t index) const override { return m_bbox; }
+
+    virtual Point3f getCentroid(uint32_t index) const override { return m_bbox.getCenter(); }
+
+    virtual bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const override {
+        Ray3f localRay = m_toObject * ray;
+        Intersection its;
+        uint32_t f;
+        if (!m_group->getBVH()->rayIntersectClosest(localRay, its, f, m_group->getHitFilter()))
+            return false;
+        u = its.uv.x();
+        v = its.uv.y();
+        t = its.t;
+
+        lastHit.instance = this;
+        lastHit.o = ray.o;
+        lastHit.d = ray.d;
+        lastHit.t = its.t;
+        lastHit.uv = its.uv;
+        lastHit.shape = its.mesh;
+        lastHit.prim = f;
+        return true;
+    }
+
+    virtual bool occluded(uint32_t index, const Ray3f &ray) const override {
+        return m_group->getBVH()->occluded(m_toObject * ray, m_group->getHitFilter());
+    }
+
+    virtual void setHitInformation(uint32_t index, const Ray3f &ray, Intersection &its) const override {
+        Ray3f localRay = m_toObject * ray;
+        Intersection localIts;
+        uint32_t f;
+        if (lastHit.instance == this && lastHit.t == its.t &&
+            lastHit.o == ray.o && lastHit.d == ray.d) {
+            localIts.t = lastHit.t;
+            localIts.uv = lastHit.uv;
+            localIts.mesh = lastHit.shape;
+            f = lastHit.prim;
+        } else {
+            /* Repeat the query in object space, which finds the same
+               primitive. The segment is left open, since the bounding boxes
+               of the group may reject a ray that ends exactly on a face */
+            Ray3f openRay(localRay, localRay.mint, std::numeric_limits<float>::infinity());
+            if (!m_group->getBVH()->rayIntersectClosest(openRay, localIts, f, m_group->getHitFilter()))
+                throw NoriException("Instance::setHitInformation(): the intersection could not be reproduced!");
+        }
+
+        /* Let the shape of the group fill in the complete record */
+        localIts.mesh->setHitInformation(f, localRay, localIts);
+
+        its.p = m_toWorld * localIts.p;
+        its.uv = localIts.uv;
+        its.mesh = localIts.mesh;
+        its.shFrame = toWorld(localIts.shFrame);
+        its.geoFrame = toWorld(localIts.geoFrame);
+    }
+
+    virtual void sampleSurface(ShapeQueryRecord &sRec, const Point2f &sample) const override {
+        throw NoriException("Instance::sampleSurface(): not supported!");
+    }
+
+    virtual float pdfSurface(const ShapeQueryRecord &sRec) const override {
+        throw NoriException("Instance::pdfSurface(): not supported!");
+    }
+
+    virtual std::string toString() const override {
+        return tfm::format(
+            "Instance[\n"
+            "  toWorld = %s,\n"
+            "  group = %s\n"
+            "]",
+            indent(m_toWorld.toString(), 12),
+            m_group ? indent(m_group->toString()) : std::string("null")
+        );
+    }
+
+private:
+    /// Transform an object space frame into world space, keeping the tangent direction
+    Frame toWorld(const Frame &frame) const {
+        Normal3f n = (m_toWorld * frame.n).normalized();
+        Vector3f s = m_toWorld * frame.s;
+        s -= n * n.dot(s);
+        if (s.squaredNorm() < 1e-12f)
+            return Frame(n);
+        s.normalize();
+        return Frame(s, n.cross(s), n);
+    }
+
+    Transform m_toWorld, m_toObject;
+    const ShapeGroup *m_group = nullptr;
+};
+
+NORI_REGISTER_CLASS(ShapeGroup, "shapegroup");
+NORI_REGISTER_CLASS(Instance, "instance");
+NORI_NAMESPACE_END
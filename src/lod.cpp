@@ -0,0 +1,181 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/lod.h>
+
+/*
+ * A level of detail (see src/simplify.cpp) is acceptable for a ray if
+ * its error is at most 'pixelError' pixels at the point where the ray
+ * enters the bounding box of the mesh. A ray that starts inside the box
+ * (e.g. a secondary ray that leaves a hit point) instead uses the point
+ * where the line of sight from the camera to its origin enters the box.
+ * For a hit point, that is where the camera ray that found it entered,
+ * so both rays measure the same distance. If the camera itself is inside
+ * the box, all of these rays use the full resolution. The size of a pixel
+ * there is the angle between neighboring camera rays times the distance
+ * to the camera. Each level fades in over one octave of distance: a ray
+ * uses it with a probability that grows from 0 to 1 while the tolerance
+ * grows from its error to twice its error.
+ *
+ * The random number that decides between two levels is a hash of the
+ * camera pixel through which the point is seen, rather than of the ray
+ * itself. Secondary rays that leave a hit point therefore make the same
+ * choice as the camera ray that found it, instead of hitting the other
+ * level just above the surface. Since the choice only depends on the ray
+ * origin and direction, the intersection and the hit information also
+ * agree on the level.
+ */
+
+NORI_NAMESPACE_BEGIN
+
+/// Map the cell of a grid over the unit vectors that contains \c d to a uniform number in [0, 1)
+static float ditherSample(const Vector3f &d, float cellSize) {
+    int32_t cell[3];
+    for (int i = 0; i < 3; ++i)
+        cell[i] = (int32_t) std::floor(d[i] / cellSize);
+    uint64_t hash = hashBytes(cell, sizeof(cell));
+    return (float) (hash >> 40) * (1.f / (float) (1u << 24));
+}
+
+LODShape::LODShape(Mesh *mesh, const BVH &settings) {
+    std::vector<std::unique_ptr<Mesh>> levels = mesh->releaseLevelsOfDetail();
+    m_bbox = mesh->Shape::getBoundingBox();
+
+    for (size_t i = 0; i <= levels.size(); ++i) {
+        Mesh *level = i == 0 ? mesh : levels[i - 1].release();
+        std::unique_ptr<BVH> bvh(new BVH());
+        bvh->setWidth(settings.getWidth());
+        bvh->setCompressed(settings.isCompressed());
+        bvh->setBuildMethod(settings.getBuildMethod());
+        bvh->setNodeOrder(settings.getNodeOrder());
+        bvh->setTriangleBlocks(settings.hasTriangleBlocks());
+        bvh->addShape(level);
+        bvh->build();
+        m_levels.push_back(std::move(bvh));
+        m_errors.push_back(level->getSimplificationError());
+    }
+
+    if (mesh->isAlphaTested())
+        m_hitFilter = &Shape::alphaTest;
+}
+
+LODShape::~LODShape() { }
+
+void LODShape::setCamera(const Point3f &position, float pixelAngle, float pixelError) {
+    m_cameraPosition = position;
+    m_pixelAngle = pixelAngle;
+    m_pixelError = pixelError;
+}
+
+uint32_t LODShape::selectLevel(const Ray3f &ray) const {
+    if (m_pixelAngle <= 0 || m_levels.size() == 1)
+        return 0;
+
+    float nearT, farT;
+    if (!m_bbox.contains(ray.o)) {
+        if (!m_bbox.rayIntersect(ray, nearT, farT))
+            return 0;
+        return selectLevel(ray(std::max(nearT, 0.f)));
+    }
+
+    /* Follow the line of sight from the camera to the origin instead */
+    if (m_bbox.contains(m_cameraPosition))
+        return 0;
+    Ray3f view(m_cameraPosition, ray.o - m_cameraPosition);
+    if (!m_bbox.rayIntersect(view, nearT, farT))
+        return selectLevel(ray.o);
+    return selectLevel(view(std::max(nearT, 0.f)));
+}
+
+uint32_t LODShape::selectLevel(const Point3f &p) const {
+    Vector3f toPoint = p - m_cameraPosition;
+    float distance = toPoint.norm();
+    if (!(distance > 0))
+        return 0;
+    float tolerance = distance * m_pixelAngle * m_pixelError;
+    float sample = ditherSample(toPoint / distance, m_pixelAngle);
+
+    uint32_t level = 0;
+    for (uint32_t i = 1; i < (uint32_t) m_levels.size(); ++i) {
+        float weight = m_errors[i] > 0
+            ? clamp(std::log2(tolerance / m_errors[i]), 0.f, 1.f) : 1.f;
+        if (sample >= weight)
+            break;
+        level = i;
+    }
+    return level;
+}
+
+bool LODShape::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const {
+    Ray3f levelRay(ray);
+    Intersection its;
+    uint32_t f;
+    if (!m_levels[selectLevel(ray)]->rayIntersectClosest(levelRay, its, f, getHitFilter()))
+        return false;
+    u = its.uv.x();
+    v = its.uv.y();
+    t = its.t;
+    return true;
+}
+
+bool LODShape::occluded(uint32_t index, const Ray3f &ray) const {
+    return m_levels[selectLevel(ray)]->occluded(ray, getHitFilter());
+}
+
+void LODShape::setHitInformation(uint32_t index, const Ray3f &ray, Intersection &its) const {
+    /* Repeat the query, which selects the same level and primitive. The
+       segment is left open, since the bounding boxes of the level may
+       reject a ray that ends exactly on a face of the box */
+    Ray3f levelRay(ray, ray.mint, std::numeric_limits<float>::infinity());
+    Intersection levelIts;
+    uint32_t f;
+    if (!m_levels[selectLevel(ray)]->rayIntersectClosest(levelRay, levelIts, f, getHitFilter()))
+        throw NoriException("LODShape::setHitInformation(): the intersection could not be reproduced!");
+    its.uv = levelIts.uv;
+    its.mesh = levelIts.mesh;
+    levelIts.mesh->setHitInformation(f, ray, its);
+}
+
+void LODShape::sampleSurface(ShapeQueryRecord &sRec, const Point2f &sample) const {
+    throw NoriException("LODShape::sampleSurface(): not supported!");
+}
+
+float LODShape::pdfSurface(const ShapeQueryRecord &sRec) const {
+    throw NoriException("LODShape::pdfSurface(): not supported!");
+}
+
+std::string LODShape::toString() const {
+    std::string levels;
+    for (size_t i = 0; i < m_levels.size(); ++i) {
+        levels += tfm::format("  %i triangles (error %f)", m_levels[i]->getPrimitiveCount(), m_errors[i]);
+        if (i + 1 < m_levels.size())
+            levels += ",";
+        levels += "\n";
+    }
+    return tfm::format(
+        "LODShape[\n"
+        "  levels = {\n"
+        "  %s  },\n"
+        "  mesh = %s\n"
+        "]",
+        indent(levels, 2),
+        indent(m_levels[0]->getShape(0)->toString())
+    );
+}
+
+NORI_NAMESPACE_END
@@ -58,10 +58,13 @@ bool run_gui(std::string filename, bool is_xml) {
 }
 
 
-bool render_headless(std::string filename, bool is_xml) {
+bool render_headless(std::string filename, bool is_xml, float timeBudget, float targetRMSE,
+                     float checkpointInterval, bool resume) {
     // TODOs - proper handling of an ctrl+z, progress bar, CL argument -b for headless
 	ImageBlock block(Vector2i(720, 720), nullptr);
 	RenderThread renderer(block);
+	renderer.setStopCriteria(timeBudget, targetRMSE);
+	renderer.setCheckpoints(checkpointInterval, resume);
 
     if (!filename.length()) {
         cerr << "Need to provide an input XML file to render in headless mode" << endl;
@@ -105,14 +108,28 @@ bool render_headless(std::string filename, bool is_xml) {
 }
 
 
+static const char *syntax = " [-b] [--time-budget <seconds>] [--target-rmse <error>]"
+                            " [--checkpoint <seconds>] [--resume] <scene.[xml|exr]>";
+
 int main(int argc, char **argv) {
     std::string filename = "";
     bool headless = false;
+    float timeBudget = 0.f, targetRMSE = 0.f, checkpointInterval = 0.f;
+    bool resume = false;
 
     for (int i = 1; i < argc; ++i) {
         std::string token(argv[i]);
         if (token == "--help") {
-            cout << "Syntax: " << argv[0] << "[-b] <scene.[xml|exr]>" <<  endl;
+            cout << "Syntax: " << argv[0] << syntax << endl;
+            cout << "  --time-budget <seconds>  Render until the time (including loading) runs out" << endl;
+            cout << "  --target-rmse <error>    Render until the estimated RMSE of the luminance is reached" << endl;
+            cout << "  --checkpoint <seconds>   Save a checkpoint of the rendering at this interval (default: 0, none)" << endl;
+            cout << "  --resume                 Continue from the checkpoint of an interrupted rendering. The result" << endl;
+            cout << "                           is bit for bit the one of an uninterrupted rendering only with a" << endl;
+            cout << "                           single worker thread: with more, pixels shared by neighboring tiles" << endl;
+            cout << "                           are rounded in a timing-dependent order, which with adaptive sampling" << endl;
+            cout << "                           can also change which pixels receive further samples." << endl;
+            cout << "All of these options imply -b. The first two replace the sample count of the scene." << endl;
             return 0;
         }
         
@@ -121,11 +138,47 @@ int main(int argc, char **argv) {
             continue;
         }
 
+        if (token == "--time-budget" || token == "--target-rmse") {
+            float value = 0.f;
+            try {
+                if (i + 1 < argc)
+                    value = toFloat(argv[++i]);
+            } catch (const std::exception &) { }
+            if (!(value > 0) || !std::isfinite(value)) {
+                cerr << "Error: " << token << " expects a positive number" << endl;
+                return -1;
+            }
+            (token == "--time-budget" ? timeBudget : targetRMSE) = value;
+            headless = true;
+            continue;
+        }
+
+        if (token == "--checkpoint") {
+            float value = -1.f;
+            try {
+                if (i + 1 < argc)
+                    value = toFloat(argv[++i]);
+            } catch (const std::exception &) { }
+            if (!(value >= 0) || !std::isfinite(value)) {
+                cerr << "Error: " << token << " expects a non-negative number" << endl;
+                return -1;
+            }
+            checkpointInterval = value;
+            headless = true;
+            continue;
+        }
+
+        if (token == "--resume") {
+            resume = true;
+            headless = true;
+            continue;
+        }
+
         if (!filename.length()) {
             filename = token;
             continue;
         } else {
-            cerr << "Syntax: " << argv[0] << "[-b] <scene.[xml|exr]>" <<  endl;
+            cerr << "Syntax: " << argv[0] << syntax << endl;
             return -1;
         }
     }
@@ -153,7 +206,7 @@ int main(int argc, char **argv) {
 #endif
 
     if (headless) {
-        return render_headless(filename, is_xml);
+        return render_headless(filename, is_xml, timeBudget, targetRMSE, checkpointInterval, resume);
     } else {
         return run_gui(filename, is_xml);
     }
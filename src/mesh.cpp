@@ -20,21 +20,460 @@
 #include <nori/bbox.h>
 #include <nori/bsdf.h>
 #include <nori/emitter.h>
+#include <nori/pager.h>
 #include <nori/warp.h>
 #include <Eigen/Geometry>
+#include <tbb/parallel_for.h>
+#include <half.h>
+#include <atomic>
+
+/*
+ * The per-mesh precomputations below run in parallel, but their results
+ * do not depend on the number of threads: the area CDF is a prefix sum
+ * over blocks of fixed size, and every vertex gathers the tangents of its
+ * faces in increasing face order, exactly like the original sequential
+ * scatter loop did.
+ *
+ * The compact attribute representation stores unit vectors with the
+ * octahedral mapping of Cigolle et al. ("A Survey of Efficient
+ * Representations for Independent Unit Vectors", JCGT 2014) as two 16-bit
+ * signed normalized values. The encoder picks the rounding direction of
+ * each component that decodes closest to the input, which bounds the
+ * angular error below 0.01 degrees. Since -32768 never occurs in a
+ * regular code, it marks vectors that cannot be encoded: NaN tangents of
+ * degenerate triangles (which make the shading code fall back to the
+ * normal) and zero vectors.
+ *
+ * All per-triangle queries go through getTriangle(), which gathers the
+ * vertex data of a triangle from either representation, or copies it from
+ * the record in a pinned cluster once the mesh has been paged (see page()
+ * and src/bvh_paging.cpp). The interpolation is the same in every case,
+ * so a paged mesh produces exactly the same hits and samples.
+ */
 
 NORI_NAMESPACE_BEGIN
 
+/// Number of triangles per block of the area prefix sum
+static const uint32_t CDF_BLOCK_SIZE = 4096;
+
+/// Grain size of the loops over vertices and faces
+static const uint32_t MESH_GRAIN_SIZE = 4096;
+
+static_assert(sizeof(Mesh::Triangle) == 42 * sizeof(float),
+              "Mesh::Triangle must only consist of floats");
+
 Mesh::Mesh() { }
 
+Mesh::~Mesh() {
+    /* Levels of detail share the BSDF of their source */
+    if (m_source)
+        m_bsdf = nullptr;
+}
+
+void Mesh::readMeshProperties(const PropertyList &propList) {
+    m_compressAttributes = propList.getBoolean("compressAttributes", false);
+
+    int lodLevels = propList.getInteger("lodLevels", 1);
+    if (lodLevels < 1 || lodLevels > 4)
+        throw NoriException("The number of levels of detail must be between 1 and 4!");
+    m_lodLevels = (uint32_t) lodLevels;
+    m_lodReduction = propList.getFloat("lodReduction", 0.25f);
+    if (!(m_lodReduction > 0.f && m_lodReduction < 1.f))
+        throw NoriException("The reduction between levels of detail must lie in (0, 1)!");
+}
+
 void Mesh::activate() {
     Shape::activate();
 
-    m_pdf.reserve(getPrimitiveCount());
-    for(uint32_t i = 0 ; i < getPrimitiveCount() ; ++i) {
-        m_pdf.append(surfaceArea(i));
+    /* The area CDF may already have been loaded from an .nmesh file */
+    if (!m_pdf.isNormalized() || m_pdf.size() != getPrimitiveCount())
+        computeAreaPDF(m_pdf);
+
+    if (m_lodLevels > 1) {
+        if (m_emitter || m_medium)
+            throw NoriException("Mesh: levels of detail are not supported for emitters and medium boundaries!");
+        buildLevelsOfDetail();
+    }
+
+    if (m_compressAttributes && !m_compressed)
+        compressAttributes();
+}
+
+void Mesh::computeAreaPDF(DiscretePDF &pdf) const {
+    uint32_t faceCount = getPrimitiveCount();
+    uint32_t blockCount = (faceCount + CDF_BLOCK_SIZE - 1) / CDF_BLOCK_SIZE;
+    std::vector<float> cdf(faceCount + 1), blockSums(blockCount + 1, 0.f);
+    cdf[0] = 0.f;
+
+    /* Prefix sums within each block */
+    tbb::parallel_for(0u, blockCount, [&](uint32_t block) {
+        uint32_t start = block * CDF_BLOCK_SIZE,
+                 end = std::min(start + CDF_BLOCK_SIZE, faceCount);
+        float sum = 0.f;
+        for (uint32_t i = start; i < end; ++i) {
+            sum += surfaceArea(i);
+            cdf[i + 1] = sum;
+        }
+    });
+
+    /* Offsets of the blocks */
+    for (uint32_t block = 0; block < blockCount; ++block)
+        blockSums[block + 1] = blockSums[block] + cdf[std::min((block + 1) * CDF_BLOCK_SIZE, faceCount)];
+
+    float sum = blockSums[blockCount];
+    if (!(sum > 0)) {
+        /* Degenerate mesh: leave the distribution unnormalized like before */
+        pdf.clear();
+        for (uint32_t i = 0; i < faceCount; ++i)
+            pdf.append(surfaceArea(i));
+        pdf.normalize();
+        return;
+    }
+
+    /* Add the offsets and normalize */
+    float normalization = 1.0f / sum;
+    tbb::parallel_for(0u, blockCount, [&](uint32_t block) {
+        uint32_t start = block * CDF_BLOCK_SIZE,
+                 end = std::min(start + CDF_BLOCK_SIZE, faceCount);
+        for (uint32_t i = start; i < end; ++i)
+            cdf[i + 1] = (blockSums[block] + cdf[i + 1]) * normalization;
+    });
+    cdf[faceCount] = 1.0f;
+
+    pdf.setNormalizedCDF(std::move(cdf), sum);
+}
+
+void Mesh::compute_pervertex_TBN() {
+    uint32_t vertexCount = (uint32_t) m_V.cols(), faceCount = (uint32_t) m_F.cols();
+
+    // Compute the tangent and bitangent of every face
+    std::vector<Vector3f> faceT(faceCount), faceB(faceCount);
+    tbb::parallel_for(
+        tbb::blocked_range<uint32_t>(0u, faceCount, MESH_GRAIN_SIZE),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                // Get vertex indices for the current face
+                int idx0 = m_F(0, i);
+                int idx1 = m_F(1, i);
+                int idx2 = m_F(2, i);
+
+                // Get positions and UVs for the current face
+                Vector3f p0 = m_V.col(idx0);
+                Vector3f p1 = m_V.col(idx1);
+                Vector3f p2 = m_V.col(idx2);
+
+                Vector2f uv0 = m_UV.col(idx0);
+                Vector2f uv1 = m_UV.col(idx1);
+                Vector2f uv2 = m_UV.col(idx2);
+
+                // Compute edges and delta UVs
+                Vector3f edge1 = p1 - p0;
+                Vector3f edge2 = p2 - p0;
+                Vector2f deltaUV1 = uv1 - uv0;
+                Vector2f deltaUV2 = uv2 - uv0;
+
+                // Compute tangent and bitangent for this face
+                float denom = deltaUV1.x() * deltaUV2.y() - deltaUV1.y() * deltaUV2.x();
+                // careful with degenerate triangle
+                float r = 1.0f / denom;
+                // weighting the degenerate TB with area
+                faceT[i] = r * (deltaUV2.y() * edge1 - deltaUV1.y() * edge2);
+                faceB[i] = r * (-deltaUV2.x() * edge1 + deltaUV1.x() * edge2);
+            }
+        }
+    );
+
+    // Build the list of face corners of every vertex (sorted, so that the
+    // sums below are independent of the scheduling)
+    std::vector<uint32_t> offsets(vertexCount + 1, 0), corners(3 * (size_t) faceCount);
+    for (uint32_t i = 0; i < 3 * faceCount; ++i)
+        ++offsets[m_F.data()[i] + 1];
+    for (uint32_t i = 0; i < vertexCount; ++i)
+        offsets[i + 1] += offsets[i];
+    {
+        std::vector<uint32_t> cursor(offsets.begin(), offsets.end() - 1);
+        for (uint32_t i = 0; i < 3 * faceCount; ++i)
+            corners[cursor[m_F.data()[i]]++] = i;
     }
-    m_pdf.normalize();
+
+    // Accumulate, normalize and re-orthogonalize per vertex
+    m_T.resize(3, vertexCount);
+    m_B.resize(3, vertexCount);
+    tbb::parallel_for(
+        tbb::blocked_range<uint32_t>(0u, vertexCount, MESH_GRAIN_SIZE),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                m_T.col(i).setZero();
+                m_B.col(i).setZero();
+                for (uint32_t j = offsets[i]; j < offsets[i + 1]; ++j) {
+                    m_T.col(i) += faceT[corners[j] / 3];
+                    m_B.col(i) += faceB[corners[j] / 3];
+                }
+                m_T.col(i).normalize();
+                m_B.col(i).normalize();
+
+                Vector3f N = m_N.col(i).normalized(); // Per-vertex normal
+                Vector3f T = m_T.col(i);
+                Vector3f B = m_B.col(i);
+
+                // Re-orthogonalize tangent and compute corrected bitangent
+                T = (T - N.dot(T) * N).normalized();
+                B = N.cross(T).normalized();
+
+                // Store back the orthogonalized results
+                m_T.col(i) = T;
+                m_B.col(i) = B;
+            }
+        }
+    );
+}
+
+/// Packed octahedral codes of vectors that have no direction
+static const uint32_t OCT_NAN = 0x80008000u, OCT_ZERO = 0x80000000u;
+
+static inline float signNotZero(float value) {
+    return value >= 0.f ? 1.f : -1.f;
+}
+
+static inline float fromSnorm16(int16_t value) {
+    return std::max(value / 32767.f, -1.f);
+}
+
+static inline uint32_t packSnorm16(int16_t x, int16_t y) {
+    return (uint32_t) (uint16_t) x | ((uint32_t) (uint16_t) y << 16);
+}
+
+static Vector3f decodeOctahedral(uint32_t code) {
+    if (code == OCT_NAN)
+        return Vector3f::Constant(std::numeric_limits<float>::quiet_NaN());
+    else if (code == OCT_ZERO)
+        return Vector3f::Zero();
+
+    Vector3f v(fromSnorm16((int16_t) (code & 0xFFFF)), fromSnorm16((int16_t) (code >> 16)), 0.f);
+    v.z() = 1.f - std::abs(v.x()) - std::abs(v.y());
+    if (v.z() < 0.f) {
+        float x = v.x();
+        v.x() = (1.f - std::abs(v.y())) * signNotZero(x);
+        v.y() = (1.f - std::abs(x)) * signNotZero(v.y());
+    }
+    return v.normalized();
+}
+
+static uint32_t encodeOctahedral(const Vector3f &v) {
+    if (!std::isfinite(v.x()) || !std::isfinite(v.y()) || !std::isfinite(v.z()))
+        return OCT_NAN;
+    float l1 = std::abs(v.x()) + std::abs(v.y()) + std::abs(v.z());
+    if (l1 == 0.f)
+        return OCT_ZERO;
+
+    /* Project onto the octahedron and unfold the lower hemisphere */
+    float x = v.x() / l1, y = v.y() / l1;
+    if (v.z() < 0.f) {
+        float px = x;
+        x = (1.f - std::abs(y)) * signNotZero(px);
+        y = (1.f - std::abs(px)) * signNotZero(y);
+    }
+
+    /* Try both roundings of each component */
+    Vector3f n = v.normalized();
+    uint32_t best = 0;
+    float bestDot = -std::numeric_limits<float>::infinity();
+    for (int i = 0; i < 4; ++i) {
+        float qx = (i & 1) ? std::ceil(clamp(x, -1.f, 1.f) * 32767.f) : std::floor(clamp(x, -1.f, 1.f) * 32767.f);
+        float qy = (i & 2) ? std::ceil(clamp(y, -1.f, 1.f) * 32767.f) : std::floor(clamp(y, -1.f, 1.f) * 32767.f);
+        uint32_t code = packSnorm16((int16_t) clamp(qx, -32767.f, 32767.f),
+                                    (int16_t) clamp(qy, -32767.f, 32767.f));
+        float dot = decodeOctahedral(code).dot(n);
+        if (dot > bestDot) {
+            bestDot = dot;
+            best = code;
+        }
+    }
+    return best;
+}
+
+static inline uint32_t encodeHalf2(float x, float y) {
+    return (uint32_t) half(x).bits() | ((uint32_t) half(y).bits() << 16);
+}
+
+static inline Point2f decodeHalf2(uint32_t code) {
+    half x, y;
+    x.setBits((uint16_t) (code & 0xFFFF));
+    y.setBits((uint16_t) (code >> 16));
+    return Point2f((float) x, (float) y);
+}
+
+/// Encode every column of a 3xN matrix and release it
+static void packVectors(MatrixXf &matrix, std::vector<uint32_t> &packed) {
+    packed.resize((size_t) matrix.cols());
+    tbb::parallel_for(
+        tbb::blocked_range<uint32_t>(0u, (uint32_t) matrix.cols(), MESH_GRAIN_SIZE),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i)
+                packed[i] = encodeOctahedral(matrix.col(i));
+        }
+    );
+    matrix = MatrixXf();
+}
+
+void Mesh::compressAttributes() {
+    uint32_t vertexCount = (uint32_t) m_V.cols(), faceCount = getPrimitiveCount();
+
+    if (m_N.size() > 0)
+        packVectors(m_N, m_packedN);
+    if (m_T.size() > 0 && m_B.size() > 0) {
+        packVectors(m_T, m_packedT);
+        packVectors(m_B, m_packedB);
+    }
+
+    if (m_UV.size() > 0) {
+        /* Keep the full-precision texture coordinates if they exceed the half range */
+        std::atomic<bool> representable(true);
+        m_packedUV.resize(vertexCount);
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, vertexCount, MESH_GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    if (!(std::abs(m_UV(0, i)) <= HALF_MAX && std::abs(m_UV(1, i)) <= HALF_MAX))
+                        representable = false;
+                    m_packedUV[i] = encodeHalf2(m_UV(0, i), m_UV(1, i));
+                }
+            }
+        );
+        if (representable)
+            m_UV = MatrixXf();
+        else
+            std::vector<uint32_t>().swap(m_packedUV);
+    }
+
+    /* Indices relative to the smallest index of each cluster. Clusters
+       that span too many vertices keep 32-bit indices in a side table */
+    uint32_t clusterCount = (faceCount + FACE_CLUSTER_SIZE - 1) / FACE_CLUSTER_SIZE;
+    std::vector<uint32_t> clusterBase(clusterCount);
+    std::vector<uint8_t> wide(clusterCount);
+    tbb::parallel_for(0u, clusterCount, [&](uint32_t cluster) {
+        uint32_t start = cluster * FACE_CLUSTER_SIZE,
+                 end = std::min(start + FACE_CLUSTER_SIZE, faceCount);
+        uint32_t minIndex = std::numeric_limits<uint32_t>::max(), maxIndex = 0;
+        for (uint32_t i = start; i < end; ++i) {
+            for (int k = 0; k < 3; ++k) {
+                minIndex = std::min(minIndex, m_F(k, i));
+                maxIndex = std::max(maxIndex, m_F(k, i));
+            }
+        }
+        clusterBase[cluster] = minIndex;
+        wide[cluster] = maxIndex - minIndex > 0xFFFF;
+    });
+
+    /* The flag bit limits the vertex count of meshes with compact indices */
+    if (vertexCount < WIDE_CLUSTER_FLAG) {
+        std::vector<uint32_t> wideF;
+        for (uint32_t cluster = 0; cluster < clusterCount; ++cluster) {
+            if (!wide[cluster])
+                continue;
+            uint32_t start = cluster * FACE_CLUSTER_SIZE,
+                     end = std::min(start + FACE_CLUSTER_SIZE, faceCount);
+            clusterBase[cluster] = WIDE_CLUSTER_FLAG | (uint32_t) (wideF.size() / (3 * FACE_CLUSTER_SIZE));
+            wideF.resize(wideF.size() + 3 * FACE_CLUSTER_SIZE, 0u);
+            memcpy(&wideF[wideF.size() - 3 * FACE_CLUSTER_SIZE], m_F.col(start).data(),
+                   sizeof(uint32_t) * 3 * (end - start));
+        }
+
+        std::vector<uint16_t> packedF(3 * (size_t) faceCount);
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, faceCount, MESH_GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    uint32_t base = clusterBase[i / FACE_CLUSTER_SIZE];
+                    if (base & WIDE_CLUSTER_FLAG)
+                        continue;
+                    for (int k = 0; k < 3; ++k)
+                        packedF[3 * i + k] = (uint16_t) (m_F(k, i) - base);
+                }
+            }
+        );
+        m_clusterBase = std::move(clusterBase);
+        m_packedF = std::move(packedF);
+        m_wideF = std::move(wideF);
+        m_F = MatrixXu();
+    }
+
+    m_compressed = true;
+}
+
+void Mesh::getTriangle(uint32_t index, Triangle &tri, uint32_t attributes) const {
+    if (m_pager) {
+        uint32_t slot = m_slots[index], cluster = m_firstCluster + slot / m_trianglesPerCluster;
+        const Triangle &record = ((const Triangle *) m_pager->acquire(cluster))[slot % m_trianglesPerCluster];
+        attributes &= m_pagedAttributes;
+        for (int k = 0; k < 3; ++k) {
+            tri.p[k] = record.p[k];
+            if (attributes & ETriangleNormals)
+                tri.n[k] = record.n[k];
+            if (attributes & ETriangleTexCoords)
+                tri.uv[k] = record.uv[k];
+            if (attributes & ETriangleTangents) {
+                tri.t[k] = record.t[k];
+                tri.b[k] = record.b[k];
+            }
+        }
+        m_pager->release(cluster);
+        return;
+    }
+
+    uint32_t idx[3] = { getVertexIndex(index, 0), getVertexIndex(index, 1), getVertexIndex(index, 2) };
+    for (int k = 0; k < 3; ++k)
+        tri.p[k] = m_V.col(idx[k]);
+
+    if ((attributes & ETriangleNormals) && hasNormals()) {
+        for (int k = 0; k < 3; ++k)
+            tri.n[k] = m_packedN.empty() ? Normal3f(m_N.col(idx[k])) : Normal3f(decodeOctahedral(m_packedN[idx[k]]));
+    }
+    if ((attributes & ETriangleTexCoords) && hasTexCoords()) {
+        for (int k = 0; k < 3; ++k)
+            tri.uv[k] = m_packedUV.empty() ? Point2f(m_UV.col(idx[k])) : decodeHalf2(m_packedUV[idx[k]]);
+    }
+    if ((attributes & ETriangleTangents) && hasTangents()) {
+        for (int k = 0; k < 3; ++k) {
+            tri.t[k] = m_packedT.empty() ? Vector3f(m_T.col(idx[k])) : decodeOctahedral(m_packedT[idx[k]]);
+            tri.b[k] = m_packedB.empty() ? Vector3f(m_B.col(idx[k])) : decodeOctahedral(m_packedB[idx[k]]);
+        }
+    }
+}
+
+void Mesh::page(const ClusterCache *pager, uint32_t firstCluster, uint32_t perCluster,
+                std::vector<uint32_t> &&slots) {
+    if (m_pager || slots.size() != getPrimitiveCount() || perCluster == 0)
+        throw NoriException("Mesh::page(): invalid arguments for \"%s\"!", m_name);
+
+    m_pagedAttributes = (hasNormals() ? ETriangleNormals : 0u) |
+                        (hasTexCoords() ? ETriangleTexCoords : 0u) |
+                        (hasTangents() ? ETriangleTangents : 0u);
+    m_pagedVertexCount = getVertexCount();
+
+    m_V = MatrixXf();
+    m_N = MatrixXf();
+    m_UV = MatrixXf();
+    m_T = MatrixXf();
+    m_B = MatrixXf();
+    m_F = MatrixXu();
+    std::vector<uint32_t>().swap(m_packedN);
+    std::vector<uint32_t>().swap(m_packedT);
+    std::vector<uint32_t>().swap(m_packedB);
+    std::vector<uint32_t>().swap(m_packedUV);
+    std::vector<uint32_t>().swap(m_clusterBase);
+    std::vector<uint16_t>().swap(m_packedF);
+    std::vector<uint32_t>().swap(m_wideF);
+
+    m_slots = std::move(slots);
+    m_firstCluster = firstCluster;
+    m_trianglesPerCluster = perCluster;
+    m_pager = pager;
+}
+
+/// Interpolate a per-vertex quantity with barycentric coordinates
+template <typename T> static inline T interpolate(const T *values, const Vector3f &bc) {
+    return bc.x() * values[0] + bc.y() * values[1] + bc.z() * values[2];
 }
 
 void Mesh::sampleSurface(ShapeQueryRecord & sRec, const Point2f & sample) const {
@@ -43,14 +482,14 @@ void Mesh::sampleSurface(ShapeQueryRecord & sRec, const Point2f & sample) const
 
     Vector3f bc = Warp::squareToUniformTriangle(s);
 
-    sRec.p = getInterpolatedVertex(idT,bc);
-    if (m_N.size() > 0) {
-        sRec.n = getInterpolatedNormal(idT, bc);
+    Triangle tri;
+    getTriangle((uint32_t) idT, tri, ETriangleNormals);
+    sRec.p = interpolate(tri.p, bc);
+    if (hasNormals()) {
+        sRec.n = interpolate(tri.n, bc).normalized();
     }
     else {
-        Point3f p0 = m_V.col(m_F(0, idT));
-        Point3f p1 = m_V.col(m_F(1, idT));
-        Point3f p2 = m_V.col(m_F(2, idT));
+        const Point3f &p0 = tri.p[0], &p1 = tri.p[1], &p2 = tri.p[2];
         Normal3f n = (p1-p0).cross(p2-p0).normalized();
         sRec.n = n;
     }
@@ -61,28 +500,30 @@ float Mesh::pdfSurface(const ShapeQueryRecord & sRec) const {
 }
 
 Point3f Mesh::getInterpolatedVertex(uint32_t index, const Vector3f &bc) const {
-    return (bc.x() * m_V.col(m_F(0, index)) +
-            bc.y() * m_V.col(m_F(1, index)) +
-            bc.z() * m_V.col(m_F(2, index)));
+    Triangle tri;
+    getTriangle(index, tri);
+    return interpolate(tri.p, bc);
 }
 
 Normal3f Mesh::getInterpolatedNormal(uint32_t index, const Vector3f &bc) const {
-    return (bc.x() * m_N.col(m_F(0, index)) +
-            bc.y() * m_N.col(m_F(1, index)) +
-            bc.z() * m_N.col(m_F(2, index))).normalized();
+    Triangle tri;
+    getTriangle(index, tri, ETriangleNormals);
+    return interpolate(tri.n, bc).normalized();
 }
 
 float Mesh::surfaceArea(uint32_t index) const {
-    uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
+    Triangle tri;
+    getTriangle(index, tri);
 
-    const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
+    const Point3f &p0 = tri.p[0], &p1 = tri.p[1], &p2 = tri.p[2];
 
     return 0.5f * Vector3f((p1 - p0).cross(p2 - p0)).norm();
 }
 
 bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const {
-    uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
-    const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
+    Triangle tri;
+    getTriangle(index, tri);
+    const Point3f &p0 = tri.p[0], &p1 = tri.p[1], &p2 = tri.p[2];
 
     /* Find vectors for two edges sharing v[0] */
     Vector3f edge1 = p1 - p0, edge2 = p2 - p0;
@@ -119,46 +560,50 @@ bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, fl
     return t >= ray.mint && t <= ray.maxt;
 }
 
+float Mesh::getAlpha(uint32_t index, const Ray3f &ray, const Point2f &uv, float t) const {
+    Point2f texUV = uv;
+    if (hasTexCoords()) {
+        Triangle tri;
+        getTriangle(index, tri, ETriangleTexCoords);
+        texUV = interpolate(tri.uv, Vector3f(1 - uv.sum(), uv.x(), uv.y()));
+    }
+
+    /* Only the texture coordinates are used by alpha lookups */
+    return m_bsdf->getAlpha(BSDFQueryRecord(Vector3f(0.f, 0.f, 1.f), texUV));
+}
+
 void Mesh::setHitInformation(uint32_t index, const Ray3f &ray, Intersection & its) const {
     /* Find the barycentric coordinates */
     Vector3f bary;
     bary << 1-its.uv.sum(), its.uv;
 
-    /* Vertex indices of the triangle */
-    uint32_t idx0 = m_F(0, index), idx1 = m_F(1, index), idx2 = m_F(2, index);
+    /* Vertex data of the triangle */
+    Triangle tri;
+    getTriangle(index, tri, ETriangleAll);
 
-    Point3f p0 = m_V.col(idx0), p1 = m_V.col(idx1), p2 = m_V.col(idx2);
+    const Point3f &p0 = tri.p[0], &p1 = tri.p[1], &p2 = tri.p[2];
 
     /* Compute the intersection positon accurately
        using barycentric coordinates */
     its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
 
     /* Compute proper texture coordinates if provided by the mesh */
-    if (m_UV.size() > 0)
-        its.uv = bary.x() * m_UV.col(idx0) +
-                 bary.y() * m_UV.col(idx1) +
-                 bary.z() * m_UV.col(idx2);
+    if (hasTexCoords())
+        its.uv = interpolate(tri.uv, bary);
 
     /* Compute the geometry frame */
     its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
 
-    if (m_N.size() > 0) {
+    if (hasNormals()) {
         /* Compute the shading frame. Note that for simplicity,
            the current implementation doesn't attempt to provide
            tangents that are continuous across the surface. That
            means that this code will need to be modified to be able
            use anisotropic BRDFs, which need tangent continuity */
-        Vector3f n = (bary.x() * m_N.col(idx0) +
-                      bary.y() * m_N.col(idx1) +
-                      bary.z() * m_N.col(idx2)).normalized();
-        if (m_T.size() > 0 && m_B.size() > 0) {
-            Vector3f t = (bary.x() * m_T.col(idx0) +
-                          bary.y() * m_T.col(idx1) +
-                          bary.z() * m_T.col(idx2)).normalized();
-
-            Vector3f b = (bary.x() * m_B.col(idx0) +
-                          bary.y() * m_B.col(idx1) +
-                          bary.z() * m_B.col(idx2)).normalized();
+        Vector3f n = interpolate(tri.n, bary).normalized();
+        if (hasTangents()) {
+            Vector3f t = interpolate(tri.t, bary).normalized();
+            Vector3f b = interpolate(tri.b, bary).normalized();
             if (isNan(t) || isNan(b)) {
 //                cout << "TB nan with degenerate triangle:" << "t:" << t << "b:" << b << endl;
                 // degenerate triangle then use geoframe
@@ -189,19 +634,79 @@ void Mesh::setHitInformation(uint32_t index, const Ray3f &ray, Intersection & it
 }
 
 BoundingBox3f Mesh::getBoundingBox(uint32_t index) const {
-    BoundingBox3f result(m_V.col(m_F(0, index)));
-    result.expandBy(m_V.col(m_F(1, index)));
-    result.expandBy(m_V.col(m_F(2, index)));
+    Triangle tri;
+    getTriangle(index, tri);
+    BoundingBox3f result(tri.p[0]);
+    result.expandBy(tri.p[1]);
+    result.expandBy(tri.p[2]);
     return result;
 }
 
 Point3f Mesh::getCentroid(uint32_t index) const {
-    return (1.0f / 3.0f) *
-        (m_V.col(m_F(0, index)) +
-         m_V.col(m_F(1, index)) +
-         m_V.col(m_F(2, index)));
+    Triangle tri;
+    getTriangle(index, tri);
+    return (1.0f / 3.0f) * (tri.p[0] + tri.p[1] + tri.p[2]);
+}
+
+uint64_t Mesh::getGeometryHash() const {
+    if (m_pager)
+        throw NoriException("Mesh::getGeometryHash(): \"%s\" is paged!", m_name);
+
+    uint64_t sizes[2] = { (uint64_t) m_V.cols(), (uint64_t) getPrimitiveCount() };
+    uint64_t hash = hashBytes(sizes, sizeof(sizes));
+    hash = hashBytes(m_V.data(), sizeof(float) * m_V.size(), hash);
+    if (m_packedF.empty())
+        return hashBytes(m_F.data(), sizeof(uint32_t) * m_F.size(), hash);
+
+    /* Hash the decoded indices, so the BVH cache does not depend on the representation */
+    std::vector<uint32_t> indices(m_packedF.size());
+    for (size_t i = 0; i < indices.size(); ++i)
+        indices[i] = getVertexIndex((uint32_t) (i / 3), (int) (i % 3));
+    return hashBytes(indices.data(), sizeof(uint32_t) * indices.size(), hash);
 }
 
+BoundingBox3f Mesh::getClippedBoundingBox(uint32_t index, const BoundingBox3f &clip) const {
+    /* Clip the triangle against the six planes of the box (Sutherland-Hodgman).
+       Every plane adds at most one vertex to the polygon */
+    Triangle tri;
+    getTriangle(index, tri);
+    Point3f vertices[2][9];
+    int count = 3, cur = 0;
+    for (int k = 0; k < 3; ++k)
+        vertices[0][k] = tri.p[k];
+
+    for (int axis = 0; axis < 3 && count > 0; ++axis) {
+        for (int side = 0; side < 2 && count > 0; ++side) {
+            float plane = side == 0 ? clip.min[axis] : clip.max[axis];
+            float sign = side == 0 ? 1.f : -1.f;
+            const Point3f *in = vertices[cur];
+            Point3f *out = vertices[1 - cur];
+            int outCount = 0;
+
+            for (int k = 0; k < count; ++k) {
+                const Point3f &p0 = in[k], &p1 = in[(k + 1) % count];
+                float d0 = sign * (p0[axis] - plane), d1 = sign * (p1[axis] - plane);
+                if (d0 >= 0)
+                    out[outCount++] = p0;
+                if ((d0 < 0 && d1 > 0) || (d0 > 0 && d1 < 0)) {
+                    Point3f p = p0 + (p1 - p0) * (d0 / (d0 - d1));
+                    p[axis] = plane;
+                    out[outCount++] = p;
+                }
+            }
+            count = outCount;
+            cur = 1 - cur;
+        }
+    }
+
+    BoundingBox3f result;
+    for (int k = 0; k < count; ++k)
+        result.expandBy(vertices[cur][k]);
+
+    /* Guard against round-off in the intersection points */
+    result.clip(clip);
+    return result;
+}
 
 std::string Mesh::toString() const {
     return tfm::format(
@@ -213,8 +718,8 @@ std::string Mesh::toString() const {
         "  emitter = %s\n"
         "]",
         m_name,
-        m_V.cols(),
-        m_F.cols(),
+        getVertexCount(),
+        getPrimitiveCount(),
         m_bsdf ? indent(m_bsdf->toString()) : std::string("null"),
         m_emitter ? indent(m_emitter->toString()) : std::string("null")
     );
@@ -0,0 +1,128 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/mmap.h>
+
+#if defined(PLATFORM_WINDOWS)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+#if defined(PLATFORM_WINDOWS)
+
+MemoryMappedFile::MemoryMappedFile(const std::string &filename) : m_filename(filename) {
+    m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE) {
+        m_file = nullptr;
+        throw NoriException("MemoryMappedFile: could not open \"%s\"", filename);
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_file, &size)) {
+        CloseHandle(m_file);
+        throw NoriException("MemoryMappedFile: could not determine the size of \"%s\"", filename);
+    }
+    m_size = (size_t) size.QuadPart;
+    if (m_size == 0)
+        return;
+
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_mapping)
+        m_data = (const uint8_t *) MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!m_data) {
+        if (m_mapping)
+            CloseHandle(m_mapping);
+        CloseHandle(m_file);
+        throw NoriException("MemoryMappedFile: could not map \"%s\"", filename);
+    }
+}
+
+MemoryMappedFile::~MemoryMappedFile() {
+    if (m_data)
+        UnmapViewOfFile(m_data);
+    if (m_mapping)
+        CloseHandle(m_mapping);
+    if (m_file)
+        CloseHandle(m_file);
+}
+
+void MemoryMappedFile::discard(size_t offset, size_t size) const {
+    /* Unlocking pages that are not locked removes them from the working set */
+    if (m_data && offset < m_size)
+        VirtualUnlock((void *) (m_data + offset), std::min(size, m_size - offset));
+}
+
+#else
+
+MemoryMappedFile::MemoryMappedFile(const std::string &filename) : m_filename(filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw NoriException("MemoryMappedFile: could not open \"%s\": %s", filename, strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        throw NoriException("MemoryMappedFile: could not determine the size of \"%s\": %s",
+                            filename, strerror(errno));
+    }
+    m_size = (size_t) st.st_size;
+    if (m_size == 0) {
+        close(fd);
+        return;
+    }
+
+    void *ptr = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+        throw NoriException("MemoryMappedFile: could not map \"%s\": %s", filename, strerror(errno));
+    m_data = (const uint8_t *) ptr;
+}
+
+MemoryMappedFile::~MemoryMappedFile() {
+    if (m_data)
+        munmap((void *) m_data, m_size);
+}
+
+void MemoryMappedFile::discard(size_t offset, size_t size) const {
+    if (!m_data || offset >= m_size)
+        return;
+    size = std::min(size, m_size - offset);
+
+    /* Only whole pages can be dropped */
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    size_t start = (offset + pageSize - 1) / pageSize * pageSize, end = offset + size;
+    if (end == m_size)
+        end = (end + pageSize - 1) / pageSize * pageSize;
+    else
+        end = end / pageSize * pageSize;
+    if (start < end)
+        madvise((void *) (m_data + start), end - start, MADV_DONTNEED);
+}
+
+#endif
+
+NORI_NAMESPACE_END
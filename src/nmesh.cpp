@@ -0,0 +1,325 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/mesh.h>
+#include <nori/mmap.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <tbb/parallel_for.h>
+#include <half.h>
+#include <fstream>
+#include <cstring>
+
+/*
+ * Binary mesh format (.nmesh). The file starts with an NMeshHeader,
+ * followed by the sections below in this order. Each section starts at a
+ * multiple of 16 bytes, and the optional ones are only present when the
+ * corresponding flag is set. All values are little endian.
+ *
+ *   positions    3 x vertexCount   float32
+ *   normals      3 x vertexCount   float32 or float16 (EHalfAttributes)
+ *   texcoords    2 x vertexCount   float32 or float16
+ *   tangents     3 x vertexCount   float32 or float16
+ *   bitangents   3 x vertexCount   float32 or float16
+ *   indices      3 x faceCount     uint32 or uint16 (E16BitIndices)
+ *   area CDF     faceCount + 1     float32, normalized (sum in the header)
+ *
+ * The matrices are stored column by column, which is the memory layout of
+ * the Eigen matrices in Mesh, so loading full-precision data amounts to
+ * one memcpy per section out of the memory-mapped file. The format is a
+ * binary cache of the parsed mesh, not a zero-copy representation: the
+ * mesh owns its matrices, since transformations are baked into them and
+ * compressAttributes() and paging (see BVH::setPagingBudget()) replace
+ * them later, so the mapping is closed once the sections are copied.
+ */
+
+NORI_NAMESPACE_BEGIN
+
+static const char NMESH_MAGIC[4] = { 'N', 'M', 'S', 'H' };
+static const uint32_t NMESH_VERSION = 1;
+
+enum ENMeshFlags {
+    EHasNormals     = 0x01,
+    EHasTexCoords   = 0x02,
+    EHasTangents    = 0x04,
+    EHalfAttributes = 0x08,
+    E16BitIndices   = 0x10,
+    EHasAreaCDF     = 0x20
+};
+
+enum ENMeshSection {
+    EPositions = 0, ENormals, ETexCoords, ETangents, EBitangents,
+    EIndices, EAreaCDF, ESectionCount
+};
+
+struct NMeshHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t vertexCount;
+    uint32_t faceCount;
+    float areaSum;       ///< Total surface area (with \c EHasAreaCDF)
+    float bboxMin[3];    ///< Bounding box of the positions
+    float bboxMax[3];
+};
+
+static_assert(sizeof(NMeshHeader) == 48, "Unexpected size of NMeshHeader");
+
+/// Byte offsets and sizes of the sections of a file with the given header
+struct NMeshLayout {
+    size_t offset[ESectionCount];
+    size_t size[ESectionCount];
+    size_t fileSize;
+
+    NMeshLayout(const NMeshHeader &header) {
+        size_t attribute = (header.flags & EHalfAttributes) ? sizeof(uint16_t) : sizeof(float);
+        size_t index = (header.flags & E16BitIndices) ? sizeof(uint16_t) : sizeof(uint32_t);
+        size_t V = header.vertexCount, F = header.faceCount;
+
+        size[EPositions]  = 3 * V * sizeof(float);
+        size[ENormals]    = (header.flags & EHasNormals) ? 3 * V * attribute : 0;
+        size[ETexCoords]  = (header.flags & EHasTexCoords) ? 2 * V * attribute : 0;
+        size[ETangents]   = (header.flags & EHasTangents) ? 3 * V * attribute : 0;
+        size[EBitangents] = size[ETangents];
+        size[EIndices]    = 3 * F * index;
+        size[EAreaCDF]    = (header.flags & EHasAreaCDF) ? (F + 1) * sizeof(float) : 0;
+
+        fileSize = sizeof(NMeshHeader);
+        for (int i = 0; i < ESectionCount; ++i) {
+            fileSize = (fileSize + 15) & ~(size_t) 15;
+            offset[i] = fileSize;
+            fileSize += size[i];
+        }
+    }
+};
+
+/// Write a section of floats, optionally converted to half precision
+static void writeAttribute(std::ostream &os, const MatrixXf &matrix, bool halfPrecision) {
+    if (!halfPrecision) {
+        os.write((const char *) matrix.data(), matrix.size() * sizeof(float));
+        return;
+    }
+    std::vector<uint16_t> values((size_t) matrix.size());
+    for (size_t i = 0; i < values.size(); ++i)
+        values[i] = half(matrix.data()[i]).bits();
+    os.write((const char *) values.data(), values.size() * sizeof(uint16_t));
+}
+
+/// Read a section of floats written by \ref writeAttribute()
+static void readAttribute(const uint8_t *data, MatrixXf &matrix, int rows,
+                          uint32_t vertexCount, bool halfPrecision) {
+    matrix.resize(rows, vertexCount);
+    if (!halfPrecision) {
+        memcpy(matrix.data(), data, matrix.size() * sizeof(float));
+        return;
+    }
+    const uint16_t *values = (const uint16_t *) data;
+    float *target = matrix.data();
+    tbb::parallel_for(
+        tbb::blocked_range<size_t>(0, (size_t) matrix.size(), 16384),
+        [&](const tbb::blocked_range<size_t> &range) {
+            for (size_t i = range.begin(); i != range.end(); ++i) {
+                half h;
+                h.setBits(values[i]);
+                target[i] = (float) h;
+            }
+        }
+    );
+}
+
+void Mesh::writeNMesh(const std::string &filename, bool halfPrecision) const {
+    if (m_compressed)
+        throw NoriException("Mesh::writeNMesh(): \"%s\" has compressed attributes!", filename);
+    if (m_pager)
+        throw NoriException("Mesh::writeNMesh(): \"%s\" is paged!", filename);
+
+    NMeshHeader header;
+    memset(&header, 0, sizeof(NMeshHeader));
+    memcpy(header.magic, NMESH_MAGIC, sizeof(NMESH_MAGIC));
+    header.version = NMESH_VERSION;
+    header.vertexCount = (uint32_t) m_V.cols();
+    header.faceCount = (uint32_t) m_F.cols();
+    for (int i = 0; i < 3; ++i) {
+        header.bboxMin[i] = m_bbox.min[i];
+        header.bboxMax[i] = m_bbox.max[i];
+    }
+
+    if (m_N.size() > 0)
+        header.flags |= EHasNormals;
+    if (m_UV.size() > 0)
+        header.flags |= EHasTexCoords;
+    if (m_T.size() > 0 && m_B.size() > 0)
+        header.flags |= EHasTangents;
+    if (halfPrecision)
+        header.flags |= EHalfAttributes;
+    if (header.vertexCount <= 0x10000)
+        header.flags |= E16BitIndices;
+
+    /* Use the distribution of an activated mesh, or build it the same way */
+    DiscretePDF pdf;
+    if (m_pdf.isNormalized() && m_pdf.size() == header.faceCount) {
+        pdf = m_pdf;
+    } else {
+        computeAreaPDF(pdf);
+    }
+    if (pdf.isNormalized()) {
+        header.flags |= EHasAreaCDF;
+        header.areaSum = pdf.getSum();
+    }
+
+    std::ofstream os(filename, std::ios::binary);
+    if (!os)
+        throw NoriException("Unable to write \"%s\"!", filename);
+
+    NMeshLayout layout(header);
+    os.write((const char *) &header, sizeof(NMeshHeader));
+    for (int section = 0; section < ESectionCount; ++section) {
+        if (layout.size[section] == 0)
+            continue;
+        static const char padding[16] = { };
+        os.write(padding, layout.offset[section] - (size_t) os.tellp());
+
+        switch (section) {
+            case EPositions:  writeAttribute(os, m_V, false); break;
+            case ENormals:    writeAttribute(os, m_N, halfPrecision); break;
+            case ETexCoords:  writeAttribute(os, m_UV, halfPrecision); break;
+            case ETangents:   writeAttribute(os, m_T, halfPrecision); break;
+            case EBitangents: writeAttribute(os, m_B, halfPrecision); break;
+            case EIndices:
+                if (header.flags & E16BitIndices) {
+                    std::vector<uint16_t> indices((size_t) m_F.size());
+                    for (size_t i = 0; i < indices.size(); ++i)
+                        indices[i] = (uint16_t) m_F.data()[i];
+                    os.write((const char *) indices.data(), indices.size() * sizeof(uint16_t));
+                } else {
+                    os.write((const char *) m_F.data(), m_F.size() * sizeof(uint32_t));
+                }
+                break;
+            case EAreaCDF:
+                os.write((const char *) pdf.getCDF().data(), pdf.getCDF().size() * sizeof(float));
+                break;
+        }
+    }
+
+    if (!os || (size_t) os.tellp() != layout.fileSize)
+        throw NoriException("Error while writing \"%s\"!", filename);
+}
+
+void Mesh::readNMesh(const std::string &filename, const Transform &trafo) {
+    cout << "Loading \"" << filename << "\" .. ";
+    cout.flush();
+    Timer timer;
+
+    MemoryMappedFile file(filename);
+    NMeshHeader header;
+    if (file.size() < sizeof(NMeshHeader))
+        throw NoriException("\"%s\" is not an .nmesh file!", filename);
+    memcpy(&header, file.data(), sizeof(NMeshHeader));
+    if (memcmp(header.magic, NMESH_MAGIC, sizeof(NMESH_MAGIC)) != 0)
+        throw NoriException("\"%s\" is not an .nmesh file!", filename);
+    if (header.version != NMESH_VERSION)
+        throw NoriException("\"%s\" has an unsupported .nmesh version (%i, expected %i). "
+                            "Please convert it again using obj2nmesh.",
+                            filename, header.version, NMESH_VERSION);
+
+    NMeshLayout layout(header);
+    if (file.size() != layout.fileSize)
+        throw NoriException("\"%s\" is truncated or corrupt!", filename);
+
+    const uint8_t *data = file.data();
+    bool halfPrecision = (header.flags & EHalfAttributes) != 0;
+    uint32_t V = header.vertexCount, F = header.faceCount;
+
+    readAttribute(data + layout.offset[EPositions], m_V, 3, V, false);
+    if (header.flags & EHasNormals)
+        readAttribute(data + layout.offset[ENormals], m_N, 3, V, halfPrecision);
+    if (header.flags & EHasTexCoords)
+        readAttribute(data + layout.offset[ETexCoords], m_UV, 2, V, halfPrecision);
+    if (header.flags & EHasTangents) {
+        readAttribute(data + layout.offset[ETangents], m_T, 3, V, halfPrecision);
+        readAttribute(data + layout.offset[EBitangents], m_B, 3, V, halfPrecision);
+    }
+
+    m_F.resize(3, F);
+    if (header.flags & E16BitIndices) {
+        const uint16_t *indices = (const uint16_t *) (data + layout.offset[EIndices]);
+        for (size_t i = 0; i < (size_t) m_F.size(); ++i)
+            m_F.data()[i] = indices[i];
+    } else {
+        memcpy(m_F.data(), data + layout.offset[EIndices], layout.size[EIndices]);
+    }
+
+    uint32_t maxIndex = m_F.size() > 0 ? m_F.maxCoeff() : 0;
+    if (F == 0 || maxIndex >= V)
+        throw NoriException("\"%s\" contains no data or invalid indices!", filename);
+
+    if (trafo.getMatrix() == Eigen::Matrix4f::Identity()) {
+        m_bbox = BoundingBox3f(Point3f(header.bboxMin[0], header.bboxMin[1], header.bboxMin[2]),
+                               Point3f(header.bboxMax[0], header.bboxMax[1], header.bboxMax[2]));
+
+        if (header.flags & EHasAreaCDF) {
+            const float *cdf = (const float *) (data + layout.offset[EAreaCDF]);
+            m_pdf.setNormalizedCDF(std::vector<float>(cdf, cdf + F + 1), header.areaSum);
+        }
+    } else {
+        /* Bake the transformation like the OBJ loader. Unreferenced
+           vertices are not stored, so the bounding box may be tighter */
+        for (uint32_t i = 0; i < V; ++i) {
+            Point3f p = trafo * Point3f(m_V.col(i));
+            m_V.col(i) = p;
+            m_bbox.expandBy(p);
+        }
+        for (uint32_t i = 0; i < (uint32_t) m_N.cols(); ++i)
+            m_N.col(i) = (trafo * Normal3f(m_N.col(i))).normalized();
+        if (header.flags & EHasTangents)
+            compute_pervertex_TBN();
+    }
+
+    m_name = filename;
+    cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
+         << timer.elapsedString() << " and " << memString(file.size()) << ")" << endl;
+}
+
+/**
+ * \brief Triangle mesh loaded from the binary \c .nmesh mesh cache
+ *
+ * Such files are created from OBJ files with the \c obj2nmesh tool and
+ * skip the text parsing when loading. The properties are the ones of the
+ * \c obj type (see \ref Mesh::readMeshProperties()), and the \c obj type
+ * also accepts \c .nmesh files, so the following are equivalent:
+ *
+ *     <mesh type="nmesh">
+ *         <string name="filename" value="sponza.nmesh"/>
+ *     </mesh>
+ *
+ *     <mesh type="obj">
+ *         <string name="filename" value="sponza.nmesh"/>
+ *     </mesh>
+ */
+class NMesh : public Mesh {
+public:
+    NMesh(const PropertyList &propList) {
+        filesystem::path filename =
+            getFileResolver()->resolve(propList.getString("filename"));
+        readMeshProperties(propList);
+        readNMesh(filename.str(), propList.getTransform("toWorld", Transform()));
+    }
+};
+
+NORI_REGISTER_CLASS(NMesh, "nmesh");
+NORI_NAMESPACE_END
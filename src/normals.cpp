@@ -31,27 +31,29 @@ public:
     Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
         /* Find the surface that is visible in the requested direction */
         Intersection its;
-        if (!scene->rayIntersect(ray, its))
+        bool hit = scene->rayIntersect(ray, its);
+        return LiHit(scene, sampler, ray, its, hit);
+    }
+
+    Color3f LiHit(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                  const Intersection &its, bool hit) const {
+        if (!hit)
             return Color3f(0.0f);
 
         /* Return the component-wise absolute
            value of the shading normal as a color */
         // warning: for visualization need to remap back to [-1, 1] for using!
 //            Normal3f n = its.shFrame.n.cwiseAbs();
-        const BSDF *bsdf = its.mesh->getBSDF();
-        float alpha = 1.0f;
-        if (bsdf && bsdf->isNull()) {
-            /* Assuming the BSDF has a method to query diffuse reflectance */
-            Vector3f wi = its.toLocal(-ray.d);
-            BSDFQueryRecord bRec(wi, its.uv);
-            alpha = bsdf->getAlpha(bRec);
-        }
-        Normal3f n = alpha * its.shFrame.n;
+        /* Cut-out regions of alpha-tested shapes were already skipped by the
+           traversal (see Shape::alphaTest), so this is the visible surface */
+        Normal3f n = its.shFrame.n;
 
         n = (n + Normal3f(1.0f)) * 0.5f;
         return Color3f(n.x(), n.y(), n.z());
     }
 
+    bool supportsPrimaryHits() const { return true; }
+
     std::string toString() const {
         return "NormalIntegrator[]";
     }
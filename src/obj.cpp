@@ -17,112 +17,254 @@
 */
 
 #include <nori/mesh.h>
+#include <nori/mmap.h>
 #include <nori/timer.h>
 #include <filesystem/resolver.h>
-#include <unordered_map>
-#include <fstream>
+#include <tbb/parallel_for.h>
 #include <Eigen/Dense>
+#include <cfloat>
+#include <cstring>
+
+/*
+ * The loader maps the file into memory and splits it into chunks of
+ * CHUNK_SIZE bytes at line boundaries, which are parsed in parallel. Vertex
+ * indices in the OBJ format are absolute, so the chunks are independent and
+ * their attributes and face corners are simply concatenated in file order.
+ * Identical (position, texture coordinate, normal) triples are then merged
+ * in a single pass through an open-addressing hash table, which assigns
+ * indices in order of first appearance like the original line-by-line
+ * loader did.
+ *
+ * Numbers are parsed in place without allocations. Decimal values with at
+ * most 19 significant digits and a small exponent are converted exactly
+ * through double precision (Clinger's fast path); the few values where the
+ * conversion to single precision could round differently than a direct
+ * conversion, and anything unusual, fall back to strtof(). The results are
+ * hence bit-identical to those of std::istream.
+ */
 
 NORI_NAMESPACE_BEGIN
 
+/// Approximate number of bytes parsed by one task
+static const size_t CHUNK_SIZE = 1024 * 1024;
+
+/// Exactly representable powers of ten
+static const double POW10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static inline bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static inline bool isTokenEnd(const char *ptr, const char *end) {
+    return ptr == end || *ptr == '\n' || isSpace(*ptr);
+}
+
+static inline void skipSpace(const char *&ptr, const char *end) {
+    while (ptr < end && isSpace(*ptr))
+        ++ptr;
+}
+
+static inline std::string token(const char *ptr, const char *end) {
+    const char *start = ptr;
+    while (!isTokenEnd(ptr, end))
+        ++ptr;
+    return std::string(start, ptr);
+}
+
+/// Parse a floating point value, or throw an exception if there is none
+static float parseFloat(const char *&ptr, const char *end) {
+    skipSpace(ptr, end);
+    const char *start = ptr;
+
+    bool negative = false;
+    if (ptr < end && (*ptr == '-' || *ptr == '+'))
+        negative = *ptr++ == '-';
+
+    /* Collect up to 19 significant digits (which fit into 64 bits) */
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool valid = false, exact = true;
+    for (; ptr < end && isDigit(*ptr); ++ptr) {
+        valid = true;
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (uint64_t) (*ptr - '0');
+            digits += mantissa != 0;
+        } else {
+            exact &= *ptr == '0';
+            ++exponent;
+        }
+    }
+    if (ptr < end && *ptr == '.') {
+        for (++ptr; ptr < end && isDigit(*ptr); ++ptr) {
+            valid = true;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (uint64_t) (*ptr - '0');
+                digits += mantissa != 0;
+                --exponent;
+            } else {
+                exact &= *ptr == '0';
+            }
+        }
+    }
+    if (valid && ptr < end && (*ptr == 'e' || *ptr == 'E')) {
+        ++ptr;
+        bool negativeExp = false;
+        if (ptr < end && (*ptr == '-' || *ptr == '+'))
+            negativeExp = *ptr++ == '-';
+        valid = ptr < end && isDigit(*ptr);
+        int value = 0;
+        for (; ptr < end && isDigit(*ptr); ++ptr)
+            value = std::min(value * 10 + (*ptr - '0'), 100000);
+        exponent += negativeExp ? -value : value;
+    }
+
+    if (valid && exact && isTokenEnd(ptr, end)) {
+        if (mantissa == 0)
+            return negative ? -0.f : 0.f;
+
+        if (mantissa <= (1ull << 53) && exponent >= -22 && exponent <= 22) {
+            /* Both operands are exact, so the result is correctly rounded */
+            double value = (double) mantissa;
+            value = exponent < 0 ? value / POW10[-exponent] : value * POW10[exponent];
+
+            /* Rounding to single precision gives the correctly rounded result
+               unless the value landed exactly halfway between two floats */
+            uint64_t bits;
+            memcpy(&bits, &value, sizeof(double));
+            if (value >= FLT_MIN && value <= FLT_MAX && (bits & 0x1FFFFFFFull) != 0x10000000ull) {
+                float result = (float) value;
+                return negative ? -result : result;
+            }
+        }
+    }
+
+    /* Slow path */
+    ptr = start;
+    std::string str = token(ptr, end);
+    if (str.empty())
+        throw NoriException("Missing floating point value");
+    ptr += str.size();
+    return toFloat(str);
+}
+
+/// Parse a non-negative integer with at least one digit
+static inline bool parseUInt(const char *&ptr, const char *end, uint32_t &result) {
+    if (ptr == end || !isDigit(*ptr))
+        return false;
+    uint64_t value = 0;
+    for (; ptr < end && isDigit(*ptr); ++ptr)
+        value = std::min(value * 10 + (uint64_t) (*ptr - '0'), (uint64_t) 0xFFFFFFFFu);
+    result = (uint32_t) value;
+    return true;
+}
+
 /**
  * \brief Loader for Wavefront OBJ triangle meshes
+ *
+ * Files with the extension \c .nmesh (as written by \c obj2nmesh) are
+ * loaded through \ref Mesh::readNMesh() instead, so scenes can switch to
+ * the binary format by changing the file name. The properties \c
+ * compressAttributes, \c lodLevels and \c lodReduction are shared with
+ * the \c nmesh type (see \ref Mesh::readMeshProperties()).
  */
 class WavefrontOBJ : public Mesh {
 public:
     WavefrontOBJ(const PropertyList &propList) {
-        typedef std::unordered_map<OBJVertex, uint32_t, OBJVertexHash> VertexMap;
-
         filesystem::path filename =
             getFileResolver()->resolve(propList.getString("filename"));
-
-        std::ifstream is(filename.str());
-        if (is.fail())
-            throw NoriException("Unable to open OBJ file \"%s\"!", filename);
         Transform trafo = propList.getTransform("toWorld", Transform());
+        readMeshProperties(propList);
+
+        if (filename.extension() == "nmesh") {
+            readNMesh(filename.str(), trafo);
+            return;
+        }
 
         cout << "Loading \"" << filename << "\" .. \n";
         cout.flush();
         Timer timer;
 
-        std::vector<Vector3f>   positions;
-        std::vector<Vector2f>   texcoords;
-        std::vector<Vector3f>   normals;
-        std::vector<uint32_t>   indices;
-        std::vector<OBJVertex>  vertices;
-        VertexMap vertexMap;
-
-        std::string line_str;
-        while (std::getline(is, line_str)) {
-            std::istringstream line(line_str);
-
-            std::string prefix;
-            line >> prefix;
-
-            if (prefix == "v") {
-                Point3f p;
-                line >> p.x() >> p.y() >> p.z();
-                p = trafo * p;
-                m_bbox.expandBy(p);
-                positions.push_back(p);
-            } else if (prefix == "vt") {
-                Point2f tc;
-                line >> tc.x() >> tc.y();
-                texcoords.push_back(tc);
-            } else if (prefix == "vn") {
-                Normal3f n;
-                line >> n.x() >> n.y() >> n.z();
-                normals.push_back((trafo * n).normalized());
-            } else if (prefix == "f") {
-                std::string v1, v2, v3, v4;
-                line >> v1 >> v2 >> v3 >> v4;
-                OBJVertex verts[6];
-                int nVertices = 3;
-
-                verts[0] = OBJVertex(v1);
-                verts[1] = OBJVertex(v2);
-                verts[2] = OBJVertex(v3);
-
-                if (!v4.empty()) {
-                    /* This is a quad, split into two triangles */
-                    verts[3] = OBJVertex(v4);
-                    verts[4] = verts[0];
-                    verts[5] = verts[2];
-                    nVertices = 6;
-                }
-                /* Convert to an indexed vertex list */
-                for (int i=0; i<nVertices; ++i) {
-                    const OBJVertex &v = verts[i];
-                    VertexMap::const_iterator it = vertexMap.find(v);
-                    if (it == vertexMap.end()) {
-                        vertexMap[v] = (uint32_t) vertices.size();
-                        indices.push_back((uint32_t) vertices.size());
-                        vertices.push_back(v);
-                    } else {
-                        indices.push_back(it->second);
-                    }
-                }
-            }
+        std::unique_ptr<MemoryMappedFile> file;
+        try {
+            file.reset(new MemoryMappedFile(filename.str()));
+        } catch (const NoriException &) {
+            throw NoriException("Unable to open OBJ file \"%s\"!", filename);
         }
 
-        m_F.resize(3, indices.size()/3);
-        memcpy(m_F.data(), indices.data(), sizeof(uint32_t)*indices.size());
-
-        m_V.resize(3, vertices.size());
-        for (uint32_t i=0; i<vertices.size(); ++i)
-            m_V.col(i) = positions.at(vertices[i].p-1);
-
-        if (!normals.empty()) {
-            m_N.resize(3, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_N.col(i) = normals.at(vertices[i].n-1);
+        /* Split the file into chunks that end after a newline */
+        const char *data = (const char *) file->data();
+        const char *dataEnd = data + file->size();
+        std::vector<const char *> bounds(1, data);
+        while (bounds.back() != dataEnd) {
+            const char *ptr = bounds.back() + std::min(CHUNK_SIZE, (size_t) (dataEnd - bounds.back()));
+            if (ptr != dataEnd) {
+                const char *newline = (const char *) memchr(ptr, '\n', dataEnd - ptr);
+                ptr = newline ? newline + 1 : dataEnd;
+            }
+            bounds.push_back(ptr);
         }
 
-        if (!texcoords.empty()) {
-            m_UV.resize(2, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_UV.col(i) = texcoords.at(vertices[i].uv-1);
+        std::vector<OBJChunk> chunks(bounds.size() - 1);
+        tbb::parallel_for(size_t(0), chunks.size(), [&](size_t i) {
+            parse(bounds[i], bounds[i + 1], trafo, chunks[i]);
+        });
+
+        for (const OBJChunk &chunk : chunks)
+            m_bbox.expandBy(chunk.bbox);
+
+        std::vector<Vector3f>  positions = concatenate(chunks, &OBJChunk::positions);
+        std::vector<Vector2f>  texcoords = concatenate(chunks, &OBJChunk::texcoords);
+        std::vector<Vector3f>  normals   = concatenate(chunks, &OBJChunk::normals);
+        std::vector<OBJVertex> corners   = concatenate(chunks, &OBJChunk::corners);
+        chunks.clear();
+
+        /* Convert to an indexed vertex list */
+        std::vector<OBJVertex> vertices;
+        m_F.resize(3, corners.size() / 3);
+        {
+            VertexMap vertexMap(positions.size());
+            uint32_t *indices = m_F.data();
+            for (size_t i = 0; i < corners.size(); ++i) {
+                const OBJVertex &v = corners[i];
+                uint32_t index = vertexMap.insert(v, vertices);
+                if (index == vertices.size()) {
+                    if (v.p == 0 || v.p > positions.size() ||
+                        (!texcoords.empty() && (v.uv == 0 || v.uv > texcoords.size())) ||
+                        (!normals.empty() && (v.n == 0 || v.n > normals.size())))
+                        throw NoriException("OBJ file \"%s\" contains an invalid vertex index!", filename);
+                    vertices.push_back(v);
+                }
+                indices[i] = index;
+            }
         }
+        corners = std::vector<OBJVertex>();
+
+        uint32_t vertexCount = (uint32_t) vertices.size();
+        m_V.resize(3, vertexCount);
+        if (!normals.empty())
+            m_N.resize(3, vertexCount);
+        if (!texcoords.empty())
+            m_UV.resize(2, vertexCount);
+
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, vertexCount, 4096),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    m_V.col(i) = positions[vertices[i].p - 1];
+                    if (!normals.empty())
+                        m_N.col(i) = normals[vertices[i].n - 1];
+                    if (!texcoords.empty())
+                        m_UV.col(i) = texcoords[vertices[i].uv - 1];
+                }
+            }
+        );
 
         size_t meshSize = m_F.size() * sizeof(uint32_t) +
             sizeof(float) * (m_V.size() + m_N.size() + m_UV.size());
@@ -152,105 +294,169 @@ protected:
         uint32_t n = (uint32_t) -1;
         uint32_t uv = (uint32_t) -1;
 
-        inline OBJVertex() { }
-
-        inline OBJVertex(const std::string &string) {
-            std::vector<std::string> tokens = tokenize(string, "/", true);
-
-            if (tokens.size() < 1 || tokens.size() > 3)
-                throw NoriException("Invalid vertex data: \"%s\"", string);
+        inline bool operator==(const OBJVertex &v) const {
+            return v.p == p && v.n == n && v.uv == uv;
+        }
+    };
 
-            p = toUInt(tokens[0]);
+    /// Attributes and face corners of one chunk of the file
+    struct OBJChunk {
+        std::vector<Vector3f>  positions;
+        std::vector<Vector2f>  texcoords;
+        std::vector<Vector3f>  normals;
+        std::vector<OBJVertex> corners;
+        BoundingBox3f bbox;
+    };
 
-            if (tokens.size() >= 2 && !tokens[1].empty())
-                uv = toUInt(tokens[1]);
+    /**
+     * \brief Open-addressing hash table that maps OBJ vertices to
+     * indices in the order of their first appearance
+     */
+    class VertexMap {
+    public:
+        VertexMap(size_t expectedSize) {
+            size_t capacity = 1024;
+            while (capacity < 2 * expectedSize)
+                capacity *= 2;
+            m_entries.resize(capacity);
+        }
 
-            if (tokens.size() >= 3 && !tokens[2].empty())
-                n = toUInt(tokens[2]);
+        /**
+         * \brief Return the index of \c v, or <tt>vertices.size()</tt>
+         * if it has not been seen before (the caller must then append it)
+         */
+        uint32_t insert(const OBJVertex &v, const std::vector<OBJVertex> &vertices) {
+            size_t mask = m_entries.size() - 1;
+            for (size_t i = hash(v) & mask; ; i = (i + 1) & mask) {
+                Entry &entry = m_entries[i];
+                if (entry.index == (uint32_t) -1) {
+                    entry.vertex = v;
+                    entry.index = (uint32_t) vertices.size();
+                    if (2 * (vertices.size() + 1) > m_entries.size())
+                        grow(vertices, v);
+                    return (uint32_t) vertices.size();
+                } else if (entry.vertex == v) {
+                    return entry.index;
+                }
+            }
         }
 
-        inline bool operator==(const OBJVertex &v) const {
-            return v.p == p && v.n == n && v.uv == uv;
+    private:
+        struct Entry {
+            OBJVertex vertex;
+            uint32_t index = (uint32_t) -1;
+        };
+
+        static size_t hash(const OBJVertex &v) {
+            uint64_t hash = (uint64_t) v.p * 0x9E3779B97F4A7C15ull ^
+                            (uint64_t) v.uv * 0xC2B2AE3D27D4EB4Full ^
+                            (uint64_t) v.n * 0x165667B19E3779F9ull;
+            return (size_t) (hash ^ (hash >> 29));
         }
-    };
 
-    /// Hash function for OBJVertex
-    struct OBJVertexHash {
-        std::size_t operator()(const OBJVertex& v) const {
-            size_t hash = std::hash<uint32_t>()(v.p);
-            hash = hash * 37 + std::hash<uint32_t>()(v.uv);
-            hash = hash * 37 + std::hash<uint32_t>()(v.n);
-            return hash;
+        /// Double the capacity (\c v is about to be appended to \c vertices)
+        void grow(const std::vector<OBJVertex> &vertices, const OBJVertex &v) {
+            std::vector<Entry> entries(2 * m_entries.size());
+            size_t mask = entries.size() - 1;
+            for (size_t index = 0; index <= vertices.size(); ++index) {
+                const OBJVertex &vertex = index < vertices.size() ? vertices[index] : v;
+                size_t i = hash(vertex) & mask;
+                while (entries[i].index != (uint32_t) -1)
+                    i = (i + 1) & mask;
+                entries[i].vertex = vertex;
+                entries[i].index = (uint32_t) index;
+            }
+            m_entries = std::move(entries);
         }
+
+        std::vector<Entry> m_entries;
     };
 
-    void compute_pervertex_TBN() {
-        // column first for Eigen
-        // Initialize m_T and m_B to have the same size as m_V (3, N)
-        m_T.resize(3, m_V.cols());
-        m_T.setZero();
-        m_B.resize(3, m_V.cols());
-        m_B.setZero();
-
-        // Iterate over each face to compute tangents and bitangents
-        for (int i = 0; i < m_F.cols(); ++i) {
-            // Get vertex indices for the current face
-            int idx0 = m_F(0, i);
-            int idx1 = m_F(1, i);
-            int idx2 = m_F(2, i);
-
-            // Get positions and UVs for the current face
-            Vector3f p0 = m_V.col(idx0);
-            Vector3f p1 = m_V.col(idx1);
-            Vector3f p2 = m_V.col(idx2);
-
-            Vector2f uv0 = m_UV.col(idx0);
-            Vector2f uv1 = m_UV.col(idx1);
-            Vector2f uv2 = m_UV.col(idx2);
-
-            // Compute edges and delta UVs
-            Vector3f edge1 = p1 - p0;
-            Vector3f edge2 = p2 - p0;
-            Vector2f deltaUV1 = uv1 - uv0;
-            Vector2f deltaUV2 = uv2 - uv0;
-
-            // Compute tangent and bitangent for this face
-            float denom = deltaUV1.x() * deltaUV2.y() - deltaUV1.y() * deltaUV2.x();
-            // careful with degenerate triangle
-            float r = 1.0f / denom;
-            // weighting the degenerate TB with area
-            Vector3f T = r * (deltaUV2.y() * edge1 - deltaUV1.y() * edge2);
-            Vector3f B = r * (-deltaUV2.x() * edge1 + deltaUV1.x() * edge2);
-
-            // Accumulate the results to the vertices
-            m_T.col(idx0) += T;
-            m_T.col(idx1) += T;
-            m_T.col(idx2) += T;
-
-            m_B.col(idx0) += B;
-            m_B.col(idx1) += B;
-            m_B.col(idx2) += B;
-        }
+    /// Parse the lines in <tt>[ptr, end)</tt>
+    static void parse(const char *ptr, const char *end, const Transform &trafo, OBJChunk &chunk) {
+        while (ptr < end) {
+            skipSpace(ptr, end);
+            const char *prefix = ptr;
+            while (!isTokenEnd(ptr, end))
+                ++ptr;
+            size_t length = (size_t) (ptr - prefix);
 
-        // Normalize accumulated tangents and bitangents
-        for (int i = 0; i < m_V.cols(); ++i) {
-            m_T.col(i).normalize();
-            m_B.col(i).normalize();
-        }
+            if (length == 1 && prefix[0] == 'v') {
+                Point3f p;
+                p.x() = parseFloat(ptr, end);
+                p.y() = parseFloat(ptr, end);
+                p.z() = parseFloat(ptr, end);
+                p = trafo * p;
+                chunk.bbox.expandBy(p);
+                chunk.positions.push_back(p);
+            } else if (length == 2 && prefix[0] == 'v' && prefix[1] == 't') {
+                Point2f tc;
+                tc.x() = parseFloat(ptr, end);
+                tc.y() = parseFloat(ptr, end);
+                chunk.texcoords.push_back(tc);
+            } else if (length == 2 && prefix[0] == 'v' && prefix[1] == 'n') {
+                Normal3f n;
+                n.x() = parseFloat(ptr, end);
+                n.y() = parseFloat(ptr, end);
+                n.z() = parseFloat(ptr, end);
+                chunk.normals.push_back((trafo * n).normalized());
+            } else if (length == 1 && prefix[0] == 'f') {
+                /* Like before, vertices beyond the fourth are ignored */
+                OBJVertex verts[6];
+                int nVertices = 0;
+                for (; nVertices < 4; ++nVertices) {
+                    skipSpace(ptr, end);
+                    if (isTokenEnd(ptr, end))
+                        break;
+                    parseVertex(ptr, end, verts[nVertices]);
+                }
+                if (nVertices < 3)
+                    throw NoriException("Invalid face with %i vertices", nVertices);
 
-        for (int i = 0; i < m_V.cols(); ++i) {
-            Vector3f N = m_N.col(i).normalized(); // Per-vertex normal
-            Vector3f T = m_T.col(i);
-            Vector3f B = m_B.col(i);
+                if (nVertices == 4) {
+                    /* This is a quad, split into two triangles */
+                    verts[4] = verts[0];
+                    verts[5] = verts[2];
+                    nVertices = 6;
+                }
+                chunk.corners.insert(chunk.corners.end(), verts, verts + nVertices);
+            }
 
-            // Re-orthogonalize tangent and compute corrected bitangent
-            T = (T - N.dot(T) * N).normalized();
-            B = N.cross(T).normalized();
+            /* Skip the rest of the line */
+            const char *newline = ptr < end ? (const char *) memchr(ptr, '\n', end - ptr) : nullptr;
+            ptr = newline ? newline + 1 : end;
+        }
+    }
 
-            // Store back the orthogonalized results
-            m_T.col(i) = T;
-            m_B.col(i) = B;
+    /// Parse a vertex of a face ("p", "p/uv", "p//n" or "p/uv/n")
+    static void parseVertex(const char *&ptr, const char *end, OBJVertex &v) {
+        const char *start = ptr;
+        bool valid = parseUInt(ptr, end, v.p);
+        if (valid && ptr < end && *ptr == '/') {
+            ++ptr;
+            parseUInt(ptr, end, v.uv);
+            if (ptr < end && *ptr == '/') {
+                ++ptr;
+                parseUInt(ptr, end, v.n);
+            }
         }
+        if (!valid || !isTokenEnd(ptr, end))
+            throw NoriException("Invalid vertex data: \"%s\"", token(start, end));
+    }
+
+    template <typename T>
+    static std::vector<T> concatenate(std::vector<OBJChunk> &chunks, std::vector<T> OBJChunk::*member) {
+        std::vector<size_t> offsets(chunks.size() + 1, 0);
+        for (size_t i = 0; i < chunks.size(); ++i)
+            offsets[i + 1] = offsets[i] + (chunks[i].*member).size();
+
+        std::vector<T> result(offsets.back());
+        tbb::parallel_for(size_t(0), chunks.size(), [&](size_t i) {
+            std::vector<T> &values = chunks[i].*member;
+            std::copy(values.begin(), values.end(), result.begin() + offsets[i]);
+            values = std::vector<T>();
+        });
+        return result;
     }
 };
 
@@ -0,0 +1,80 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/mesh.h>
+#include <nori/timer.h>
+#include <filesystem/path.h>
+#include <memory>
+
+/*
+ * Converts OBJ files into the binary .nmesh format (see src/nmesh.cpp),
+ * which scenes can load without parsing:
+ *
+ *     obj2nmesh [--half] mesh.obj [more.obj ...]
+ *
+ * Every input is written next to the original with the extension .nmesh.
+ * With --half, normals, texture coordinates and tangents are stored as
+ * 16-bit floats.
+ */
+
+using namespace nori;
+
+int main(int argc, char **argv) {
+    bool halfPrecision = false;
+    std::vector<std::string> filenames;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string token(argv[i]);
+        if (token == "--help") {
+            cout << "Syntax: " << argv[0] << " [--half] <mesh.obj> [<mesh.obj> ..]" << endl;
+            return 0;
+        } else if (token == "--half") {
+            halfPrecision = true;
+        } else {
+            filenames.push_back(token);
+        }
+    }
+
+    if (filenames.empty()) {
+        cerr << "Syntax: " << argv[0] << " [--half] <mesh.obj> [<mesh.obj> ..]" << endl;
+        return -1;
+    }
+
+    try {
+        for (const std::string &filename : filenames) {
+            filesystem::path path(filename);
+            if (path.extension() != "obj")
+                throw NoriException("\"%s\" is not an OBJ file!", filename);
+            std::string output = filename.substr(0, filename.size() - 3) + "nmesh";
+
+            PropertyList props;
+            props.setString("filename", filename);
+            std::unique_ptr<Mesh> mesh(static_cast<Mesh *>(
+                NoriObjectFactory::createInstance("obj", props)));
+
+            Timer timer;
+            mesh->writeNMesh(output, halfPrecision);
+            cout << "Wrote \"" << output << "\" (took " << timer.elapsedString() << ")" << endl;
+        }
+    } catch (const std::exception &e) {
+        cerr << "Error: " << e.what() << endl;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,163 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/pager.h>
+#include <cstring>
+#include <new>
+
+/*
+ * Residency protocol. A reader increments the pin count of a cluster and
+ * then loads its data pointer; the evicting thread clears the data pointer
+ * and then loads the pin count. Both use sequentially consistent atomics,
+ * so at least one of them observes the other: either the reader sees no
+ * data (and falls back to the locked slow path), or the evicting thread
+ * sees the pin and puts the pointer back. Data that a reader has obtained
+ * is therefore never freed while it is pinned.
+ *
+ * The recency of a cluster is the value of a clock that advances with every
+ * miss, so all requests between two misses count as simultaneous. This
+ * keeps hits free of shared writes while still evicting in LRU order with
+ * respect to the misses, which are what the budget is about.
+ */
+
+NORI_NAMESPACE_BEGIN
+
+static const std::align_val_t CLUSTER_ALIGNMENT = std::align_val_t(64);
+
+static const uint32_t INVALID_CLUSTER = (uint32_t) -1;
+
+/// Source of the identifiers of the caches (0 is never used)
+static std::atomic<uint64_t> nextCacheId(1);
+
+void ClusterCache::AlignedDeleter::operator()(uint8_t *ptr) const {
+    ::operator delete[](ptr, CLUSTER_ALIGNMENT);
+}
+
+ClusterCache::ClusterCache(const std::string &filename,
+                           const std::vector<uint64_t> &offsets, size_t budget)
+    : m_id(nextCacheId++), m_budget(budget) {
+    m_file.reset(new MemoryMappedFile(filename));
+    m_clusterCount = offsets.empty() ? 0u : (uint32_t) offsets.size() - 1;
+    m_clusters.reset(new Cluster[m_clusterCount]);
+
+    for (uint32_t i = 0; i < m_clusterCount; ++i) {
+        if (offsets[i] > offsets[i + 1] || offsets[i + 1] > m_file->size())
+            throw NoriException("ClusterCache: cluster %i exceeds the size of \"%s\"",
+                                i, filename);
+        m_clusters[i].offset = offsets[i];
+        m_clusters[i].size = (uint32_t) (offsets[i + 1] - offsets[i]);
+    }
+}
+
+ClusterCache::~ClusterCache() { }
+
+const uint8_t *ClusterCache::load(uint32_t cluster, Stats &stats) const {
+    Cluster &c = m_clusters[cluster];
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (true) {
+        /* Nothing is evicted while the lock is held, so pinning is safe */
+        if (const uint8_t *data = c.data.load()) {
+            c.pins.fetch_add(1);
+            touch(c);
+            return data;
+        }
+        if (!c.loading)
+            break;
+        m_loaded.wait(lock);
+    }
+
+    c.loading = true;
+    uint64_t now = m_clock.fetch_add(1) + 1;
+    while (m_residentBytes + c.size > m_budget && evict(stats))
+        ;
+    m_residentBytes += c.size;
+    lock.unlock();
+
+    /* Copy the data without blocking the other threads */
+    std::unique_ptr<uint8_t, AlignedDeleter> storage(
+        (uint8_t *) ::operator new[](std::max(c.size, 1u), CLUSTER_ALIGNMENT));
+    memcpy(storage.get(), m_file->data() + c.offset, c.size);
+    m_file->discard(c.offset, c.size);
+
+    lock.lock();
+    const uint8_t *data = storage.get();
+    c.storage = std::move(storage);
+    c.residentIndex = (uint32_t) m_resident.size();
+    m_resident.push_back(cluster);
+    c.lastUse.store(now, std::memory_order_relaxed);
+    c.pins.fetch_add(1);
+    c.data.store(data);
+    c.loading = false;
+    stats.misses++;
+    stats.bytesRead += c.size;
+    m_loaded.notify_all();
+    return data;
+}
+
+bool ClusterCache::evict(Stats &stats) const {
+    for (size_t attempt = 0; attempt < m_resident.size(); ++attempt) {
+        uint32_t victim = INVALID_CLUSTER;
+        uint64_t oldest = std::numeric_limits<uint64_t>::max();
+        for (uint32_t index : m_resident) {
+            const Cluster &c = m_clusters[index];
+            uint64_t lastUse = c.lastUse.load(std::memory_order_relaxed);
+            if (lastUse < oldest && c.pins.load(std::memory_order_relaxed) == 0) {
+                oldest = lastUse;
+                victim = index;
+            }
+        }
+        if (victim == INVALID_CLUSTER)
+            return false;
+
+        Cluster &c = m_clusters[victim];
+        const uint8_t *data = c.data.exchange(nullptr);
+        if (c.pins.load() != 0) {
+            /* A reader pinned the cluster in the meantime, try another one */
+            c.data.store(data);
+            c.lastUse.store(m_clock.load(), std::memory_order_relaxed);
+            continue;
+        }
+
+        c.storage.reset();
+        m_clusters[m_resident.back()].residentIndex = c.residentIndex;
+        m_resident[c.residentIndex] = m_resident.back();
+        m_resident.pop_back();
+        m_residentBytes -= c.size;
+        stats.evictions++;
+        return true;
+    }
+    return false;
+}
+
+size_t ClusterCache::getResidentBytes() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_residentBytes;
+}
+
+void ClusterCache::resetStats() {
+    /* Entries remembered by localStats() would dangle after clear() */
+    for (Stats &stats : m_stats)
+        stats = Stats();
+}
+
+std::vector<ClusterCache::Stats> ClusterCache::getStats() const {
+    return std::vector<Stats>(m_stats.begin(), m_stats.end());
+}
+
+NORI_NAMESPACE_END
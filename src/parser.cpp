@@ -18,13 +18,97 @@
 
 #include <nori/parser.h>
 #include <nori/proplist.h>
+#include <nori/timer.h>
 #include <Eigen/Geometry>
 #include <pugixml.hpp>
+#include <tbb/parallel_for.h>
 #include <fstream>
+#include <mutex>
 #include <set>
 
+/*
+ * Scenes are loaded in three phases:
+ *
+ * 1. The XML tree is parsed into ObjectRecords, which hold the type,
+ *    property list and children of every object. Nothing is constructed.
+ * 2. All objects are constructed in parallel. Meshes, textures and
+ *    environment maps read their files in their constructors, so this is
+ *    where the assets are loaded. Objects without children (and thus
+ *    without dependencies) are also activated here.
+ * 3. Meshes whose children are all activated and not shared with other
+ *    objects (typically a BSDF and maybe an area light) are connected
+ *    and activated in parallel, since activate() precomputes tangents,
+ *    the area distribution, compact attributes and levels of detail.
+ * 4. In the order of the XML file, children are added to their parents
+ *    and the remaining objects are activated, exactly like before.
+ *
+ * While objects are created or activated in parallel, the output to cout
+ * is collected per object and printed in the order of the file afterwards.
+ */
+
 NORI_NAMESPACE_BEGIN
 
+/// An object of the scene description that has not been created yet
+struct ObjectRecord {
+    pugi::xml_node node;
+    int tag;
+    PropertyList propList;
+    std::vector<ObjectRecord *> children;  ///< Including references, in XML order
+    NoriObject *object = nullptr;
+    uint32_t parents = 0;                  ///< Number of objects that have this one as a child
+    bool connected = false;                ///< Have the children been added?
+    bool activated = false;
+    double loadTime = 0;                   ///< Time spent in phases 2 and 3 (ms)
+    std::string output;                    ///< Output to cout during phases 2 and 3
+};
+
+/**
+ * \brief Stream buffer that collects the output of every thread separately
+ *
+ * Installed in \c cout while objects are created in parallel, so that the
+ * messages of concurrent loads do not interleave.
+ */
+class ThreadOutputBuffer : public std::streambuf {
+public:
+    /**
+     * \brief Run \c f and return what it printed on the calling thread
+     *
+     * The output collected so far is set aside, since the thread may pick
+     * up another object while it waits for nested parallel work.
+     */
+    template <typename Func> static std::string capture(const Func &f) {
+        std::string outer, result;
+        outer.swap(buffer());
+        try {
+            f();
+        } catch (...) {
+            outer.swap(buffer());
+            throw;
+        }
+        result.swap(buffer());
+        outer.swap(buffer());
+        return result;
+    }
+
+protected:
+    virtual int_type overflow(int_type c) override {
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+            buffer().push_back(traits_type::to_char_type(c));
+        return traits_type::not_eof(c);
+    }
+
+    virtual std::streamsize xsputn(const char *s, std::streamsize n) override {
+        buffer().append(s, (size_t) n);
+        return n;
+    }
+
+private:
+    static std::string &buffer() {
+        static thread_local std::string output;
+        return output;
+    }
+};
+
 NoriObject *loadFromXML(const std::string &filename) {
     /* Load the XML file using 'pugi' (a tiny self-contained XML parser implemented in C++) */
     pugi::xml_document doc;
@@ -68,6 +152,7 @@ NoriObject *loadFromXML(const std::string &filename) {
         ESampler              = NoriObject::ESampler,
         ETest                 = NoriObject::ETest,
         EReconstructionFilter = NoriObject::EReconstructionFilter,
+        EShapeGroup           = NoriObject::EShapeGroup,
 
         /* Properties */
         EBoolean = NoriObject::EClassTypeCount,
@@ -83,6 +168,10 @@ NoriObject *loadFromXML(const std::string &filename) {
         ERotate,
         EScale,
         ELookAt,
+        EReference,
+
+        /* Shorthand for <mesh type="instance"> */
+        EInstance,
 
         EInvalid
     };
@@ -101,6 +190,8 @@ NoriObject *loadFromXML(const std::string &filename) {
     tags["sampler"]    = ESampler;
     tags["rfilter"]    = EReconstructionFilter;
     tags["test"]       = ETest;
+    tags["shapegroup"] = EShapeGroup;
+    tags["instance"]   = EInstance;
     tags["boolean"]    = EBoolean;
     tags["integer"]    = EInteger;
     tags["float"]      = EFloat;
@@ -114,6 +205,7 @@ NoriObject *loadFromXML(const std::string &filename) {
     tags["rotate"]     = ERotate;
     tags["scale"]      = EScale;
     tags["lookat"]     = ELookAt;
+    tags["ref"]        = EReference;
 
     /* Helper function to check if attributes are fully specified */
     auto check_attributes = [&](const pugi::xml_node &node, std::set<std::string> attrs) {
@@ -131,9 +223,15 @@ NoriObject *loadFromXML(const std::string &filename) {
 
     Eigen::Affine3f transform;
 
+    /* Objects that were declared with an "id" attribute (only shape groups can be used again via <ref>) */
+    std::map<std::string, ObjectRecord *> namedObjects;
+
+    /* All objects, children before their parents (i.e. in the original activation order) */
+    std::vector<std::unique_ptr<ObjectRecord>> records;
+
     /* Helper function to parse a Nori XML node (recursive) */
-    std::function<NoriObject *(pugi::xml_node &, PropertyList &, int)> parseTag = [&](
-        pugi::xml_node &node, PropertyList &list, int parentTag) -> NoriObject * {
+    std::function<ObjectRecord *(pugi::xml_node &, PropertyList &, int)> parseTag = [&](
+        pugi::xml_node &node, PropertyList &list, int parentTag) -> ObjectRecord * {
         /* Skip over comments */
         if (node.type() == pugi::node_comment || node.type() == pugi::node_declaration)
             return nullptr;
@@ -150,6 +248,12 @@ NoriObject *loadFromXML(const std::string &filename) {
                                 filename, node.name(), offset(node.offset_debug()));
         int tag = it->second;
 
+        /* Instances are shapes, but get their own tag for readability */
+        if (tag == EInstance) {
+            node.append_attribute("type") = "instance";
+            tag = EMesh;
+        }
+
         /* Perform some safety checks to make sure that the XML tree really makes sense */
         bool hasParent            = parentTag != EInvalid;
         bool parentIsObject       = hasParent && parentTag < NoriObject::EClassTypeCount;
@@ -170,50 +274,67 @@ NoriObject *loadFromXML(const std::string &filename) {
             throw NoriException("Error while parsing \"%s\": node \"%s\" requires a Nori object as parent (at %s)",
                                 filename, node.name(), offset(node.offset_debug()));
 
+        if (tag == EReference) {
+            /* Hand out a previously declared object again */
+            check_attributes(node, { "id" });
+            auto it = namedObjects.find(node.attribute("id").value());
+            if (it == namedObjects.end())
+                throw NoriException("Error while parsing \"%s\": reference to unknown object \"%s\" (at %s)",
+                                    filename, node.attribute("id").value(), offset(node.offset_debug()));
+
+            /* Every parent takes ownership of its children (e.g. shapes delete
+               their BSDF), so only shape groups, which instances merely
+               point to, may have several parents */
+            if (it->second->tag != EShapeGroup)
+                throw NoriException("Error while parsing \"%s\": \"%s\" is not a shape group, "
+                                    "only shape groups can be referenced (at %s)",
+                                    filename, node.attribute("id").value(), offset(node.offset_debug()));
+            return it->second;
+        }
+
         if (tag == EScene)
             node.append_attribute("type") = "scene";
+        else if (tag == EShapeGroup)
+            node.append_attribute("type") = "shapegroup";
         else if (tag == ETransform)
             transform.setIdentity();
 
+        /* Object ids are local to the enclosing scene */
+        std::map<std::string, ObjectRecord *> outerObjects;
+        if (tag == EScene)
+            outerObjects.swap(namedObjects);
+
         PropertyList propList;
-        std::vector<NoriObject *> children;
+        std::vector<ObjectRecord *> children;
         for (pugi::xml_node &ch: node.children()) {
-            NoriObject *child = parseTag(ch, propList, tag);
+            ObjectRecord *child = parseTag(ch, propList, tag);
             if (child)
                 children.push_back(child);
         }
 
-        NoriObject *result = nullptr;
+        if (tag == EScene)
+            namedObjects.swap(outerObjects);
+
+        ObjectRecord *result = nullptr;
         try {
             if (currentIsObject) {
                 //check_attributes(node, { "type" });
 
-                /* This is an object, first instantiate it */
-                result = NoriObjectFactory::createInstance(
-                    node.attribute("type").value(),
-                    propList
-                );
-
-                if (result->getClassType() != (int) tag) {
-                    throw NoriException(
-                        "Unexpectedly constructed an object "
-                        "of type <%s> (expected type <%s>): %s",
-                        NoriObject::classTypeName(result->getClassType()),
-                        NoriObject::classTypeName((NoriObject::EClassType) tag),
-                        result->toString());
+                /* This is an object, which is created later on */
+                result = new ObjectRecord();
+                result->node = node;
+                result->tag = tag;
+                result->propList = std::move(propList);
+                result->children = std::move(children);
+                records.emplace_back(result);
+
+                /* Remember it for later references */
+                if (node.attribute("id")) {
+                    std::string id = node.attribute("id").value();
+                    if (namedObjects.find(id) != namedObjects.end())
+                        throw NoriException("Duplicate object id \"%s\"", id);
+                    namedObjects[id] = result;
                 }
-
-                // set the name to help parent decide what to do with this node
-                result->setIdName(node.attribute("name").value());
-
-                /* Add all children */
-                for (auto ch: children) {
-                    result->addChild(ch);
-                    ch->setParent(result);
-                }
-
-                /* Activate / configure the object */
-                result->activate();
             } else {
                 /* This is a property */
                 switch (tag) {
@@ -334,7 +455,138 @@ NoriObject *loadFromXML(const std::string &filename) {
     };
 
     PropertyList list;
-    return parseTag(*doc.begin(), list, EInvalid);
+    ObjectRecord *root = parseTag(*doc.begin(), list, EInvalid);
+    for (const auto &record : records) {
+        for (ObjectRecord *ch : record->children)
+            ++ch->parents;
+    }
+
+    /* Instantiate an object and activate it if it has no children */
+    auto create = [&](ObjectRecord &record) {
+        Timer timer;
+        NoriObject *result = NoriObjectFactory::createInstance(
+            record.node.attribute("type").value(),
+            record.propList
+        );
+        record.object = result;
+
+        if (result->getClassType() != record.tag) {
+            throw NoriException(
+                "Unexpectedly constructed an object "
+                "of type <%s> (expected type <%s>): %s",
+                NoriObject::classTypeName(result->getClassType()),
+                NoriObject::classTypeName((NoriObject::EClassType) record.tag),
+                result->toString());
+        }
+
+        // set the name to help parent decide what to do with this node
+        result->setIdName(record.node.attribute("name").value());
+
+        /* Tests run in activate() and print their results, so they stay sequential */
+        if (record.children.empty() && record.tag != ETest) {
+            result->activate();
+            record.activated = true;
+        }
+        record.loadTime = timer.elapsed();
+    };
+
+    /* Add the children of an object */
+    auto connect = [](ObjectRecord &record) {
+        for (ObjectRecord *ch : record.children) {
+            record.object->addChild(ch->object);
+            ch->object->setParent(record.object);
+        }
+        record.connected = true;
+    };
+
+    /* Run 'f' on the given records in parallel and collect their output */
+    std::mutex errorMutex;
+    std::string error;
+    auto forEach = [&](const std::vector<ObjectRecord *> &list, auto f) {
+        tbb::parallel_for(
+            tbb::blocked_range<size_t>(0, list.size(), 1),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i) {
+                    ObjectRecord &record = *list[i];
+                    try {
+                        record.output += ThreadOutputBuffer::capture([&] { f(record); });
+                    } catch (const std::exception &e) {
+                        std::lock_guard<std::mutex> guard(errorMutex);
+                        if (error.empty())
+                            error = tfm::format("Error while parsing \"%s\": %s (at %s)", filename,
+                                                e.what(), offset(record.node.offset_debug()));
+                    }
+                }
+            },
+            tbb::simple_partitioner()
+        );
+    };
+
+    ThreadOutputBuffer threadOutput;
+    std::streambuf *coutBuffer = cout.rdbuf(&threadOutput);
+
+    /* Phase 2: construct all objects in parallel */
+    Timer timer;
+    std::vector<ObjectRecord *> all;
+    for (const auto &record : records)
+        all.push_back(record.get());
+    forEach(all, create);
+
+    /* Phase 3: connect and activate the independent meshes in parallel */
+    std::vector<ObjectRecord *> meshes;
+    for (const auto &record : records) {
+        bool independent = error.empty() && record->tag == EMesh && !record->activated;
+        for (ObjectRecord *ch : record->children)
+            independent = independent && ch->activated && ch->parents == 1;
+        if (independent)
+            meshes.push_back(record.get());
+    }
+    forEach(meshes, [&](ObjectRecord &record) {
+        Timer timer;
+        connect(record);
+        record.object->activate();
+        record.activated = true;
+        record.loadTime += timer.elapsed();
+    });
+
+    cout.rdbuf(coutBuffer);
+    for (const auto &record : records)
+        cout << record->output;
+    cout.flush();
+    if (!error.empty())
+        throw NoriException("%s", error);
+
+    /* Report the objects that loaded a file */
+    bool header = false;
+    for (const auto &record : records) {
+        if (!record->propList.has("filename"))
+            continue;
+        if (!header) {
+            cout << "Loaded assets in " << timer.elapsedString() << ":" << endl;
+            header = true;
+        }
+        cout << "  " << record->node.attribute("type").value() << " \""
+             << record->propList.getString("filename", "") << "\": "
+             << timeString(record->loadTime) << endl;
+    }
+
+    /* Phase 4: connect and activate the objects in their original order */
+    for (const auto &record : records) {
+        try {
+            /* Add all children */
+            if (!record->connected)
+                connect(*record);
+
+            /* Activate / configure the object */
+            if (!record->activated)
+                record->object->activate();
+        } catch (const NoriException &e) {
+            throw NoriException("Error while parsing \"%s\": %s (at %s)", filename,
+                                e.what(), offset(record->node.offset_debug()));
+        }
+    }
+
+    return root ? root->object : nullptr;
 }
 
 NORI_NAMESPACE_END
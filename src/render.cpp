@@ -26,11 +26,11 @@
 #include <nori/sampler.h>
 #include <nori/integrator.h>
 #include <nori/gui.h>
+#include <nori/scheduler.h>
+#include <nori/checkpoint.h>
 #include <tbb/parallel_for.h>
-#include <tbb/blocked_range.h>
 #include <tbb/task_scheduler_init.h>
 #include <filesystem/resolver.h>
-#include <tbb/concurrent_vector.h>
 
 
 NORI_NAMESPACE_BEGIN
@@ -70,20 +70,68 @@ float RenderThread::getProgress() {
     else return 1.f;
 }
 
-static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block) {
+/**
+ * Render one sample per pixel of the block and add it to the block's contents.
+ * With \c statistics, converged pixels are skipped and the samples of the
+ * other ones are recorded. Returns the number of samples that were rendered.
+ */
+static size_t renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block,
+                          PixelStatistics *statistics) {
     const Camera *camera = scene->getCamera();
     const Integrator *integrator = scene->getIntegrator();
 
     Point2i offset = block.getOffset();
     Vector2i size  = block.getSize();
 
-    /* Clear the block contents */
-    block.clear();
+    if (scene->usePacketTracing() && integrator->supportsPrimaryHits()) {
+        /* Generate the camera rays of the entire block in 4x4 pixel tiles,
+           so that every packet of 16 rays covers a compact image region */
+        size_t count = (size_t) size.x() * size.y(), n = 0;
+        std::vector<Point2i> pixels(count);
+        std::vector<Point2f> pixelSamples(count);
+        std::vector<Color3f> weights(count);
+        std::vector<Ray3f> rays(count);
+        std::vector<Intersection> its(count);
+        std::unique_ptr<bool[]> hits(new bool[count]);
+
+        for (int ty=0; ty<size.y(); ty += 4) {
+            for (int tx=0; tx<size.x(); tx += 4) {
+                for (int y=ty; y<std::min(ty + 4, size.y()); ++y) {
+                    for (int x=tx; x<std::min(tx + 4, size.x()); ++x) {
+                        pixels[n] = Point2i(x + offset.x(), y + offset.y());
+                        if (statistics && statistics->isConverged(pixels[n]))
+                            continue;
+                        pixelSamples[n] = pixels[n].cast<float>() + sampler->next2D();
+                        Point2f apertureSample = sampler->next2D();
+                        weights[n] = camera->sampleRay(rays[n], pixelSamples[n], apertureSample);
+                        ++n;
+                    }
+                }
+            }
+        }
+
+        /* Trace all primary rays at once */
+        scene->rayIntersectStream(rays.data(), its.data(), hits.get(), n);
+
+        /* Shade the hits and store them in the image block */
+        for (size_t i=0; i<n; ++i) {
+            Color3f value = weights[i] * integrator->LiHit(scene, sampler, rays[i], its[i], hits[i]);
+            block.put(pixelSamples[i], value);
+            if (statistics)
+                statistics->put(pixels[i], value);
+        }
+        return n;
+    }
 
     /* For each pixel and pixel sample sample */
+    size_t n = 0;
     for (int y=0; y<size.y(); ++y) {
         for (int x=0; x<size.x(); ++x) {
-            Point2f pixelSample = Point2f((float) (x + offset.x()), (float) (y + offset.y())) + sampler->next2D();
+            Point2i pixel(x + offset.x(), y + offset.y());
+            if (statistics && statistics->isConverged(pixel))
+                continue;
+
+            Point2f pixelSample = pixel.cast<float>() + sampler->next2D();
             Point2f apertureSample = sampler->next2D();
 
             /* Sample a ray from the camera */
@@ -95,11 +143,67 @@ static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block)
 
             /* Store in the image block */
             block.put(pixelSample, value);
+            if (statistics)
+                statistics->put(pixel, value);
+            ++n;
         }
     }
+    return n;
 }
 
+/**
+ * \brief Estimate of the RMSE of the pixel luminances
+ *
+ * The estimate is assembled from the variance sums of the tiles (see
+ * \ref PixelStatistics::getVarianceSum()), which the worker that holds a
+ * tile updates after each of its visits.
+ */
+class NoiseEstimate {
+public:
+    NoiseEstimate(TileScheduler &scheduler) : m_tiles(scheduler.getTileCount()) {
+        for (uint32_t i = 0; i < scheduler.getTileCount(); ++i) {
+            const TileScheduler::Tile &tile = scheduler.getTile(i);
+            m_tiles[i].missing = (uint32_t) (tile.size.x() * tile.size.y());
+            m_missing += m_tiles[i].missing;
+        }
+        m_pixelCount = std::max((double) m_missing.load(), 1.0);
+    }
+
+    /// Update the contribution of a tile, which must not be visited at the same time
+    void update(const TileScheduler::Tile &tile, const PixelStatistics &statistics) {
+        Entry &entry = m_tiles[tile.id];
+        uint32_t missing;
+        double variance = statistics.getVarianceSum(tile.offset, tile.size, missing);
+        m_missing.fetch_add((int64_t) missing - (int64_t) entry.missing);
+        double sum = m_varianceSum.load();
+        while (!m_varianceSum.compare_exchange_weak(sum, sum + (variance - entry.variance)))
+            ;
+        entry.variance = variance;
+        entry.missing = missing;
+    }
+
+    /// Return the estimated RMSE (infinite while some pixels have fewer than two samples)
+    float getRMSE() const {
+        if (m_missing.load() > 0)
+            return std::numeric_limits<float>::infinity();
+        return (float) std::sqrt(std::max(m_varianceSum.load(), 0.0) / m_pixelCount);
+    }
+
+private:
+    struct Entry {
+        double variance = 0;  ///< Sum of the variances of the tile's pixels
+        uint32_t missing = 0; ///< Number of pixels without a variance estimate
+    };
+
+    std::vector<Entry> m_tiles;
+    std::atomic<double> m_varianceSum { 0.0 };
+    std::atomic<int64_t> m_missing { 0 };
+    double m_pixelCount;
+};
+
 void RenderThread::renderScene(const std::string & filename) {
+    /* The time budget includes loading the scene */
+    Timer startTimer;
 
     filesystem::path path(filename);
 
@@ -131,66 +235,210 @@ void RenderThread::renderScene(const std::string & filename) {
         m_render_status = 1;
         m_progress = 0.f;
         int n_threads = tbb::task_scheduler_init::automatic; 
-        m_render_thread = std::thread([this, outputNameStem] {
+        float timeBudget = m_timeBudget, targetRMSE = m_targetRMSE;
+        float checkpointInterval = m_checkpointInterval;
+        bool resume = m_resume;
+        m_render_thread = std::thread([this, outputNameStem, startTimer, timeBudget, targetRMSE,
+                                       checkpointInterval, resume] {
             tbb::task_scheduler_init init;
             const Camera *camera = m_scene->getCamera();
             Vector2i outputSize = camera->getOutputSize();
 
-            /* Create a block generator (i.e. a work scheduler) */
-            BlockGenerator blockGenerator(outputSize, NORI_BLOCK_SIZE);
+            /* Divide the image into tiles, which the workers refine in
+               turns without waiting for each other (see TileScheduler) */
+            uint32_t numSamples = (uint32_t) m_scene->getSampler()->getSampleCount();
+            uint32_t numWorkers = (uint32_t) tbb::task_scheduler_init::default_num_threads();
+            uint64_t sampleBudget = (uint64_t) outputSize.x() * outputSize.y() * numSamples;
+
+            /* Rendering against a deadline or a noise level continues until
+               one of them is reached instead of stopping at the sample count */
+            bool progressive = timeBudget > 0 || targetRMSE > 0;
+            if (progressive) {
+                numSamples = std::numeric_limits<uint32_t>::max();
+                sampleBudget = std::numeric_limits<uint64_t>::max();
+            }
+
+            /* With adaptive sampling, converged pixels are skipped and leave
+               their samples to the others, up to a maximum per pixel */
+            std::unique_ptr<PixelStatistics> statistics;
+            if (m_scene->useAdaptiveSampling()) {
+                uint32_t maxSamples = m_scene->getAdaptiveMaxSamples();
+                statistics.reset(new PixelStatistics(outputSize, m_scene->getAdaptiveThreshold(),
+                    std::min(m_scene->getAdaptiveMinSamples(), maxSamples), maxSamples));
+                numSamples = maxSamples;
+            } else if (targetRMSE > 0) {
+                statistics.reset(new PixelStatistics(outputSize, 0.f, 2, numSamples));
+            }
+
+            TileScheduler scheduler(outputSize, NORI_BLOCK_SIZE, numSamples,
+                                    m_scene->getSamplesPerVisit(), numWorkers, sampleBudget);
+
+            /* Save the state of the rendering periodically, and continue from
+               the last save of an interrupted rendering of the same scene */
+            std::unique_ptr<RenderCheckpoint> checkpoint;
+            if (checkpointInterval > 0 || resume) {
+                std::string settings = tfm::format("%s\n%i %i %i %i %f %i %i", m_scene->toString(),
+                    NORI_BLOCK_SIZE, numSamples, m_scene->getSamplesPerVisit(),
+                    m_scene->useAdaptiveSampling(), m_scene->getAdaptiveThreshold(),
+                    m_scene->getAdaptiveMinSamples(), targetRMSE > 0);
+                checkpoint.reset(new RenderCheckpoint(outputNameStem + ".checkpoint",
+                    hashBytes(settings.data(), settings.size()),
+                    checkpointInterval > 0 ? checkpointInterval : std::numeric_limits<float>::infinity()));
+            }
+            if (resume) {
+                try {
+                    if (checkpoint->restore(m_block, scheduler, *m_scene->getSampler(), statistics.get()))
+                        cout << tfm::format("Resuming from \"%s.checkpoint\" (%.1f samples per pixel on average)",
+                            outputNameStem, (double) scheduler.getFinishedSamples() /
+                            ((double) outputSize.x() * outputSize.y())) << endl;
+                } catch (const NoriException &e) {
+                    cerr << "Warning: " << e.what() << " Rendering from the start." << endl;
+                }
+            }
+
+            std::unique_ptr<NoiseEstimate> noise;
+            if (targetRMSE > 0) {
+                noise.reset(new NoiseEstimate(scheduler));
+                for (uint32_t i = 0; i < scheduler.getTileCount(); ++i)
+                    noise->update(scheduler.getTile(i), *statistics);
+            }
 
             cout << "Rendering .. ";
             cout.flush();
             Timer timer;
 
-            auto numSamples = m_scene->getSampler()->getSampleCount();
-            auto numBlocks = blockGenerator.getBlockCount();
+            auto work = [&](uint32_t worker) {
+                // Allocate memory for a small image block, which the worker uses for all of its visits
+                ImageBlock block(Vector2i(NORI_BLOCK_SIZE),
+                                 camera->getReconstructionFilter());
+
+                TileScheduler::Visit visit;
+                while (true) {
+                    if (checkpoint)
+                        checkpoint->beginVisit();
+                    if (!scheduler.next(worker, visit))
+                        break;
+                    TileScheduler::Tile &tile = *visit.tile;
+                    block.setOffset(tile.offset);
+                    block.setSize(tile.size);
+                    block.setBlockId(tile.id);
+                    block.clear();
+
+                    // Continue using the same sampler for every visit of the tile
+                    if (!tile.sampler) {
+                        tile.sampler = m_scene->getSampler()->clone();
+                        tile.sampler->prepare(block);
+                    }
 
-            tbb::concurrent_vector< std::unique_ptr<Sampler> > samplers;
-            samplers.resize(numBlocks);
+                    // Render the samples of this visit. Once the deadline has passed, the
+                    // tile is left as soon as it has one sample per pixel
+                    uint32_t samples = 0;
+                    size_t pixelSamples = 0;
+                    for (uint32_t k = visit.sampleBegin; k < visit.sampleEnd; ++k, ++samples) {
+                        if (m_render_status == 2) {
+                            scheduler.abort();
+                            break;
+                        }
+                        if (timeBudget > 0 && startTimer.elapsed() >= 1000.0 * timeBudget)
+                            scheduler.stop();
+                        if (k > 0 && scheduler.isStopped())
+                            break;
+                        pixelSamples += renderBlock(m_scene, tile.sampler.get(), block, statistics.get());
+                    }
 
-            for (uint32_t k = 0; k < numSamples ; ++k) {
-                m_progress = k/float(numSamples);
-                if(m_render_status == 2)
-                    break;
+                    // Retire the tile once all of its pixels have converged
+                    if (m_scene->useAdaptiveSampling())
+                        tile.activePixels = statistics->getActivePixelCount(tile.offset, tile.size);
 
-                tbb::blocked_range<int> range(0, numBlocks);
+                    // Stop once the estimated noise level is reached
+                    if (noise) {
+                        noise->update(tile, *statistics);
+                        if (noise->getRMSE() <= targetRMSE)
+                            scheduler.stop();
+                    }
 
-                auto map = [&](const tbb::blocked_range<int> &range) {
-                    // Allocate memory for a small image block to be rendered by the current thread
-                    ImageBlock block(Vector2i(NORI_BLOCK_SIZE),
-                                     camera->getReconstructionFilter());
+                    // The image block has been processed. Now add it to the "big" block that represents the entire image.
+                    // No other worker renders this tile at the same time, so only its border needs atomic updates
+                    m_block.putExclusive(block);
 
-                    for (int i = range.begin(); i < range.end(); ++i) {
-                        // Request an image block from the block generator
-                        blockGenerator.next(block);
+                    scheduler.finish(worker, visit, samples, pixelSamples);
 
-                        // Get block id to continue using the same sampler
-                        auto blockId = block.getBlockId();
-                        if(k == 0) { // Initialize the sampler for the first sample
-                            std::unique_ptr<Sampler> sampler(m_scene->getSampler()->clone());
-                            sampler->prepare(block);
-                            samplers.at(blockId) = std::move(sampler);
-                        }
-
-                        // Render all contained pixels
-                        renderBlock(m_scene, samplers.at(blockId).get(), block);
+                    // A stopped rendering has dropped the unfinished tiles from the queues
+                    if (checkpoint) {
+                        checkpoint->endVisit();
+                        if (checkpoint->isDue() && !scheduler.isStopped())
+                            checkpoint->capture(m_block, scheduler, statistics.get());
+                    }
 
-                        // The image block has been processed. Now add it to the "big" block that represents the entire image
-                        m_block.put(block);
+                    if (progressive) {
+                        /* The variance falls with the inverse of the sample count */
+                        float progress = 0.f;
+                        if (timeBudget > 0)
+                            progress = (float) (startTimer.elapsed() / (1000.0 * timeBudget));
+                        if (noise)
+                            progress = std::max(progress, std::pow(targetRMSE / noise->getRMSE(), 2.f));
+                        m_progress = std::min(progress, 1.f);
+                    } else {
+                        m_progress = scheduler.getProgress();
                     }
-                };
+                }
+                if (checkpoint)
+                    checkpoint->endVisit();
+            };
 
-                /// Uncomment the following line for single threaded rendering
-                //map(range);
+            /// Uncomment the following line for single threaded rendering
+            //work(0);
 
-                /// Default: parallel rendering
-                tbb::parallel_for(range, map);
+            /// Default: parallel rendering
+            tbb::parallel_for(0u, numWorkers, work);
 
-                blockGenerator.reset();
+            cout << "done. (took " << timer.elapsedString() << ")" << endl;
+
+            if (progressive || statistics) {
+                uint32_t minSamples = std::numeric_limits<uint32_t>::max(), maxSamples = 0, retired = 0;
+                for (uint32_t i = 0; i < scheduler.getTileCount(); ++i) {
+                    const TileScheduler::Tile &tile = scheduler.getTile(i);
+                    minSamples = std::min(minSamples, tile.samples);
+                    maxSamples = std::max(maxSamples, tile.samples);
+                    retired += tile.activePixels == 0 ? 1 : 0;
+                }
+                std::string summary = tfm::format("Achieved %.1f samples per pixel on average",
+                    (double) scheduler.getFinishedSamples() / ((double) outputSize.x() * outputSize.y()));
+                if (m_scene->useAdaptiveSampling())
+                    summary += tfm::format(", %i of %i tiles retired", retired, scheduler.getTileCount());
+                else
+                    summary += tfm::format(" (%i to %i per tile)", minSamples, maxSamples);
+                if (noise)
+                    summary += tfm::format(", estimated RMSE %.4g", noise->getRMSE());
+                cout << summary << endl;
             }
 
-            cout << "done. (took " << timer.elapsedString() << ")" << endl;
+            BVH::TraversalStats stats = m_scene->getBVH()->getTraversalStats();
+            if (stats.rays > 0)
+                cout << "BVH traversal: " << stats.rays << " rays, "
+                     << (double) stats.nodes / stats.rays << " nodes/ray, "
+                     << (double) stats.primitives / stats.rays << " primitives/ray" << endl;
+            if (stats.shadowRays > 0)
+                cout << "BVH occlusion: " << stats.shadowRays << " rays, "
+                     << (double) stats.shadowNodes / stats.shadowRays << " nodes/ray" << endl;
+
+            std::vector<ClusterCache::Stats> paging = m_scene->getBVH()->getPagingStats();
+            if (!paging.empty()) {
+                ClusterCache::Stats total;
+                std::string misses;
+                for (const ClusterCache::Stats &thread : paging) {
+                    total.accesses += thread.accesses;
+                    total.misses += thread.misses;
+                    total.evictions += thread.evictions;
+                    total.bytesRead += thread.bytesRead;
+                    misses += (misses.empty() ? "" : ", ") + std::to_string(thread.misses);
+                }
+                cout << "Geometry paging: " << total.accesses << " lookups, " << total.misses
+                     << " misses (" << 100.0 * total.misses / std::max(total.accesses, (uint64_t) 1)
+                     << "%), " << total.evictions << " evictions, " << memString(total.bytesRead)
+                     << " read" << endl;
+                cout << "Geometry paging misses per thread: " << misses << endl;
+            }
 
             /* Now turn the rendered image block into
                a properly normalized bitmap */
@@ -201,6 +449,16 @@ void RenderThread::renderScene(const std::string & filename) {
             /* Save using the OpenEXR and PNG formats */
             bitmap->save(outputNameStem);
 
+            /* Save the number of samples of every pixel as an additional output */
+            if (statistics) {
+                std::unique_ptr<Bitmap> sampleCounts(statistics->toSampleCountBitmap());
+                sampleCounts->saveEXR(outputNameStem + "_samples");
+            }
+
+            /* The checkpoint is no longer needed once the image is saved */
+            if (checkpoint && !scheduler.isAborted())
+                checkpoint->remove();
+
             delete m_scene;
             m_scene = nullptr;
 
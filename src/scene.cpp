@@ -22,11 +22,67 @@
 #include <nori/sampler.h>
 #include <nori/camera.h>
 #include <nori/emitter.h>
+#include <nori/lod.h>
+#include <filesystem/resolver.h>
+#include <Eigen/Geometry>
 
 NORI_NAMESPACE_BEGIN
 
-Scene::Scene(const PropertyList &) {
+Scene::Scene(const PropertyList &propList) {
     m_bvh = new BVH();
+
+    /* Branching factor of the acceleration structure (2, 4 or 8) */
+    m_bvh->setWidth(propList.getInteger("bvhWidth", 2));
+
+    /* Store the wide nodes with 8-bit quantized child bounds */
+    m_bvh->setCompressed(propList.getBoolean("bvhCompressed", false));
+
+    /* Construction algorithm ("sah", "sbvh", "lbvh" or "hlbvh") and the
+       fraction of additional references that spatial splits may create */
+    m_bvh->setBuildMethod(BVH::parseBuildMethod(propList.getString("bvhBuilder", "sah")));
+    m_bvh->setSplitBudget(propList.getFloat("sbvhBudget", 0.3f));
+
+    /* Arrangement of the nodes in memory ("depthfirst", "treelet" or "veb") */
+    m_bvh->setNodeOrder(BVH::parseNodeOrder(propList.getString("bvhNodeOrder", "depthfirst")));
+
+    /* Copy the triangles into SoA blocks for the leaf tests (disable to
+       save their memory at the cost of slower traversal) */
+    m_bvh->setTriangleBlocks(propList.getBoolean("bvhTriangleBlocks", true));
+
+    /* Directory for cached hierarchies, relative to the scene file */
+    std::string cacheDirectory = propList.getString("bvhCache", "");
+    if (!cacheDirectory.empty())
+        m_bvh->setCacheDirectory(getFileResolver()->resolve(cacheDirectory).str());
+
+    /* Memory budget of the paged triangle blocks and meshes in MiB
+       (0: keep them in memory) */
+    int pagingBudget = propList.getInteger("bvhPagingBudget", 0);
+    if (pagingBudget < 0)
+        throw NoriException("Scene: the paging budget must be non-negative!");
+    m_bvh->setPagingBudget((size_t) pagingBudget * 1024 * 1024);
+
+    /* Tolerated error of the levels of detail in pixels */
+    m_lodPixelError = propList.getFloat("lodPixelError", 0.5f);
+
+    /* Trace camera rays in coherent packets */
+    m_packetTracing = propList.getBoolean("packetTracing", false);
+
+    /* Samples per pixel that a render worker takes at each visit of a tile */
+    int samplesPerVisit = propList.getInteger("samplesPerVisit", 1);
+    if (samplesPerVisit < 1)
+        throw NoriException("Scene: the number of samples per visit must be positive!");
+    m_samplesPerVisit = (uint32_t) samplesPerVisit;
+
+    /* Adaptive sampling: relative standard error at which pixels stop
+       receiving samples (0: disabled), and the range of samples per pixel
+       (0: four times the sample count of the sampler) */
+    m_adaptiveThreshold = propList.getFloat("adaptiveThreshold", 0.f);
+    int adaptiveMinSamples = propList.getInteger("adaptiveMinSamples", 16);
+    int adaptiveMaxSamples = propList.getInteger("adaptiveMaxSamples", 0);
+    if (m_adaptiveThreshold < 0 || adaptiveMinSamples < 2 || adaptiveMaxSamples < 0)
+        throw NoriException("Scene: invalid adaptive sampling parameters!");
+    m_adaptiveMinSamples = (uint32_t) adaptiveMinSamples;
+    m_adaptiveMaxSamples = (uint32_t) adaptiveMaxSamples;
 }
 
 Scene::~Scene() {
@@ -37,11 +93,19 @@ Scene::~Scene() {
     for(auto e : m_emitters)
         delete e;
     m_emitters.clear();
+    for (auto group : m_shapeGroups)
+        delete group;
 }
 
 void Scene::activate() {
     m_bvh->build();
 
+    /* Reject hits on cut-out regions inside the traversal */
+    for (const Shape *shape : m_shapes) {
+        if (shape->isAlphaTested())
+            m_hitFilter = &Shape::alphaTest;
+    }
+
     if (!m_integrator)
         throw NoriException("No integrator was specified!");
     if (!m_camera)
@@ -54,16 +118,59 @@ void Scene::activate() {
         m_sampler->activate();
     }
 
+    /* Select the levels of detail from the angle between neighboring camera rays */
+    if (!m_lodShapes.empty()) {
+        const Vector2i &size = m_camera->getOutputSize();
+        Point2f center(0.5f * size.x(), 0.5f * size.y()), aperture(0.5f, 0.5f);
+        Ray3f ray1, ray2;
+        m_camera->sampleRay(ray1, center, aperture);
+        m_camera->sampleRay(ray2, Point2f(center.x() + 1.f, center.y()), aperture);
+        Vector3f d1 = ray1.d.normalized(), d2 = ray2.d.normalized();
+        float pixelAngle = std::atan2(d1.cross(d2).norm(), d1.dot(d2));
+        for (LODShape *shape : m_lodShapes)
+            shape->setCamera(ray1.o, pixelAngle, m_lodPixelError);
+    }
+
     cout << endl;
     cout << "Configuration: " << toString() << endl;
     cout << endl;
 }
 
+uint32_t Scene::getAdaptiveMaxSamples() const {
+    if (m_adaptiveMaxSamples > 0)
+        return m_adaptiveMaxSamples;
+    return 4 * (uint32_t) m_sampler->getSampleCount();
+}
+
+void Scene::rayIntersectStream(const Ray3f *rays, Intersection *its,
+        bool *hits, size_t count) const {
+    for (size_t i = 0; i < count; i += 16) {
+        size_t size = std::min(count - i, (size_t) 16);
+        uint32_t mask = m_bvh->rayIntersect16(rays + i, its + i, (1u << size) - 1);
+        for (size_t j = 0; j < size; ++j) {
+            hits[i + j] = (mask & (1u << j)) != 0;
+
+            /* The hit may lie on a cut-out region, which only the alpha test
+               of a single ray skips. Misses and other hits are final */
+            if (m_hitFilter && hits[i + j] && its[i + j].mesh->isAlphaTested())
+                hits[i + j] = rayIntersect(rays[i + j], its[i + j]);
+        }
+    }
+}
+
 void Scene::addChild(NoriObject *obj) {
     switch (obj->getClassType()) {
         case EMesh: {
                 Shape *mesh = static_cast<Shape *>(obj);
-                m_bvh->addShape(mesh);
+                Mesh *triangles = dynamic_cast<Mesh *>(mesh);
+                if (triangles && triangles->hasLevelsOfDetail()) {
+                    /* The levels take the place of the mesh in the BVH */
+                    LODShape *shape = new LODShape(triangles, *m_bvh);
+                    m_lodShapes.push_back(shape);
+                    m_bvh->addShape(shape);
+                } else {
+                    m_bvh->addShape(mesh);
+                }
                 m_shapes.push_back(mesh);
                 if(mesh->isEmitter())
                     m_emitters.push_back(mesh->getEmitter());
@@ -74,6 +181,11 @@ void Scene::addChild(NoriObject *obj) {
             m_emitters.push_back(static_cast<Emitter *>(obj));
             break;
 
+        case EShapeGroup:
+            /* Only rendered through instances that reference it */
+            m_shapeGroups.push_back(obj);
+            break;
+
         case ESampler:
             if (m_sampler)
                 throw NoriException("There can only be one sampler per scene!");
@@ -0,0 +1,137 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/scheduler.h>
+#include <nori/block.h>
+
+/*
+ * A worker stops as soon as all queues are empty, even if other workers
+ * are still rendering tiles that will be queued again. This loses no
+ * parallelism: at that point, every unfinished tile is held by another
+ * worker, which returns it to its own queue and takes it right back.
+ * Workers therefore never wait, and a worker that was delayed (e.g. because
+ * it runs a nested parallel algorithm) cannot hold up the others.
+ *
+ * The tiles are dealt out to the queues in spiral order, so every worker
+ * starts near the center of the image. Stealing from the back of a queue
+ * takes the tile that its owner would have visited last.
+ */
+
+NORI_NAMESPACE_BEGIN
+
+TileScheduler::TileScheduler(const Vector2i &size, int tileSize, uint32_t sampleCount,
+                             uint32_t samplesPerVisit, uint32_t workerCount,
+                             uint64_t sampleBudget)
+    : m_workerCount(std::max(workerCount, 1u)), m_sampleCount(sampleCount),
+      m_samplesPerVisit(std::max(samplesPerVisit, 1u)) {
+    BlockGenerator generator(size, tileSize);
+    m_tiles.resize(generator.getBlockCount());
+    m_queues.reset(new Queue[m_workerCount]);
+
+    /* Only the placement of the blocks is needed, not their storage */
+    ImageBlock block(Vector2i(0, 0), nullptr);
+    for (uint32_t i = 0; generator.next(block); ++i) {
+        Tile &tile = m_tiles[block.getBlockId()];
+        tile.offset = block.getOffset();
+        tile.size = block.getSize();
+        tile.id = block.getBlockId();
+        tile.activePixels = (uint32_t) (tile.size.x() * tile.size.y());
+        if (m_sampleCount > 0)
+            m_queues[i % m_workerCount].tiles.push_back(tile.id);
+    }
+
+    if (sampleBudget == 0)
+        sampleBudget = (uint64_t) size.x() * size.y() * m_sampleCount;
+    m_sampleBudget = std::max((double) sampleBudget, 1.0);
+}
+
+bool TileScheduler::pop(uint32_t worker, bool steal, uint32_t &id) {
+    Queue &queue = m_queues[worker];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tiles.empty())
+        return false;
+    if (steal) {
+        id = queue.tiles.back();
+        queue.tiles.pop_back();
+    } else {
+        id = queue.tiles.front();
+        queue.tiles.pop_front();
+    }
+    return true;
+}
+
+bool TileScheduler::next(uint32_t worker, Visit &visit) {
+    if (m_aborted || (double) m_finishedSamples.load(std::memory_order_relaxed) >= m_sampleBudget)
+        return false;
+
+    uint32_t id;
+    while (true) {
+        bool found = pop(worker, false, id);
+        for (uint32_t i = 1; i < m_workerCount && !found; ++i)
+            found = pop((worker + i) % m_workerCount, true, id);
+        if (!found)
+            return false;
+
+        /* After stop(), tiles with samples are dropped from the queues */
+        if (!m_stopped || m_tiles[id].samples == 0)
+            break;
+    }
+
+    Tile &tile = m_tiles[id];
+    visit.tile = &tile;
+    visit.sampleBegin = tile.samples;
+    visit.sampleEnd = std::min(tile.samples + m_samplesPerVisit, m_sampleCount);
+    return true;
+}
+
+void TileScheduler::restore(const std::vector<std::vector<uint32_t>> &queues,
+                            uint64_t finishedSamples) {
+    for (uint32_t i = 0; i < m_workerCount; ++i)
+        m_queues[i].tiles.clear();
+
+    /* The order of the visits only stays the same for the same number of workers */
+    uint32_t i = 0;
+    for (size_t j = 0; j < queues.size(); ++j) {
+        for (uint32_t id : queues[j]) {
+            uint32_t worker = queues.size() == m_workerCount ? (uint32_t) j : i++ % m_workerCount;
+            m_queues[worker].tiles.push_back(id);
+        }
+    }
+    m_finishedSamples = finishedSamples;
+}
+
+std::vector<uint32_t> TileScheduler::getQueue(uint32_t worker) const {
+    Queue &queue = m_queues[worker];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    return std::vector<uint32_t>(queue.tiles.begin(), queue.tiles.end());
+}
+
+void TileScheduler::finish(uint32_t worker, const Visit &visit, uint32_t samples,
+                           uint64_t pixelSamples) {
+    Tile &tile = *visit.tile;
+    tile.samples = visit.sampleBegin + samples;
+    m_finishedSamples.fetch_add(pixelSamples, std::memory_order_relaxed);
+
+    if (tile.samples < m_sampleCount && tile.activePixels > 0 && !m_stopped) {
+        Queue &queue = m_queues[worker];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tiles.push_back(tile.id);
+    }
+}
+
+NORI_NAMESPACE_END
@@ -36,6 +36,28 @@ void Shape::activate() {
             NoriObjectFactory::createInstance("diffuse", PropertyList()));
         m_bsdf->activate();
     }
+
+    m_alphaTested = m_bsdf->hasAlpha() && !m_emitter && !m_medium;
+}
+
+float Shape::getAlpha(uint32_t index, const Ray3f &ray, const Point2f &uv, float t) const {
+    Intersection its;
+    its.t = t;
+    its.uv = uv;
+    its.mesh = this;
+    setHitInformation(index, ray, its);
+    return m_bsdf->getAlpha(BSDFQueryRecord(its.toLocal(-ray.d), its.uv));
+}
+
+uint64_t Shape::getGeometryHash() const {
+    uint32_t count = getPrimitiveCount();
+    uint64_t hash = hashBytes(&count, sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; ++i) {
+        BoundingBox3f bbox = getBoundingBox(i);
+        hash = hashBytes(bbox.min.data(), sizeof(float) * 3, hash);
+        hash = hashBytes(bbox.max.data(), sizeof(float) * 3, hash);
+    }
+    return hash;
 }
 
 void Shape::addChild(NoriObject *obj) {
@@ -0,0 +1,413 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2024 by Sihan Chen
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/mesh.h>
+#include <nori/timer.h>
+#include <tbb/parallel_sort.h>
+#include <Eigen/Geometry>
+
+/*
+ * Levels of detail are created with the quadric error metric of Garland
+ * and Heckbert ("Surface Simplification Using Quadric Error Metrics",
+ * SIGGRAPH 1997). Vertices are merged by position, and every position
+ * accumulates the planes of its triangles; the error of moving it to a
+ * point is the sum of the squared distances to these planes. Edges are
+ * collapsed onto one of their endpoints (half-edge collapses), so the
+ * simplified meshes use a subset of the original vertices together with
+ * their normals, texture coordinates and tangents. To keep the mesh
+ * closed and the attributes continuous, vertices on borders, non-manifold
+ * edges and attribute seams are never moved. A collapse is rejected if it
+ * would flip a triangle.
+ *
+ * The collapses are carried out in passes: each pass evaluates the
+ * cheapest collapse of every vertex and performs the cheaper half of them
+ * in order of increasing error, skipping collapses that involve a vertex
+ * which was already touched in the same pass. The square root of the
+ * largest error so far bounds the distance between the current mesh and
+ * every plane of the original triangles around a moved vertex, and serves
+ * as the geometric error of a level. The sorts use total orders, so the
+ * result does not depend on the number of threads.
+ */
+
+NORI_NAMESPACE_BEGIN
+
+static const uint32_t INVALID_INDEX = (uint32_t) -1;
+
+/// Minimum cosine of the angle by which a collapse may rotate a triangle
+static const double MIN_ROTATION_COSINE = 0.2;
+
+/// Sum of squared distances to a set of planes (symmetric 4x4 matrix)
+struct Quadric {
+    double a00 = 0, a01 = 0, a02 = 0, a11 = 0, a12 = 0, a22 = 0;
+    double b0 = 0, b1 = 0, b2 = 0, c = 0;
+
+    Quadric() { }
+
+    /// Quadric of the plane n.x + d = 0 with unit normal \c n
+    Quadric(const Eigen::Vector3d &n, double d)
+        : a00(n.x() * n.x()), a01(n.x() * n.y()), a02(n.x() * n.z()),
+          a11(n.y() * n.y()), a12(n.y() * n.z()), a22(n.z() * n.z()),
+          b0(n.x() * d), b1(n.y() * d), b2(n.z() * d), c(d * d) { }
+
+    Quadric &operator+=(const Quadric &q) {
+        a00 += q.a00; a01 += q.a01; a02 += q.a02;
+        a11 += q.a11; a12 += q.a12; a22 += q.a22;
+        b0 += q.b0; b1 += q.b1; b2 += q.b2; c += q.c;
+        return *this;
+    }
+
+    Quadric operator+(const Quadric &q) const {
+        Quadric result(*this);
+        result += q;
+        return result;
+    }
+
+    /// Return the error at position \c p
+    double evaluate(const Point3f &p) const {
+        double x = p.x(), y = p.y(), z = p.z();
+        double value = a00 * x * x + a11 * y * y + a22 * z * z
+            + 2 * (a01 * x * y + a02 * x * z + a12 * y * z)
+            + 2 * (b0 * x + b1 * y + b2 * z) + c;
+        return std::max(value, 0.0);
+    }
+};
+
+/// Simplifies the faces of a mesh by half-edge collapses
+class MeshSimplifier {
+public:
+    /// Prepare the simplification of \c faces (three vertex indices per triangle)
+    MeshSimplifier(const MatrixXf &V, std::vector<uint32_t> &&faces)
+        : m_V(V), m_faces(std::move(faces)) {
+        uint32_t vertexCount = (uint32_t) m_V.cols();
+
+        /* Merge the vertices by position */
+        std::vector<uint32_t> order(vertexCount);
+        for (uint32_t i = 0; i < vertexCount; ++i)
+            order[i] = i;
+        auto less = [&](uint32_t i, uint32_t j) {
+            for (int k = 0; k < 3; ++k) {
+                if (m_V(k, i) != m_V(k, j))
+                    return m_V(k, i) < m_V(k, j);
+            }
+            return i < j;
+        };
+        tbb::parallel_sort(order.begin(), order.end(), less);
+        m_position.resize(vertexCount);
+        uint32_t positionCount = 0;
+        for (uint32_t i = 0; i < vertexCount; ++i) {
+            if (i > 0 && m_V.col(order[i]) != m_V.col(order[i - 1]))
+                positionCount++;
+            m_position[order[i]] = positionCount;
+        }
+        m_quadrics.resize(vertexCount > 0 ? positionCount + 1 : 0);
+
+        /* Accumulate the planes of the triangles, dropping degenerate ones */
+        removeDegenerateFaces();
+        for (size_t i = 0; i < m_faces.size(); i += 3) {
+            Eigen::Vector3d p0 = m_V.col(m_faces[i]).cast<double>(),
+                            p1 = m_V.col(m_faces[i + 1]).cast<double>(),
+                            p2 = m_V.col(m_faces[i + 2]).cast<double>();
+            Eigen::Vector3d n = (p1 - p0).cross(p2 - p0);
+            double length = n.norm();
+            if (length == 0)
+                continue;
+            n /= length;
+            Quadric q(n, -n.dot(p0));
+            for (int k = 0; k < 3; ++k)
+                m_quadrics[m_position[m_faces[i + k]]] += q;
+        }
+    }
+
+    /// Return the number of remaining triangles
+    uint32_t getTriangleCount() const { return (uint32_t) (m_faces.size() / 3); }
+
+    /// Return the vertex indices of the remaining triangles
+    const std::vector<uint32_t> &getFaces() const { return m_faces; }
+
+    /// Return a bound on the distance between the current and the original mesh
+    float getError() const { return (float) std::sqrt(m_maxCost); }
+
+    /// Collapse edges until at most \c target triangles remain or no collapse is possible
+    void simplify(uint32_t target) {
+        while (getTriangleCount() > target && simplifyPass(target))
+            ;
+    }
+
+private:
+    /// Edge of a triangle between two positions
+    struct Edge {
+        uint32_t from, to;     ///< Positions of the endpoints
+        uint32_t vertex;       ///< Vertex index at \c to
+
+        bool operator<(const Edge &e) const {
+            if (from != e.from)
+                return from < e.from;
+            if (to != e.to)
+                return to < e.to;
+            return vertex < e.vertex;
+        }
+    };
+
+    /// Cheapest collapse of a position
+    struct Collapse {
+        double cost;
+        uint32_t from, to, vertex;
+    };
+
+    enum EPositionFlags {
+        ELocked = 1,   ///< Lies on a border or a non-manifold edge
+        ESeam = 2      ///< Is shared by several vertices with different attributes
+    };
+
+    /// Remove triangles with coinciding corners
+    void removeDegenerateFaces() {
+        size_t count = 0;
+        for (size_t i = 0; i < m_faces.size(); i += 3) {
+            uint32_t p0 = m_position[m_faces[i]], p1 = m_position[m_faces[i + 1]],
+                     p2 = m_position[m_faces[i + 2]];
+            if (p0 == p1 || p1 == p2 || p2 == p0)
+                continue;
+            for (int k = 0; k < 3; ++k)
+                m_faces[count + k] = m_faces[i + k];
+            count += 3;
+        }
+        m_faces.resize(count);
+    }
+
+    /// Perform one pass of collapses, returns \c false if none was possible
+    bool simplifyPass(uint32_t target) {
+        uint32_t positionCount = (uint32_t) m_quadrics.size();
+        uint32_t faceCount = getTriangleCount();
+
+        /* Directed edges of all triangles, grouped by their endpoints */
+        std::vector<Edge> edges;
+        edges.reserve(6 * (size_t) faceCount);
+        for (size_t i = 0; i < m_faces.size(); i += 3) {
+            for (int k = 0; k < 3; ++k) {
+                uint32_t a = m_faces[i + k], b = m_faces[i + (k + 1) % 3];
+                edges.push_back(Edge { m_position[a], m_position[b], b });
+                edges.push_back(Edge { m_position[b], m_position[a], a });
+            }
+        }
+        tbb::parallel_sort(edges.begin(), edges.end());
+
+        /* Classify the positions */
+        std::vector<uint8_t> flags(positionCount, 0);
+        std::vector<uint32_t> vertexAt(positionCount, INVALID_INDEX);
+        for (uint32_t vertex : m_faces) {
+            uint32_t position = m_position[vertex];
+            if (vertexAt[position] == INVALID_INDEX)
+                vertexAt[position] = vertex;
+            else if (vertexAt[position] != vertex)
+                flags[position] |= ESeam;
+        }
+        for (size_t i = 0; i < edges.size(); ) {
+            size_t j = i + 1;
+            while (j < edges.size() && edges[j].from == edges[i].from && edges[j].to == edges[i].to)
+                ++j;
+            /* Every triangle contributes one entry per direction */
+            if (j - i != 2) {
+                flags[edges[i].from] |= ELocked;
+                flags[edges[i].to] |= ELocked;
+            }
+            i = j;
+        }
+
+        /* Cheapest collapse of every movable position */
+        std::vector<Collapse> best(positionCount, Collapse { -1, 0, 0, 0 });
+        for (size_t i = 0; i < edges.size(); ) {
+            size_t j = i + 1;
+            bool consistent = true;
+            while (j < edges.size() && edges[j].from == edges[i].from && edges[j].to == edges[i].to) {
+                /* Both triangles must agree on the attributes at the target */
+                consistent &= edges[j].vertex == edges[i].vertex;
+                ++j;
+            }
+            const Edge &e = edges[i];
+            i = j;
+            if (!consistent || (flags[e.from] & (ELocked | ESeam)))
+                continue;
+            double cost = (m_quadrics[e.from] + m_quadrics[e.to]).evaluate(m_V.col(e.vertex));
+            Collapse &b = best[e.from];
+            if (b.cost < 0 || cost < b.cost)
+                b = Collapse { cost, e.from, e.to, e.vertex };
+        }
+        edges.clear();
+        edges.shrink_to_fit();
+
+        std::vector<Collapse> collapses;
+        for (const Collapse &c : best) {
+            if (c.cost >= 0)
+                collapses.push_back(c);
+        }
+        best.clear();
+        best.shrink_to_fit();
+        if (collapses.empty())
+            return false;
+        tbb::parallel_sort(collapses.begin(), collapses.end(), [](const Collapse &c1, const Collapse &c2) {
+            return c1.cost < c2.cost || (c1.cost == c2.cost && c1.from < c2.from);
+        });
+
+        /* Triangles around every position */
+        std::vector<uint32_t> adjacencyStart(positionCount + 1, 0u), adjacency(m_faces.size());
+        for (uint32_t vertex : m_faces)
+            adjacencyStart[m_position[vertex] + 1]++;
+        for (uint32_t i = 0; i < positionCount; ++i)
+            adjacencyStart[i + 1] += adjacencyStart[i];
+        {
+            std::vector<uint32_t> fill(adjacencyStart.begin(), adjacencyStart.end() - 1);
+            for (size_t i = 0; i < m_faces.size(); ++i)
+                adjacency[fill[m_position[m_faces[i]]]++] = (uint32_t) (i / 3);
+        }
+
+        /* Perform the cheaper half of the collapses */
+        std::vector<uint32_t> remap(m_V.cols());
+        for (uint32_t i = 0; i < (uint32_t) remap.size(); ++i)
+            remap[i] = i;
+        std::vector<bool> touched(positionCount, false);
+        size_t considered = std::max(collapses.size() / 2, (size_t) 1);
+        bool progress = false;
+
+        for (size_t i = 0; i < considered && faceCount > target; ++i) {
+            const Collapse &c = collapses[i];
+            if (touched[c.from] || touched[c.to])
+                continue;
+
+            Point3f destination = m_V.col(c.vertex);
+            uint32_t removed = 0;
+            bool valid = true;
+            for (uint32_t k = adjacencyStart[c.from]; k < adjacencyStart[c.from + 1]; ++k) {
+                const uint32_t *face = &m_faces[3 * adjacency[k]];
+                uint32_t v[3], p[3];
+                for (int l = 0; l < 3; ++l) {
+                    v[l] = remap[face[l]];
+                    p[l] = m_position[v[l]];
+                }
+                if (p[0] == p[1] || p[1] == p[2] || p[2] == p[0])
+                    continue; /* Already removed by another collapse */
+                if (p[0] == c.to || p[1] == c.to || p[2] == c.to) {
+                    removed++;
+                    continue;
+                }
+
+                /* Reject collapses that rotate the triangle too far */
+                Eigen::Vector3d q[3], r[3];
+                for (int l = 0; l < 3; ++l) {
+                    q[l] = m_V.col(v[l]).cast<double>();
+                    r[l] = p[l] == c.from ? Eigen::Vector3d(destination.cast<double>()) : q[l];
+                }
+                Eigen::Vector3d n0 = (q[1] - q[0]).cross(q[2] - q[0]),
+                                n1 = (r[1] - r[0]).cross(r[2] - r[0]);
+                if (n0.dot(n1) <= MIN_ROTATION_COSINE * n0.norm() * n1.norm()) {
+                    valid = false;
+                    break;
+                }
+            }
+            if (!valid)
+                continue;
+
+            remap[vertexAt[c.from]] = c.vertex;
+            m_quadrics[c.to] += m_quadrics[c.from];
+            m_maxCost = std::max(m_maxCost, c.cost);
+            touched[c.from] = touched[c.to] = true;
+            faceCount -= removed;
+            progress = true;
+        }
+
+        for (uint32_t &vertex : m_faces)
+            vertex = remap[vertex];
+        removeDegenerateFaces();
+        return progress;
+    }
+
+    const MatrixXf &m_V;
+    std::vector<uint32_t> m_faces;     ///< Current triangles
+    std::vector<uint32_t> m_position;  ///< Position of every vertex
+    std::vector<Quadric> m_quadrics;   ///< Quadric of every position
+    double m_maxCost = 0;
+};
+
+void Mesh::buildLevelsOfDetail() {
+    cout << "Simplifying \"" << m_name << "\" .. ";
+    cout.flush();
+    Timer timer;
+
+    uint32_t faceCount = (uint32_t) m_F.cols();
+    MeshSimplifier simplifier(m_V, std::vector<uint32_t>(m_F.data(), m_F.data() + m_F.size()));
+    std::string counts = std::to_string(faceCount);
+    uint32_t previous = faceCount;
+
+    for (uint32_t level = 1; level < m_lodLevels; ++level) {
+        uint32_t target = (uint32_t) (faceCount * std::pow(m_lodReduction, (float) level));
+        simplifier.simplify(target);
+
+        /* Skip the remaining levels once the simplification gets stuck */
+        uint32_t count = simplifier.getTriangleCount();
+        if (count == 0 || count > previous * (1 + m_lodReduction) / 2)
+            break;
+        previous = count;
+
+        /* Keep the referenced vertices in their original order */
+        const std::vector<uint32_t> &faces = simplifier.getFaces();
+        std::vector<uint32_t> vertexMap(m_V.cols(), INVALID_INDEX);
+        for (uint32_t vertex : faces)
+            vertexMap[vertex] = 0;
+        std::vector<uint32_t> vertices;
+        for (uint32_t i = 0; i < (uint32_t) vertexMap.size(); ++i) {
+            if (vertexMap[i] != INVALID_INDEX) {
+                vertexMap[i] = (uint32_t) vertices.size();
+                vertices.push_back(i);
+            }
+        }
+
+        std::unique_ptr<Mesh> mesh(new Mesh());
+        uint32_t vertexCount = (uint32_t) vertices.size();
+        auto gather = [&](const MatrixXf &source, MatrixXf &target) {
+            if (source.size() == 0)
+                return;
+            target.resize(source.rows(), vertexCount);
+            for (uint32_t i = 0; i < vertexCount; ++i)
+                target.col(i) = source.col(vertices[i]);
+        };
+        gather(m_V, mesh->m_V);
+        gather(m_N, mesh->m_N);
+        gather(m_UV, mesh->m_UV);
+        gather(m_T, mesh->m_T);
+        gather(m_B, mesh->m_B);
+        mesh->m_F.resize(3, count);
+        for (uint32_t i = 0; i < 3 * count; ++i)
+            mesh->m_F.data()[i] = vertexMap[faces[i]];
+        for (uint32_t i = 0; i < vertexCount; ++i)
+            mesh->m_bbox.expandBy(mesh->m_V.col(i));
+
+        mesh->m_name = tfm::format("%s (level %i)", m_name, level);
+        mesh->m_bsdf = m_bsdf;
+        mesh->m_alphaTested = m_alphaTested;
+        mesh->m_source = this;
+        mesh->m_simplificationError = simplifier.getError();
+        if (m_compressAttributes)
+            mesh->compressAttributes();
+
+        counts += tfm::format(", %i", count);
+        m_levels.push_back(std::move(mesh));
+    }
+
+    cout << "done (took " << timer.elapsedString() << ", " << counts << " triangles)." << endl;
+}
+
+NORI_NAMESPACE_END
@@ -57,6 +57,11 @@ NORI_NAMESPACE_BEGIN
  *
  * 3. that the average radiance received by a camera within some scene
  *    matches a given value (modulo noise).
+ *
+ * When the boolean property \c pairwise is set, the scenes are instead
+ * compared in pairs: the average radiance of the second scene of each pair
+ * must match that of the first one (e.g. a rendering with an approximation
+ * against the exact one), which is tested with Welch's t-test.
  */
 class StudentsTTest : public NoriObject {
 public:
@@ -82,6 +87,9 @@ public:
 
         /* Number of BSDF samples that should be generated (default: 100K) */
         m_sampleCount = propList.getInteger("sampleCount", 100000);
+
+        /* Compare the scenes in pairs instead of against reference values */
+        m_pairwise = propList.getBoolean("pairwise", false);
     }
 
     virtual ~StudentsTTest() {
@@ -247,6 +255,45 @@ public:
                     ++passed;
                 }
             }
+        } else if (m_pairwise) {
+            if (m_scenes.size() % 2 != 0 || !m_references.empty())
+                throw NoriException("Pairwise tests need an even number of scenes and no reference values!");
+            if (!m_bsdfs.empty() || !m_emitters.empty())
+                throw NoriException("Cannot test BSDFs, emitters, and scenes at the same time!");
+
+            Sampler *sampler = static_cast<Sampler *>(
+                NoriObjectFactory::createInstance("independent", PropertyList()));
+
+            /* Sidak correction for the number of tests */
+            int testCount = (int) m_scenes.size() / 2;
+            double significanceLevel = 1.0 - std::pow(1.0 - (double) m_significanceLevel, 1.0 / testCount);
+
+            for (size_t i = 0; i < m_scenes.size(); i += 2) {
+                cout << "------------------------------------------------------" << endl;
+                cout << "Comparing scene: " << m_scenes[i + 1]->toString() << endl;
+                cout << "against scene: " << m_scenes[i]->toString() << endl;
+                ++total;
+
+                cout << "Generating 2 x " << m_sampleCount << " paths.. " << endl;
+                double mean[2], variance[2];
+                for (int j = 0; j < 2; ++j)
+                    estimate(m_scenes[i + j], sampler, mean[j], variance[j]);
+
+                /* Welch's t-test; with this many samples, the t-distribution is a normal distribution */
+                double stdError = std::sqrt((variance[0] + variance[1]) / m_sampleCount);
+                double t = stdError > 0 ? std::abs(mean[1] - mean[0]) / stdError : 0.0;
+                double pValue = std::erfc(t / std::sqrt(2.0));
+
+                std::string result = tfm::format(
+                    "Means: %f vs. %f, t-statistic = %f, p-value = %e, significance level = %e: ",
+                    mean[0], mean[1], t, pValue, significanceLevel);
+                if (pValue >= significanceLevel) {
+                    ++passed;
+                    cout << result << "Accepted the null hypothesis." << endl;
+                } else {
+                    cout << result << "Rejected the null hypothesis!" << endl;
+                }
+            }
         } else {
             if (m_references.size() != m_scenes.size())
                 throw NoriException("Specified a different number of scenes and reference values!");
@@ -258,8 +305,6 @@ public:
 
             int ctr = 0;
             for (auto scene : m_scenes) {
-                const Integrator *integrator = scene->getIntegrator();
-                const Camera *camera = scene->getCamera();
                 float reference = m_references[ctr++];
 
                 cout << "------------------------------------------------------" << endl;
@@ -268,25 +313,8 @@ public:
 
                 cout << "Generating " << m_sampleCount << " paths.. " << endl;
 
-                double mean = 0, variance = 0;
-                for (int k=0; k<m_sampleCount; ++k) {
-                    /* Sample a ray from the camera */
-                    Ray3f ray;
-                    Point2f pixelSample = (sampler->next2D().array()
-                        * camera->getOutputSize().cast<float>().array()).matrix();
-                    Color3f value = camera->sampleRay(ray, pixelSample, sampler->next2D());
-
-                    /* Compute the incident radiance */
-                    value *= integrator->Li(scene, sampler, ray);
-
-                    /* Numerically robust online variance estimation using an
-                       algorithm proposed by Donald Knuth (TAOCP vol.2, 3rd ed., p.232) */
-                    double result = (double) value.getLuminance();
-                    double delta = result - mean;
-                    mean += delta / (double) (k+1);
-                    variance += delta * (result - mean);
-                }
-                variance /= m_sampleCount - 1;
+                double mean, variance;
+                estimate(scene, sampler, mean, variance);
 
                 std::pair<bool, std::string>
                     result = hypothesis::students_t_test(mean, variance, reference,
@@ -304,14 +332,43 @@ public:
         }
     }
 
+    /// Estimate the mean and variance of the luminance received by the camera of a scene
+    void estimate(const Scene *scene, Sampler *sampler, double &mean, double &variance) const {
+        const Integrator *integrator = scene->getIntegrator();
+        const Camera *camera = scene->getCamera();
+
+        mean = 0;
+        variance = 0;
+        for (int k=0; k<m_sampleCount; ++k) {
+            /* Sample a ray from the camera */
+            Ray3f ray;
+            Point2f pixelSample = (sampler->next2D().array()
+                * camera->getOutputSize().cast<float>().array()).matrix();
+            Color3f value = camera->sampleRay(ray, pixelSample, sampler->next2D());
+
+            /* Compute the incident radiance */
+            value *= integrator->Li(scene, sampler, ray);
+
+            /* Numerically robust online variance estimation using an
+               algorithm proposed by Donald Knuth (TAOCP vol.2, 3rd ed., p.232) */
+            double result = (double) value.getLuminance();
+            double delta = result - mean;
+            mean += delta / (double) (k+1);
+            variance += delta * (result - mean);
+        }
+        variance /= m_sampleCount - 1;
+    }
+
     virtual std::string toString() const override {
         return tfm::format(
             "StudentsTTest[\n"
             "  significanceLevel = %f,\n"
-            "  sampleCount= %i\n"
+            "  sampleCount= %i,\n"
+            "  pairwise = %s\n"
             "]",
             m_significanceLevel,
-            m_sampleCount
+            m_sampleCount,
+            m_pairwise ? "yes" : "no"
         );
     }
 
@@ -325,6 +382,7 @@ private:
     std::vector<float> m_references;
     float m_significanceLevel;
     int m_sampleCount;
+    bool m_pairwise;
 };
 
 NORI_REGISTER_CLASS(StudentsTTest, "ttest");